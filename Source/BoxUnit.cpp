@@ -71,7 +71,7 @@ bool Box::LineSegmentIntersection(PointD p11, PointD p12, PointD p21, PointD p22
 
 
 
-bool Box::isWaveFormInside(SorterSpikePtr so)
+bool Box::isWaveFormInside(const SorterSpikePtr& so)
 {
     PointD BoxTopLeft(x, y);
     PointD BoxBottomLeft(x, (y - h));
@@ -108,6 +108,8 @@ bool Box::isWaveFormInside(SorterSpikePtr so)
 BoxUnit::BoxUnit(Box B, int id) 
     : unitId(id), isActive(false)
 {
+    setDefaultColors(colorRGB, unitId);
+
     addBox(B);
 }
 
@@ -150,7 +152,7 @@ void BoxUnit::updateColor()
 }
 
 
-bool BoxUnit::isWaveFormInsideAllBoxes(SorterSpikePtr so)
+bool BoxUnit::isWaveFormInsideAllBoxes(const SorterSpikePtr& so)
 {
     
     for (int k = 0; k < lstBoxes.size(); k++)
@@ -54,7 +54,7 @@ public:
     bool LineSegmentIntersection(PointD p11, PointD p12, PointD p21, PointD p22);
 
     /** Returns true if a waveform is inside the box */
-    bool isWaveFormInside(SorterSpikePtr so);
+    bool isWaveFormInside(const SorterSpikePtr& so);
 
     /** Microseconds */
     double x, w;
@@ -87,7 +87,7 @@ public:
     BoxUnit(Box B, int id);
 
     /** Returns true if spike waveform is inside all boxes*/
-    bool isWaveFormInsideAllBoxes(SorterSpikePtr so);
+    bool isWaveFormInsideAllBoxes(const SorterSpikePtr& so);
 
     /** Returns the global ID for this unit */
     int getUnitId();
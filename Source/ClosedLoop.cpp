@@ -0,0 +1,194 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ClosedLoop.h"
+
+/** Deadline used until one is set (microseconds) */
+static const float defaultDeadlineMicroseconds = 50.0f;
+
+SpikeLatencyWatchdog::SpikeLatencyWatchdog()
+    : ticksToMicroseconds(1.0e6 / double(Time::getHighResolutionTicksPerSecond())),
+      numSpikes(0),
+      numLate(0),
+      numAbandoned(0),
+      totalTicks(0),
+      worstTicks(0)
+{
+    setDeadline(defaultDeadlineMicroseconds);
+}
+
+void SpikeLatencyWatchdog::setDeadline(float microseconds)
+{
+    microseconds = jmax(1.0f, microseconds);
+
+    deadlineMicroseconds = microseconds;
+    deadlineTicks = int64(double(microseconds) / ticksToMicroseconds);
+}
+
+void SpikeLatencyWatchdog::addSpike(int64 startTicks, int64 endTicks, bool abandoned)
+{
+    const int64 elapsed = endTicks - startTicks;
+
+    numSpikes.fetch_add(1, std::memory_order_relaxed);
+    totalTicks.fetch_add(elapsed, std::memory_order_relaxed);
+
+    if (elapsed > deadlineTicks.load(std::memory_order_relaxed))
+        numLate.fetch_add(1, std::memory_order_relaxed);
+
+    if (abandoned)
+        numAbandoned.fetch_add(1, std::memory_order_relaxed);
+
+    // only the processing thread writes, so a plain compare is enough
+    if (elapsed > worstTicks.load(std::memory_order_relaxed))
+        worstTicks.store(elapsed, std::memory_order_relaxed);
+}
+
+void SpikeLatencyWatchdog::reset()
+{
+    numSpikes = 0;
+    numLate = 0;
+    numAbandoned = 0;
+    totalTicks = 0;
+    worstTicks = 0;
+}
+
+float SpikeLatencyWatchdog::getWorstMicroseconds() const
+{
+    return float(double(worstTicks.load()) * ticksToMicroseconds);
+}
+
+float SpikeLatencyWatchdog::getMeanMicroseconds() const
+{
+    const int64 n = numSpikes.load();
+
+    return n > 0 ? float(double(totalTicks.load()) * ticksToMicroseconds / double(n)) : 0.0f;
+}
+
+String SpikeLatencyWatchdog::toString() const
+{
+    return String(numSpikes.load()) + " spikes, mean " + String(getMeanMicroseconds(), 1)
+        + " us, worst " + String(getWorstMicroseconds(), 1) + " us, "
+        + String(numLate.load()) + " over " + String(deadlineMicroseconds.load(), 0) + " us, "
+        + String(numAbandoned.load()) + " abandoned";
+}
+
+DeferredSpikeQueue::DeferredSpikeQueue(Listener* listener_, int capacity)
+    : Thread("Deferred Spike Queue"),
+      listener(listener_),
+      fifo(capacity),
+      entries(capacity),
+      numDropped(0)
+{
+}
+
+DeferredSpikeQueue::~DeferredSpikeQueue()
+{
+    stop();
+}
+
+bool DeferredSpikeQueue::push(int electrode, const SorterSpikePtr& spike, uint16 incomingSortedId,
+                              SortingMode mode, bool passedThreshold)
+{
+    int start1, size1, start2, size2;
+    fifo.prepareToWrite(1, start1, size1, start2, size2);
+
+    if (size1 + size2 == 0)
+    {
+        numDropped++;
+        return false;
+    }
+
+    // slots are emptied by the reader, so no spike is ever released here
+    Entry& entry = entries[size1 > 0 ? start1 : start2];
+    entry.electrode = electrode;
+    entry.spike = spike;
+    entry.incomingSortedId = incomingSortedId;
+    entry.mode = mode;
+    entry.passedThreshold = passedThreshold;
+    entry.stateVersion = 0;
+    entry.sampleNumber = 0;
+
+    fifo.finishedWrite(1);
+
+    return true;
+}
+
+bool DeferredSpikeQueue::pushState(int electrode, uint32 stateVersion, int64 sampleNumber, SortingMode mode)
+{
+    int start1, size1, start2, size2;
+    fifo.prepareToWrite(1, start1, size1, start2, size2);
+
+    if (size1 + size2 == 0)
+    {
+        numDropped++;
+        return false;
+    }
+
+    Entry& entry = entries[size1 > 0 ? start1 : start2];
+    entry.electrode = electrode;
+    entry.incomingSortedId = 0;
+    entry.mode = mode;
+    entry.passedThreshold = false;
+    entry.stateVersion = stateVersion;
+    entry.sampleNumber = sampleNumber;
+
+    fifo.finishedWrite(1);
+
+    return true;
+}
+
+void DeferredSpikeQueue::stop()
+{
+    stopThread(1000);
+
+    drain();
+}
+
+void DeferredSpikeQueue::drain()
+{
+    int start1, size1, start2, size2;
+    fifo.prepareToRead(fifo.getNumReady(), start1, size1, start2, size2);
+
+    for (int block = 0; block < 2; block++)
+    {
+        const int start = block == 0 ? start1 : start2;
+        const int size = block == 0 ? size1 : size2;
+
+        for (int i = start; i < start + size; i++)
+        {
+            listener->handleDeferredSpike(entries[i]);
+            entries[i].spike = nullptr;
+        }
+    }
+
+    fifo.finishedRead(size1 + size2);
+}
+
+void DeferredSpikeQueue::run()
+{
+    while (!threadShouldExit())
+    {
+        drain();
+        wait(1);
+    }
+}
@@ -0,0 +1,185 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __CLOSEDLOOP_H__
+#define __CLOSEDLOOP_H__
+
+#include <ProcessorHeaders.h>
+
+#include "Containers.h"
+#include "Sorter.h"
+
+#include <atomic>
+#include <vector>
+
+/**
+    Checks the per-spike latency of closed-loop sorting against a deadline.
+
+    The processing thread asks for the deadline of each spike when it
+    arrives (Sorter::classifySpike gives up at that point, which only
+    happens if new units or bases keep being published while it claims
+    one) and reports the time the sorted ID was set. Counts, the mean
+    and the worst case are kept in atomics, so they can be read from any
+    thread while spikes are being recorded.
+
+    The deadline is monitored, not enforced: a spike that takes longer
+    (e.g. because the thread was preempted) is still sorted and still
+    raises its unit's trigger; it is only counted as late.
+*/
+class SpikeLatencyWatchdog
+{
+public:
+
+    /** Constructor */
+    SpikeLatencyWatchdog();
+
+    /** Sets the per-spike deadline (microseconds) */
+    void setDeadline(float microseconds);
+
+    /** Returns the per-spike deadline (microseconds) */
+    float getDeadline() const { return deadlineMicroseconds.load(); }
+
+    /** Returns the tick count by which a spike that arrived at startTicks must be sorted */
+    int64 getDeadlineTicks(int64 startTicks) const { return startTicks + deadlineTicks.load(std::memory_order_relaxed); }
+
+    /** Records one spike; abandoned means sorting gave up at the deadline (processing thread) */
+    void addSpike(int64 startTicks, int64 endTicks, bool abandoned);
+
+    /** Clears all counts */
+    void reset();
+
+    int64 getNumSpikes() const { return numSpikes; }
+
+    /** Spikes whose sorted ID was set after the deadline */
+    int64 getNumLate() const { return numLate; }
+
+    /** Spikes left unsorted because classification could not start before the deadline */
+    int64 getNumAbandoned() const { return numAbandoned; }
+
+    /** Returns the worst latency seen since the last reset (microseconds) */
+    float getWorstMicroseconds() const;
+
+    /** Returns the mean latency since the last reset (microseconds) */
+    float getMeanMicroseconds() const;
+
+    /** Describes the counts in one line */
+    String toString() const;
+
+private:
+
+    /** Set from the message thread, read by the processing thread */
+    std::atomic<float> deadlineMicroseconds;
+    std::atomic<int64> deadlineTicks;
+
+    double ticksToMicroseconds;
+
+    std::atomic<int64> numSpikes;
+    std::atomic<int64> numLate;
+    std::atomic<int64> numAbandoned;
+    std::atomic<int64> totalTicks;
+    std::atomic<int64> worstTicks;
+};
+
+/**
+    Carries the work that closed-loop sorting leaves out of the processing
+    thread (PCA training, unit statistics, display and recording) to a
+    background thread.
+
+    push() is wait-free: the spike is placed in a single-producer,
+    single-consumer ring and nothing else happens on the calling thread.
+    If the ring is full the entry is dropped and counted; the spike has
+    already been sorted, so only bookkeeping is lost. The background
+    thread polls every millisecond and hands each entry to its Listener,
+    where the last reference to a spike is usually released too.
+*/
+class DeferredSpikeQueue : public Thread
+{
+public:
+
+    /** One spike waiting for bookkeeping */
+    struct Entry
+    {
+        /** Position of the electrode in its owner's list */
+        int electrode = -1;
+
+        SorterSpikePtr spike;
+        uint16 incomingSortedId = 0;
+        SortingMode mode = SORT_AND_DISPLAY;
+
+        /** True if the spike crossed threshold and was (or was meant to be) sorted */
+        bool passedThreshold = false;
+
+        /** For entries without a spike: a sorter state version published at sampleNumber */
+        uint32 stateVersion = 0;
+        int64 sampleNumber = 0;
+    };
+
+    /** Does the deferred work for each entry */
+    class Listener
+    {
+    public:
+        virtual ~Listener() { }
+
+        /** Called on the queue's thread, in the order spikes were pushed */
+        virtual void handleDeferredSpike(const Entry& entry) = 0;
+    };
+
+    /** Constructor */
+    DeferredSpikeQueue(Listener* listener, int capacity = 16384);
+
+    /** Destructor */
+    ~DeferredSpikeQueue();
+
+    /** Queues a spike (processing thread); returns false if the queue was full */
+    bool push(int electrode, const SorterSpikePtr& spike, uint16 incomingSortedId,
+              SortingMode mode, bool passedThreshold);
+
+    /** Queues an entry without a spike, so a sorter edit reaches the recorder in
+        order with the spikes around it (processing thread) */
+    bool pushState(int electrode, uint32 stateVersion, int64 sampleNumber, SortingMode mode);
+
+    /** Stops the thread after handling everything still queued */
+    void stop();
+
+    /** Returns the number of entries dropped because the queue was full */
+    int64 getNumDropped() const { return numDropped; }
+
+    /** Handles queued entries */
+    void run() override;
+
+private:
+
+    /** Hands every queued entry to the listener */
+    void drain();
+
+    Listener* listener;
+
+    AbstractFifo fifo;
+    std::vector<Entry> entries;
+
+    std::atomic<int64> numDropped;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(DeferredSpikeQueue);
+};
+
+#endif // __CLOSEDLOOP_H__
@@ -83,13 +83,28 @@ float PointD::cross(PointD c) const
 }
 
 
+SorterSpikeContainer::SorterSpikeContainer(const SpikeChannel* channel, uint16 sortedId_, int64 timestamp_)
+    : chan(channel),
+      sortedId(sortedId_),
+      timestamp(timestamp_),
+      compactScale(0)
+{
+    color[0] = color[1] = color[2] = 127;
+    pcProj[0] = pcProj[1] = 0;
+    basisVersion = 0;
+    stateVersion = 0;
+}
+
 SorterSpikeContainer::SorterSpikeContainer(const SpikeChannel* channel, uint16 sortedId_, int64 timestamp_, const float* waveform)
     : chan(channel),
       sortedId(sortedId_),
-      timestamp(timestamp_)
+      timestamp(timestamp_),
+      compactScale(0)
 {
     color[0] = color[1] = color[2] = 127;
     pcProj[0] = pcProj[1] = 0;
+    basisVersion = 0;
+    stateVersion = 0;
 
     int nSamples = chan->getNumChannels() * chan->getTotalSamples();
 
@@ -100,50 +115,129 @@ SorterSpikeContainer::SorterSpikeContainer(const SpikeChannel* channel, uint16 s
 
 const float* SorterSpikeContainer::getData() const
 {
+    jassert(!isCompact());
+
     return data.getData();
 }
 
+SorterSpikePtr SorterSpikeContainer::createCompactCopy() const
+{
+    jassert(!isCompact());
+
+    const int nSamples = chan->getNumChannels() * chan->getTotalSamples();
+
+    SorterSpikeContainer* copy = new SorterSpikeContainer(chan, sortedId, timestamp);
+    memcpy(copy->color, color, sizeof(color));
+    copy->pcProj[0] = pcProj[0];
+    copy->pcProj[1] = pcProj[1];
+    copy->basisVersion = basisVersion;
+    copy->stateVersion = stateVersion;
+
+    copy->compactData.malloc(jmax(1, nSamples));
+
+    // the largest magnitude maps to full scale, so each spike keeps 15 bits of its own range
+    float maxMagnitude = 0;
+
+    if (nSamples > 0)
+    {
+        const Range<float> range = FloatVectorOperations::findMinAndMax(data.getData(), nSamples);
+        maxMagnitude = jmax(std::abs(range.getStart()), std::abs(range.getEnd()));
+    }
+
+    copy->compactScale = maxMagnitude > 0 ? maxMagnitude / 32767.0f : 1.0f;
+
+    const float toSteps = 1.0f / copy->compactScale;
+    const float* source = data.getData();
+    int16* dest = copy->compactData.getData();
+
+    // branch-free rounding, so the compiler can vectorise the conversion
+    for (int i = 0; i < nSamples; i++)
+    {
+        const float steps = source[i] * toSteps;
+        dest[i] = (int16) (steps + (steps >= 0 ? 0.5f : -0.5f));
+    }
+
+    return copy;
+}
+
+SorterSpikePtr SorterSpikeContainer::expand()
+{
+    if (!isCompact())
+        return this;
+
+    SorterSpikeContainer* copy = new SorterSpikeContainer(chan, sortedId, timestamp);
+    memcpy(copy->color, color, sizeof(color));
+    copy->pcProj[0] = pcProj[0];
+    copy->pcProj[1] = pcProj[1];
+    copy->basisVersion = basisVersion;
+    copy->stateVersion = stateVersion;
+
+    copy->data.malloc(jmax(1, chan->getNumChannels() * (int) chan->getTotalSamples()));
+    copyData(copy->data.getData());
+
+    return copy;
+}
+
+void SorterSpikeContainer::copyData(float* dest) const
+{
+    const int nSamples = chan->getNumChannels() * chan->getTotalSamples();
+
+    if (!isCompact())
+    {
+        memcpy(dest, data.getData(), sizeof(float) * nSamples);
+        return;
+    }
+
+    const int16* source = compactData.getData();
+
+    for (int i = 0; i < nSamples; i++)
+        dest[i] = float(source[i]) * compactScale;
+}
+
 const SpikeChannel* SorterSpikeContainer::getChannel() const
 {
     return chan;
 }
 
+size_t SorterSpikeContainer::getMemoryUsage() const
+{
+    const size_t sampleSize = isCompact() ? sizeof(int16) : sizeof(float);
+
+    return sizeof(SorterSpikeContainer)
+        + sampleSize * size_t(chan->getNumChannels()) * size_t(chan->getTotalSamples());
+}
+
 int64 SorterSpikeContainer::getTimestamp() const
 {
     return timestamp;
 }
 
-float SorterSpikeContainer::getMinimum(int channelIndex)
+float SorterSpikeContainer::getMinimum(int channelIndex) const
 {
+    jassert(!isCompact());
+
+    // the detector aligns the peak here, so no scan is needed
     int offset = channelIndex * chan->getTotalSamples() + chan->getPrePeakSamples() + 1;
 
     return data[offset];
 }
 
-float SorterSpikeContainer::getMaximum(int channelIndex)
+float SorterSpikeContainer::getMaximum(int channelIndex) const
 {
-    int offset = channelIndex * chan->getTotalSamples();
+    jassert(!isCompact());
 
-    float maximum = -99999.9f;
+    const int numSamples = chan->getTotalSamples();
 
-    for (int i = offset; i < offset + chan->getTotalSamples(); i++)
-    {
-        if (data[i] > maximum)
-            maximum = data[i];
-    }
-
-    return maximum;
+    return FloatVectorOperations::findMaximum(data + channelIndex * numSamples, numSamples);
 }
 
-bool SorterSpikeContainer::checkThresholds(Array<float> thresholds)
+bool SorterSpikeContainer::checkThresholds(const Array<float>& thresholds) const
 {
-
-    bool belowThresh = true;
-
     for (int i = 0; i < thresholds.size(); i++)
     {
-        belowThresh &= getMinimum(i) < thresholds[i];
+        if (!(getMinimum(i) < thresholds[i]))
+            return false;
     }
 
-    return belowThresh;
-}
\ No newline at end of file
+    return true;
+}
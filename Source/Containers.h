@@ -72,6 +72,11 @@ public:
     float X, Y;
 };
 
+class SorterSpikeContainer;
+
+/** Reference-counted object pointer to a spike container*/
+typedef ReferenceCountedObjectPtr<SorterSpikeContainer> SorterSpikePtr;
+
 /** 
     Holds data about an individual spike
 */
@@ -85,23 +90,44 @@ public:
     /** Delete default constructor */
     SorterSpikeContainer() = delete;
 
-    /** Return a pointer to the spike waveform data*/
+    /** Return a pointer to the spike waveform data (not available on compact spikes) */
     const float* getData() const;
 
+    /** Returns true if the waveform is held as 16-bit samples with a per-spike scale */
+    bool isCompact() const { return compactData != nullptr; }
+
+    /** Returns the 16-bit samples of a compact spike (microvolts = sample * getCompactScale()) */
+    const int16* getCompactData() const { return compactData.getData(); }
+
+    /** Returns the microvolts per step of a compact spike */
+    float getCompactScale() const { return compactScale; }
+
+    /** Returns a copy holding the waveform in 16 bits, with sorting results and projections */
+    SorterSpikePtr createCompactCopy() const;
+
+    /** Returns a float copy of a compact spike, or this spike if it is not compact */
+    SorterSpikePtr expand();
+
+    /** Writes the waveform to dest as floats, however it is stored */
+    void copyData(float* dest) const;
+
     /** Return a pointer to the SpikeChannel object associated with this spike */
     const SpikeChannel* getChannel() const;
 
     /** Return the timestamp of this spike*/
     int64 getTimestamp() const;
 
-    /** Returns the minimum value of this spike's waveform on a particular channel*/
-    float getMinimum(int chan = 0);
+    /** Returns the value of this spike's waveform at the detection sample on a particular channel*/
+    float getMinimum(int chan = 0) const;
 
     /** Returns the maximum value of this spike's waveform on a particular channel*/
-    float getMaximum(int chan = 0);
+    float getMaximum(int chan = 0) const;
 
     /** Check that the minimum is below all thresholds */
-    bool checkThresholds(Array<float> thresholds);
+    bool checkThresholds(const Array<float>& thresholds) const;
+
+    /** Returns the bytes held by this spike (object and waveform) */
+    size_t getMemoryUsage() const;
 
     /** Spike color (RGB) */
     uint8 color[3];
@@ -109,6 +135,12 @@ public:
     /** PC projections (X/Y)*/
     float pcProj[2];
 
+    /** Version of the PC basis used for pcProj (0 = not projected) */
+    uint32 basisVersion;
+
+    /** Version of the sorter state the spike was sorted with (0 = not sorted) */
+    uint32 stateVersion;
+
     /** Sorted ID (> 0) */
     uint16 sortedId;
 
@@ -146,13 +178,18 @@ public:
     }
 
 private:
+
+    /** Creates a spike without waveform storage */
+    SorterSpikeContainer(const SpikeChannel* channel, uint16 sortedId, int64 timestamp);
+
     int64 timestamp;
     HeapBlock<float> data;
     const SpikeChannel* chan;
-};
 
-/** Reference-counted object pointer to a spike container*/
-typedef ReferenceCountedObjectPtr<SorterSpikeContainer> SorterSpikePtr;
+    /** 16-bit waveform of a compact spike (data is then empty) */
+    HeapBlock<int16> compactData;
+    float compactScale;
+};
 
 /** Reference-counted array of spike containers*/
 typedef ReferenceCountedArray<SorterSpikeContainer, CriticalSection> SorterSpikeArray;
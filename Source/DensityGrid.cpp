@@ -0,0 +1,99 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "DensityGrid.h"
+
+DensityGrid::DensityGrid(int width_, int height_)
+    : width(jmax(1, width_)),
+      height(jmax(1, height_)),
+      counts(size_t(width) * size_t(height), 0.0f)
+{
+    setRange(-5, -5, 5, 5);
+}
+
+void DensityGrid::setRange(float xMin_, float yMin_, float xMax, float yMax)
+{
+    xMin = xMin_;
+    yMin = yMin_;
+    xScale = xMax > xMin ? float(width) / (xMax - xMin) : 0.0f;
+    yScale = yMax > yMin ? float(height) / (yMax - yMin) : 0.0f;
+
+    clear();
+}
+
+void DensityGrid::add(float x, float y)
+{
+    const float fx = (x - xMin) * xScale;
+    const float fy = (y - yMin) * yScale;
+
+    // also rejects NaN
+    if (!(fx >= 0 && fy >= 0 && fx < float(width) && fy < float(height)))
+        return;
+
+    counts[int(fy) * width + int(fx)] += 1.0f;
+}
+
+void DensityGrid::decay(float factor)
+{
+    for (auto& count : counts)
+        count *= factor;
+}
+
+void DensityGrid::clear()
+{
+    std::fill(counts.begin(), counts.end(), 0.0f);
+}
+
+const PixelARGB* DensityGrid::getColourMap()
+{
+    static PixelARGB colourMap[256];
+    static bool initialised = false;
+
+    if (!initialised)
+    {
+        const Colour stops[] = { Colour(0, 0, 0), Colour(40, 0, 120), Colour(190, 30, 80),
+                                 Colour(250, 140, 0), Colour(255, 255, 200) };
+
+        for (int i = 0; i < 256; i++)
+        {
+            const float position = float(i) / 255.0f * 4.0f;
+            const int stop = jmin(3, int(position));
+
+            colourMap[i] = stops[stop].interpolatedWith(stops[stop + 1], position - float(stop)).getPixelARGB();
+        }
+
+        initialised = true;
+    }
+
+    return colourMap;
+}
+
+float DensityGrid::getMaxCount() const
+{
+    float maxCount = 0;
+
+    for (auto count : counts)
+        maxCount = jmax(maxCount, count);
+
+    return maxCount;
+}
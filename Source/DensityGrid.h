@@ -0,0 +1,91 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __DENSITYGRID_H__
+#define __DENSITYGRID_H__
+
+#include <ProcessorHeaders.h>
+
+#include <vector>
+
+/**
+    Fixed-size 2D histogram over a rectangle of PC space, used to show
+    cluster structure on electrodes whose spike rate is far beyond what
+    individual points can show.
+
+    Adding a point is O(1) and the memory is fixed by the grid size, not
+    by the number of spikes. Old counts fade through decay(), which the
+    display applies once per frame.
+*/
+class DensityGrid
+{
+public:
+
+    /** Constructor */
+    DensityGrid(int width, int height);
+
+    /** Sets the region of PC space covered by the grid (clears it) */
+    void setRange(float xMin, float yMin, float xMax, float yMax);
+
+    /** Adds one count to the cell containing (x, y); points outside are ignored */
+    void add(float x, float y);
+
+    /** Multiplies all counts by factor (0..1) */
+    void decay(float factor);
+
+    /** Sets all counts to zero */
+    void clear();
+
+    /** Returns the count of a cell */
+    float getCount(int x, int y) const { return counts[y * width + x]; }
+
+    /** Returns the highest count in the grid */
+    float getMaxCount() const;
+
+    /** Returns the grid width in cells */
+    int getWidth() const { return width; }
+
+    /** Returns the grid height in cells */
+    int getHeight() const { return height; }
+
+    /** Returns the bytes held by the counts */
+    int64 getMemoryUsage() const { return int64(counts.capacity()) * (int64) sizeof(float); }
+
+    /** Returns the 256-entry colour map used to draw densities, from empty
+        (black) to densest (white) */
+    static const PixelARGB* getColourMap();
+
+private:
+
+    int width;
+    int height;
+
+    float xMin, yMin;
+    float xScale, yScale;
+
+    std::vector<float> counts;
+
+    JUCE_DECLARE_NON_COPYABLE(DensityGrid);
+};
+
+#endif // __DENSITYGRID_H__
@@ -0,0 +1,243 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ElectrodeOverview.h"
+
+#include "SpikeSorter.h"
+#include "ElectrodeSummary.h"
+#include "DensityGrid.h"
+
+/** Thumbnail size and spacing (pixels) */
+static const int tileWidth = 150;
+static const int tileHeight = 96;
+static const int tileGap = 6;
+
+/** At most this many tiles are re-rendered per refresh... */
+static const int maxTilesPerRefresh = 16;
+
+/** ...and only while the refresh has used less than this (ms) */
+static const double renderBudgetMs = 4.0;
+
+ElectrodeOverview::ElectrodeOverview()
+    : nextTile(0),
+      numColumns(1),
+      paintMilliseconds(0)
+{
+}
+
+void ElectrodeOverview::setElectrodes(const Array<Electrode*>& electrodes)
+{
+    tiles.clear();
+
+    for (auto electrode : electrodes)
+        tiles.push_back({ electrode, Image(Image::RGB, tileWidth, tileHeight, true) });
+
+    nextTile = 0;
+
+    // draw everything once, so no tile starts out blank
+    for (auto& tile : tiles)
+        renderTile(tile);
+
+    resized();
+    repaint();
+}
+
+void ElectrodeOverview::refresh()
+{
+    if (tiles.empty())
+        return;
+
+    const double start = Time::getMillisecondCounterHiRes();
+
+    for (int n = 0; n < jmin(maxTilesPerRefresh, (int) tiles.size()); n++)
+    {
+        renderTile(tiles[nextTile]);
+        nextTile = (nextTile + 1) % tiles.size();
+
+        if (Time::getMillisecondCounterHiRes() - start > renderBudgetMs)
+            break;
+    }
+
+    paintMilliseconds += Time::getMillisecondCounterHiRes() - start;
+
+    repaint();
+}
+
+void ElectrodeOverview::renderTile(Tile& tile)
+{
+    Electrode* electrode = tile.electrode;
+    ElectrodeSummary* summary = electrode->summary.get();
+
+    float p1min, p2min, p1max, p2max;
+    electrode->sorter->getPCArange(p1min, p2min, p1max, p2max);
+    summary->setPCRange(p1min, p2min, p1max, p2max);
+
+    Graphics g(tile.image);
+
+    g.fillAll(Colour(30, 30, 30));
+
+    // title: name and firing rate
+    g.setColour(Colours::white);
+    g.setFont(Font("Small Text", 12, Font::plain));
+    g.drawText(electrode->name, 4, 2, tileWidth - 60, 14, Justification::left, true);
+
+    g.setColour(electrode->getSortingMode() == BYPASS ? Colours::grey : Colours::lightgreen);
+    g.drawText(String(summary->updateFiringRate(), 1) + " Hz", tileWidth - 60, 2, 56, 14, Justification::right, false);
+
+    // PC density, one pixel per cell, drawn at twice the size
+    const int gridSize = ElectrodeSummary::gridSize;
+    const int densityX = 4;
+    const int densityY = 20;
+
+    uint32 maxCount = 0;
+
+    for (int y = 0; y < gridSize; y++)
+        for (int x = 0; x < gridSize; x++)
+            maxCount = jmax(maxCount, summary->getCount(x, y));
+
+    {
+        Image::BitmapData data(tile.image, densityX, densityY, gridSize * 2, gridSize * 2, Image::BitmapData::writeOnly);
+
+        const PixelARGB* colourMap = DensityGrid::getColourMap();
+        const float scale = maxCount > 0 ? 255.0f / std::log1p(float(maxCount)) : 0.0f;
+
+        for (int y = 0; y < gridSize * 2; y++)
+        {
+            uint8* pixel = data.getLinePointer(y);
+
+            for (int x = 0; x < gridSize * 2; x++, pixel += data.pixelStride)
+            {
+                const PixelARGB& colour = colourMap[jmin(255, int(std::log1p(float(summary->getCount(x / 2, y / 2))) * scale))];
+
+                if (data.pixelFormat == Image::RGB)
+                    ((PixelRGB*) pixel)->set(colour);
+                else
+                    ((PixelARGB*) pixel)->set(colour);
+            }
+        }
+    }
+
+    summary->decay();
+
+    // mean waveform, channels side by side, scaled to the first channel's display range
+    const int waveX = densityX + gridSize * 2 + 6;
+    const int waveWidth = tileWidth - waveX - 4;
+    const int waveHeight = gridSize * 2;
+    const float waveCentre = float(densityY) + waveHeight / 2.0f;
+
+    const int numChannels = summary->getNumChannels();
+    const int numSamples = summary->getNumSamples();
+
+    if (summary->getNumSpikes() > 0 && numChannels > 0 && numSamples > 1)
+    {
+        const float range = electrode->displayRanges.size() > 0 ? electrode->displayRanges[0] : 250.0f;
+        const float yScale = -float(waveHeight) / range;
+        const float channelWidth = float(waveWidth) / numChannels;
+        const float dx = channelWidth / float(numSamples - 1);
+
+        Path path;
+        path.preallocateSpace(3 * numChannels * numSamples);
+
+        for (int ch = 0; ch < numChannels; ch++)
+        {
+            const float x0 = waveX + ch * channelWidth;
+
+            path.startNewSubPath(x0, waveCentre + summary->getMeanSample(ch, 0) * yScale);
+
+            for (int i = 1; i < numSamples; i++)
+                path.lineTo(x0 + i * dx, waveCentre + summary->getMeanSample(ch, i) * yScale);
+        }
+
+        g.reduceClipRegion(waveX, densityY, waveWidth, waveHeight);
+        g.setColour(Colours::white);
+        g.strokePath(path, PathStrokeType(1.0f));
+    }
+}
+
+void ElectrodeOverview::paint(Graphics& g)
+{
+    const double start = Time::getMillisecondCounterHiRes();
+
+    g.fillAll(Colours::black);
+
+    for (int i = 0; i < (int) tiles.size(); i++)
+    {
+        g.drawImageAt(tiles[i].image,
+                      tileGap + (i % numColumns) * (tileWidth + tileGap),
+                      tileGap + (i / numColumns) * (tileHeight + tileGap));
+    }
+
+    paintMilliseconds += Time::getMillisecondCounterHiRes() - start;
+}
+
+double ElectrodeOverview::takePaintTime()
+{
+    const double milliseconds = paintMilliseconds;
+    paintMilliseconds = 0;
+
+    return milliseconds;
+}
+
+int64 ElectrodeOverview::getMemoryUsage() const
+{
+    int64 bytes = 0;
+
+    // RGB images are stored 3 bytes per pixel
+    for (auto& tile : tiles)
+        bytes += int64(tile.image.getWidth()) * tile.image.getHeight() * 3;
+
+    return bytes;
+}
+
+void ElectrodeOverview::resized()
+{
+    numColumns = jmax(1, (getWidth() - tileGap) / (tileWidth + tileGap));
+}
+
+int ElectrodeOverview::getTotalHeight() const
+{
+    const int numRows = ((int) tiles.size() + numColumns - 1) / numColumns;
+
+    return tileGap + numRows * (tileHeight + tileGap);
+}
+
+int ElectrodeOverview::getTileAt(Point<int> position) const
+{
+    const int column = (position.x - tileGap) / (tileWidth + tileGap);
+    const int row = (position.y - tileGap) / (tileHeight + tileGap);
+
+    if (position.x < tileGap || position.y < tileGap || column >= numColumns)
+        return -1;
+
+    const int index = row * numColumns + column;
+
+    return index < (int) tiles.size() ? index : -1;
+}
+
+void ElectrodeOverview::mouseUp(const MouseEvent& event)
+{
+    const int index = getTileAt(event.getPosition());
+
+    if (index >= 0 && onElectrodeClicked)
+        onElectrodeClicked(index);
+}
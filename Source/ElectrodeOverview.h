@@ -0,0 +1,106 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __ELECTRODEOVERVIEW_H__
+#define __ELECTRODEOVERVIEW_H__
+
+#include <VisualizerWindowHeaders.h>
+
+#include <vector>
+
+class Electrode;
+
+/**
+    Tiles every electrode of a stream as a small thumbnail showing its PC
+    density, mean waveform and firing rate, so many electrodes can be
+    scanned at once. Clicking a tile opens that electrode.
+
+    Thumbnails are drawn from each electrode's ElectrodeSummary, never from
+    a SpikePlot, into cached images. Each refresh re-renders only a few
+    tiles in turn, within a fixed time budget, so the cost per frame does
+    not grow with the number of electrodes.
+*/
+class ElectrodeOverview : public Component
+{
+public:
+
+    /** Called with the index of a clicked electrode */
+    std::function<void(int)> onElectrodeClicked;
+
+    /** Constructor */
+    ElectrodeOverview();
+
+    /** Destructor */
+    ~ElectrodeOverview() { }
+
+    /** Sets the electrodes to show */
+    void setElectrodes(const Array<Electrode*>& electrodes);
+
+    /** Re-renders the next tiles within the frame budget and repaints */
+    void refresh();
+
+    /** Draws the cached tiles */
+    void paint(Graphics& g) override;
+
+    /** Lays out the tiles */
+    void resized() override;
+
+    /** Opens the clicked electrode */
+    void mouseUp(const MouseEvent& event) override;
+
+    /** Returns the height needed to show all tiles at the current width */
+    int getTotalHeight() const;
+
+    /** Returns the time spent rendering and painting since the last call (ms) */
+    double takePaintTime();
+
+    /** Returns the bytes held by the cached tile images */
+    int64 getMemoryUsage() const;
+
+private:
+
+    struct Tile
+    {
+        Electrode* electrode;
+        Image image;
+    };
+
+    /** Draws one electrode's thumbnail into its cached image */
+    void renderTile(Tile& tile);
+
+    /** Returns the tile under a point, or -1 */
+    int getTileAt(Point<int> position) const;
+
+    std::vector<Tile> tiles;
+
+    /** Tile to re-render first on the next refresh */
+    int nextTile;
+
+    int numColumns;
+
+    double paintMilliseconds;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ElectrodeOverview);
+};
+
+#endif // __ELECTRODEOVERVIEW_H__
@@ -0,0 +1,132 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ElectrodeSummary.h"
+
+/** The mean waveform becomes an exponential average over this many spikes */
+static const int meanWaveformSpikes = 32;
+
+ElectrodeSummary::ElectrodeSummary(int numChannels_, int numSamples_)
+    : numChannels(numChannels_),
+      numSamples(numSamples_),
+      xMin(0), yMin(0), xScale(0), yScale(0),
+      rangeXMax(0), rangeYMax(0),
+      grid(gridSize * gridSize),
+      meanWaveform(size_t(jmax(0, numChannels_ * numSamples_))),
+      numSpikes(0),
+      rateNumSpikes(0),
+      rateTime(Time::getMillisecondCounterHiRes()),
+      firingRate(0)
+{
+    clear();
+}
+
+void ElectrodeSummary::addSpike(const SorterSpikeContainer* spike)
+{
+    const int64 n = numSpikes.load(std::memory_order_relaxed) + 1;
+
+    // cumulative mean for the first spikes, then an exponential average
+    const float weight = 1.0f / float(jmin(n, int64(meanWaveformSpikes)));
+    const float* data = spike->getData();
+    const int numValues = jmin((int) meanWaveform.size(),
+                               spike->getChannel()->getNumChannels() * (int) spike->getChannel()->getTotalSamples());
+
+    for (int i = 0; i < numValues; i++)
+    {
+        const float mean = meanWaveform[i].load(std::memory_order_relaxed);
+        meanWaveform[i].store(mean + (data[i] - mean) * weight, std::memory_order_relaxed);
+    }
+
+    // only spikes projected on a PC basis have coordinates
+    if (spike->basisVersion != 0)
+    {
+        const float fx = (spike->pcProj[0] - xMin.load(std::memory_order_relaxed)) * xScale.load(std::memory_order_relaxed);
+        const float fy = (spike->pcProj[1] - yMin.load(std::memory_order_relaxed)) * yScale.load(std::memory_order_relaxed);
+
+        if (fx >= 0 && fy >= 0 && fx < float(gridSize) && fy < float(gridSize))
+            grid[int(fy) * gridSize + int(fx)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    numSpikes.store(n, std::memory_order_relaxed);
+}
+
+void ElectrodeSummary::setPCRange(float xMin_, float yMin_, float xMax, float yMax)
+{
+    if (xMin_ == xMin.load() && yMin_ == yMin.load() && xMax == rangeXMax && yMax == rangeYMax)
+        return;
+
+    xMin = xMin_;
+    yMin = yMin_;
+    xScale = xMax > xMin_ ? float(gridSize) / (xMax - xMin_) : 0.0f;
+    yScale = yMax > yMin_ ? float(gridSize) / (yMax - yMin_) : 0.0f;
+    rangeXMax = xMax;
+    rangeYMax = yMax;
+
+    for (auto& cell : grid)
+        cell.store(0, std::memory_order_relaxed);
+}
+
+void ElectrodeSummary::decay()
+{
+    // an increment racing with this is occasionally lost, which only matters for display
+    for (auto& cell : grid)
+    {
+        const uint32 count = cell.load(std::memory_order_relaxed);
+
+        if (count > 0)
+            cell.store((count * 7) >> 3, std::memory_order_relaxed);
+    }
+}
+
+float ElectrodeSummary::updateFiringRate()
+{
+    const double now = Time::getMillisecondCounterHiRes();
+    const int64 n = numSpikes;
+
+    const double elapsed = (now - rateTime) / 1000.0;
+
+    if (elapsed > 0)
+    {
+        const float rate = float(double(n - rateNumSpikes) / elapsed);
+
+        firingRate += (rate - firingRate) * 0.5f;
+    }
+
+    rateNumSpikes = n;
+    rateTime = now;
+
+    return firingRate;
+}
+
+void ElectrodeSummary::clear()
+{
+    for (auto& cell : grid)
+        cell.store(0);
+
+    for (auto& value : meanWaveform)
+        value.store(0);
+
+    numSpikes = 0;
+    rateNumSpikes = 0;
+    firingRate = 0;
+}
@@ -0,0 +1,115 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __ELECTRODESUMMARY_H__
+#define __ELECTRODESUMMARY_H__
+
+#include <ProcessorHeaders.h>
+
+#include "Containers.h"
+
+#include <atomic>
+#include <vector>
+
+/**
+    Small running summary of one electrode's spikes for the overview grid:
+    a coarse PC density grid, the mean waveform and the firing rate.
+
+    addSpike() is called on the audio thread for every displayed spike and
+    costs one cell increment plus one pass over the waveform; everything
+    else is called from the message thread. All shared values are atomics,
+    so the reader may see a partly updated summary but never blocks the
+    writer.
+*/
+class ElectrodeSummary
+{
+public:
+
+    /** Cells along each side of the density grid */
+    static const int gridSize = 32;
+
+    /** Constructor */
+    ElectrodeSummary(int numChannels, int numSamples);
+
+    /** Adds a spike that passed threshold (audio thread) */
+    void addSpike(const SorterSpikeContainer* spike);
+
+    /** Sets the region of PC space covered by the grid; clears the grid if it changed */
+    void setPCRange(float xMin, float yMin, float xMax, float yMax);
+
+    /** Fades the density grid by a factor of 7/8 */
+    void decay();
+
+    /** Returns the count of a density grid cell */
+    uint32 getCount(int x, int y) const { return grid[y * gridSize + x].load(std::memory_order_relaxed); }
+
+    /** Returns one sample of the mean waveform (channels one after another) */
+    float getMeanSample(int channel, int sample) const
+    {
+        return meanWaveform[channel * numSamples + sample].load(std::memory_order_relaxed);
+    }
+
+    /** Returns the number of spikes added since construction or clear() */
+    int64 getNumSpikes() const { return numSpikes; }
+
+    /** Returns the firing rate (Hz) since the previous call, smoothed over a few calls */
+    float updateFiringRate();
+
+    /** Returns the number of channels */
+    int getNumChannels() const { return numChannels; }
+
+    /** Returns the number of samples per channel */
+    int getNumSamples() const { return numSamples; }
+
+    /** Empties the summary (not while spikes are being added) */
+    void clear();
+
+    /** Returns the bytes held by the grid and mean waveform */
+    int64 getMemoryUsage() const
+    {
+        return (int64) sizeof(ElectrodeSummary)
+            + int64(grid.size()) * (int64) sizeof(std::atomic<uint32>)
+            + int64(meanWaveform.size()) * (int64) sizeof(std::atomic<float>);
+    }
+
+private:
+
+    const int numChannels;
+    const int numSamples;
+
+    std::atomic<float> xMin, yMin, xScale, yScale;
+    float rangeXMax, rangeYMax;
+
+    std::vector<std::atomic<uint32>> grid;
+    std::vector<std::atomic<float>> meanWaveform;
+
+    std::atomic<int64> numSpikes;
+
+    int64 rateNumSpikes;
+    double rateTime;
+    float firingRate;
+
+    JUCE_DECLARE_NON_COPYABLE(ElectrodeSummary);
+};
+
+#endif // __ELECTRODESUMMARY_H__
@@ -0,0 +1,247 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "MemoryBudget.h"
+
+#include <algorithm>
+
+/** Levels are only lowered while the total stays below this share of the cap */
+static const double growThreshold = 0.75;
+
+int64 MemoryUsage::getTotal() const
+{
+    int64 sum = 0;
+
+    for (int i = 0; i < NUM_SUBSYSTEMS; i++)
+        sum += bytes[i];
+
+    return sum;
+}
+
+MemoryUsage& MemoryUsage::operator+= (const MemoryUsage& other)
+{
+    for (int i = 0; i < NUM_SUBSYSTEMS; i++)
+        bytes[i] += other.bytes[i];
+
+    return *this;
+}
+
+String MemoryUsage::getSubsystemName(int subsystem)
+{
+    switch (subsystem)
+    {
+    case TRAINING_BUFFER:
+        return "Training buffers";
+    case PC_HISTORY:
+        return "PC history";
+    case PC_IMAGES:
+        return "PC images";
+    case WAVEFORM_RASTERS:
+        return "Waveform rasters";
+    case DISPLAY_QUEUE:
+        return "Display queues";
+    case SUMMARY:
+        return "Overview";
+    case PCA_JOBS:
+        return "PCA jobs";
+    case RECORDER:
+        return "Recorder";
+    default:
+        return "Other";
+    }
+}
+
+MemoryBudget::MemoryBudget()
+    : cap(0),
+      total(0)
+{
+}
+
+int64 MemoryBudget::getSavings(const Entry& entry)
+{
+    const MemoryUsage& usage = entry.usage;
+
+    int64 savings = usage.bytes[MemoryUsage::PC_HISTORY] / 2;
+
+    // leaving level 0 also stores the training spikes in 16 bits
+    if (entry.level == 0)
+        savings += usage.bytes[MemoryUsage::TRAINING_BUFFER] * 3 / 4;
+    else
+        savings += usage.bytes[MemoryUsage::TRAINING_BUFFER] / 2;
+
+    if (!entry.visible && entry.level == 0)
+    {
+        savings += usage.bytes[MemoryUsage::PC_IMAGES]
+                 + usage.bytes[MemoryUsage::WAVEFORM_RASTERS]
+                 + usage.bytes[MemoryUsage::DISPLAY_QUEUE];
+    }
+
+    return savings;
+}
+
+int64 MemoryBudget::getGrowth(const Entry& entry)
+{
+    const int64 training = entry.usage.bytes[MemoryUsage::TRAINING_BUFFER];
+
+    return entry.usage.bytes[MemoryUsage::PC_HISTORY] + (entry.level == 1 ? training * 3 : training);
+}
+
+bool MemoryBudget::update(std::vector<Entry>& electrodes, const MemoryUsage& shared)
+{
+    total = shared.getTotal();
+
+    for (auto& entry : electrodes)
+        total += entry.usage.getTotal();
+
+    bool changed = false;
+
+    if (cap == 0)
+    {
+        for (auto& entry : electrodes)
+        {
+            changed = changed || entry.level != 0;
+            entry.level = 0;
+        }
+
+        return changed;
+    }
+
+    if (total > cap)
+    {
+        int64 excess = total - cap;
+
+        // enough steps to cover the excess, hidden and large electrodes first
+        while (excess > 0)
+        {
+            Entry* next = nullptr;
+
+            for (auto& entry : electrodes)
+            {
+                if (entry.level >= maxLevel)
+                    continue;
+
+                if (next == nullptr
+                    || (next->visible && !entry.visible)
+                    || (next->visible == entry.visible
+                        && (entry.level < next->level
+                            || (entry.level == next->level && getSavings(entry) > getSavings(*next)))))
+                {
+                    next = &entry;
+                }
+            }
+
+            if (next == nullptr)
+                break;
+
+            excess -= jmax(int64(1), getSavings(*next));
+            next->level++;
+            changed = true;
+        }
+    }
+    else
+    {
+        // one step at a time, visible electrode first, while there is
+        // clearly room
+        Entry* next = nullptr;
+
+        for (auto& entry : electrodes)
+        {
+            if (entry.level == 0)
+                continue;
+
+            if (next == nullptr
+                || (entry.visible && !next->visible)
+                || (entry.visible == next->visible && entry.level > next->level))
+            {
+                next = &entry;
+            }
+        }
+
+        if (next != nullptr && double(total + getGrowth(*next)) < growThreshold * double(cap))
+        {
+            next->level--;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+String MemoryBudget::getReport(const std::vector<Entry>& electrodes, const MemoryUsage& shared) const
+{
+    MemoryUsage sum = shared;
+
+    for (auto& entry : electrodes)
+        sum += entry.usage;
+
+    String report = "Memory " + formatBytes(total);
+
+    if (cap > 0)
+        report << " of " << formatBytes(cap);
+
+    report << "\n";
+
+    for (int i = 0; i < MemoryUsage::NUM_SUBSYSTEMS; i++)
+    {
+        if (sum.bytes[i] > 0)
+            report << "  " << MemoryUsage::getSubsystemName(i) << ": " << formatBytes(sum.bytes[i]) << "\n";
+    }
+
+    std::vector<const Entry*> largest;
+
+    for (auto& entry : electrodes)
+        largest.push_back(&entry);
+
+    std::stable_sort(largest.begin(), largest.end(), [](const Entry* a, const Entry* b)
+    {
+        return a->usage.getTotal() > b->usage.getTotal();
+    });
+
+    const int numShown = jmin(8, (int) largest.size());
+
+    if (numShown > 0)
+        report << "Largest electrodes:\n";
+
+    for (int i = 0; i < numShown; i++)
+    {
+        report << "  " << largest[i]->name << ": " << formatBytes(largest[i]->usage.getTotal());
+
+        if (largest[i]->level > 0)
+            report << " (history 1/" << (1 << largest[i]->level) << ")";
+
+        report << "\n";
+    }
+
+    return report.trim();
+}
+
+String MemoryBudget::formatBytes(int64 bytes)
+{
+    if (bytes >= (int64(1) << 30))
+        return String(double(bytes) / double(int64(1) << 30), 2) + " GB";
+
+    if (bytes >= (1 << 20))
+        return String(double(bytes) / double(1 << 20), 1) + " MB";
+
+    return String(double(bytes) / 1024.0, 1) + " kB";
+}
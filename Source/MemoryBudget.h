@@ -0,0 +1,142 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __MEMORYBUDGET_H__
+#define __MEMORYBUDGET_H__
+
+#include <ProcessorHeaders.h>
+
+#include <vector>
+
+/**
+    Bytes held by one electrode (or by the processor as a whole), by subsystem
+*/
+struct MemoryUsage
+{
+    enum Subsystem
+    {
+        /** PC basis and the spikes collected for PCA jobs */
+        TRAINING_BUFFER = 0,
+
+        /** Projections kept for the PC scatter */
+        PC_HISTORY,
+
+        /** PC scatter image and density grid */
+        PC_IMAGES,
+
+        /** Waveform persistence rasters and their images */
+        WAVEFORM_RASTERS,
+
+        /** Spikes waiting to be drawn */
+        DISPLAY_QUEUE,
+
+        /** Overview summaries and thumbnails */
+        SUMMARY,
+
+        /** Queued and running PCA jobs */
+        PCA_JOBS,
+
+        /** Spike recorder FIFO */
+        RECORDER,
+
+        NUM_SUBSYSTEMS
+    };
+
+    int64 bytes[NUM_SUBSYSTEMS] = {};
+
+    /** Adds bytes to one subsystem */
+    void add(Subsystem subsystem, int64 numBytes) { bytes[subsystem] += numBytes; }
+
+    /** Returns the bytes of all subsystems */
+    int64 getTotal() const;
+
+    MemoryUsage& operator+= (const MemoryUsage& other);
+
+    /** Returns a display name for a subsystem */
+    static String getSubsystemName(int subsystem);
+};
+
+/**
+    Keeps the memory held by all electrodes under a global cap.
+
+    Each electrode has a history level: level 0 keeps the full PCA
+    training buffer and PC scatter history, and each level above halves
+    them; from level 1 the training spikes are also stored in 16 bits.
+    Electrodes that are not on screen also give up their display images
+    and queued spikes from level 1. When the total exceeds the cap,
+    levels are raised on hidden electrodes first (the largest first),
+    and only then on the visible one; when there is room again, they are
+    lowered one step per update, the visible electrode first.
+*/
+class MemoryBudget
+{
+public:
+
+    /** Highest history level */
+    static const int maxLevel = 3;
+
+    /** One electrode as seen by the budget */
+    struct Entry
+    {
+        String name;
+        MemoryUsage usage;
+        bool visible = false;
+        int level = 0;
+    };
+
+    /** Constructor */
+    MemoryBudget();
+
+    /** Sets the cap in bytes (0 = unlimited) */
+    void setCap(int64 bytes) { cap = jmax(int64(0), bytes); }
+
+    /** Returns the cap in bytes (0 = unlimited) */
+    int64 getCap() const { return cap; }
+
+    /** Adjusts the entries' levels for the measured usage; returns true if
+        any changed */
+    bool update(std::vector<Entry>& electrodes, const MemoryUsage& shared);
+
+    /** Returns the total measured by the last update */
+    int64 getTotal() const { return total; }
+
+    /** Describes the last update: totals by subsystem and the largest
+        electrodes */
+    String getReport(const std::vector<Entry>& electrodes, const MemoryUsage& shared) const;
+
+    /** Formats a byte count, e.g. "12.3 MB" */
+    static String formatBytes(int64 bytes);
+
+private:
+
+    /** Estimated bytes freed by raising an electrode one level */
+    static int64 getSavings(const Entry& entry);
+
+    /** Estimated bytes needed to lower an electrode one level */
+    static int64 getGrowth(const Entry& entry);
+
+    int64 cap;
+    int64 total;
+};
+
+#endif // __MEMORYBUDGET_H__
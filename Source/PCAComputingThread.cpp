@@ -39,24 +39,78 @@ void PCAComputingThread::addPCAjob(PCAJobPtr job)
     }
 }
 
+int64 PCAComputingThread::getMemoryUsage()
+{
+    int64 bytes = runningJobBytes;
+
+    ScopedLock critical(lock);
+
+    for (int n = 0; n < jobs.size(); n++)
+        bytes += jobs[n]->getMemoryUsage();
+
+    return bytes;
+}
+
 void PCAComputingThread::run()
 {
     while (jobs.size() > 0)
     {
 		lock.enter();
         PCAJobPtr J = jobs.removeAndReturn(0);
-	if (J == nullptr) continue;
+        runningJob = J;
 		lock.exit();
+	if (J == nullptr) continue;
         // compute PCA
         // 1. Compute Covariance matrix
         // 2. Apply SVD on covariance matrix
         // 3. Extract the two principal components corresponding to the largest singular values
 
         J->computeCov();
+        runningJobBytes = J->getMemoryUsage();
+
         J->computeSVD();
 
+        // 3b. An automatic mask keeps the part of the waveform the first basis
+        //     loads on, and the basis is trained again on that part only
+        if (J->choosesMask())
+        {
+            J->chooseMask();
+            J->computeCov();
+            runningJobBytes = J->getMemoryUsage();
+            J->computeSVD();
+        }
+
+        runningJobBytes = 0;
+
         // 4. Report to the spike sorting electrode that PCA is finished
         J->reportDone = true;
+
+        if (J->listener != nullptr)
+            J->listener->pcaJobFinished(J.get());
+
+        ScopedLock critical(lock);
+        runningJob = nullptr;
+    }
+}
+
+void PCAComputingThread::removeJobs(PCAjob::Listener* listener)
+{
+    for (;;)
+    {
+        {
+            ScopedLock critical(lock);
+
+            for (int n = jobs.size(); --n >= 0;)
+            {
+                if (jobs[n]->listener == listener)
+                    jobs.remove(n);
+            }
+
+            if (runningJob == nullptr || runningJob->listener != listener)
+                return;
+        }
+
+        Thread::sleep(1);
     }
 }
 
@@ -51,8 +51,21 @@ public:
     /** Adds a job to the queue*/
     void addPCAjob(PCAJobPtr job);
 
+    /** Returns the bytes held by queued jobs and the job being computed */
+    int64 getMemoryUsage();
+
+    /** Drops the queued jobs of a listener and waits until its running job, if
+        any, has been reported, so no job is left pointing at a deleted sorter */
+    void removeJobs(PCAjob::Listener* listener);
+
 private:
 
+    /** Work memory of the job being computed */
+    std::atomic<int64> runningJobBytes { 0 };
+
+    /** Job being computed or reported, guarded by lock */
+    PCAJobPtr runningJob;
+
     PCAJobArray jobs;
 	CriticalSection lock;
 
@@ -39,22 +39,53 @@ static double sqrarg;
 #define SQR(a) ((sqrarg = (a)) == 0.0 ? 0.0 : sqrarg * sqrarg)
 
 
-PCAjob::PCAjob(SorterSpikeArray& _spikes, float* _pc1, float* _pc2,
-                std::atomic<float>& pc1Min,  std::atomic<float>& pc2Min,  std::atomic<float>&pc1Max,  std::atomic<float>& pc2Max, std::atomic<bool>& _reportDone) : spikes(_spikes),
-pc1min(pc1Min), pc2min(pc2Min), pc1max(pc1Max), pc2max(pc2Max), reportDone(_reportDone)
+PCAjob::PCAjob(SorterSpikeArray& _spikes, float* _pc1, float* _pc2, const ProjectionMask& _mask,
+                std::atomic<float>& pc1Min,  std::atomic<float>& pc2Min,  std::atomic<float>&pc1Max,  std::atomic<float>& pc2Max, std::atomic<bool>& _reportDone,
+                ProjectionMask* _chosenMask, float _maskEnergy, Listener* _listener) :
+pc1min(pc1Min), pc2min(pc2Min), pc1max(pc1Max), pc2max(pc2Max), reportDone(_reportDone), listener(_listener), mask(_mask),
+chosenMask(_chosenMask), maskEnergy(_maskEnergy)
 {
-	SorterSpikePtr spike = spikes[0];
+    // a buffer that was shrunk or restored may not be full yet
+    for (int n = 0; n < _spikes.size(); n++)
+    {
+        if (_spikes[n] != nullptr)
+            spikes.add(_spikes[n]);
+    }
+
     cov = nullptr;
+    size = 0;
+    numSpikes = 0;
+    useGram = false;
     pc1 = _pc1;
     pc2 = _pc2;
 
-    dim = spike->getChannel()->getNumChannels()*spike->getChannel()->getTotalSamples();
+    // only the masked part of each waveform is analysed
+    dim = mask.getNumValues();
 
 };
 
 PCAjob::~PCAjob()
 {
+    if (cov != nullptr)
+    {
+        for (int k = 0; k < size; k++)
+            delete[] cov[k];
+
+        delete[] cov;
+    }
+}
+
+int64 PCAjob::getMemoryUsage() const
+{
+    int64 bytes = sizeof(PCAjob) + int64(spikes.size()) * (int64) sizeof(SorterSpikePtr);
+
+    if (data != nullptr)
+        bytes += int64(numSpikes) * dim * (int64) sizeof(float);
+
+    if (cov != nullptr)
+        bytes += int64(size) * size * (int64) sizeof(float) + size * (int64) sizeof(float*);
 
+    return bytes;
 }
 
 // calculates sqrt( a^2 + b^2 ) with decent precision
@@ -313,57 +344,118 @@ int PCAjob::svdcmp(float** a, int nRows, int nCols, float* w, float** v)
 
 void PCAjob::computeCov()
 {
-    // allocate and zero
-    cov = new float*[dim];
-    float* mean  = new float[dim];
+    numSpikes = spikes.size();
+
+    if (numSpikes == 0 || dim == 0)
+        return;
+
+    // centred data matrix, one row per spike
+    data.calloc(size_t(numSpikes) * dim);
+
+    HeapBlock<double> mean(dim, true);
+
+    for (int n = 0; n < numSpikes; n++)
+    {
+        float* row = data + size_t(n) * dim;
+        const SorterSpikeContainer* spike = spikes[n];
+
+        // compact training spikes are converted straight into the data matrix
+        if (spike->isCompact())
+            mask.gather(spike->getCompactData(), spike->getCompactScale(), row);
+        else
+            mask.gather(spike->getData(), row);
+
+        for (int k = 0; k < dim; k++)
+            mean[k] += row[k];
+    }
+
     for (int k = 0; k < dim; k++)
+        mean[k] /= jmax(1, numSpikes);
+
+    for (int n = 0; n < numSpikes; n++)
     {
-        cov[k] = new float[dim];
-        for (int j=0; j<dim; j++)
-        {
-            cov[k][j] = 0;
-        }
+        float* row = data + size_t(n) * dim;
+
+        for (int k = 0; k < dim; k++)
+            row[k] = float(row[k] - mean[k]);
     }
-    // compute mean
 
-    for (int j=0; j<dim; j++)
+    // With more dimensions than spikes (wide electrodes), decompose the
+    // N x N Gram matrix X * Xt instead of the dim x dim covariance Xt * X;
+    // both have the same non-zero eigenvalues, and the SVD is cubic in size.
+    useGram = numSpikes < dim;
+    size = useGram ? numSpikes : dim;
+
+    const float scale = 1.0f / float(jmax(1, numSpikes - 1));
+
+    cov = new float*[size];
+
+    for (int i = 0; i < size; i++)
+        cov[i] = new float[size]();
+
+    if (useGram)
     {
-        mean[j] = 0;
-        for (int i=0; i<spikes.size(); i++)
+        for (int i = 0; i < numSpikes; i++)
         {
-            SorterSpikePtr spike = spikes[i];
-            float v = spike->spikeDataIndexToMicrovolts(j);
-            mean[j] += v / dim;
-        }
-    }
-    // aggregate
+            const float* a = data + size_t(i) * dim;
 
+            for (int j = i; j < numSpikes; j++)
+            {
+                const float* b = data + size_t(j) * dim;
+
+                float sum = 0;
+
+                for (int k = 0; k < dim; k++)
+                    sum += a[k] * b[k];
 
-    for (int i=0; i<dim; i++)
+                cov[i][j] = cov[j][i] = sum * scale;
+            }
+        }
+    }
+    else
     {
-        for (int j=i; j<dim; j++)
+        // accumulate the upper triangle one spike (row) at a time
+        for (int n = 0; n < numSpikes; n++)
         {
-            // cov[i][j] = sum_k[ (X(i,:)) * (Xj-mue(j) ]
-            float sum = 0 ;
-            for (int k=0; k<spikes.size(); k++)
+            const float* row = data + size_t(n) * dim;
+
+            for (int i = 0; i < dim; i++)
             {
+                const float vi = row[i];
+                float* covRow = cov[i];
+
+                for (int j = i; j < dim; j++)
+                    covRow[j] += vi * row[j];
+            }
+        }
 
-                SorterSpikePtr spike = spikes[k];
-                float vi = spike->spikeDataIndexToMicrovolts(i);
-                float vj = spike->spikeDataIndexToMicrovolts(j);
-                sum += (vi-mean[i]) * (vj-mean[j]);
+        for (int i = 0; i < dim; i++)
+        {
+            for (int j = i; j < dim; j++)
+            {
+                cov[i][j] *= scale;
+                cov[j][i] = cov[i][j];
             }
-            cov[i][j] = sum / (dim-1);
-            cov[j][i] = sum / (dim-1);
         }
     }
-    delete[] mean;
 
 }
 
-std::vector<int> sort_indexes(std::vector<float> v)
+void PCAjob::chooseMask()
+{
+    if (chosenMask == nullptr)
+        return;
+
+    mask.chooseFromLoadings(pc1, pc2, maskEnergy);
+    dim = mask.getNumValues();
+
+    *chosenMask = mask;
+    chosenMask = nullptr;
+}
+
+/** Returns the indices of v ordered by decreasing value */
+static std::vector<int> sort_indexes(const std::vector<float>& v)
 {
-    // initialize original index locations
     std::vector<int> idx(v.size());
 
     for (int i = 0; i != idx.size(); ++i)
@@ -371,62 +463,88 @@ std::vector<int> sort_indexes(std::vector<float> v)
         idx[i] = i;
     }
 
-    //sort indexes based on comparing values in v
-    sort(
-        idx.begin(),
-        idx.end()//,
-        //[&v](size_t i1, size_t i2)
-        //{
-        //	return v[i1] > v[i2];
-        //}
-    );
+    std::stable_sort(idx.begin(), idx.end(), [&v](int i1, int i2)
+    {
+        return v[i1] > v[i2];
+    });
 
     return idx;
 }
 
 void PCAjob::computeSVD()
 {
-
+    if (cov == nullptr)
+        return;
 
     float** eigvec, *sigvalues;
-    sigvalues = new float[dim];
+    sigvalues = new float[size];
 
-    eigvec = new float*[dim];
-    for (int k = 0; k < dim; k++)
+    eigvec = new float*[size];
+    for (int k = 0; k < size; k++)
+        eigvec[k] = new float[size]();
+
+    // the matrix is symmetric, so V holds its eigenvectors
+    svdcmp(cov, size, size, sigvalues, eigvec);
+
+    std::vector<float> sig(sigvalues, sigvalues + size);
+    std::vector<int> sortind = sort_indexes(sig);
+
+    // components over the masked values, expanded into full waveforms below
+    HeapBlock<float> compact1(dim), compact2(dim);
+    float* pcs[2] = { compact1, compact2 };
+
+    for (int c = 0; c < 2; c++)
     {
-        eigvec[k] = new float[dim];
-        for (int j=0; j<dim; j++)
+        const int column = sortind[jmin(c, size - 1)];
+
+        if (useGram)
         {
-            eigvec[k][j] = 0;
-        }
-    }
+            // principal axis = Xt * u, normalised
+            for (int k = 0; k < dim; k++)
+                pcs[c][k] = 0;
 
-    svdcmp(cov, dim, dim, sigvalues, eigvec);
+            for (int n = 0; n < numSpikes; n++)
+            {
+                const float weight = eigvec[n][column];
+                const float* row = data + size_t(n) * dim;
 
-    std::vector<float> sig;
-    sig.resize(dim);
-    for (int k = 0; k < dim; k++)
-        sig[k] = sigvalues[k];
+                for (int k = 0; k < dim; k++)
+                    pcs[c][k] += weight * row[k];
+            }
 
-    std::vector<int> sortind = sort_indexes(sig);
+            double norm = 0;
 
-    for (int k = 0; k < dim; k++)
-    {
-        pc1[k] = eigvec[k][sortind[0]];
-        pc2[k] = eigvec[k][sortind[1]];
+            for (int k = 0; k < dim; k++)
+                norm += double(pcs[c][k]) * pcs[c][k];
+
+            const float inverseNorm = norm > 0 ? float(1.0 / std::sqrt(norm)) : 0.0f;
+
+            for (int k = 0; k < dim; k++)
+                pcs[c][k] *= inverseNorm;
+        }
+        else
+        {
+            for (int k = 0; k < dim; k++)
+                pcs[c][k] = eigvec[k][column];
+        }
     }
+
+    mask.scatter(compact1, pc1);
+    mask.scatter(compact2, pc2);
+
     // project samples to find the display range
     float min1 = 1e10, min2 = 1e10, max1 = -1e10, max2 = -1e10;
 
     for (int j = 0; j < spikes.size(); j++)
     {
-        float sum1 = 0, sum2=0;
-        for (int k = 0; k < dim; k++)
-        {
-            SorterSpikePtr spike = spikes[j];
-            sum1 += spike->spikeDataIndexToMicrovolts(k) * pc1[k];
-            sum2 += spike->spikeDataIndexToMicrovolts(k) * pc2[k];
-        }
+        float sum1, sum2;
+        const SorterSpikeContainer* spike = spikes[j];
+
+        if (spike->isCompact())
+            mask.project(spike->getCompactData(), spike->getCompactScale(), pc1, pc2, sum1, sum2);
+        else
+            mask.project(spike->getData(), pc1, pc2, sum1, sum2);
+
         if (sum1 < min1)
             min1 = sum1;
         if (sum2 < min2)
@@ -437,27 +555,25 @@ void PCAjob::computeSVD()
             max2 = sum2;
     }
 
-
     pc1min = min1 - 1.5 * (max1-min1);
     pc2min = min2 - 1.5 * (max2-min2);
     pc1max = max1 + 1.5 * (max1-min1);
     pc2max = max2 + 1.5 * (max2-min2);
 
     // clear memory
-    for (int k = 0; k < dim; k++)
-    {
+    for (int k = 0; k < size; k++)
         delete[] eigvec[k];
-    }
+
     delete[] eigvec;
     delete[] sigvalues;
 
-    // delete covariances
-    for (int k = 0; k < dim; k++)
+    for (int k = 0; k < size; k++)
         delete[] cov[k];
 
     delete[] cov;
     cov = nullptr;
 
+    data.free();
 }
 
 
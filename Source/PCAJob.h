@@ -27,6 +27,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <ProcessorHeaders.h>
 
 #include "Containers.h"
+#include "ProjectionMask.h"
 
 #include <algorithm>
 #include <list>
@@ -42,30 +43,72 @@ class PCAjob : public ReferenceCountedObject
 {
 public:
 
-    /** Constructor */
-    PCAjob(SorterSpikeArray& _spikes, float* _pc1, float* _pc2,
-           std::atomic<float>&,  std::atomic<float>&,  std::atomic<float>&,  std::atomic<float>&, std::atomic<bool>& _reportDone);
+    /** Told when a job has finished */
+    class Listener
+    {
+    public:
+        virtual ~Listener() { }
+
+        /** Called on the PCA thread, after reportDone has been set */
+        virtual void pcaJobFinished(PCAjob* job) = 0;
+    };
+
+    /** Constructor. If chosenMask is set, the job also chooses a mask that keeps
+        maskEnergy of the loadings (see chooseMask) and writes it there */
+    PCAjob(SorterSpikeArray& _spikes, float* _pc1, float* _pc2, const ProjectionMask& mask,
+           std::atomic<float>&,  std::atomic<float>&,  std::atomic<float>&,  std::atomic<float>&, std::atomic<bool>& _reportDone,
+           ProjectionMask* chosenMask = nullptr, float maskEnergy = 0.0f, Listener* listener = nullptr);
 
     /** Destructor */
     ~PCAjob();
 
-    /** Computes covariance of the waveforms*/
+    /** Computes covariance of the waveforms; when there are fewer spikes than
+        waveform values (electrodes with many channels), the smaller spike-by-spike
+        Gram matrix is computed instead */
     void computeCov();
 
-    /** Computes the Singular Value Decomposition of the waveforms*/
+    /** Computes the Singular Value Decomposition of the waveforms and
+        stores the two components with the largest variance */
     void computeSVD();
 
+    /** Returns true if the job still has to choose a mask */
+    bool choosesMask() const { return chosenMask != nullptr; }
+
+    /** Chooses a mask from the loadings of the basis just computed and restricts
+        the job to it; computeCov and computeSVD then train the basis on the mask */
+    void chooseMask();
+
+    /** Returns the bytes held by this job (spike references and work matrices) */
+    int64 getMemoryUsage() const;
+
     float** cov;
     SorterSpikeArray spikes;
     float* pc1, *pc2;
     std::atomic<float>& pc1min, &pc2min, &pc1max, &pc2max;
     std::atomic<bool>& reportDone;
 
+    /** Told when the job has finished, or nullptr */
+    Listener* listener;
+
 private:
     
     int svdcmp(float** a, int nRows, int nCols, float* w, float** v);
     float pythag(float a, float b);
+    /** Values analysed per waveform (the masked part) */
     int dim;
+
+    ProjectionMask mask;
+
+    ProjectionMask* chosenMask;
+    float maskEnergy;
+
+    /** Mean-centred waveforms, numSpikes x dim */
+    HeapBlock<float> data;
+    int numSpikes;
+
+    /** Size of the decomposed matrix (dim, or numSpikes for the Gram matrix) */
+    int size;
+    bool useGram;
 };
 
 typedef ReferenceCountedObjectPtr<PCAjob> PCAJobPtr;
@@ -25,17 +25,68 @@
 #include "PCAProjectionAxes.h"
 
 #include "SpikeSorter.h"
+#include "SpikePlot.h"
+
+/** Time constant of the density display's decay */
+static const double densityDecaySeconds = 5.0;
+
+/** A density view without new spikes is still repainted this often (ms) while it fades */
+static const double fadeRepaintInterval = 1000.0;
+
+/** Writes 2x2 pixel points straight into an image's pixel data */
+template <class PixelType>
+static void plotPoints(const Image::BitmapData& data,
+                       const ProjectionHistory& history,
+                       int firstPoint, int numPoints, uint32 basisVersion,
+                       float xMin, float xScale, float yMin, float yScale,
+                       int width, int height)
+{
+    for (int n = firstPoint; n < firstPoint + numPoints; n++)
+    {
+        const int slot = history.getSlot(n);
+
+        // points projected with an earlier basis are in different coordinates
+        if (history.basisVersions[slot] != basisVersion)
+            continue;
+
+        const float fx = (history.pcX[slot] - xMin) * xScale;
+        const float fy = (history.pcY[slot] - yMin) * yScale;
+
+        if (!(fx >= 0 && fy >= 0 && fx < float(width - 1) && fy < float(height - 1)))
+            continue;
+
+        const int x = int(fx);
+        const int y = int(fy);
+
+        const uint32 c = history.colours[slot];
+        PixelARGB colour(255, uint8(c >> 16), uint8(c >> 8), uint8(c));
+
+        for (int dy = 0; dy < 2; dy++)
+        {
+            uint8* line = data.getLinePointer(y + dy) + x * data.pixelStride;
+
+            ((PixelType*) line)->set(colour);
+            ((PixelType*) (line + data.pixelStride))->set(colour);
+        }
+    }
+}
 
 PCAProjectionAxes::PCAProjectionAxes(Electrode* electrode_) :
     GenericDrawAxes(GenericDrawAxes::PCA),
     electrode(electrode_),
+    history(maxHistoryDepth),
     imageDim(500),
     rangeX(250),
     rangeY(250),
-    spikesReceivedSinceLastRedraw(0)
+    density(250, 250),
+    densityMode(false),
+    lastDecayTime(0),
+    pointBudget(maxHistoryDepth),
+    numPointsDrawn(0),
+    drawnBasisVersion(0),
+    lastFullRedraw(0)
 {
     projectionImage = Image(Image::RGB, imageDim, imageDim, true);
-    bufferSize = 600;
     pcaMin[0] = pcaMin[1] = -5;
     pcaMax[0] = pcaMax[1] = 5;
 
@@ -57,6 +108,14 @@ PCAProjectionAxes::PCAProjectionAxes(Electrode* electrode_) :
     rangeDownButton->setBounds(10, 10, 20, 15);
     addAndMakeVisible(rangeDownButton);
 
+    densityButton = new UtilityButton("D", Font("Small Text", 10, Font::plain));
+    densityButton->setRadius(3.0f);
+    densityButton->setClickingTogglesState(true);
+    densityButton->setTooltip("Show spike density instead of individual spikes");
+    densityButton->addListener(this);
+    densityButton->setBounds(60, 10, 20, 15);
+    addAndMakeVisible(densityButton);
+
     redrawSpikes = true;
 
 }
@@ -80,6 +139,59 @@ void PCAProjectionAxes::setPolygonDrawingMode(bool on)
 void PCAProjectionAxes::updateUnits(std::vector<PCAUnit> _units)
 {
     units = _units;
+
+    invalidate();
+}
+
+void PCAProjectionAxes::refresh()
+{
+    if (history.getTotalAdded() != numPointsDrawn
+        || redrawSpikes
+        || electrode->sorter->getBasisVersion() != drawnBasisVersion)
+    {
+        needsRepaint = true;
+    }
+
+    if (densityMode && Time::getMillisecondCounterHiRes() - lastDecayTime >= fadeRepaintInterval)
+        needsRepaint = true;
+
+    if (needsRepaint)
+    {
+        repaint();
+        needsRepaint = false;
+    }
+}
+
+void PCAProjectionAxes::setPointBudget(int numPoints)
+{
+    pointBudget = jlimit(1, maxHistoryDepth, numPoints);
+}
+
+void PCAProjectionAxes::setHistoryDepth(int numPoints)
+{
+    numPoints = jlimit(1, maxHistoryDepth, numPoints);
+
+    if (numPoints == history.getCapacity())
+        return;
+
+    history.setCapacity(numPoints);
+    redrawSpikes = true;
+}
+
+void PCAProjectionAxes::releaseImage()
+{
+    projectionImage = Image();
+}
+
+void PCAProjectionAxes::addMemoryUsage(MemoryUsage& usage) const
+{
+    usage.add(MemoryUsage::PC_HISTORY, history.getMemoryUsage());
+
+    // RGB images are stored 3 bytes per pixel
+    if (projectionImage.isValid())
+        usage.add(MemoryUsage::PC_IMAGES, int64(projectionImage.getWidth()) * projectionImage.getHeight() * 3);
+
+    usage.add(MemoryUsage::PC_IMAGES, density.getMemoryUsage());
 }
 
 void PCAProjectionAxes::drawUnit(Graphics& g, PCAUnit unit)
@@ -137,8 +249,9 @@ void PCAProjectionAxes::drawUnit(Graphics& g, PCAUnit unit)
 
 void PCAProjectionAxes::paint(Graphics& g)
 {
+    const double start = Time::getMillisecondCounterHiRes();
 
-    spikesReceivedSinceLastRedraw = 0;
+    updateProjectionImage();
 
     g.drawImage(projectionImage,
         0, 0, getWidth(), getHeight(),
@@ -178,53 +291,145 @@ void PCAProjectionAxes::paint(Graphics& g)
         }
     }
 
-    if (redrawSpikes)
+    if (SpikePlot* plot = electrode->getPlotIfCreated())
+        plot->addPaintTime(Time::getMillisecondCounterHiRes() - start);
+
+}
+
+void PCAProjectionAxes::updateProjectionImage()
+{
+    const uint32 basisVersion = electrode->sorter->getBasisVersion();
+
+    if (!projectionImage.isValid())
+    {
+        projectionImage = Image(Image::RGB, imageDim, imageDim, true);
+        redrawSpikes = true;
+    }
+
+    // Points dropped from the history stay in the image until the next full
+    // redraw, so one is also made each time the history has turned over
+    if (densityMode)
     {
-        projectionImage.clear(juce::Rectangle<int>(0, 0, projectionImage.getWidth(), projectionImage.getHeight()),
-            Colours::black);
+        if (redrawSpikes || basisVersion != drawnBasisVersion)
+            redraw(false);
 
-        bool subsample = false;
-        int dk = (subsample) ? 5 : 1;
+        const double now = Time::getMillisecondCounterHiRes();
 
-        for (int k = 0; k < bufferSize; k += dk)
-        {
-            drawProjectedSpike(spikeBuffer[k]);
-        }
-        redrawSpikes = false;
+        density.decay(float(std::exp(-(now - lastDecayTime) / (densityDecaySeconds * 1000.0))));
+        lastDecayTime = now;
+
+        drawDensity();
+        return;
+    }
+
+    if (redrawSpikes
+        || basisVersion != drawnBasisVersion
+        || history.getTotalAdded() - lastFullRedraw >= history.getCapacity())
+    {
+        redraw(false);
+        return;
     }
 
+    const int numNew = int(jmin(int64(jmin(history.size(), pointBudget)), history.getTotalAdded() - numPointsDrawn));
+
+    if (numNew > 0)
+        drawProjectedPoints(history.size() - numNew, numNew);
+
+    numPointsDrawn = history.getTotalAdded();
 }
 
 
-void PCAProjectionAxes::drawProjectedSpike(SorterSpikePtr s)
+void PCAProjectionAxes::drawProjectedPoints(int firstPoint, int numPoints)
 {
-    if (s != nullptr && rangeSet)
+    if (!rangeSet || numPoints <= 0)
+        return;
+
+    Image::BitmapData data(projectionImage, 0, 0, rangeX, rangeY, Image::BitmapData::readWrite);
+
+    const float xScale = float(rangeX) / (pcaMax[0] - pcaMin[0]);
+    const float yScale = float(rangeY) / (pcaMax[1] - pcaMin[1]);
+
+    if (data.pixelFormat == Image::RGB)
+        plotPoints<PixelRGB>(data, history, firstPoint, numPoints, drawnBasisVersion,
+                             pcaMin[0], xScale, pcaMin[1], yScale, rangeX, rangeY);
+    else if (data.pixelFormat == Image::ARGB)
+        plotPoints<PixelARGB>(data, history, firstPoint, numPoints, drawnBasisVersion,
+                              pcaMin[0], xScale, pcaMin[1], yScale, rangeX, rangeY);
+}
+
+void PCAProjectionAxes::drawDensity()
+{
+    Image::BitmapData data(projectionImage, 0, 0, rangeX, rangeY, Image::BitmapData::readWrite);
+
+    const PixelARGB* colourMap = DensityGrid::getColourMap();
+
+    // log scaling keeps sparse clusters visible next to dense ones
+    const float maxCount = density.getMaxCount();
+    const float scale = maxCount > 0 ? 255.0f / std::log1p(maxCount) : 0.0f;
+
+    const int width = jmin(rangeX, density.getWidth());
+    const int height = jmin(rangeY, density.getHeight());
+
+    for (int y = 0; y < height; y++)
     {
-        Graphics g(projectionImage);
+        uint8* pixel = data.getLinePointer(y);
 
-        g.setColour(Colour(s->color[0], s->color[1], s->color[2]));
+        for (int x = 0; x < width; x++, pixel += data.pixelStride)
+        {
+            const PixelARGB& colour = colourMap[jmin(255, int(std::log1p(density.getCount(x, y)) * scale))];
 
-        float x = (s->pcProj[0] - pcaMin[0]) / (pcaMax[0] - pcaMin[0]) * rangeX;
-        float y = (s->pcProj[1] - pcaMin[1]) / (pcaMax[1] - pcaMin[1]) * rangeY;
-        if (x >= 0 & y >= 0 & x <= rangeX & y <= rangeY)
-            g.fillEllipse(x, y, 2, 2);
+            if (data.pixelFormat == Image::RGB)
+                ((PixelRGB*) pixel)->set(colour);
+            else
+                ((PixelARGB*) pixel)->set(colour);
+        }
     }
 }
 
 void PCAProjectionAxes::redraw(bool subsample)
 {
-    Graphics g(projectionImage);
-
     projectionImage.clear(juce::Rectangle<int>(0, 0, projectionImage.getWidth(), projectionImage.getHeight()),
         Colours::black);
 
-    int dk = (subsample) ? 5 : 1;
+    drawnBasisVersion = electrode->sorter->getBasisVersion();
 
-    for (int k = 0; k < bufferSize; k += dk)
+    if (densityMode)
     {
-        drawProjectedSpike(spikeBuffer[k]);
+        // the grid covers the current range, so it is rebuilt from the history
+        density.setRange(pcaMin[0], pcaMin[1], pcaMax[0], pcaMax[1]);
+
+        for (int n = 0; n < history.size(); n++)
+        {
+            const int slot = history.getSlot(n);
+
+            if (history.basisVersions[slot] == drawnBasisVersion)
+                density.add(history.pcX[slot], history.pcY[slot]);
+        }
+
+        lastDecayTime = Time::getMillisecondCounterHiRes();
+        numPointsDrawn = history.getTotalAdded();
+        lastFullRedraw = history.getTotalAdded();
+        redrawSpikes = false;
+        return;
     }
 
+    // when subsampling, only the most recent fifth of the history is drawn
+    const int numPoints = jmin(pointBudget, subsample ? history.size() / 5 : history.size());
+
+    drawProjectedPoints(history.size() - numPoints, numPoints);
+
+    numPointsDrawn = history.getTotalAdded();
+    lastFullRedraw = history.getTotalAdded();
+    redrawSpikes = false;
+}
+
+void PCAProjectionAxes::setDensityMode(bool on)
+{
+    densityMode = on;
+    densityButton->setToggleState(on, dontSendNotification);
+
+    redrawSpikes = true;
+    repaint();
 }
 
 void PCAProjectionAxes::setPCARange(float p1min, float p2min, float p1max, float p2max)
@@ -242,20 +447,12 @@ void PCAProjectionAxes::setPCARange(float p1min, float p2min, float p1max, float
 
 bool PCAProjectionAxes::updateSpikeData(SorterSpikePtr s)
 {
+    // drawn into the image by the next paint()
+    history.add(s);
 
-    if (spikesReceivedSinceLastRedraw < bufferSize)
-    {
-
-        spikeIndex++;
-        spikeIndex %= bufferSize;
-
-        spikeBuffer.set(spikeIndex, s);
+    if (densityMode && s->basisVersion == drawnBasisVersion)
+        density.add(s->pcProj[0], s->pcProj[1]);
 
-        spikesReceivedSinceLastRedraw++;
-        //drawProjectedSpike(newSpike);
-        redrawSpikes = true;
-
-    }
     return true;
 }
 
@@ -265,8 +462,10 @@ void PCAProjectionAxes::clear()
     projectionImage.clear(juce::Rectangle<int>(0, 0, projectionImage.getWidth(), projectionImage.getHeight()),
         Colours::black);
 
-    spikeBuffer.clear();
-    spikeIndex = 0;
+    history.clear();
+    density.clear();
+    numPointsDrawn = 0;
+    lastFullRedraw = 0;
 
     redrawSpikes = true;
 }
@@ -497,6 +696,11 @@ void PCAProjectionAxes::buttonClicked(Button* button)
         rangeUp();
     }
 
+    else if (button == densityButton)
+    {
+        setDensityMode(densityButton->getToggleState());
+    }
+
 }
 
 void PCAProjectionAxes::mouseWheelMove(const MouseEvent& event, const MouseWheelDetails& wheel)
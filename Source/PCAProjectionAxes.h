@@ -29,6 +29,9 @@
 #include "Containers.h"
 #include "SpikeSorterCanvas.h"
 #include "PCAUnit.h"
+#include "ProjectionHistory.h"
+#include "DensityGrid.h"
+#include "MemoryBudget.h"
 
 class Electrode;
 class SpikeSorterCanvas;
@@ -53,12 +56,36 @@ public:
     /** Renders the PCA projections */
     void paint(Graphics& g);
 
+    /** Shows a decaying 2D histogram of the projections instead of individual points */
+    void setDensityMode(bool on);
+
+    /** Returns true if the density display is on */
+    bool isInDensityMode() const { return densityMode; }
+
     /** Turns polygon drawing mode on or off*/
     void setPolygonDrawingMode(bool on);
 
     /** Clears the axes*/
     void clear();
 
+    /** Repaints if new points, a range change or unit edits are pending */
+    void refresh();
+
+    /** Sets the most points drawn in one frame (new points beyond it wait for the next full redraw) */
+    void setPointBudget(int numPoints);
+
+    /** Changes how many projections the history keeps; the newest are preserved */
+    void setHistoryDepth(int numPoints);
+
+    /** Frees the scatter image; it is recreated and redrawn on the next paint */
+    void releaseImage();
+
+    /** Adds the bytes held by the history, image and density grid */
+    void addMemoryUsage(MemoryUsage& usage) const;
+
+    /** Points kept in the scatter history at full memory */
+    static const int maxHistoryDepth = 20000;
+
     /** Mouse callbacks*/
     void mouseDown(const juce::MouseEvent& event);
     void mouseUp(const juce::MouseEvent& event);
@@ -68,6 +95,7 @@ public:
 
     //bool keyPressed(const KeyPress& key);
     
+    /** Clears the image and draws the whole history (or its most recent fifth) */
     void redraw(bool subsample);
 
     void updateUnits(std::vector<PCAUnit> _units);
@@ -84,17 +112,24 @@ public:
 private:
     float prevx,prevy;
     bool inPolygonDrawingMode;
-	void drawProjectedSpike(SorterSpikePtr s);
+    /** Draws points [firstPoint, firstPoint + numPoints) of the history
+        (0 = oldest) that were projected with the basis last redrawn */
+	void drawProjectedPoints(int firstPoint, int numPoints);
+
+    /** Brings the image up to date: points added since the last paint are
+        written into it directly, and only a range or basis change causes
+        a full redraw */
+    void updateProjectionImage();
+
+    /** Renders the density grid into the image through the colour map */
+    void drawDensity();
 
     bool rangeSet;
     
-    void updateProjectionImage(uint16_t, uint16_t, uint16_t, const uint8_t* col);
 	void updateRange(SorterSpikePtr s);
-    ScopedPointer<UtilityButton> rangeDownButton, rangeUpButton;
+    ScopedPointer<UtilityButton> rangeDownButton, rangeUpButton, densityButton;
 
-    SorterSpikeArray spikeBuffer;
-    int bufferSize;
-    int spikeIndex;
+    ProjectionHistory history;
     bool updateProcessor;
 	void calcWaveformPeakIdx(SorterSpikePtr, int, int, int*, int*);
 
@@ -108,7 +143,22 @@ private:
     int rangeX;
     int rangeY;
 
-    int spikesReceivedSinceLastRedraw;
+    DensityGrid density;
+    bool densityMode;
+
+    /** Time of the last decay step (ms) */
+    double lastDecayTime;
+
+    int pointBudget;
+
+    /** History::getTotalAdded() when points were last drawn */
+    int64 numPointsDrawn;
+
+    /** Basis version the image was last fully redrawn with */
+    uint32 drawnBasisVersion;
+
+    /** History::getTotalAdded() at the last full redraw */
+    int64 lastFullRedraw;
 
     float pcaMin[2],pcaMax[2];
     std::list<PointD> drawnPolygon;
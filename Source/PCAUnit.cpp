@@ -117,7 +117,7 @@ bool PCAUnit::isPointInsidePolygon(PointD p)
     return poly.isPointInside(p);
 }
 
-bool PCAUnit::isWaveFormInsidePolygon(SorterSpikePtr so)
+bool PCAUnit::isWaveFormInsidePolygon(const SorterSpikePtr& so)
 {
     return poly.isPointInside(PointD(so->pcProj[0],so->pcProj[1]));
 }
@@ -75,7 +75,7 @@ public:
     int getUnitId();
 
     /** Checks whether waveform is inside this unit's polygon */
-	bool isWaveFormInsidePolygon(SorterSpikePtr so);
+	bool isWaveFormInsidePolygon(const SorterSpikePtr& so);
 
     /** Checks whether a point is inside this unit's polygone */
     bool isPointInsidePolygon(PointD p);
@@ -0,0 +1,98 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ProjectionHistory.h"
+
+ProjectionHistory::ProjectionHistory(int capacity_)
+    : capacity(0), first(0), numPoints(0), totalAdded(0)
+{
+    setCapacity(capacity_);
+}
+
+/** Copies the newest numKept points of a ring buffer into a new, unwrapped array */
+template <typename T>
+static void resizeRing(std::vector<T>& values, int first, int numPoints, int numKept, int newCapacity)
+{
+    std::vector<T> resized(newCapacity, T());
+
+    const int oldCapacity = (int) values.size();
+
+    for (int n = 0; n < numKept; n++)
+        resized[n] = values[(first + numPoints - numKept + n) % oldCapacity];
+
+    values.swap(resized);
+}
+
+void ProjectionHistory::setCapacity(int capacity_)
+{
+    capacity_ = jmax(1, capacity_);
+
+    if (capacity_ == capacity)
+        return;
+
+    const int numKept = jmin(numPoints, capacity_);
+
+    // new vectors, so shrinking returns the memory
+    resizeRing(pcX, first, numPoints, numKept, capacity_);
+    resizeRing(pcY, first, numPoints, numKept, capacity_);
+    resizeRing(colours, first, numPoints, numKept, capacity_);
+    resizeRing(unitIds, first, numPoints, numKept, capacity_);
+    resizeRing(timestamps, first, numPoints, numKept, capacity_);
+    resizeRing(basisVersions, first, numPoints, numKept, capacity_);
+
+    capacity = capacity_;
+    first = 0;
+    numPoints = numKept;
+}
+
+void ProjectionHistory::clear()
+{
+    first = 0;
+    numPoints = 0;
+    totalAdded = 0;
+}
+
+void ProjectionHistory::add(const SorterSpikePtr& spike)
+{
+    int slot;
+
+    if (numPoints < capacity)
+    {
+        slot = getSlot(numPoints);
+        numPoints++;
+    }
+    else
+    {
+        slot = first;
+        first = (first + 1) % capacity;
+    }
+
+    pcX[slot] = spike->pcProj[0];
+    pcY[slot] = spike->pcProj[1];
+    colours[slot] = (uint32(spike->color[0]) << 16) | (uint32(spike->color[1]) << 8) | uint32(spike->color[2]);
+    unitIds[slot] = spike->sortedId;
+    timestamps[slot] = spike->getTimestamp();
+    basisVersions[slot] = spike->basisVersion;
+
+    totalAdded++;
+}
@@ -0,0 +1,106 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __PROJECTIONHISTORY_H__
+#define __PROJECTIONHISTORY_H__
+
+#include <ProcessorHeaders.h>
+
+#include "Containers.h"
+
+#include <vector>
+
+/**
+    Ring buffer of recent spike projections for the PC scatter plot.
+
+    Only what the scatter needs is kept (PC coordinates, colour, unit,
+    timestamp and the basis the projection was made with), stored as
+    separate arrays, so a point costs 26 bytes instead of a full
+    waveform copy and long histories stay cheap.
+*/
+class ProjectionHistory
+{
+public:
+
+    /** Constructor */
+    ProjectionHistory(int capacity);
+
+    /** Changes the number of points kept, keeping the newest ones */
+    void setCapacity(int capacity);
+
+    /** Returns the bytes held by the point arrays */
+    int64 getMemoryUsage() const { return int64(capacity) * bytesPerPoint; }
+
+    /** Bytes stored per point */
+    static const int bytesPerPoint = sizeof(float) * 2 + sizeof(uint32) * 2 + sizeof(uint16) + sizeof(int64);
+
+    /** Returns the maximum number of points kept */
+    int getCapacity() const { return capacity; }
+
+    /** Returns the number of points currently stored */
+    int size() const { return numPoints; }
+
+    /** Removes all points */
+    void clear();
+
+    /** Adds the projection of a spike, replacing the oldest point if full */
+    void add(const SorterSpikePtr& spike);
+
+    /** Index of the n-th oldest point in the arrays below */
+    int getSlot(int n) const { return (first + n) % capacity; }
+
+    /** Index of the most recently added point, or -1 if empty */
+    int getNewestSlot() const { return numPoints > 0 ? getSlot(numPoints - 1) : -1; }
+
+    /** Returns the number of points added since construction or clear() */
+    int64 getTotalAdded() const { return totalAdded; }
+
+    /** Projection on the first principal component */
+    std::vector<float> pcX;
+
+    /** Projection on the second principal component */
+    std::vector<float> pcY;
+
+    /** Spike colour as 0x00RRGGBB */
+    std::vector<uint32> colours;
+
+    /** Sorted ID (0 = unsorted) */
+    std::vector<uint16> unitIds;
+
+    /** Spike timestamp (sample number) */
+    std::vector<int64> timestamps;
+
+    /** Sorter::getBasisVersion() when the spike was projected (0 = not projected) */
+    std::vector<uint32> basisVersions;
+
+private:
+
+    int capacity;
+    int first;
+    int numPoints;
+    int64 totalAdded;
+
+    JUCE_DECLARE_NON_COPYABLE(ProjectionHistory);
+};
+
+#endif // __PROJECTIONHISTORY_H__
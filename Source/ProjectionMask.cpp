@@ -0,0 +1,288 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ProjectionMask.h"
+
+ProjectionMask::ProjectionMask(int numChannels_, int numSamples_)
+{
+    reset(numChannels_, numSamples_);
+}
+
+void ProjectionMask::reset(int numChannels_, int numSamples_)
+{
+    numChannels = jmax(0, numChannels_);
+    numSamples = jmax(0, numSamples_);
+
+    channelEnabled.assign(numChannels, 1);
+    windowStart = 0;
+    windowEnd = numSamples;
+
+    update();
+}
+
+void ProjectionMask::setChannelEnabled(int channel, bool enabled)
+{
+    if (channel < 0 || channel >= numChannels)
+        return;
+
+    channelEnabled[channel] = enabled ? 1 : 0;
+    update();
+}
+
+bool ProjectionMask::isChannelEnabled(int channel) const
+{
+    return channel >= 0 && channel < numChannels && channelEnabled[channel] != 0;
+}
+
+void ProjectionMask::setWindow(int start, int end)
+{
+    windowStart = jlimit(0, numSamples, jmin(start, end));
+    windowEnd = jlimit(0, numSamples, jmax(start, end));
+
+    update();
+}
+
+void ProjectionMask::update()
+{
+    spans.clear();
+    numValues = 0;
+
+    const int length = windowEnd - windowStart;
+
+    if (length <= 0)
+        return;
+
+    for (int ch = 0; ch < numChannels; ch++)
+    {
+        if (!channelEnabled[ch])
+            continue;
+
+        const int start = ch * numSamples + windowStart;
+
+        // merge with the previous span when the window covers whole channels
+        if (!spans.empty() && spans.back().start + spans.back().length == start)
+            spans.back().length += length;
+        else
+            spans.push_back({ start, length });
+
+        numValues += length;
+    }
+}
+
+void ProjectionMask::gather(const float* waveform, float* dest) const
+{
+    for (const Span& span : spans)
+    {
+        memcpy(dest, waveform + span.start, sizeof(float) * span.length);
+        dest += span.length;
+    }
+}
+
+void ProjectionMask::gather(const int16* waveform, float scale, float* dest) const
+{
+    for (const Span& span : spans)
+    {
+        const int16* w = waveform + span.start;
+
+        for (int k = 0; k < span.length; k++)
+            dest[k] = float(w[k]) * scale;
+
+        dest += span.length;
+    }
+}
+
+void ProjectionMask::scatter(const float* values, float* dest) const
+{
+    for (int k = 0; k < numChannels * numSamples; k++)
+        dest[k] = 0;
+
+    for (const Span& span : spans)
+    {
+        memcpy(dest + span.start, values, sizeof(float) * span.length);
+        values += span.length;
+    }
+}
+
+void ProjectionMask::clearExcluded(float* waveform) const
+{
+    int next = 0;
+
+    for (const Span& span : spans)
+    {
+        for (int k = next; k < span.start; k++)
+            waveform[k] = 0;
+
+        next = span.start + span.length;
+    }
+
+    for (int k = next; k < numChannels * numSamples; k++)
+        waveform[k] = 0;
+}
+
+void ProjectionMask::chooseFromLoadings(const float* pc1, const float* pc2, float energyFraction)
+{
+    if (numChannels == 0 || numSamples == 0)
+        return;
+
+    std::vector<double> channelEnergy(numChannels, 0.0);
+    double totalEnergy = 0;
+
+    for (int ch = 0; ch < numChannels; ch++)
+    {
+        for (int i = 0; i < numSamples; i++)
+        {
+            const int k = ch * numSamples + i;
+            channelEnergy[ch] += double(pc1[k]) * pc1[k] + double(pc2[k]) * pc2[k];
+        }
+
+        totalEnergy += channelEnergy[ch];
+    }
+
+    if (totalEnergy <= 0)
+    {
+        reset(numChannels, numSamples);
+        return;
+    }
+
+    // strongest channels first, until enough of the loadings are covered
+    std::vector<int> order(numChannels);
+
+    for (int ch = 0; ch < numChannels; ch++)
+        order[ch] = ch;
+
+    std::stable_sort(order.begin(), order.end(), [&channelEnergy](int a, int b)
+    {
+        return channelEnergy[a] > channelEnergy[b];
+    });
+
+    channelEnabled.assign(numChannels, 0);
+
+    double kept = 0;
+
+    for (int ch : order)
+    {
+        channelEnabled[ch] = 1;
+        kept += channelEnergy[ch];
+
+        if (kept >= energyFraction * totalEnergy)
+            break;
+    }
+
+    // then trim the weaker end of the window while enough remains
+    std::vector<double> sampleEnergy(numSamples, 0.0);
+
+    for (int ch = 0; ch < numChannels; ch++)
+    {
+        if (!channelEnabled[ch])
+            continue;
+
+        for (int i = 0; i < numSamples; i++)
+        {
+            const int k = ch * numSamples + i;
+            sampleEnergy[i] += double(pc1[k]) * pc1[k] + double(pc2[k]) * pc2[k];
+        }
+    }
+
+    windowStart = 0;
+    windowEnd = numSamples;
+
+    const double allowedLoss = (1.0 - energyFraction) * totalEnergy - (totalEnergy - kept);
+    double lost = 0;
+
+    while (windowEnd - windowStart > 1)
+    {
+        const double first = sampleEnergy[windowStart];
+        const double last = sampleEnergy[windowEnd - 1];
+        const double smaller = jmin(first, last);
+
+        if (lost + smaller > allowedLoss)
+            break;
+
+        lost += smaller;
+
+        if (first <= last)
+            windowStart++;
+        else
+            windowEnd--;
+    }
+
+    update();
+}
+
+String ProjectionMask::toString() const
+{
+    StringArray channels;
+
+    for (int ch = 0; ch < numChannels; ch++)
+    {
+        if (channelEnabled[ch])
+            channels.add(String(ch));
+    }
+
+    return "channels=" + channels.joinIntoString(",")
+           + " window=" + String(windowStart) + "-" + String(windowEnd);
+}
+
+bool ProjectionMask::fromString(const String& description)
+{
+    const String channelList = description.fromFirstOccurrenceOf("channels=", false, false).upToFirstOccurrenceOf(" ", false, false);
+    const String window = description.fromFirstOccurrenceOf("window=", false, false).upToFirstOccurrenceOf(" ", false, false);
+
+    if (!description.contains("channels=") || !window.containsChar('-'))
+        return false;
+
+    std::vector<uint8> channels(numChannels, 0);
+
+    for (auto& token : StringArray::fromTokens(channelList, ",", ""))
+    {
+        const int ch = token.getIntValue();
+
+        if (token.isEmpty() || ch < 0 || ch >= numChannels)
+            return false;
+
+        channels[ch] = 1;
+    }
+
+    const int start = window.upToFirstOccurrenceOf("-", false, false).getIntValue();
+    const int end = window.fromFirstOccurrenceOf("-", false, false).getIntValue();
+
+    if (start < 0 || end > numSamples || start >= end)
+        return false;
+
+    channelEnabled = channels;
+    windowStart = start;
+    windowEnd = end;
+
+    update();
+
+    return true;
+}
+
+bool ProjectionMask::operator==(const ProjectionMask& other) const
+{
+    return numChannels == other.numChannels
+        && numSamples == other.numSamples
+        && channelEnabled == other.channelEnabled
+        && windowStart == other.windowStart
+        && windowEnd == other.windowEnd;
+}
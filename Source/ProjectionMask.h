@@ -0,0 +1,166 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __PROJECTIONMASK_H__
+#define __PROJECTIONMASK_H__
+
+#include <ProcessorHeaders.h>
+
+#include <vector>
+
+/**
+    Selects the part of a waveform used for PCA: a subset of channels and
+    a window of samples that is the same on every selected channel.
+
+    On electrodes with many channels, most channels carry nothing from a
+    given unit; leaving them out of PCA training and of the per-spike
+    projection saves work without losing separation. Waveforms are stored
+    channel by channel, so the mask is kept as a list of contiguous spans
+    of the flattened waveform.
+*/
+class ProjectionMask
+{
+public:
+
+    /** Creates a mask that includes everything */
+    ProjectionMask(int numChannels = 0, int numSamples = 0);
+
+    /** Changes the waveform size and includes everything */
+    void reset(int numChannels, int numSamples);
+
+    /** Returns true if every value of the waveform is included */
+    bool isFull() const { return numValues == numChannels * numSamples; }
+
+    /** Includes or excludes a channel */
+    void setChannelEnabled(int channel, bool enabled);
+
+    /** Returns true if a channel is included */
+    bool isChannelEnabled(int channel) const;
+
+    /** Sets the included samples (on every channel) to [start, end) */
+    void setWindow(int start, int end);
+
+    /** First included sample */
+    int getWindowStart() const { return windowStart; }
+
+    /** One past the last included sample */
+    int getWindowEnd() const { return windowEnd; }
+
+    /** Number of included values per waveform */
+    int getNumValues() const { return numValues; }
+
+    /** Number of values in a complete waveform */
+    int getTotalValues() const { return numChannels * numSamples; }
+
+    /** Projects a waveform onto two components over the included values */
+    void project(const float* waveform, const float* pc1, const float* pc2, float& proj1, float& proj2) const
+    {
+        float sum1 = 0, sum2 = 0;
+
+        for (const Span& span : spans)
+        {
+            const float* w = waveform + span.start;
+            const float* a = pc1 + span.start;
+            const float* b = pc2 + span.start;
+
+            for (int k = 0; k < span.length; k++)
+            {
+                sum1 += a[k] * w[k];
+                sum2 += b[k] * w[k];
+            }
+        }
+
+        proj1 = sum1;
+        proj2 = sum2;
+    }
+
+    /** Projects a 16-bit waveform (microvolts = sample * scale) over the included values */
+    void project(const int16* waveform, float scale, const float* pc1, const float* pc2, float& proj1, float& proj2) const
+    {
+        float sum1 = 0, sum2 = 0;
+
+        for (const Span& span : spans)
+        {
+            const int16* w = waveform + span.start;
+            const float* a = pc1 + span.start;
+            const float* b = pc2 + span.start;
+
+            for (int k = 0; k < span.length; k++)
+            {
+                sum1 += a[k] * float(w[k]);
+                sum2 += b[k] * float(w[k]);
+            }
+        }
+
+        proj1 = sum1 * scale;
+        proj2 = sum2 * scale;
+    }
+
+    /** Copies the included values of a waveform to dest (getNumValues() values) */
+    void gather(const float* waveform, float* dest) const;
+
+    /** Copies the included values of a 16-bit waveform to dest, in microvolts */
+    void gather(const int16* waveform, float scale, float* dest) const;
+
+    /** Expands getNumValues() values into a complete waveform, with zeros elsewhere */
+    void scatter(const float* values, float* dest) const;
+
+    /** Sets all excluded values of a waveform to zero */
+    void clearExcluded(float* waveform) const;
+
+    /** Keeps the channels, then the window, holding a given fraction of the
+        squared loadings of two unit-length components */
+    void chooseFromLoadings(const float* pc1, const float* pc2, float energyFraction);
+
+    /** Describes the mask as text, e.g. "channels=0,1,5 window=4-28" */
+    String toString() const;
+
+    /** Restores a mask written by toString; returns false (leaving the mask unchanged) if unreadable */
+    bool fromString(const String& description);
+
+    bool operator==(const ProjectionMask& other) const;
+    bool operator!=(const ProjectionMask& other) const { return !operator==(other); }
+
+private:
+
+    /** Rebuilds the spans after a change */
+    void update();
+
+    struct Span
+    {
+        int start;
+        int length;
+    };
+
+    int numChannels;
+    int numSamples;
+
+    std::vector<uint8> channelEnabled;
+    int windowStart;
+    int windowEnd;
+
+    std::vector<Span> spans;
+    int numValues;
+};
+
+#endif // __PROJECTIONMASK_H__
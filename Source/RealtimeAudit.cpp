@@ -0,0 +1,483 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "RealtimeAudit.h"
+
+#if SPIKE_SORTER_REALTIME_AUDIT
+
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void* ptr);
+#endif
+
+namespace
+{
+    enum ViolationKind
+    {
+        ALLOCATION = 0,
+        RELEASE,
+        LOCK
+    };
+
+    const char* const violationNames[] = { "allocation", "free", "blocking lock" };
+
+    /** Stack depth kept per call site */
+    const int maxFrames = 24;
+
+    /** Frames belonging to the audit itself (record and the hook) */
+    const int skipFrames = 2;
+
+    /** Distinct call sites that can be told apart; further ones are only
+        counted */
+    const int maxSites = 1024;
+
+    enum SiteState
+    {
+        SITE_EMPTY = 0,
+        SITE_WRITING,
+        SITE_READY
+    };
+
+    /** One distinct call stack; the table is filled without locks, since
+        taking one would itself be reported */
+    struct Site
+    {
+        std::atomic<int> state;
+        std::atomic<int64> count;
+
+        ViolationKind kind;
+        uint64 hash;
+        int numFrames;
+        void* frames[maxFrames];
+    };
+
+    Site sites[maxSites];
+
+    std::atomic<int64> numViolations(0);
+    std::atomic<int64> numUnlisted(0);
+    std::atomic<bool> trap(false);
+
+    /** Set while the audit itself runs, so its own allocations are ignored */
+    thread_local bool inAudit = false;
+
+    __attribute__((noinline)) void record(ViolationKind kind)
+    {
+        if (RealtimeAudit::realtimeDepth == 0 || inAudit)
+            return;
+
+        inAudit = true;
+
+        void* stack[maxFrames + skipFrames];
+        const int depth = backtrace(stack, maxFrames + skipFrames);
+
+        void** frames = stack + jmin(skipFrames, depth);
+        const int numFrames = depth - jmin(skipFrames, depth);
+
+        numViolations++;
+
+        if (trap)
+        {
+            static const char message[] = "Real-time audit: violation on the audio-thread path\n";
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+            backtrace_symbols_fd(frames, numFrames, STDERR_FILENO);
+            raise(SIGTRAP);
+        }
+
+        uint64 hash = uint64(kind) + 1;
+
+        for (int i = 0; i < numFrames; i++)
+            hash = hash * 1099511628211ull + uint64(pointer_sized_uint(frames[i]));
+
+        bool listed = false;
+
+        for (int probe = 0; probe < maxSites && !listed; probe++)
+        {
+            Site& site = sites[(hash + uint64(probe)) % maxSites];
+
+            int state = site.state.load(std::memory_order_acquire);
+
+            if (state == SITE_EMPTY)
+            {
+                if (site.state.compare_exchange_strong(state, SITE_WRITING, std::memory_order_acquire))
+                {
+                    site.kind = kind;
+                    site.hash = hash;
+                    site.numFrames = numFrames;
+                    std::copy(frames, frames + numFrames, site.frames);
+
+                    site.count = 1;
+                    site.state.store(SITE_READY, std::memory_order_release);
+
+                    listed = true;
+                    continue;
+                }
+            }
+
+            // another thread is filling this slot in; it only takes a moment
+            while (state == SITE_WRITING)
+                state = site.state.load(std::memory_order_acquire);
+
+            if (site.hash == hash && site.kind == kind && site.numFrames == numFrames
+                && std::equal(frames, frames + numFrames, site.frames))
+            {
+                site.count++;
+                listed = true;
+            }
+        }
+
+        if (!listed)
+            numUnlisted++;
+
+        inAudit = false;
+    }
+
+    /** Turns one line of backtrace_symbols output into a readable frame */
+    String describeFrame(const char* symbol)
+    {
+        const String line(symbol);
+
+        // glibc: "binary(mangled+0x1a) [0x4005d6]"
+        const int open = line.indexOfChar('(');
+        const int plus = line.indexOfChar(open, '+');
+
+        if (open < 0 || plus <= open + 1)
+            return line;
+
+        const String mangled = line.substring(open + 1, plus);
+
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(mangled.toRawUTF8(), nullptr, nullptr, &status);
+
+        if (status != 0 || demangled == nullptr)
+            return line;
+
+        const String name(demangled);
+        free(demangled);
+
+        return name + " " + line.substring(plus, line.indexOfChar(plus, ')'));
+    }
+
+    void* allocate(size_t size)
+    {
+#if defined(__GLIBC__)
+        return __libc_malloc(size);
+#else
+        return malloc(size);
+#endif
+    }
+
+    void* allocateAligned(size_t alignment, size_t size)
+    {
+#if defined(__GLIBC__)
+        return __libc_memalign(alignment, size);
+#else
+        void* ptr = nullptr;
+        return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+#endif
+    }
+
+    void release(void* ptr)
+    {
+#if defined(__GLIBC__)
+        __libc_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+#if defined(__linux__)
+    template <typename Function>
+    Function findNext(const char* name)
+    {
+        return (Function) dlsym(RTLD_NEXT, name);
+    }
+
+    typedef int (*MutexFunction)(pthread_mutex_t*);
+    typedef int (*RwLockFunction)(pthread_rwlock_t*);
+
+    // resolved before main, so the lookup never happens on the audio thread
+    MutexFunction nextMutexLock = findNext<MutexFunction>("pthread_mutex_lock");
+    RwLockFunction nextReadLock = findNext<RwLockFunction>("pthread_rwlock_rdlock");
+    RwLockFunction nextWriteLock = findNext<RwLockFunction>("pthread_rwlock_wrlock");
+#endif
+
+    /** backtrace() loads its unwinder on first use; do that up front */
+    struct Preload
+    {
+        Preload()
+        {
+            void* frame;
+            backtrace(&frame, 1);
+        }
+    } preload;
+}
+
+void RealtimeAudit::setTrap(bool shouldTrap)
+{
+    trap = shouldTrap;
+}
+
+int64 RealtimeAudit::getNumViolations()
+{
+    return numViolations;
+}
+
+void RealtimeAudit::reset()
+{
+    for (auto& site : sites)
+    {
+        site.count = 0;
+        site.state = SITE_EMPTY;
+    }
+
+    numViolations = 0;
+    numUnlisted = 0;
+}
+
+String RealtimeAudit::getReport(int maxFramesShown)
+{
+    const bool wasInAudit = inAudit;
+    inAudit = true;
+
+    std::vector<const Site*> listed;
+    int64 totals[3] = { 0, 0, 0 };
+
+    for (auto& site : sites)
+    {
+        if (site.state.load(std::memory_order_acquire) == SITE_READY)
+        {
+            listed.push_back(&site);
+            totals[site.kind] += site.count;
+        }
+    }
+
+    std::sort(listed.begin(), listed.end(),
+              [](const Site* a, const Site* b) { return a->count > b->count; });
+
+    String report = String(numViolations.load()) + " violations at " + String((int) listed.size())
+                    + " call sites (" + String(totals[ALLOCATION]) + " allocations, "
+                    + String(totals[RELEASE]) + " frees, " + String(totals[LOCK]) + " blocking locks)\n";
+
+    if (numUnlisted > 0)
+        report += String(numUnlisted.load()) + " violations came from call sites beyond the first "
+                  + String(maxSites) + "\n";
+
+    for (auto* site : listed)
+    {
+        report += "\n" + String(site->count.load()) + " x " + violationNames[site->kind] + "\n";
+
+        const int numShown = jmin(maxFramesShown, site->numFrames);
+        char** symbols = backtrace_symbols(site->frames, numShown);
+
+        for (int i = 0; i < numShown; i++)
+            report += "    " + (symbols != nullptr ? describeFrame(symbols[i]) : String::toHexString((pointer_sized_int) site->frames[i])) + "\n";
+
+        free(symbols);
+    }
+
+    inAudit = wasInAudit;
+
+    return report;
+}
+
+// Allocator hooks. operator new and delete are replaced on every platform;
+// with glibc the C allocation functions are too, since HeapBlock and most
+// of JUCE use them directly.
+
+void* operator new(size_t size)
+{
+    record(ALLOCATION);
+
+    if (void* ptr = allocate(size))
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    record(ALLOCATION);
+
+    if (void* ptr = allocate(size))
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    record(ALLOCATION);
+    return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    record(ALLOCATION);
+    return allocate(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    record(ALLOCATION);
+
+    if (void* ptr = allocateAligned(size_t(alignment), size))
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    record(ALLOCATION);
+
+    if (void* ptr = allocateAligned(size_t(alignment), size))
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr != nullptr)
+        record(RELEASE);
+
+    release(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    if (ptr != nullptr)
+        record(RELEASE);
+
+    release(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { operator delete[](ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { operator delete(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { operator delete[](ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { operator delete(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { operator delete[](ptr); }
+
+#if defined(__GLIBC__)
+
+extern "C" void* malloc(size_t size) noexcept
+{
+    record(ALLOCATION);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) noexcept
+{
+    record(ALLOCATION);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) noexcept
+{
+    record(ALLOCATION);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept
+{
+    record(ALLOCATION);
+
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    *ptr = __libc_memalign(alignment, size);
+
+    return *ptr != nullptr ? 0 : ENOMEM;
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    record(ALLOCATION);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void free(void* ptr) noexcept
+{
+    if (ptr != nullptr)
+        record(RELEASE);
+
+    __libc_free(ptr);
+}
+
+#endif
+
+// Lock hooks. Only the calls that can block are violations; JUCE's
+// CriticalSection and std::mutex both end up here on Linux.
+
+#if defined(__linux__)
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex) noexcept
+{
+    record(LOCK);
+
+    if (nextMutexLock == nullptr)
+        nextMutexLock = findNext<MutexFunction>("pthread_mutex_lock");
+
+    return nextMutexLock(mutex);
+}
+
+extern "C" int pthread_rwlock_rdlock(pthread_rwlock_t* lock) noexcept
+{
+    record(LOCK);
+
+    if (nextReadLock == nullptr)
+        nextReadLock = findNext<RwLockFunction>("pthread_rwlock_rdlock");
+
+    return nextReadLock(lock);
+}
+
+extern "C" int pthread_rwlock_wrlock(pthread_rwlock_t* lock) noexcept
+{
+    record(LOCK);
+
+    if (nextWriteLock == nullptr)
+        nextWriteLock = findNext<RwLockFunction>("pthread_rwlock_wrlock");
+
+    return nextWriteLock(lock);
+}
+
+#endif
+
+#endif // SPIKE_SORTER_REALTIME_AUDIT
@@ -0,0 +1,88 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REALTIMEAUDIT_H__
+#define __REALTIMEAUDIT_H__
+
+#include <ProcessorHeaders.h>
+
+/**
+    Real-time-safety audit of the per-spike path.
+
+    REALTIME_AUDIT_SCOPE marks code that runs on the audio thread for
+    every spike (SpikeSorter::handleSpike and its equivalents in the
+    command-line tools). In a normal build it expands to nothing.
+
+    When the tools are configured with -DREALTIME_AUDIT=ON,
+    SPIKE_SORTER_REALTIME_AUDIT is defined and RealtimeAudit.cpp replaces
+    the global allocator (operator new/delete and, with glibc, malloc and
+    free) and, on Linux, the blocking pthread lock calls. Any of these
+    made while a thread is inside a marked scope is a violation. Each one
+    is recorded by call stack and counted, or with setTrap(true) the
+    process stops at the first one. tryEnter() is not a violation, since
+    it never blocks.
+
+    The hooks only take effect in an executable, so the plugin itself is
+    audited through spike-sorter-replay and spike-sorter-loadgen.
+*/
+namespace RealtimeAudit
+{
+    /** Nesting depth of marked scopes on the calling thread */
+    inline thread_local int realtimeDepth = 0;
+
+    /** Marks the lifetime of an object as audio-thread code */
+    class ScopedRealtimeSection
+    {
+    public:
+        ScopedRealtimeSection() { realtimeDepth++; }
+        ~ScopedRealtimeSection() { realtimeDepth--; }
+
+        JUCE_DECLARE_NON_COPYABLE(ScopedRealtimeSection);
+    };
+
+#if SPIKE_SORTER_REALTIME_AUDIT
+
+    /** Stops the process (SIGTRAP) at the first violation instead of
+        counting it */
+    void setTrap(bool shouldTrap);
+
+    /** Returns the number of violations recorded since the last reset */
+    int64 getNumViolations();
+
+    /** Forgets all recorded violations */
+    void reset();
+
+    /** Lists the call sites of all violations, most frequent first,
+        with up to maxFrames symbolized frames each */
+    String getReport(int maxFrames = 8);
+
+#endif
+}
+
+#if SPIKE_SORTER_REALTIME_AUDIT
+#define REALTIME_AUDIT_SCOPE RealtimeAudit::ScopedRealtimeSection realtimeAuditScope
+#else
+#define REALTIME_AUDIT_SCOPE
+#endif
+
+#endif // __REALTIMEAUDIT_H__
@@ -25,7 +25,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <algorithm>
 
 #include "Sorter.h"
-#include "SpikeSorter.h"
 #include "PCAComputingThread.h"
 
 #include "BoxUnit.h"
@@ -33,29 +32,133 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 int Sorter::nextUnitId = 1;
 
-Sorter::Sorter(Electrode* electrode_, PCAComputingThread* pcaThread_)
-    : electrode(electrode_),
-      computingThread(pcaThread_),
-      bufferSize(200),
+struct Sorter::Classifier
+{
+    /** A unit reduced to what classification tests */
+    struct Unit
+    {
+        int unitId;
+        uint8 color[3];
+
+        /** Box units only */
+        std::vector<Box> boxes;
+
+        /** PCA units only */
+        cPolygon polygon;
+
+        /** Gives a spike this unit's ID and color */
+        void assignTo(const SorterSpikePtr& spike) const
+        {
+            spike->sortedId = unitId;
+            spike->color[0] = color[0];
+            spike->color[1] = color[1];
+            spike->color[2] = color[2];
+        }
+    };
+
+    std::vector<float> pc1, pc2;
+    ProjectionMask mask;
+
+    bool basisValid = false;
+    uint32 basisVersion = 0;
+
+    /** Sorter state version this copy was made from */
+    uint32 stateVersion = 1;
+
+    std::vector<Unit> pcaUnits;
+    std::vector<Unit> boxUnits;
+
+    /** Projects a spike on the basis, if there is one */
+    void project(const SorterSpikePtr& spike) const
+    {
+        if (!basisValid)
+            return;
+
+        mask.project(spike->getData(), pc1.data(), pc2.data(), spike->pcProj[0], spike->pcProj[1]);
+
+        spike->basisVersion = basisVersion;
+    }
+
+    /** Returns the unit a projected spike belongs to, or nullptr; polygons are
+        tested first, then boxes, as in sortSpike */
+    Unit* findUnit(const SorterSpikePtr& spike)
+    {
+        for (auto& unit : pcaUnits)
+        {
+            if (unit.polygon.isPointInside(PointD(spike->pcProj[0], spike->pcProj[1])))
+                return &unit;
+        }
+
+        for (auto& unit : boxUnits)
+        {
+            bool inside = !unit.boxes.empty();
+
+            for (int b = 0; inside && b < unit.boxes.size(); b++)
+                inside = unit.boxes[b].isWaveFormInside(spike);
+
+            if (inside)
+                return &unit;
+        }
+
+        return nullptr;
+    }
+};
+
+/** FNV-1a hash, used to detect a damaged PC basis in saved settings */
+static uint32 basisChecksum(const void* data, size_t numBytes)
+{
+    const uint8* bytes = (const uint8*) data;
+    uint32 hash = 2166136261u;
+
+    for (size_t i = 0; i < numBytes; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+Sorter::Sorter(int numChannels_, int waveformLength_, PCAComputingThread* pcaThread_)
+    : computingThread(pcaThread_),
+      bufferSize(defaultBufferSize),
       spikeBufferIndex(-1),
       bPCAComputed(false),
       bPCAJobFinished(false),
       bPCAJobSubmitted(false),
       bPCAFirstJobFinished(false),
       bRePCA(false),
+      bChoosingMask(false),
       selectedUnit(-1),
       selectedBox(-1),
       pc1min(-5),
       pc2min(-5),
       pc1max(5),
       pc2max(5),
-      numChannels(electrode_->numChannels),
-      waveformLength(electrode_->numSamples)
+      numChannels(numChannels_),
+      waveformLength(waveformLength_),
+      automaticPCA(true),
+      compactStorage(false),
+      stateVersion(1),
+      basisVersion(0),
+      publishedClassifier(0),
+      readingClassifier(-1),
+      classifierVersion(1),
+      keepStateHistory(false)
      
 {
 
+    classifiers[0] = std::make_unique<Classifier>();
+    classifiers[1] = std::make_unique<Classifier>();
+
     pc1 = new float[int64(numChannels) * waveformLength];
     pc2 = new float[int64(numChannels) * waveformLength];
+    jobPc1.allocate(int64(numChannels) * waveformLength, true);
+    jobPc2.allocate(int64(numChannels) * waveformLength, true);
+
+    // dense electrodes leave out the channels a first basis does not use
+    mask.reset(numChannels, waveformLength);
+    maskMode = numChannels > 4 ? MASK_AUTO : MASK_NONE;
 
     for (int n = 0; n < bufferSize; n++)
     {
@@ -65,6 +168,10 @@ Sorter::Sorter(Electrode* electrode_, PCAComputingThread* pcaThread_)
 
 void Sorter::resizeWaveform(int numSamples)
 {
+    // a running job writes to the buffers reallocated below
+    if (computingThread != nullptr)
+        computingThread->removeJobs(this);
+
     const ScopedLock myScopedLock(mut);
 
     waveformLength = numSamples;
@@ -74,6 +181,11 @@ void Sorter::resizeWaveform(int numSamples)
 
     pc1 = new float[int64(numChannels) * waveformLength];
     pc2 = new float[int64(numChannels) * waveformLength];
+    jobPc1.allocate(int64(numChannels) * waveformLength, true);
+    jobPc2.allocate(int64(numChannels) * waveformLength, true);
+    currentJob = nullptr;
+
+    mask.reset(numChannels, waveformLength);
 
     spikeBuffer.clear();
     
@@ -89,15 +201,23 @@ void Sorter::resizeWaveform(int numSamples)
 	selectedUnit = -1;
 	selectedBox = -1;
 	bRePCA = false;
+	bChoosingMask = false;
 	pc1min = -1;
 	pc2min = -1;
 	pc1max = 1;
 	pc2max = 1;
 
+    stateVersion++;
+    updateClassifier();
+
 }
 
 Sorter::~Sorter()
 {
+    // a job still queued or running would write to the basis and call back
+    if (computingThread != nullptr)
+        computingThread->removeJobs(this);
+
     delete[] pc1;
     delete[] pc2;
     pc1 = nullptr;
@@ -118,55 +238,114 @@ void Sorter::getSelectedUnitAndBox(int& unitID, int& boxid)
 
 void Sorter::projectOnPrincipalComponents(SorterSpikePtr so)
 {
+    // the published copy of the basis and mask is read without locking
+    const int slot = claimClassifier(0);
+
+    classifiers[slot]->project(so);
+    readingClassifier.store(-1);
+
+    // the buffer can be resized and the mask changed from the message thread;
+    // a spike that arrives meanwhile is not collected, rather than waiting
+    const ScopedTryLock myScopedTryLock(mut);
+
+    if (myScopedTryLock.isLocked())
+    {
+        collectSpike(so);
+
+        if (!bPCAComputed)
+            startPCAJobIfDue();
+    }
+}
 
+void Sorter::collectSpike(const SorterSpikePtr& so)
+{
     // 1. Add spike to buffer
     spikeBufferIndex++;
     spikeBufferIndex %= bufferSize;
     spikeBuffer.set(spikeBufferIndex, so);
+}
 
-    // 2. Check whether current PCA job has finished
-    if (bPCAJobFinished)
-    {
-        bPCAComputed = true;
+void Sorter::pcaJobFinished(PCAjob* job)
+{
+    const ScopedLock myScopedLock(mut);
 
-        if (!bPCAFirstJobFinished)
-            bPCAFirstJobFinished = true;
+    // trained on a mask or basis that has changed since it was submitted
+    if (job != currentJob.get())
+    {
+        bPCAJobFinished = false;
+        return;
     }
 
-    // 3. If job has finished, project spike onto PC axes
-    if (bPCAComputed)
+    // installed and published here, so the processing thread never copies the basis
+    installFinishedJob();
+    currentJob = nullptr;
+
+    updateClassifier();
+}
+
+void Sorter::installFinishedJob()
+{
+    // 2. Check whether current PCA job has finished
+    if (!bPCAJobFinished)
+        return;
+
+    if (!bPCAComputed)
     {
-        
+        const size_t bytes = sizeof(float) * numChannels * waveformLength;
+        memcpy(pc1, jobPc1.getData(), bytes);
+        memcpy(pc2, jobPc2.getData(), bytes);
 
-        so->pcProj[0] = so->pcProj[1] = 0;
+        // the job trained its basis on the mask it chose; swapping does not allocate
+        if (bChoosingMask && maskMode == MASK_AUTO)
+            std::swap(mask, chosenMask);
 
-        const int maxSample = so->getChannel()->getNumChannels() * so->getChannel()->getTotalSamples();
+        bChoosingMask = false;
 
-        for (int k = 0; k < maxSample; k++)
-        {
-            
-            float v = so->spikeDataIndexToMicrovolts(k);
+        stateVersion++;
+        basisVersion++;
+    }
 
-            so->pcProj[0] += pc1[k]* v;
-            so->pcProj[1] += pc2[k]* v;
+    bPCAComputed = true;
 
-        }
+    // cleared here, not by the display, so the next job is never taken as finished early
+    bPCAJobFinished = false;
 
-        return;
+    if (!bPCAFirstJobFinished)
+        bPCAFirstJobFinished = true;
+}
 
-    }
+bool Sorter::projectSpike(const SorterSpikePtr& so)
+{
+    // 3. If job has finished, project spike onto PC axes
+    if (!bPCAComputed)
+        return false;
+
+    // only the masked values contribute; the basis is zero elsewhere
+    mask.project(so->getData(), pc1, pc2, so->pcProj[0], so->pcProj[1]);
+
+    so->basisVersion = basisVersion;
+
+    return true;
+}
 
+void Sorter::startPCAJobIfDue()
+{
     // 4. If we have enough spikes, start a new PCA job
-    if ((spikeBufferIndex == bufferSize -1 && !bPCAComputed && !bPCAJobSubmitted) || bRePCA)
+    if (automaticPCA && ((spikeBufferIndex == bufferSize -1 && !bPCAComputed && !bPCAJobSubmitted) || bRePCA))
     {
         bPCAJobSubmitted = true;
 	    bPCAComputed = false;
         bRePCA = false;
 
-        PCAJobPtr job = new PCAjob(spikeBuffer, pc1, pc2, pc1min, pc2min, pc1max, pc2max, bPCAJobFinished);
-        computingThread->addPCAjob(job);
-    }
+        // a basis over the whole waveform shows which part matters; the job
+        // chooses the automatic mask from it and trains again on the mask
+        bChoosingMask = maskMode == MASK_AUTO && mask.isFull();
 
+        currentJob = new PCAjob(spikeBuffer, jobPc1, jobPc2, getProjectionMask(),
+                                pc1min, pc2min, pc1max, pc2max, bPCAJobFinished,
+                                bChoosingMask ? &chosenMask : nullptr, autoMaskEnergy, this);
+        computingThread->addPCAjob(currentJob);
+    }
 }
 
 void Sorter::getPCArange(float& p1min,float& p2min, float& p1max,  float& p2max)
@@ -200,42 +379,232 @@ bool Sorter::firstJobFinished()
     return bPCAFirstJobFinished;
 }
 
+bool Sorter::getBasis(float* pc1_, float* pc2_)
+{
+    const ScopedLock myScopedLock(mut);
+
+    if (!bPCAComputed)
+        return false;
+
+    memcpy(pc1_, pc1, sizeof(float) * numChannels * waveformLength);
+    memcpy(pc2_, pc2, sizeof(float) * numChannels * waveformLength);
+
+    return true;
+}
+
+void Sorter::setBasis(const float* pc1_, const float* pc2_)
+{
+    const ScopedLock myScopedLock(mut);
+
+    memcpy(pc1, pc1_, sizeof(float) * numChannels * waveformLength);
+    memcpy(pc2, pc2_, sizeof(float) * numChannels * waveformLength);
+
+    bPCAComputed = true;
+    bPCAFirstJobFinished = true;
+    bPCAJobFinished = false;
+    bChoosingMask = false;
+    currentJob = nullptr;
+    stateVersion++;
+    basisVersion++;
+    updateClassifier();
+}
+
+ProjectionMask Sorter::getProjectionMask()
+{
+    const ScopedLock myScopedLock(mut);
+
+    return mask;
+}
+
+void Sorter::setProjectionMask(const ProjectionMask& mask_, ProjectionMaskMode mode)
+{
+    const ScopedLock myScopedLock(mut);
+
+    if (mask_.getTotalValues() != numChannels * waveformLength)
+        return;
+
+    mask = mask_;
+    maskMode = mode;
+    stateVersion++;
+    updateClassifier();
+}
+
+void Sorter::setProjectionMaskMode(ProjectionMaskMode mode)
+{
+    {
+        const ScopedLock myScopedLock(mut);
+
+        if (mode != MASK_MANUAL)
+            mask.reset(numChannels, waveformLength);
+
+        maskMode = mode;
+        stateVersion++;
+    }
+
+    RePCA();
+    updateClassifier();
+}
+
+String Sorter::getProjectionMaskModeName(ProjectionMaskMode mode)
+{
+    switch (mode)
+    {
+    case MASK_AUTO:
+        return "Auto";
+    case MASK_MANUAL:
+        return "Manual";
+    default:
+        return "None";
+    }
+}
+
+void Sorter::setTrainingBufferSize(int numSpikes)
+{
+    const ScopedLock myScopedLock(mut);
+
+    numSpikes = jmax(3, numSpikes);
+
+    if (numSpikes == bufferSize)
+        return;
+
+    // stored spikes are moved as they are, without converting compact ones
+    Array<SorterSpikePtr> spikes;
+
+    for (int n = 1; n <= bufferSize; n++)
+    {
+        if (SorterSpikePtr spike = spikeBuffer[(spikeBufferIndex + n) % bufferSize])
+            spikes.add(spike);
+    }
+
+    bufferSize = numSpikes;
+    spikeBuffer.clear();
+
+    for (int n = 0; n < bufferSize; n++)
+        spikeBuffer.add(nullptr);
+
+    setRecentSpikes(spikes);
+}
+
+int64 Sorter::getMemoryUsage()
+{
+    const ScopedLock myScopedLock(mut);
+
+    int64 bytes = 4 * int64(numChannels) * waveformLength * (int64) sizeof(float)
+                  + int64(bufferSize) * (int64) sizeof(SorterSpikePtr);
+
+    for (int n = 0; n < spikeBuffer.size(); n++)
+    {
+        if (SorterSpikePtr spike = spikeBuffer[n])
+            bytes += (int64) spike->getMemoryUsage();
+    }
+
+    return bytes;
+}
+
+Array<SorterSpikePtr> Sorter::getRecentSpikes()
+{
+    const ScopedLock myScopedLock(mut);
+
+    Array<SorterSpikePtr> spikes;
+
+    for (int n = 1; n <= bufferSize; n++)
+    {
+        SorterSpikePtr spike = spikeBuffer[(spikeBufferIndex + n) % bufferSize];
+
+        if (spike != nullptr)
+            spikes.add(spike->expand());
+    }
+
+    return spikes;
+}
+
+void Sorter::setCompactStorage(bool compact)
+{
+    const ScopedLock myScopedLock(mut);
+
+    if (compact == compactStorage)
+        return;
+
+    compactStorage = compact;
+
+    for (int n = 0; n < spikeBuffer.size(); n++)
+    {
+        SorterSpikePtr spike = spikeBuffer[n];
+
+        if (spike != nullptr && spike->isCompact() != compact)
+            spikeBuffer.set(n, compact ? spike->createCompactCopy() : spike->expand());
+    }
+}
+
+void Sorter::setRecentSpikes(const Array<SorterSpikePtr>& spikes)
+{
+    const ScopedLock myScopedLock(mut);
+
+    const int numSpikes = jmin(spikes.size(), bufferSize);
+
+    for (int n = 0; n < bufferSize; n++)
+    {
+        SorterSpikePtr spike = n < numSpikes ? spikes[spikes.size() - numSpikes + n] : nullptr;
+
+        if (spike != nullptr && spike->isCompact() != compactStorage)
+            spike = compactStorage ? spike->createCompactCopy() : spike->expand();
+
+        spikeBuffer.set(n, spike);
+    }
+
+    spikeBufferIndex = numSpikes - 1;
+}
+
 void Sorter::RePCA()
 {
-    if (bPCAComputed)
+    const ScopedLock myScopedLock(mut);
+
+    // a job still running was trained on the old mask; its result is dropped
+    // and a new job is started with the next spike
+    if (bPCAComputed || bPCAJobSubmitted)
     {
         bPCAComputed = false;
         bPCAJobSubmitted = false;
         bRePCA = true;
+        bChoosingMask = false;
+        currentJob = nullptr;
+        stateVersion++;
+        updateClassifier();
     }
 }
 
 void Sorter::addPCAunit(PCAUnit unit)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
     pcaUnits.push_back(unit);
+    updateClassifier();
 }
 
 int Sorter::addBoxUnit(int channel)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
 
     BoxUnit unit(Sorter::generateUnitId());
     boxUnits.push_back(unit);
-    setSelectedUnitAndBox(nextUnitId, 0);
+    setSelectedUnitAndBox(unit.getUnitId(), 0);
+    updateClassifier();
 
-    return nextUnitId;
+    return unit.getUnitId();
 }
 
 int Sorter::addBoxUnit(int channel, Box B)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
 
     BoxUnit unit(B, Sorter::generateUnitId());
     boxUnits.push_back(unit);
-    setSelectedUnitAndBox(nextUnitId, 0);
+    setSelectedUnitAndBox(unit.getUnitId(), 0);
+    updateClassifier();
 
-    return nextUnitId;
+    return unit.getUnitId();
 }
 
 void Sorter::getUnitColor(int unitId, uint8& R, uint8& G, uint8& B)
@@ -272,32 +641,66 @@ int Sorter::generateUnitId()
 
 }
 
-void Sorter::generateNewIds()
+void Sorter::reserveUnitId(int unitId)
+{
+    nextUnitId = jmax(unitId + 1, nextUnitId);
+}
+
+std::vector<std::pair<int, int>> Sorter::generateNewIds()
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
+
+    std::vector<std::pair<int, int>> ids;
 
     for (int k = 0; k < boxUnits.size(); k++)
     {
+        const int oldId = boxUnits[k].unitId;
         boxUnits[k].unitId = generateUnitId();
         boxUnits[k].updateColor();
+        ids.push_back({ oldId, boxUnits[k].unitId });
     }
     for (int k = 0; k < pcaUnits.size(); k++)
     {
+        const int oldId = pcaUnits[k].unitId;
         pcaUnits[k].unitId = generateUnitId();
         pcaUnits[k].updateColor();
+        ids.push_back({ oldId, pcaUnits[k].unitId });
     }
+
+    updateClassifier();
+
+    return ids;
+}
+
+Array<int> Sorter::getUnitIds()
+{
+    const ScopedLock myScopedLock(mut);
+
+    Array<int> ids;
+
+    for (auto& unit : boxUnits)
+        ids.add(unit.unitId);
+
+    for (auto& unit : pcaUnits)
+        ids.add(unit.unitId);
+
+    return ids;
 }
 
 void Sorter::removeAllUnits()
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
     boxUnits.clear();
     pcaUnits.clear();
+    updateClassifier();
 }
 
 bool Sorter::removeUnit(int unitID)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
     
     LOGD("Sorter::removeUnit() ", unitID);
 
@@ -306,6 +709,7 @@ bool Sorter::removeUnit(int unitID)
         if (boxUnits[k].getUnitId() == unitID)
         {
             boxUnits.erase(boxUnits.begin()+k);
+            updateClassifier();
             return true;
         }
     }
@@ -315,6 +719,7 @@ bool Sorter::removeUnit(int unitID)
         if (pcaUnits[k].getUnitId() == unitID)
         {
             pcaUnits.erase(pcaUnits.begin()+k);
+            updateClassifier();
             return true;
         }
     }
@@ -326,6 +731,7 @@ bool Sorter::removeUnit(int unitID)
 bool Sorter::addBoxToUnit(int channel, int unitID)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
 
     for (int k = 0; k < boxUnits.size(); k++)
     {
@@ -337,6 +743,7 @@ bool Sorter::addBoxToUnit(int channel, int unitID)
             B.channel = channel;
             boxUnits[k].addBox(B);
             setSelectedUnitAndBox(unitID, (int) boxUnits[k].lstBoxes.size() - 1);
+            updateClassifier();
             return true;
         }
     }
@@ -348,12 +755,14 @@ bool Sorter::addBoxToUnit(int channel, int unitID)
 bool Sorter::addBoxToUnit(int channel, int unitID, Box B)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
 
     for (int k = 0; k < boxUnits.size(); k++)
     {
         if (boxUnits[k].getUnitId() == unitID)
         {
             boxUnits[k].addBox(B);
+            updateClassifier();
             return true;
         }
     }
@@ -379,17 +788,21 @@ std::vector<PCAUnit> Sorter::getPCAUnits()
 void Sorter::updatePCAUnits(std::vector<PCAUnit> _units)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
     pcaUnits = _units;
+    updateClassifier();
 }
 
 void Sorter::updateBoxUnits(std::vector<BoxUnit> _units)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
     boxUnits = _units;
+    updateClassifier();
 }
 
 
-bool Sorter::checkBoxUnits(SorterSpikePtr spike)
+bool Sorter::checkBoxUnits(SorterSpikePtr spike, bool updateStats)
 {
     for (int k = 0; k < boxUnits.size(); k++)
     {
@@ -399,10 +812,15 @@ bool Sorter::checkBoxUnits(SorterSpikePtr spike)
             spike->color[0] = boxUnits[k].colorRGB[0];
             spike->color[1] = boxUnits[k].colorRGB[1];
             spike->color[2] = boxUnits[k].colorRGB[2];
-            boxUnits[k].updateWaveform(spike);
+
+            if (updateStats)
+                boxUnits[k].updateWaveform(spike);
+
             return true;
         }
     }
+
+    return false;
 }
 
 bool Sorter::checkPCAUnits(SorterSpikePtr spike)
@@ -418,6 +836,288 @@ bool Sorter::checkPCAUnits(SorterSpikePtr spike)
             return true;
         }
     }
+
+    return false;
+}
+
+bool Sorter::processSpike(SorterSpikePtr spike)
+{
+    // projected and sorted on the published copies, without locking
+    const int slot = claimClassifier(0);
+    Classifier& classifier = *classifiers[slot];
+
+    classifier.project(spike);
+    spike->stateVersion = classifier.stateVersion;
+
+    Classifier::Unit* unit = classifier.findUnit(spike);
+
+    if (unit != nullptr)
+        unit->assignTo(spike);
+
+    readingClassifier.store(-1);
+
+    // a spike that arrives while the message thread holds the lock is left out
+    // of PCA training and unit statistics, rather than waiting for it
+    const ScopedTryLock myScopedTryLock(mut);
+
+    if (myScopedTryLock.isLocked())
+    {
+        collectSpike(spike);
+
+        if (!bPCAComputed)
+            startPCAJobIfDue();
+
+        if (unit != nullptr)
+            updateUnitStatistics(spike);
+    }
+
+    // compacted later by compactCollectedSpikes, so the processing thread does not allocate a copy
+    return unit != nullptr;
+}
+
+void Sorter::compactCollectedSpikes()
+{
+    if (!compactStorage)
+        return;
+
+    // nothing is allocated or freed under the lock: the buffer is copied into
+    // storage reserved beforehand, and the copies are made outside it
+    const int capacity = bufferSize;
+
+    Array<SorterSpikePtr> spikes;
+    spikes.ensureStorageAllocated(capacity);
+
+    {
+        const ScopedLock myScopedLock(mut);
+
+        // grown meanwhile; the next call catches up
+        if (spikeBuffer.size() > capacity)
+            return;
+
+        for (int n = 0; n < spikeBuffer.size(); n++)
+            spikes.add(spikeBuffer[n]);
+    }
+
+    Array<SorterSpikePtr> copies;
+    copies.ensureStorageAllocated(spikes.size());
+
+    for (auto& spike : spikes)
+        copies.add(spike != nullptr && !spike->isCompact() ? spike->createCompactCopy() : nullptr);
+
+    const ScopedLock myScopedLock(mut);
+
+    if (!compactStorage)
+        return;
+
+    // a slot collected again since the snapshot keeps its newer spike; the
+    // replaced spikes are still referenced by the snapshot, so they are freed
+    // after the lock has been released
+    for (int n = 0; n < copies.size() && n < spikeBuffer.size(); n++)
+    {
+        if (copies[n] != nullptr && spikeBuffer[n].get() == spikes[n].get())
+            spikeBuffer.set(n, copies[n]);
+    }
+}
+
+void Sorter::compactNewestSpike(const SorterSpikePtr& spike)
+{
+    // the copy is made after sorting, so it keeps the unit and projection
+    if (spikeBufferIndex >= 0 && spikeBuffer[spikeBufferIndex].get() == spike.get())
+        spikeBuffer.set(spikeBufferIndex, spike->createCompactCopy());
+}
+
+int Sorter::claimClassifier(int64 deadlineTicks)
+{
+    // publishClassifier never rewrites a claimed classifier, so a claim only
+    // has to be repeated if another one was published while it was made
+    int slot = publishedClassifier.load();
+
+    for (;;)
+    {
+        readingClassifier.store(slot);
+
+        const int published = publishedClassifier.load();
+
+        if (published == slot)
+            return slot;
+
+        if (deadlineTicks > 0 && Time::getHighResolutionTicks() >= deadlineTicks)
+        {
+            readingClassifier.store(-1);
+            return -1;
+        }
+
+        slot = published;
+    }
+}
+
+bool Sorter::classifySpike(const SorterSpikePtr& spike, int64 deadlineTicks)
+{
+    const int slot = claimClassifier(deadlineTicks);
+
+    if (slot < 0)
+        return false;
+
+    Classifier& classifier = *classifiers[slot];
+
+    classifier.project(spike);
+    spike->stateVersion = classifier.stateVersion;
+
+    if (Classifier::Unit* unit = classifier.findUnit(spike))
+        unit->assignTo(spike);
+
+    readingClassifier.store(-1);
+
+    return true;
+}
+
+void Sorter::updateClassifier()
+{
+    const ScopedLock myScopedLock(mut);
+
+    if (classifierVersion != stateVersion)
+        publishClassifier();
+}
+
+void Sorter::publishClassifier()
+{
+    const int slot = 1 - publishedClassifier.load();
+
+    // classifySpike may still be reading the one it claimed before the last publish
+    while (readingClassifier.load() == slot)
+        Thread::yield();
+
+    Classifier& classifier = *classifiers[slot];
+    const int dim = numChannels * waveformLength;
+
+    classifier.basisValid = bPCAComputed;
+    classifier.basisVersion = basisVersion;
+    classifier.stateVersion = stateVersion;
+    classifier.mask = mask;
+
+    if (bPCAComputed)
+    {
+        classifier.pc1.assign(pc1, pc1 + dim);
+        classifier.pc2.assign(pc2, pc2 + dim);
+    }
+
+    classifier.pcaUnits.clear();
+
+    for (auto& pcaUnit : pcaUnits)
+    {
+        Classifier::Unit unit;
+        unit.unitId = pcaUnit.unitId;
+        std::copy(pcaUnit.colorRGB, pcaUnit.colorRGB + 3, unit.color);
+        unit.polygon = pcaUnit.poly;
+        classifier.pcaUnits.push_back(unit);
+    }
+
+    classifier.boxUnits.clear();
+
+    for (auto& boxUnit : boxUnits)
+    {
+        Classifier::Unit unit;
+        unit.unitId = boxUnit.unitId;
+        std::copy(boxUnit.colorRGB, boxUnit.colorRGB + 3, unit.color);
+        unit.boxes = boxUnit.lstBoxes;
+        classifier.boxUnits.push_back(unit);
+    }
+
+    publishedClassifier.store(slot);
+
+    // stored after the copy is published, so a spike sorted after reading it
+    // never uses an older state
+    classifierVersion = stateVersion.load();
+
+    if (keepStateHistory)
+        saveStateToHistory();
+}
+
+void Sorter::setStateHistory(bool enabled)
+{
+    const ScopedLock myScopedLock(mut);
+
+    keepStateHistory = enabled;
+    savedStates.clear();
+
+    // the state already published is the first one recorded
+    if (enabled)
+        saveStateToHistory();
+}
+
+void Sorter::saveStateToHistory()
+{
+    XmlElement state("ELECTRODE");
+    saveCustomParametersToXml(&state);
+
+    savedStates.push_back({ classifierVersion.load(), state.toString() });
+
+    if (savedStates.size() > maxSavedStates)
+        savedStates.pop_front();
+}
+
+std::unique_ptr<XmlElement> Sorter::takeSavedState(uint32 version)
+{
+    const ScopedLock myScopedLock(mut);
+
+    // states are taken in the order they were published, so older ones are no longer needed
+    while (!savedStates.empty() && savedStates.front().version < version)
+        savedStates.pop_front();
+
+    if (!savedStates.empty() && savedStates.front().version == version)
+    {
+        if (std::unique_ptr<XmlElement> state = parseXML(savedStates.front().xml))
+            return state;
+    }
+
+    LOGD("Sorter: state ", (int64) version, " was not kept; using the current state");
+
+    std::unique_ptr<XmlElement> state = std::make_unique<XmlElement>("ELECTRODE");
+    saveCustomParametersToXml(state.get());
+
+    return state;
+}
+
+void Sorter::trainOnSpike(const SorterSpikePtr& spike)
+{
+    const ScopedLock myScopedLock(mut);
+
+    collectSpike(spike);
+
+    // a basis that arrived after classification still positions the spike for display
+    if (bPCAComputed)
+    {
+        if (spike->basisVersion != basisVersion)
+            projectSpike(spike);
+    }
+    else
+    {
+        startPCAJobIfDue();
+    }
+
+    updateUnitStatistics(spike);
+
+    if (compactStorage)
+        compactNewestSpike(spike);
+
+    // a basis picked up above is used from the next classified spike on
+    updateClassifier();
+}
+
+void Sorter::updateUnitStatistics(const SorterSpikePtr& spike)
+{
+    // as in checkBoxUnits, only box units keep waveform statistics
+    if (spike->sortedId <= 0)
+        return;
+
+    for (int k = 0; k < boxUnits.size(); k++)
+    {
+        if (boxUnits[k].getUnitId() == spike->sortedId)
+        {
+            boxUnits[k].updateWaveform(spike);
+            break;
+        }
+    }
 }
 
 bool Sorter::sortSpike(SorterSpikePtr spike, bool PCAfirst)
@@ -448,6 +1148,7 @@ bool Sorter::sortSpike(SorterSpikePtr spike, bool PCAfirst)
 bool Sorter::removeBoxFromUnit(int unitId, int boxIndex)
 {
     const ScopedLock myScopedLock(mut);
+    stateVersion++;
 
     for (int k = 0; k < boxUnits.size(); k++)
     {
@@ -455,6 +1156,7 @@ bool Sorter::removeBoxFromUnit(int unitId, int boxIndex)
         {
             bool s= boxUnits[k].deleteBox(boxIndex);
             setSelectedUnitAndBox(-1,-1);
+            updateClassifier();
 
             return s;
         }
@@ -502,10 +1204,7 @@ int Sorter::getNumBoxes(int unitId)
 
 void Sorter::saveCustomParametersToXml(XmlElement* xml)
 {
-
-    xml->setAttribute("name", electrode->name);
-    xml->setAttribute("stream_name", electrode->streamName);
-    xml->setAttribute("source_node_id", electrode->sourceNodeId);
+    const ScopedLock myScopedLock(mut);
 
     xml->setAttribute("selectedUnit", selectedUnit);
     xml->setAttribute("selectedBox", selectedBox);
@@ -517,13 +1216,12 @@ void Sorter::saveCustomParametersToXml(XmlElement* xml)
     pcaNode->setAttribute("pc2min", pc2min);
     pcaNode->setAttribute("pc1max", pc1max);
     pcaNode->setAttribute("pc2max", pc2max);
+    pcaNode->setAttribute("basisValid", bPCAComputed);
+    pcaNode->setAttribute("maskMode", (int) maskMode);
+    pcaNode->setAttribute("mask", mask.toString());
 
-    for (int k = 0; k < numChannels * waveformLength; k++)
-    {
-        XmlElement* dimNode = pcaNode->createNewChildElement("PCA_DIM");
-        dimNode->setAttribute("pc1", pc1[k]);
-        dimNode->setAttribute("pc2", pc2[k]);
-    }
+    if (bPCAComputed)
+        saveBasis(pcaNode);
 
     for (int pcaUnitIter = 0; pcaUnitIter < pcaUnits.size(); pcaUnitIter++)
     {
@@ -534,8 +1232,8 @@ void Sorter::saveCustomParametersToXml(XmlElement* xml)
         PcaUnitNode->setAttribute("ColorG", pcaUnits[pcaUnitIter].colorRGB[1]);
         PcaUnitNode->setAttribute("ColorB", pcaUnits[pcaUnitIter].colorRGB[2]);
         PcaUnitNode->setAttribute("PolygonNumPoints", (int)pcaUnits[pcaUnitIter].poly.pts.size());
-        PcaUnitNode->setAttribute("PolygonOffsetX", (int)pcaUnits[pcaUnitIter].poly.offset.X);
-        PcaUnitNode->setAttribute("PolygonOffsetY", (int)pcaUnits[pcaUnitIter].poly.offset.Y);
+        PcaUnitNode->setAttribute("PolygonOffsetX", pcaUnits[pcaUnitIter].poly.offset.X);
+        PcaUnitNode->setAttribute("PolygonOffsetY", pcaUnits[pcaUnitIter].poly.offset.Y);
 
         for (int p = 0; p < pcaUnits[pcaUnitIter].poly.pts.size(); p++)
         {
@@ -560,16 +1258,77 @@ void Sorter::saveCustomParametersToXml(XmlElement* xml)
         {
             XmlElement* boxNode = boxUnitNode->createNewChildElement("BOX");
             boxNode->setAttribute("ch", (int) box.channel);
-            boxNode->setAttribute("x", (int) box.x);
-            boxNode->setAttribute("y", (int) box.y);
-            boxNode->setAttribute("w", (int) box.w);
-            boxNode->setAttribute("h", (int) box.h);
+            boxNode->setAttribute("x", box.x);
+            boxNode->setAttribute("y", box.y);
+            boxNode->setAttribute("w", box.w);
+            boxNode->setAttribute("h", box.h);
+        }
+    }
+}
+
+void Sorter::saveBasis(XmlElement* pcaNode)
+{
+    const int dim = numChannels * waveformLength;
+
+    MemoryBlock basis(sizeof(float) * 2 * dim);
+    memcpy(basis.getData(), pc1, sizeof(float) * dim);
+    memcpy((float*) basis.getData() + dim, pc2, sizeof(float) * dim);
+
+    pcaNode->setAttribute("basisVersion", basisFormatVersion);
+    pcaNode->setAttribute("basisChecksum", String::toHexString((int64) basisChecksum(basis.getData(), basis.getSize())));
+    pcaNode->setAttribute("basis", Base64::toBase64(basis.getData(), basis.getSize()));
+}
+
+bool Sorter::loadBasis(XmlElement* pcaNode)
+{
+    const int dim = numChannels * waveformLength;
+
+    if (pcaNode->hasAttribute("basis"))
+    {
+        MemoryOutputStream basis;
+
+        if (pcaNode->getIntAttribute("basisVersion") == basisFormatVersion
+            && Base64::convertFromBase64(basis, pcaNode->getStringAttribute("basis"))
+            && basis.getDataSize() == sizeof(float) * 2 * dim
+            && String::toHexString((int64) basisChecksum(basis.getData(), basis.getDataSize()))
+               == pcaNode->getStringAttribute("basisChecksum"))
+        {
+            memcpy(pc1, basis.getData(), sizeof(float) * dim);
+            memcpy(pc2, (const float*) basis.getData() + dim, sizeof(float) * dim);
+            return true;
+        }
+
+        LOGC("Spike Sorter: stored PC basis is damaged or from a newer version; it will be recomputed");
+        return false;
+    }
+
+    // Settings saved before the binary format: one PCA_DIM element per dimension
+    int dimcounter = 0;
+
+    forEachXmlChildElement(*pcaNode, dimNode)
+    {
+        if (dimNode->hasTagName("PCA_DIM") && dimcounter < dim)
+        {
+            pc1[dimcounter] = dimNode->getDoubleAttribute("pc1");
+            pc2[dimcounter] = dimNode->getDoubleAttribute("pc2");
+            dimcounter++;
         }
     }
+
+    return dimcounter == dim;
 }
 
 void Sorter::loadCustomParametersFromXml(XmlElement* xml)
 {
+    // a running job writes to the buffers reallocated below
+    if (computingThread != nullptr)
+        computingThread->removeJobs(this);
+
+    const ScopedLock myScopedLock(mut);
+
+    boxUnits.clear();
+    pcaUnits.clear();
+    stateVersion++;
 
     selectedUnit = xml->getIntAttribute("selectedUnit", 0);
     selectedBox = xml->getIntAttribute("selectedBox", 0);
@@ -592,17 +1351,33 @@ void Sorter::loadCustomParametersFromXml(XmlElement* xml)
 
             pc1 = new float[waveformLength * numChannels];
             pc2 = new float[waveformLength * numChannels];
-            int dimcounter = 0;
-
-            forEachXmlChildElement(*sorterNode, dimNode)
-            {
-                if (dimNode->hasTagName("PCA_DIM"))
-                {
-                    pc1[dimcounter] = dimNode->getDoubleAttribute("pc1");
-                    pc2[dimcounter] = dimNode->getDoubleAttribute("pc2");
-                    dimcounter++;
-                }
-            }
+            jobPc1.allocate(waveformLength * numChannels, true);
+            jobPc2.allocate(waveformLength * numChannels, true);
+            currentJob = nullptr;
+
+            // settings without a mask were sorted on the whole waveform
+            mask.reset(numChannels, waveformLength);
+            maskMode = (ProjectionMaskMode) jlimit(0, NUM_MASK_MODES - 1,
+                                                   sorterNode->getIntAttribute("maskMode", MASK_NONE));
+
+            if (sorterNode->hasAttribute("mask") && !mask.fromString(sorterNode->getStringAttribute("mask")))
+                LOGC("Spike Sorter: ignoring unreadable PCA mask");
+
+            // A complete stored basis can be used straight away, so polygons
+            // drawn in that basis keep matching without waiting for a new job.
+            // Files from before basisValid wrote PCA_DIM elements whether or not
+            // a basis had been computed; polygon units can only be drawn on a
+            // computed one, so their presence vouches for it.
+            const bool basisValid = sorterNode->hasAttribute("basisValid")
+                                    ? sorterNode->getBoolAttribute("basisValid")
+                                    : sorterNode->getChildByName("UNIT") != nullptr;
+
+            bPCAComputed = basisValid && loadBasis(sorterNode);
+            bPCAFirstJobFinished = bPCAFirstJobFinished || bPCAComputed;
+            bPCAJobFinished = false;
+
+            if (bPCAComputed)
+                basisVersion++;
 
             forEachXmlChildElement(*sorterNode, unitNode)
             {
@@ -615,7 +1390,7 @@ void Sorter::loadCustomParametersFromXml(XmlElement* xml)
 
                     pcaUnit.unitId = unitNode->getIntAttribute("UnitID");
 
-                    nextUnitId = jmax(pcaUnit.unitId + 1, nextUnitId);
+                    reserveUnitId(pcaUnit.unitId);
 
                     pcaUnit.colorRGB[0] = unitNode->getIntAttribute("ColorR");
                     pcaUnit.colorRGB[1] = unitNode->getIntAttribute("ColorG");
@@ -653,7 +1428,7 @@ void Sorter::loadCustomParametersFromXml(XmlElement* xml)
                     BoxUnit boxUnit;
                     boxUnit.unitId = unitNode->getIntAttribute("UnitID");
 
-                    nextUnitId = jmax(boxUnit.unitId + 1, nextUnitId);
+                    reserveUnitId(boxUnit.unitId);
 
                     boxUnit.colorRGB[0] = unitNode->getIntAttribute("ColorR");
                     boxUnit.colorRGB[1] = unitNode->getIntAttribute("ColorG");
@@ -681,6 +1456,6 @@ void Sorter::loadCustomParametersFromXml(XmlElement* xml)
         }
     }
 
-    electrode->plot->updateUnits();
+    updateClassifier();
 
 }
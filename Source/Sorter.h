@@ -27,29 +27,69 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <ProcessorHeaders.h>
 
 #include "Containers.h"
+#include "ProjectionMask.h"
+#include "PCAJob.h"
 
 #include <algorithm>    // std::sort
 #include <list>
 #include <queue>
+#include <deque>
 #include <atomic>
+#include <memory>
 
 class PCAUnit;
 class PCAComputingThread;
 class Box;
 class BoxUnit;
-class Electrode;
+
+/**
+    How much work is done for each spike on an electrode
+*/
+enum SortingMode
+{
+    /** Check thresholds, sort and display (default) */
+    SORT_AND_DISPLAY = 0,
+
+    /** Check thresholds and sort, but do not update the display */
+    SORT_ONLY,
+
+    /** Display spikes that cross threshold, without projecting or sorting them */
+    THRESHOLD_ONLY,
+
+    /** Pass spikes through untouched */
+    BYPASS,
+
+    NUM_SORTING_MODES
+};
+
+/**
+    How the part of each waveform used for PCA is chosen
+*/
+enum ProjectionMaskMode
+{
+    /** Use every channel and sample */
+    MASK_NONE = 0,
+
+    /** Choose channels and a window from the loadings of the first basis */
+    MASK_AUTO,
+
+    /** Use the channels and window set by the user */
+    MASK_MANUAL,
+
+    NUM_MASK_MODES
+};
 
 /** 
-    Sorts spikes from a single electrode (1-4 channels)
+    Sorts spikes from a single electrode (any number of channels)
 
     Each Sorter can have an arbitrary number of Box units and PCA Units
 */
-class Sorter
+class Sorter : private PCAjob::Listener
 {
 public:
 
     /** Constructor */
-    Sorter(Electrode* electrode, PCAComputingThread* pcaThread);
+    Sorter(int numChannels, int waveformLength, PCAComputingThread* pcaThread);
 
     /** Destructor */
     ~Sorter();
@@ -57,16 +97,42 @@ public:
     /** Sets the size of the waveform (in samples) and re-set PCA calculation */
     void resizeWaveform(int numSamples);
 
+    /** Projects a spike that has crossed threshold and assigns it to a unit (the per-spike
+        path of SpikeSorter::handleSpike); returns true if a unit was found. Classifies
+        like classifySpike, then collects the spike for PCA and adds it to its unit's
+        statistics unless another thread holds the lock, so it never waits */
+    bool processSpike(SorterSpikePtr so);
+
+    /** Closed-loop half of processSpike: projects the spike on the published basis
+        and assigns a unit, leaving the training buffer and unit statistics to
+        trainOnSpike. Reads a copy of the units, basis and mask without locking,
+        so it never waits for other threads; only one thread may classify (call
+        classifySpike, processSpike or projectOnPrincipalComponents).
+        Gives up, leaving the spike unsorted, if new copies keep being published
+        until deadlineTicks (0 = no deadline); returns false in that case */
+    bool classifySpike(const SorterSpikePtr& so, int64 deadlineTicks);
+
+    /** Bookkeeping half of processSpike, for a spike already classified (any thread):
+        collects it for PCA, starts jobs and updates the statistics of its unit */
+    void trainOnSpike(const SorterSpikePtr& so);
+
+    /** Installs the basis of a finished PCA job and publishes the units, basis and
+        mask to classifySpike if they changed since it last saw them (any thread
+        but the classifying one; the PCA thread calls it as each job finishes) */
+    void updateClassifier();
+
     /** Tests whether a candidate spike belongs to one of the defined units*/
     bool sortSpike(SorterSpikePtr so, bool PCAfirst);
 
-    /** Tests whether a candidate spike belongs to one of the available BoxUnits*/
-    bool checkBoxUnits(SorterSpikePtr so);
+    /** Tests whether a candidate spike belongs to one of the available BoxUnits
+        (and adds it to that unit's statistics if updateStats is set) */
+    bool checkBoxUnits(SorterSpikePtr so, bool updateStats = true);
 
     /** Tests whether a candidate spike belongs to one of the available PCAUnits*/
     bool checkPCAUnits(SorterSpikePtr so);
 
-    /** Projects a spike waveform into PC space */
+    /** Projects a spike waveform into PC space and collects it for PCA, without
+        waiting for the lock (see processSpike) */
 	void projectOnPrincipalComponents(SorterSpikePtr so);
 
     /** Gets the RGB color values for a unit */
@@ -135,8 +201,11 @@ public:
     /** Generates the next global unit ID (across all Sorters) */
     static int generateUnitId();
 
-    /** Re-generates IDs for all units */
-    void generateNewIds();
+    /** Re-generates IDs for all units; returns each old ID with its new one */
+    std::vector<std::pair<int, int>> generateNewIds();
+
+    /** Returns the IDs of all units */
+    Array<int> getUnitIds();
 
     /** Selects a box for a particular unit */
     void setSelectedUnitAndBox(int unitId, int boxId);
@@ -147,14 +216,137 @@ public:
     /** Saves sorting parameters for one electrode */
     void saveCustomParametersToXml(XmlElement* electrodeNode);
 
-    /** Loads sorting parameters for one electrode*/
+    /** Loads sorting parameters for one electrode (replacing any existing units)*/
     void loadCustomParametersFromXml(XmlElement* electrodeNode);
 
+    /** Returns a counter that changes whenever the units or the PC basis change */
+    uint32 getStateVersion() const { return stateVersion; }
+
+    /** Returns the state version that spikes are currently sorted with; it only
+        changes once the new units and basis have been published to them */
+    uint32 getPublishedVersion() const { return classifierVersion; }
+
+    /** Keeps the serialised state of every version published from now on, so a
+        recording can log each one as it was (turning it off forgets them) */
+    void setStateHistory(bool enabled);
+
+    /** Returns the state published as version (an ELECTRODE element) and forgets
+        the ones before it; falls back to the current state if that version is not
+        kept. Versions must be taken in increasing order */
+    std::unique_ptr<XmlElement> takeSavedState(uint32 version);
+
+    /** Returns a counter that changes whenever the PC basis changes (0 = no basis yet) */
+    uint32 getBasisVersion() const { return basisVersion; }
+
+    /** Enables or disables automatic PCA jobs (when disabled, the basis only changes on load) */
+    void setAutomaticPCA(bool enabled) { automaticPCA = enabled; }
+
+    /** Returns the number of channels per waveform */
+    int getNumChannels() const { return numChannels; }
+
+    /** Returns the number of samples per channel */
+    int getWaveformLength() const { return waveformLength; }
+
+    /** Copies the PC basis (numChannels * waveformLength values each); returns false if none has been computed */
+    bool getBasis(float* pc1, float* pc2);
+
+    /** Installs a previously computed PC basis */
+    void setBasis(const float* pc1, const float* pc2);
+
+    /** Returns a copy of the mask used for PCA training and projection */
+    ProjectionMask getProjectionMask();
+
+    /** Returns how the mask is chosen */
+    ProjectionMaskMode getProjectionMaskMode() const { return maskMode; }
+
+    /** Installs a mask as is (e.g. when restoring state); the basis is not recomputed */
+    void setProjectionMask(const ProjectionMask& mask, ProjectionMaskMode mode);
+
+    /** Changes how the mask is chosen and recomputes the basis; MASK_NONE and
+        MASK_AUTO start again from the whole waveform */
+    void setProjectionMaskMode(ProjectionMaskMode mode);
+
+    /** Returns a short name for a mask mode */
+    static String getProjectionMaskModeName(ProjectionMaskMode mode);
+
+    /** Returns the spikes collected for the next PCA job, oldest first (always as floats) */
+    Array<SorterSpikePtr> getRecentSpikes();
+
+    /** Stores the spikes collected for PCA jobs as 16-bit waveforms (half the memory)
+        or as floats; spikes already collected are converted */
+    void setCompactStorage(bool compact);
+
+    /** Returns true if collected spikes are stored as 16-bit waveforms */
+    bool isCompactStorage() const { return compactStorage; }
+
+    /** Replaces the spikes collected by processSpike since the last call with their
+        16-bit copies, if compact storage is on (message thread, in batches) */
+    void compactCollectedSpikes();
+
+    /** Changes the number of spikes collected for PCA jobs, keeping the newest */
+    void setTrainingBufferSize(int numSpikes);
+
+    /** Returns the number of spikes collected for PCA jobs */
+    int getTrainingBufferSize() const { return bufferSize; }
+
+    /** Returns the bytes held by the PC basis and the spike buffer */
+    int64 getMemoryUsage();
+
+    /** Spikes collected for PCA unless memory is short */
+    static const int defaultBufferSize = 200;
+
+    /** Refills the PCA spike buffer (e.g. after a restart) */
+    void setRecentSpikes(const Array<SorterSpikePtr>& spikes);
+
+    /** Makes sure generateUnitId never returns an ID that is already in use */
+    static void reserveUnitId(int unitId);
+
 private:
 
-    CriticalSection mut;
+    /** Adds a spike to the training buffer (lock held) */
+    void collectSpike(const SorterSpikePtr& so);
+
+    /** Makes the basis and mask of a finished PCA job current (lock held) */
+    void installFinishedJob();
+
+    /** Installs and publishes the basis of the job that just finished, unless
+        the job was superseded after it was submitted (PCA thread) */
+    void pcaJobFinished(PCAjob* job) override;
+
+    /** Adds a sorted spike to the statistics of its box unit (lock held) */
+    void updateUnitStatistics(const SorterSpikePtr& so);
+
+    /** Projects a spike if a basis has been computed; returns false otherwise (lock held) */
+    bool projectSpike(const SorterSpikePtr& so);
+
+    /** Starts a PCA job once the training buffer is full or one was requested (lock held) */
+    void startPCAJobIfDue();
+
+    /** Copies the units, basis and mask to the classifier that classifySpike
+        is not reading, then publishes it (lock held) */
+    void publishClassifier();
+
+    /** Serialises the published state into the history (lock held) */
+    void saveStateToHistory();
+
+    /** Claims the published classifier for reading; returns its slot, or -1 if
+        copies kept being published until deadlineTicks (0 = no deadline).
+        The claim is released by storing -1 in readingClassifier */
+    int claimClassifier(int64 deadlineTicks);
+
+    /** Replaces the newest collected spike with its 16-bit copy (lock held) */
+    void compactNewestSpike(const SorterSpikePtr& so);
+
+    /** Writes the PC basis as a single base64 attribute (little-endian floats, pc1 then pc2) */
+    void saveBasis(XmlElement* pcaNode);
+
+    /** Reads the PC basis from the base64 attribute or the older PCA_DIM elements; returns false if missing or damaged */
+    bool loadBasis(XmlElement* pcaNode);
 
-    Electrode* electrode;
+    /** Version of the binary basis attribute written by saveBasis */
+    static const int basisFormatVersion = 1;
+
+    CriticalSection mut;
 
     PCAComputingThread* computingThread;
 
@@ -170,12 +362,67 @@ private:
     
     float* pc1, *pc2;
     std::atomic<float> pc1min, pc2min, pc1max, pc2max;
+
+    /** Part of each waveform used for PCA; pc1 and pc2 are zero elsewhere */
+    ProjectionMask mask;
+    ProjectionMaskMode maskMode;
+
+    /** Share of the squared PC loadings kept by an automatic mask */
+    static constexpr float autoMaskEnergy = 0.9f;
+
+    /** Mask chosen by the running PCA job, installed with its basis */
+    ProjectionMask chosenMask;
+    bool bChoosingMask;
+
+    /** Basis written by PCA jobs; copied to pc1 and pc2 only when the job
+        that wrote it is still current */
+    HeapBlock<float> jobPc1, jobPc2;
+
+    /** Job whose result will be installed; a job submitted before a RePCA
+        or setBasis is no longer current and its result is dropped */
+    PCAJobPtr currentJob;
     
     int bufferSize,spikeBufferIndex;
     
     bool bPCAJobSubmitted,bPCAComputed, bRePCA, bPCAFirstJobFinished;
     std::atomic<bool> bPCAJobFinished;
 
+    bool automaticPCA;
+
+    /** Collected spikes are replaced by 16-bit copies once sorted (by trainOnSpike
+        or compactCollectedSpikes, never on the processing thread) */
+    bool compactStorage;
+
+    std::atomic<uint32> stateVersion;
+    std::atomic<uint32> basisVersion;
+
+    /** What classifySpike needs, copied from the fields above */
+    struct Classifier;
+
+    /** classifySpike reads the published classifier while the other one is rewritten */
+    std::unique_ptr<Classifier> classifiers[2];
+    std::atomic<int> publishedClassifier;
+
+    /** Classifier claimed by classifySpike, or -1 */
+    std::atomic<int> readingClassifier;
+
+    /** stateVersion when the published classifier was copied */
+    std::atomic<uint32> classifierVersion;
+
+    /** One state kept for takeSavedState */
+    struct SavedState
+    {
+        uint32 version;
+        String xml;
+    };
+
+    /** Published states not yet taken, oldest first; a recording that falls
+        further behind than maxSavedStates gets the current state instead */
+    std::deque<SavedState> savedStates;
+    bool keepStateHistory;
+
+    static const size_t maxSavedStates = 64;
+
 };
 
 
@@ -0,0 +1,638 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SorterStateFile.h"
+#include "Sorter.h"
+#include "BoxUnit.h"
+#include "PCAUnit.h"
+
+static const char* fileMagic = "OESSTATE";
+static const int fileHeaderSize = 16;
+static const int chunkHeaderSize = 16;
+
+/** Upper bound on any count read from a chunk, so damaged files cannot trigger huge allocations */
+static const int maxCount = 1 << 20;
+
+// ---------------------------------------------------------------------------
+// Payload encoding
+// ---------------------------------------------------------------------------
+
+static void writeString(MemoryOutputStream& out, const String& s)
+{
+    out.writeInt((int) s.getNumBytesAsUTF8());
+    out.write(s.toRawUTF8(), s.getNumBytesAsUTF8());
+}
+
+static void writeStats(MemoryOutputStream& out, int unitId, const WaveformStats& stats)
+{
+    const int numRows = (int) stats.WaveFormMean.size();
+    const int numCols = numRows > 0 ? (int) stats.WaveFormMean[0].size() : 0;
+
+    out.writeInt(unitId);
+    out.writeDouble(stats.numSamples);
+    out.writeDouble(stats.lastSpikeTime);
+    out.writeInt(numRows);
+    out.writeInt(numCols);
+
+    for (auto* matrix : { &stats.WaveFormMean, &stats.WaveFormSk, &stats.WaveFormMk })
+    {
+        for (int r = 0; r < numRows; r++)
+            for (int c = 0; c < numCols; c++)
+                out.writeDouble(r < (int) matrix->size() && c < (int) (*matrix)[r].size() ? (*matrix)[r][c] : 0.0);
+    }
+}
+
+/** Bounds-checked reader over a mapped chunk payload */
+class PayloadReader
+{
+public:
+
+    PayloadReader(const uint8* data_, size_t size_) : data(data_), size(size_), pos(0), ok(true) { }
+
+    bool isOk() const { return ok; }
+
+    /** Returns false (and latches the error) if fewer than n bytes remain */
+    bool require(size_t n)
+    {
+        if (!ok || size - pos < n)
+            ok = false;
+
+        return ok;
+    }
+
+    template <typename T>
+    T read()
+    {
+        T value = T();
+
+        if (require(sizeof(T)))
+        {
+            memcpy(&value, data + pos, sizeof(T));
+            pos += sizeof(T);
+        }
+
+        return value;
+    }
+
+    /** Reads a count and checks that count * bytesPerItem bytes follow */
+    int readCount(size_t bytesPerItem)
+    {
+        const int32 count = read<int32>();
+
+        if (count < 0 || count > maxCount || !require(size_t(count) * bytesPerItem))
+        {
+            ok = false;
+            return 0;
+        }
+
+        return count;
+    }
+
+    String readString()
+    {
+        const int length = readCount(1);
+
+        if (!ok)
+            return String();
+
+        String s = String::fromUTF8((const char*) data + pos, length);
+        pos += length;
+
+        return s;
+    }
+
+    void readFloats(float* dest, int count)
+    {
+        if (require(sizeof(float) * count))
+        {
+            memcpy(dest, data + pos, sizeof(float) * count);
+            pos += sizeof(float) * count;
+        }
+    }
+
+private:
+
+    const uint8* data;
+    size_t size;
+    size_t pos;
+    bool ok;
+};
+
+// ---------------------------------------------------------------------------
+// SorterStateWriter
+// ---------------------------------------------------------------------------
+
+SorterStateWriter::SorterStateWriter(const File& file, uint64 sessionToken, bool append)
+{
+    file.getParentDirectory().createDirectory();
+
+    // an existing file is only extended if it is a sidecar this version can read
+    if (append && file.existsAsFile())
+    {
+        SorterStateReader existing(file);
+        append = existing.isValid();
+    }
+
+    stream = std::make_unique<FileOutputStream>(file);
+
+    if (stream->failedToOpen())
+    {
+        LOGC("Spike Sorter: could not open state file ", file.getFullPathName());
+        stream.reset();
+        return;
+    }
+
+    if (!append)
+    {
+        // FileOutputStream appends to existing files
+        stream->setPosition(0);
+        stream->truncate();
+
+        stream->write(fileMagic, 8);
+        stream->writeInt((int) SorterStateFile::formatVersion);
+        stream->writeInt(0);
+    }
+
+    MemoryOutputStream session;
+    session.writeInt64((int64) sessionToken);
+
+    writeChunk("SESS", session);
+}
+
+void SorterStateWriter::writeChunk(const char* type, const MemoryOutputStream& payload)
+{
+    static const char padding[8] = { 0 };
+
+    const size_t size = payload.getDataSize();
+
+    stream->write(type, 4);
+    stream->writeInt(0);
+    stream->writeInt64((int64) size);
+    stream->write(payload.getData(), size);
+
+    if (size % 8 != 0)
+        stream->write(padding, 8 - size % 8);
+}
+
+void SorterStateWriter::writeElectrode(const String& key, Sorter* sorter)
+{
+    if (stream == nullptr)
+        return;
+
+    MemoryOutputStream electrode;
+    writeString(electrode, key);
+    writeChunk("ELEC", electrode);
+
+    // Basis
+    const int numChannels = sorter->getNumChannels();
+    const int waveformLength = sorter->getWaveformLength();
+    const int dimension = numChannels * waveformLength;
+
+    HeapBlock<float> pc1(dimension, true), pc2(dimension, true);
+    const bool basisValid = sorter->getBasis(pc1, pc2);
+
+    float pc1min, pc2min, pc1max, pc2max;
+    sorter->getPCArange(pc1min, pc2min, pc1max, pc2max);
+
+    MemoryOutputStream basis;
+    basis.writeInt(numChannels);
+    basis.writeInt(waveformLength);
+    basis.writeFloat(pc1min);
+    basis.writeFloat(pc2min);
+    basis.writeFloat(pc1max);
+    basis.writeFloat(pc2max);
+    basis.writeInt(basisValid ? 1 : 0);
+
+    if (basisValid)
+    {
+        basis.write(pc1, sizeof(float) * dimension);
+        basis.write(pc2, sizeof(float) * dimension);
+    }
+
+    writeChunk("BASE", basis);
+
+    // PCA mask (the basis is zero outside it)
+    MemoryOutputStream mask;
+    mask.writeInt((int) sorter->getProjectionMaskMode());
+    writeString(mask, sorter->getProjectionMask().toString());
+
+    writeChunk("MASK", mask);
+
+    // Units
+    std::vector<BoxUnit> boxUnits = sorter->getBoxUnits();
+    std::vector<PCAUnit> pcaUnits = sorter->getPCAUnits();
+
+    MemoryOutputStream units;
+    units.writeInt((int) boxUnits.size());
+
+    for (auto& unit : boxUnits)
+    {
+        units.writeInt(unit.unitId);
+        units.write(unit.colorRGB, 3);
+        units.writeByte(unit.isActive ? 1 : 0);
+        units.writeInt((int) unit.lstBoxes.size());
+
+        for (auto& box : unit.lstBoxes)
+        {
+            units.writeInt(box.channel);
+            units.writeDouble(box.x);
+            units.writeDouble(box.y);
+            units.writeDouble(box.w);
+            units.writeDouble(box.h);
+        }
+    }
+
+    units.writeInt((int) pcaUnits.size());
+
+    for (auto& unit : pcaUnits)
+    {
+        units.writeInt(unit.unitId);
+        units.write(unit.colorRGB, 3);
+        units.writeByte(unit.isActive ? 1 : 0);
+        units.writeFloat(unit.poly.offset.X);
+        units.writeFloat(unit.poly.offset.Y);
+        units.writeInt((int) unit.poly.pts.size());
+
+        for (auto& point : unit.poly.pts)
+        {
+            units.writeFloat(point.X);
+            units.writeFloat(point.Y);
+        }
+    }
+
+    writeChunk("UNIT", units);
+
+    // Unit statistics
+    MemoryOutputStream stats;
+    stats.writeInt((int) (boxUnits.size() + pcaUnits.size()));
+
+    for (auto& unit : boxUnits)
+        writeStats(stats, unit.unitId, unit.stats);
+
+    for (auto& unit : pcaUnits)
+        writeStats(stats, unit.unitId, unit.stats);
+
+    writeChunk("STAT", stats);
+
+    // Recent spikes
+    Array<SorterSpikePtr> spikes = sorter->getRecentSpikes();
+
+    MemoryOutputStream history;
+    history.writeInt(spikes.size());
+    history.writeInt(dimension);
+
+    for (auto spike : spikes)
+    {
+        const int numValues = spike->getChannel()->getNumChannels() * spike->getChannel()->getTotalSamples();
+
+        history.writeInt64(spike->getTimestamp());
+        history.writeShort((short) spike->sortedId);
+        history.write(spike->color, 3);
+        history.writeByte(0);
+        history.writeFloat(spike->pcProj[0]);
+        history.writeFloat(spike->pcProj[1]);
+
+        for (int i = 0; i < dimension; i++)
+            history.writeFloat(i < numValues ? spike->getData()[i] : 0.0f);
+    }
+
+    writeChunk("HIST", history);
+
+    stream->flush();
+}
+
+// ---------------------------------------------------------------------------
+// SorterStateReader
+// ---------------------------------------------------------------------------
+
+SorterStateReader::SorterStateReader(const File& file)
+    : valid(false),
+      sessionToken(0)
+{
+    if (!file.existsAsFile())
+        return;
+
+    map = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+
+    const uint8* data = (const uint8*) map->getData();
+    const size_t size = map->getSize();
+
+    if (data == nullptr || size < (size_t) fileHeaderSize || memcmp(data, fileMagic, 8) != 0)
+        return;
+
+    uint32 version;
+    memcpy(&version, data + 8, 4);
+
+    if (version != SorterStateFile::formatVersion)
+    {
+        LOGC("Spike Sorter: unsupported state file version ", (int) version);
+        return;
+    }
+
+    String currentElectrode;
+    bool haveElectrode = false;
+
+    size_t pos = fileHeaderSize;
+
+    // A truncated last chunk (e.g. a crash while appending) ends the scan
+    while (size - pos >= (size_t) chunkHeaderSize)
+    {
+        const String type = String::fromUTF8((const char*) data + pos, 4);
+
+        uint64 chunkSize;
+        memcpy(&chunkSize, data + pos + 8, 8);
+
+        const size_t payload = pos + chunkHeaderSize;
+
+        if (chunkSize > size - payload)
+            break;
+
+        Chunk chunk;
+        chunk.data = data + payload;
+        chunk.size = (size_t) chunkSize;
+
+        if (type == "SESS" && chunk.size >= 8)
+        {
+            memcpy(&sessionToken, chunk.data, 8);
+
+            // only the chunks of the last session are current
+            electrodes.clear();
+            haveElectrode = false;
+        }
+        else if (type == "ELEC")
+        {
+            PayloadReader reader(chunk.data, chunk.size);
+            currentElectrode = reader.readString();
+            haveElectrode = reader.isOk();
+
+            if (haveElectrode)
+                electrodes[currentElectrode].clear();
+        }
+        else if (haveElectrode)
+        {
+            electrodes[currentElectrode][type] = chunk;
+        }
+
+        pos = payload + (size_t) ((chunkSize + 7) & ~uint64(7));
+
+        if (pos > size)
+            break;
+    }
+
+    valid = true;
+}
+
+Array<SorterSpikePtr> SorterStateReader::restoreElectrode(const String& key, Sorter* sorter, const SpikeChannel* channel)
+{
+    Array<SorterSpikePtr> spikes;
+
+    auto electrode = electrodes.find(key);
+
+    if (electrode == electrodes.end())
+        return spikes;
+
+    std::map<String, Chunk>& chunks = electrode->second;
+
+    const int numChannels = sorter->getNumChannels();
+    const int waveformLength = sorter->getWaveformLength();
+    const int dimension = numChannels * waveformLength;
+
+    // Basis: only usable if the waveform shape has not changed
+    if (chunks.count("BASE"))
+    {
+        PayloadReader reader(chunks["BASE"].data, chunks["BASE"].size);
+
+        const int storedChannels = reader.read<int32>();
+        const int storedLength = reader.read<int32>();
+        const float pc1min = reader.read<float>();
+        const float pc2min = reader.read<float>();
+        const float pc1max = reader.read<float>();
+        const float pc2max = reader.read<float>();
+        const bool basisValid = reader.read<uint32>() != 0;
+
+        if (!reader.isOk() || storedChannels != numChannels || storedLength != waveformLength)
+        {
+            LOGC("Spike Sorter: state file basis does not match electrode ", key, "; ignoring it");
+        }
+        else
+        {
+            if (basisValid)
+            {
+                HeapBlock<float> pc1(dimension), pc2(dimension);
+                reader.readFloats(pc1, dimension);
+                reader.readFloats(pc2, dimension);
+
+                if (reader.isOk())
+                    sorter->setBasis(pc1, pc2);
+            }
+
+            sorter->setPCArange(pc1min, pc2min, pc1max, pc2max);
+        }
+    }
+
+    if (chunks.count("MASK"))
+    {
+        PayloadReader reader(chunks["MASK"].data, chunks["MASK"].size);
+
+        const int mode = reader.read<int32>();
+        const String description = reader.readString();
+
+        ProjectionMask mask(numChannels, waveformLength);
+
+        if (reader.isOk() && mode >= 0 && mode < NUM_MASK_MODES && mask.fromString(description))
+            sorter->setProjectionMask(mask, (ProjectionMaskMode) mode);
+        else
+            LOGC("Spike Sorter: state file PCA mask for ", key, " is unreadable; ignoring it");
+    }
+
+    // Units
+    std::vector<BoxUnit> boxUnits;
+    std::vector<PCAUnit> pcaUnits;
+
+    if (chunks.count("UNIT"))
+    {
+        PayloadReader reader(chunks["UNIT"].data, chunks["UNIT"].size);
+
+        const int numBoxUnits = reader.readCount(12);
+
+        for (int i = 0; i < numBoxUnits && reader.isOk(); i++)
+        {
+            BoxUnit unit(reader.read<int32>());
+            unit.lstBoxes.clear();
+
+            for (int c = 0; c < 3; c++)
+                unit.colorRGB[c] = reader.read<uint8>();
+
+            unit.isActive = reader.read<uint8>() != 0;
+
+            const int numBoxes = reader.readCount(36);
+
+            for (int b = 0; b < numBoxes; b++)
+            {
+                Box box(reader.read<int32>());
+                box.x = reader.read<double>();
+                box.y = reader.read<double>();
+                box.w = reader.read<double>();
+                box.h = reader.read<double>();
+
+                unit.lstBoxes.push_back(box);
+            }
+
+            boxUnits.push_back(unit);
+        }
+
+        const int numPCAUnits = reader.readCount(20);
+
+        for (int i = 0; i < numPCAUnits && reader.isOk(); i++)
+        {
+            PCAUnit unit(reader.read<int32>());
+
+            for (int c = 0; c < 3; c++)
+                unit.colorRGB[c] = reader.read<uint8>();
+
+            unit.isActive = reader.read<uint8>() != 0;
+            unit.poly.offset.X = reader.read<float>();
+            unit.poly.offset.Y = reader.read<float>();
+
+            const int numPoints = reader.readCount(8);
+
+            for (int p = 0; p < numPoints; p++)
+            {
+                PointD point;
+                point.X = reader.read<float>();
+                point.Y = reader.read<float>();
+
+                unit.poly.pts.push_back(point);
+            }
+
+            pcaUnits.push_back(unit);
+        }
+
+        if (!reader.isOk())
+        {
+            LOGC("Spike Sorter: damaged unit chunk in state file for electrode ", key);
+            boxUnits.clear();
+            pcaUnits.clear();
+        }
+    }
+
+    // Unit statistics, matched by ID
+    if (chunks.count("STAT"))
+    {
+        PayloadReader reader(chunks["STAT"].data, chunks["STAT"].size);
+
+        const int numStats = reader.readCount(28);
+
+        for (int i = 0; i < numStats && reader.isOk(); i++)
+        {
+            const int unitId = reader.read<int32>();
+
+            WaveformStats stats;
+            stats.numSamples = reader.read<double>();
+            stats.lastSpikeTime = reader.read<double>();
+
+            const int numRows = reader.read<int32>();
+            const int numCols = reader.read<int32>();
+
+            if (numRows < 0 || numCols < 0 || numRows > maxCount / jmax(1, numCols)
+                || !reader.require(size_t(3) * numRows * numCols * sizeof(double)))
+                break;
+
+            for (auto* matrix : { &stats.WaveFormMean, &stats.WaveFormSk, &stats.WaveFormMk })
+            {
+                matrix->assign(numRows, std::vector<double>(numCols));
+
+                for (int r = 0; r < numRows; r++)
+                    for (int c = 0; c < numCols; c++)
+                        (*matrix)[r][c] = reader.read<double>();
+            }
+
+            for (auto& unit : boxUnits)
+                if (unit.unitId == unitId)
+                    unit.stats = stats;
+
+            for (auto& unit : pcaUnits)
+                if (unit.unitId == unitId)
+                    unit.stats = stats;
+        }
+    }
+
+    for (auto& unit : boxUnits)
+        Sorter::reserveUnitId(unit.unitId);
+
+    for (auto& unit : pcaUnits)
+        Sorter::reserveUnitId(unit.unitId);
+
+    sorter->updateBoxUnits(boxUnits);
+    sorter->updatePCAUnits(pcaUnits);
+
+    // Recent spikes
+    if (chunks.count("HIST") && channel != nullptr)
+    {
+        PayloadReader reader(chunks["HIST"].data, chunks["HIST"].size);
+
+        const int numSpikes = reader.read<int32>();
+        const int storedDimension = reader.read<int32>();
+        const size_t spikeSize = 8 + 2 + 4 + 8 + sizeof(float) * size_t(jmax(0, storedDimension));
+
+        if (reader.isOk() && storedDimension == dimension
+            && channel->getNumChannels() * (int) channel->getTotalSamples() == dimension
+            && numSpikes >= 0 && numSpikes <= maxCount && reader.require(spikeSize * numSpikes))
+        {
+            HeapBlock<float> waveform(dimension);
+
+            for (int i = 0; i < numSpikes; i++)
+            {
+                const int64 timestamp = reader.read<int64>();
+                const uint16 sortedId = reader.read<uint16>();
+
+                uint8 color[3];
+
+                for (int c = 0; c < 3; c++)
+                    color[c] = reader.read<uint8>();
+
+                reader.read<uint8>();
+
+                const float pcProj0 = reader.read<float>();
+                const float pcProj1 = reader.read<float>();
+
+                reader.readFloats(waveform, dimension);
+
+                SorterSpikePtr spike = new SorterSpikeContainer(channel, sortedId, timestamp, waveform);
+                memcpy(spike->color, color, 3);
+                spike->pcProj[0] = pcProj0;
+                spike->pcProj[1] = pcProj1;
+                spike->basisVersion = sorter->getBasisVersion();
+
+                spikes.add(spike);
+            }
+
+            sorter->setRecentSpikes(spikes);
+        }
+    }
+
+    LOGD("Spike Sorter: restored electrode ", key, " (", (int) (boxUnits.size() + pcaUnits.size()),
+         " units, ", spikes.size(), " spikes)");
+
+    return spikes;
+}
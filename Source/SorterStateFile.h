@@ -0,0 +1,130 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __SORTERSTATEFILE_H__
+#define __SORTERSTATEFILE_H__
+
+#include <ProcessorHeaders.h>
+
+#include "Containers.h"
+
+#include <map>
+
+class Sorter;
+
+/**
+    Binary sidecar holding the complete state of a set of Sorters, so a
+    restart can resume with valid projections and populated displays
+    without recomputing anything.
+
+    The file is a 16-byte header ("OESSTATE", uint32 version, uint32 0)
+    followed by chunks, each with a 16-byte header (4-character type,
+    uint32 flags, uint64 payload size) and a payload padded to 8 bytes:
+
+        SESS  uint64 token matching the settings file that refers to it
+        ELEC  electrode key; the chunks that follow belong to it
+        BASE  PC basis and axis ranges
+        MASK  channels and samples used for PCA
+        UNIT  box and polygon unit geometry
+        STAT  WaveformStats of every unit
+        HIST  recent spikes (the PCA training buffer)
+
+    Chunks are only ever appended. When the same chunk appears more than
+    once for an electrode the last one wins, so a checkpoint can be added
+    to the end of an existing file; unknown chunk types are skipped.
+    Everything is little-endian and independent of the GUI.
+*/
+namespace SorterStateFile
+{
+    /** Current format version */
+    const uint32 formatVersion = 1;
+}
+
+/**
+    Writes (or appends to) a sorter state sidecar
+*/
+class SorterStateWriter
+{
+public:
+
+    /** Opens the file; with append = false any existing content is replaced */
+    SorterStateWriter(const File& file, uint64 sessionToken, bool append);
+
+    /** Returns true if the file could be opened */
+    bool openedOk() const { return stream != nullptr; }
+
+    /** Appends all chunks for one electrode */
+    void writeElectrode(const String& key, Sorter* sorter);
+
+private:
+
+    void writeChunk(const char* type, const MemoryOutputStream& payload);
+
+    std::unique_ptr<FileOutputStream> stream;
+
+    JUCE_DECLARE_NON_COPYABLE(SorterStateWriter);
+};
+
+/**
+    Reads a sorter state sidecar through a memory-mapped view
+*/
+class SorterStateReader
+{
+public:
+
+    /** Maps the file and indexes its chunks */
+    SorterStateReader(const File& file);
+
+    /** Returns true if the file was a readable sidecar */
+    bool isValid() const { return valid; }
+
+    /** Returns the token of the last session written to the file */
+    uint64 getSessionToken() const { return sessionToken; }
+
+    /** Returns true if the file holds state for an electrode */
+    bool hasElectrode(const String& key) const { return electrodes.count(key) > 0; }
+
+    /** Restores basis, units, stats and recent spikes into a Sorter;
+        returns the restored spikes (oldest first) so displays can be refilled */
+    Array<SorterSpikePtr> restoreElectrode(const String& key, Sorter* sorter, const SpikeChannel* channel);
+
+private:
+
+    struct Chunk
+    {
+        const uint8* data = nullptr;
+        size_t size = 0;
+    };
+
+    std::unique_ptr<MemoryMappedFile> map;
+
+    bool valid;
+    uint64 sessionToken;
+
+    /** Latest chunk of each type for each electrode */
+    std::map<String, std::map<String, Chunk>> electrodes;
+
+    JUCE_DECLARE_NON_COPYABLE(SorterStateReader);
+};
+
+#endif // __SORTERSTATEFILE_H__
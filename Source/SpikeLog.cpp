@@ -0,0 +1,257 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SpikeLog.h"
+
+static const char* logMagic = "OESPKLOG";
+
+// All supported platforms are little-endian, so values are copied as-is
+template <typename T>
+static uint8* put(uint8* dest, T value)
+{
+    memcpy(dest, &value, sizeof(T));
+    return dest + sizeof(T);
+}
+
+template <typename T>
+static bool get(InputStream& stream, T& value, uint32& remaining)
+{
+    if (remaining < sizeof(T) || stream.read(&value, sizeof(T)) != sizeof(T))
+        return false;
+
+    remaining -= sizeof(T);
+    return true;
+}
+
+static void writeString(OutputStream& stream, const String& s)
+{
+    const uint32 numBytes = (uint32) s.getNumBytesAsUTF8();
+    stream.write(&numBytes, sizeof(numBytes));
+    stream.write(s.toRawUTF8(), numBytes);
+}
+
+bool SpikeLog::writeHeader(OutputStream& stream)
+{
+    stream.write(logMagic, 8);
+    return stream.write(&formatVersion, sizeof(formatVersion));
+}
+
+bool SpikeLog::writeElectrode(OutputStream& stream, const ElectrodeInfo& info)
+{
+    MemoryOutputStream payload;
+
+    uint8 fixed[12];
+    uint8* p = fixed;
+    p = put<uint16>(p, (uint16) info.index);
+    p = put<uint16>(p, (uint16) info.numChannels);
+    p = put<uint16>(p, (uint16) info.prePeakSamples);
+    p = put<uint16>(p, (uint16) info.postPeakSamples);
+    p = put<float>(p, info.sampleRate);
+
+    payload.write(fixed, sizeof(fixed));
+    writeString(payload, info.name);
+    writeString(payload, info.identifier);
+
+    const uint8 type = ELECTRODE;
+    const uint32 size = (uint32) payload.getDataSize();
+
+    stream.write(&type, 1);
+    stream.write(&size, sizeof(size));
+    return stream.write(payload.getData(), payload.getDataSize());
+}
+
+int SpikeLog::writeSpikeHeader(uint8* dest,
+                               int electrode,
+                               int64 sampleNumber,
+                               uint16 sortedIdIn,
+                               uint16 sortedIdOut,
+                               int numValues)
+{
+    uint8* p = dest;
+
+    p = put<uint8>(p, SPIKE);
+    p = put<uint32>(p, (uint32) (spikeHeaderSize + numValues * sizeof(float)));
+    p = put<uint16>(p, (uint16) electrode);
+    p = put<int64>(p, sampleNumber);
+    p = put<uint16>(p, sortedIdIn);
+    p = put<uint16>(p, sortedIdOut);
+    p = put<uint32>(p, (uint32) numValues);
+
+    return (int) (p - dest);
+}
+
+void SpikeLog::writeState(MemoryBlock& dest, int electrode, int64 sampleNumber, const String& state)
+{
+    const uint32 numBytes = (uint32) state.getNumBytesAsUTF8();
+
+    dest.setSize(recordPrefixSize + 2 + 8 + 4 + numBytes);
+
+    uint8* p = (uint8*) dest.getData();
+    p = put<uint8>(p, STATE);
+    p = put<uint32>(p, 2 + 8 + 4 + numBytes);
+    p = put<uint16>(p, (uint16) electrode);
+    p = put<int64>(p, sampleNumber);
+    p = put<uint32>(p, numBytes);
+
+    memcpy(p, state.toRawUTF8(), numBytes);
+}
+
+SpikeLogReader::SpikeLogReader(InputStream* stream_)
+    : stream(stream_),
+      valid(false),
+      electrodeIndex(-1),
+      sampleNumber(0),
+      sortedIdIn(0),
+      sortedIdOut(0),
+      numValues(0),
+      waveformCapacity(0)
+{
+    char magic[8];
+    uint32 version = 0;
+
+    if (stream->read(magic, 8) != 8 || memcmp(magic, logMagic, 8) != 0)
+    {
+        lastError = "Not a spike log";
+        return;
+    }
+
+    if (stream->read(&version, sizeof(version)) != sizeof(version) || version > SpikeLog::formatVersion)
+    {
+        lastError = "Unsupported spike log version " + String(version);
+        return;
+    }
+
+    valid = true;
+}
+
+bool SpikeLogReader::readString(String& s, uint32& remaining)
+{
+    uint32 numBytes;
+
+    if (!get(*stream, numBytes, remaining) || numBytes > remaining)
+        return false;
+
+    MemoryBlock utf8(numBytes + 1, true);
+
+    if (stream->read(utf8.getData(), (int) numBytes) != (int) numBytes)
+        return false;
+
+    remaining -= numBytes;
+    s = String::fromUTF8((const char*) utf8.getData(), (int) numBytes);
+
+    return true;
+}
+
+SpikeLog::RecordType SpikeLogReader::readNext()
+{
+    if (!valid)
+        return SpikeLog::END_OF_LOG;
+
+    uint8 type;
+    uint32 remaining;
+
+    if (stream->read(&type, 1) != 1 || stream->read(&remaining, sizeof(remaining)) != sizeof(remaining))
+        return SpikeLog::END_OF_LOG;
+
+    const int64 next = stream->getPosition() + remaining;
+    bool ok = true;
+
+    switch (type)
+    {
+    case SpikeLog::ELECTRODE:
+    {
+        uint16 index, numChannels, pre, post;
+
+        ok = get(*stream, index, remaining)
+            && get(*stream, numChannels, remaining)
+            && get(*stream, pre, remaining)
+            && get(*stream, post, remaining)
+            && get(*stream, electrodeInfo.sampleRate, remaining)
+            && readString(electrodeInfo.name, remaining)
+            && readString(electrodeInfo.identifier, remaining);
+
+        electrodeInfo.index = index;
+        electrodeInfo.numChannels = numChannels;
+        electrodeInfo.prePeakSamples = pre;
+        electrodeInfo.postPeakSamples = post;
+        break;
+    }
+    case SpikeLog::SPIKE:
+    {
+        uint16 index;
+        uint32 count;
+
+        ok = get(*stream, index, remaining)
+            && get(*stream, sampleNumber, remaining)
+            && get(*stream, sortedIdIn, remaining)
+            && get(*stream, sortedIdOut, remaining)
+            && get(*stream, count, remaining)
+            && count * sizeof(float) <= remaining;
+
+        if (ok)
+        {
+            electrodeIndex = index;
+            numValues = (int) count;
+
+            if (numValues > waveformCapacity)
+            {
+                waveform.realloc(numValues);
+                waveformCapacity = numValues;
+            }
+
+            const int numBytes = numValues * (int) sizeof(float);
+            ok = stream->read(waveform.getData(), numBytes) == numBytes;
+        }
+        break;
+    }
+    case SpikeLog::STATE:
+    {
+        uint16 index;
+
+        ok = get(*stream, index, remaining)
+            && get(*stream, sampleNumber, remaining)
+            && readString(state, remaining);
+
+        electrodeIndex = index;
+        break;
+    }
+    default:
+        // unknown record types from newer writers are skipped
+        break;
+    }
+
+    if (!ok)
+    {
+        lastError = "Truncated record near byte " + String(stream->getPosition());
+        valid = false;
+        return SpikeLog::END_OF_LOG;
+    }
+
+    if (stream->getPosition() != next)
+        stream->setPosition(next);
+
+    if (type == SpikeLog::ELECTRODE || type == SpikeLog::SPIKE || type == SpikeLog::STATE)
+        return (SpikeLog::RecordType) type;
+
+    return readNext();
+}
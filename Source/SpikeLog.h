@@ -0,0 +1,189 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __SPIKELOG_H__
+#define __SPIKELOG_H__
+
+#include <ProcessorHeaders.h>
+
+/**
+    Binary log of the Spike Sorter's input, written by SpikeRecorder
+    and read back by the replay tool.
+
+    All values are little-endian. The file starts with an 8-byte magic
+    string and a uint32 format version, followed by a sequence of records:
+
+        uint8   record type
+        uint32  payload size in bytes
+        ...     payload
+
+    ELECTRODE  uint16 index, uint16 numChannels, uint16 prePeakSamples,
+               uint16 postPeakSamples, float sampleRate,
+               string name, string identifier
+
+    SPIKE      uint16 electrode index, int64 sample number,
+               uint16 incoming sorted ID, uint16 outgoing sorted ID,
+               uint32 number of values, float[] waveform
+
+    STATE      uint16 electrode index, int64 sample number,
+               string sorter state (ELECTRODE XML, including thresholds)
+
+    Strings are a uint32 byte count followed by UTF-8 data.
+
+    A STATE record always precedes the first SPIKE that was classified
+    with that state, so replaying the records in order reproduces the
+    live sorting decisions exactly.
+*/
+namespace SpikeLog
+{
+    /** Current format version */
+    const uint32 formatVersion = 1;
+
+    /** Size of the file header (magic + version) */
+    const int headerSize = 12;
+
+    /** Size of the per-record type + payload size prefix */
+    const int recordPrefixSize = 5;
+
+    /** Size of the fixed part of a SPIKE payload */
+    const int spikeHeaderSize = 2 + 8 + 2 + 2 + 4;
+
+    /** Record types */
+    enum RecordType
+    {
+        END_OF_LOG = 0,
+        ELECTRODE = 1,
+        SPIKE = 2,
+        STATE = 3
+    };
+
+    /** Describes one recorded electrode */
+    struct ElectrodeInfo
+    {
+        int index = 0;
+        String name;
+        String identifier;
+        int numChannels = 0;
+        int prePeakSamples = 0;
+        int postPeakSamples = 0;
+        float sampleRate = 0.0f;
+    };
+
+    /** Writes the file header */
+    bool writeHeader(OutputStream& stream);
+
+    /** Writes a complete ELECTRODE record */
+    bool writeElectrode(OutputStream& stream, const ElectrodeInfo& info);
+
+    /** Writes the fixed part of a SPIKE record (including its prefix) into dest,
+        returning the number of bytes used. The waveform follows directly after. */
+    int writeSpikeHeader(uint8* dest,
+                         int electrode,
+                         int64 sampleNumber,
+                         uint16 sortedIdIn,
+                         uint16 sortedIdOut,
+                         int numValues);
+
+    /** Serialises a complete STATE record into a memory block */
+    void writeState(MemoryBlock& dest, int electrode, int64 sampleNumber, const String& state);
+}
+
+/**
+    Reads a spike log record by record.
+
+    The waveform buffer is re-used between records, so reading a
+    long log does not allocate per spike.
+*/
+class SpikeLogReader
+{
+public:
+
+    /** Constructor (takes ownership of the stream) */
+    SpikeLogReader(InputStream* stream);
+
+    /** Destructor */
+    ~SpikeLogReader() { }
+
+    /** Returns true if the header was valid */
+    bool isValid() const { return valid; }
+
+    /** Returns a description of the last error */
+    String getLastError() const { return lastError; }
+
+    /** Advances to the next record and returns its type (END_OF_LOG at the end or on error) */
+    SpikeLog::RecordType readNext();
+
+    /** Returns the electrode described by the last ELECTRODE record */
+    const SpikeLog::ElectrodeInfo& getElectrodeInfo() const { return electrodeInfo; }
+
+    /** Returns the electrode index of the last SPIKE or STATE record */
+    int getElectrodeIndex() const { return electrodeIndex; }
+
+    /** Returns the sample number of the last SPIKE or STATE record */
+    int64 getSampleNumber() const { return sampleNumber; }
+
+    /** Returns the sorted ID the last spike arrived with */
+    uint16 getSortedIdIn() const { return sortedIdIn; }
+
+    /** Returns the sorted ID the live sorter assigned to the last spike */
+    uint16 getSortedIdOut() const { return sortedIdOut; }
+
+    /** Returns the waveform of the last SPIKE record */
+    const float* getWaveform() const { return waveform.getData(); }
+
+    /** Returns the number of values in the last waveform */
+    int getNumValues() const { return numValues; }
+
+    /** Returns the sorter state of the last STATE record */
+    const String& getState() const { return state; }
+
+    /** Returns the number of bytes read so far */
+    int64 getPosition() const { return stream->getPosition(); }
+
+    /** Returns the total size of the log */
+    int64 getTotalLength() const { return stream->getTotalLength(); }
+
+private:
+
+    bool readString(String& s, uint32& remaining);
+
+    std::unique_ptr<InputStream> stream;
+
+    bool valid;
+    String lastError;
+
+    SpikeLog::ElectrodeInfo electrodeInfo;
+
+    int electrodeIndex;
+    int64 sampleNumber;
+    uint16 sortedIdIn, sortedIdOut;
+
+    HeapBlock<float> waveform;
+    int numValues, waveformCapacity;
+
+    String state;
+
+    JUCE_DECLARE_NON_COPYABLE(SpikeLogReader);
+};
+
+#endif // __SPIKELOG_H__
@@ -27,59 +27,51 @@
 #include "PCAProjectionAxes.h"
 #include "WaveformAxes.h"
 
+/** Display refreshes run at ~10 Hz; enough for ~80,000 spikes/s per electrode */
+static const int displayQueueSize = 8192;
+
 SpikePlot::SpikePlot(
     SpikeSorter* sorter_,
     Electrode* electrode_) :
     sorter(sorter_),
     electrode(electrode_),
-    limitsChanged(true),
+    displayFifo(displayQueueSize),
+    displayQueue(displayQueueSize),
+    displayedBasisVersion(0),
+    numDroppedSpikes(0),
+    displayPaused(false),
+    paintMilliseconds(0),
     name(electrode_->name)
 
 {
 
     font = Font("Default", 15, Font::plain);
 
-    switch (electrode->numChannels)
-    {
-    case 1:
-        nWaveAx = 1;
-        nProjAx = 1;
-        minWidth = 600;
-        aspectRatio = 0.5f;
-        break;
-    case 2:
-        nWaveAx = 2;
-        nProjAx = 1;
-        minWidth = 300;
-        aspectRatio = 0.5f;
-        break;
-    case 4:
-        nWaveAx = 4;
-        nProjAx = 1;
-        minWidth = 400;
-        aspectRatio = 0.5f;
-        break;
-    default: // unsupported number of axes provided
-        LOGD("SpikePlot as UNKNOWN, defaulting to SINGLE_PLOT");
-        nWaveAx = 1;
-        nProjAx = 0;
-    }
+    // one waveform axis per channel, laid out in a near-square grid;
+    // 1, 2 and 4 channels keep their single-row and 2 x 2 layouts
+    nWaveAx = electrode->numChannels;
+    nProjAx = 1;
 
-    std::vector<float> scales = { 250, 250, 250, 250 }; // processor->getElectrodeVoltageScales(electrodeID);
-    initAxes(scales);
+    nWaveCols = nWaveAx <= 2 ? jmax(1, nWaveAx) : (int) std::ceil(std::sqrt((double) nWaveAx));
+    nWaveRows = (nWaveAx + nWaveCols - 1) / nWaveCols;
+
+    minWidth = nWaveAx == 1 ? 600 : (nWaveAx == 2 ? 300 : 400);
+    aspectRatio = 0.5f;
+
+    // display settings live on the Electrode, so they exist before the plot does
+    initAxes();
 
     for (int i = 0; i < electrode->numChannels; i++)
     {
-        UtilityButton* rangeButton = new UtilityButton(String(scales[i], 0), Font("Small Text", 10, Font::plain));
+        UtilityButton* rangeButton = new UtilityButton(String(electrode->displayRanges[i], 0), Font("Small Text", 10, Font::plain));
         rangeButton->setRadius(3.0f);
         rangeButton->addListener(this);
         addAndMakeVisible(rangeButton);
-        
-        thresholds.add(0);
+
         rangeButtons.add(rangeButton);
 
-        sorter->cache->setThreshold(electrode->getKey(), i, 0.0);
-        sorter->cache->setRange(electrode->getKey(), i, double(scales[i]));
+        if (i < nWaveAx)
+            wAxes[i]->setDetectorThreshold(electrode->displayThresholds[i]);
     }
 
 }
@@ -90,58 +82,29 @@ SpikePlot::~SpikePlot()
     wAxes.clear();
 }
 
-void SpikePlot::saveCustomParametersToXml(XmlElement* xml)
+void SpikePlot::setSelectedUnitAndBox(int unitID, int boxID)
 {
-    XmlElement* mainNode = xml->createNewChildElement("PLOT");
-
-    mainNode->setAttribute("stream_source", electrode->streamSourceId); // Continuous source node ID
-    mainNode->setAttribute("stream_name", electrode->streamName);
-    mainNode->setAttribute("spike_source", electrode->sourceNodeId); // Spike node ID
-    mainNode->setAttribute("name", electrode->name);
+    const ScopedLock myScopedLock(mut);
+    electrode->sorter->setSelectedUnitAndBox(unitID, boxID);
 
-    for (int i = 0; i < electrode->numChannels; i++)
-    {
-        XmlElement* rangeNode = mainNode->createNewChildElement("AXIS");
-        rangeNode->setAttribute("thresh", thresholds[i]);
-        rangeNode->setAttribute("range", ranges[i]);
-    }
+    // selected units are drawn thicker
+    pAxes[0]->invalidate();
 
+    for (int i = 0; i < nWaveAx; i++)
+        wAxes[i]->invalidate();
 }
 
-void SpikePlot::loadCustomParametersFromXml(XmlElement* xml)
+double SpikePlot::takePaintTime()
 {
+    const double milliseconds = paintMilliseconds;
+    paintMilliseconds = 0;
 
-    forEachXmlChildElement(*xml, mainNode)
-    {
-        if (mainNode->hasTagName("PLOT"))
-        {
-
-            std::string stream_source = mainNode->getStringAttribute("stream_source").toStdString();
-            std::string stream_name = mainNode->getStringAttribute("stream_name").toStdString();
-            std::string source = mainNode->getStringAttribute("spike_source").toStdString();
-            std::string electrode_name = mainNode->getStringAttribute("name").toStdString();
-
-            std::string key = stream_source + "|" + stream_name + "|" + source + "|" + electrode_name;
-
-            int i = 0;
-            forEachXmlChildElement(*mainNode, axisNode)
-            {
-                if (axisNode->hasTagName("AXIS"))
-                {
-                    sorter->cache->setThreshold(key, i, axisNode->getIntAttribute("thresh"));
-                    sorter->cache->setRange(key, i, axisNode->getIntAttribute("range"));
-                    i++;
-                }
-            }
-        }
-    }
-
+    return milliseconds;
 }
 
-void SpikePlot::setSelectedUnitAndBox(int unitID, int boxID)
+void SpikePlot::setPointBudget(int numPoints)
 {
-    const ScopedLock myScopedLock(mut);
-    electrode->sorter->setSelectedUnitAndBox(unitID, boxID);
+    pAxes[0]->setPointBudget(numPoints);
 }
 
 void SpikePlot::getSelectedUnitAndBox(int& unitID, int& boxID)
@@ -173,7 +136,10 @@ void SpikePlot::paint(Graphics& g)
 
 void SpikePlot::refresh()
 {
-    pAxes[0]->repaint();
+    drainDisplayQueue();
+
+    // axes without changes are skipped
+    pAxes[0]->refresh();
     
     for (int i = 0; i < nWaveAx; i++)
     {
@@ -216,33 +182,127 @@ void SpikePlot::setPCARange(float p1min, float p2min, float p1max, float p2max)
 }
 
 void SpikePlot::processSpikeObject(SorterSpikePtr s)
+{
+    if (displayPaused)
+        return;
+
+    int start1, size1, start2, size2;
+    displayFifo.prepareToWrite(1, start1, size1, start2, size2);
+
+    if (size1 + size2 == 0)
+    {
+        numDroppedSpikes++;
+        return;
+    }
+
+    // slots are emptied by the reader, so no spike is ever released here
+    displayQueue[size1 > 0 ? start1 : start2] = s;
+
+    displayFifo.finishedWrite(1);
+}
+
+void SpikePlot::drainDisplayQueue()
 {
     const ScopedLock myScopedLock(mut);
 
-    if (nWaveAx > 0)
+    if (electrode->sorter->getBasisVersion() != displayedBasisVersion)
     {
-        for (int i = 0; i < nWaveAx; i++)
+        displayedBasisVersion = electrode->sorter->getBasisVersion();
+
+        float p1min, p2min, p1max, p2max;
+        electrode->sorter->getPCArange(p1min, p2min, p1max, p2max);
+        pAxes[0]->setPCARange(p1min, p2min, p1max, p2max);
+    }
+
+    int start1, size1, start2, size2;
+    displayFifo.prepareToRead(displayFifo.getNumReady(), start1, size1, start2, size2);
+
+    for (int block = 0; block < 2; block++)
+    {
+        const int start = block == 0 ? start1 : start2;
+        const int size = block == 0 ? size1 : size2;
+
+        for (int i = start; i < start + size; i++)
         {
-            wAxes[i]->updateSpikeData(s);
+            SorterSpikePtr spike = displayQueue[i];
+            displayQueue[i] = nullptr;
+
+            if (nWaveAx > 0)
+            {
+                for (int n = 0; n < nWaveAx; n++)
+                    wAxes[n]->updateSpikeData(spike);
+
+                pAxes[0]->updateSpikeData(spike);
+            }
         }
+    }
+
+    displayFifo.finishedRead(size1 + size2);
+}
+
+void SpikePlot::discardDisplayQueue()
+{
+    int start1, size1, start2, size2;
+    displayFifo.prepareToRead(displayFifo.getNumReady(), start1, size1, start2, size2);
+
+    for (int i = start1; i < start1 + size1; i++)
+        displayQueue[i] = nullptr;
+
+    for (int i = start2; i < start2 + size2; i++)
+        displayQueue[i] = nullptr;
+
+    displayFifo.finishedRead(size1 + size2);
+}
+
+void SpikePlot::setMemoryLevel(int level, bool visible)
+{
+    const ScopedLock myScopedLock(mut);
+
+    pAxes[0]->setHistoryDepth(PCAProjectionAxes::maxHistoryDepth >> level);
+
+    const bool pause = !visible && level > 0;
+
+    if (pause == displayPaused)
+        return;
+
+    // the audio thread stops queueing before the queue is emptied
+    displayPaused = pause;
+
+    if (pause)
+    {
+        discardDisplayQueue();
 
-        pAxes[0]->updateSpikeData(s);
+        for (int i = 0; i < nWaveAx; i++)
+            wAxes[i]->releaseMemory();
 
+        pAxes[0]->releaseImage();
     }
 }
 
-void SpikePlot::initAxes(std::vector<float> scales)
+void SpikePlot::addMemoryUsage(MemoryUsage& usage) const
+{
+    const int64 spikeBytes = int64(sizeof(SorterSpikeContainer))
+        + int64(sizeof(float)) * electrode->numChannels * electrode->numSamples;
+
+    usage.add(MemoryUsage::DISPLAY_QUEUE,
+              int64(displayQueue.capacity()) * (int64) sizeof(SorterSpikePtr)
+              + int64(displayFifo.getNumReady()) * spikeBytes);
+
+    for (int i = 0; i < nWaveAx; i++)
+        wAxes[i]->addMemoryUsage(usage);
+
+    pAxes[0]->addMemoryUsage(usage);
+}
+
+void SpikePlot::initAxes()
 {
     const ScopedLock myScopedLock(mut);
-    
-    initLimits();
 
     for (int i = 0; i < nWaveAx; i++)
     {
         WaveformAxes* wAx = new WaveformAxes(this, electrode, i);
         wAxes.add(wAx);
         addAndMakeVisible(wAx);
-        ranges.add(scales[i]);
     }
 
     PCAProjectionAxes* pAx = new PCAProjectionAxes(electrode);
@@ -263,36 +323,8 @@ void SpikePlot::resized()
     float width = (float)getWidth() - 10;
     float height = (float)getHeight() - 50;
 
-    float axesWidth = 0;
-    float axesHeight = 0;
-
-    // to compute the axes positions we need to know how many columns of proj and wave axes should exist
-    // using these two values we can calculate the positions of all of the sub axes
-    int nProjCols = 0;
-    int nWaveCols = 0;
-
-    switch (electrode->numChannels)
-    {
-    case 1:
-        nProjCols = 1;
-        nWaveCols = 1;
-        axesWidth = width / 2;
-        axesHeight = height;
-        break;
-
-    case 2:
-        nProjCols = 1;
-        nWaveCols = 2;
-        axesWidth = width / 2;
-        axesHeight = height;
-        break;
-    case 4:
-        nProjCols = 1;
-        nWaveCols = 2;
-        axesWidth = width / 2;
-        axesHeight = height / 2;
-        break;
-    }
+    const float axesWidth = width / 2;
+    const float axesHeight = height / nWaveRows;
 
     for (int i = 0; i < nWaveAx; i++)
     {
@@ -326,7 +358,7 @@ void SpikePlot::modifyRange(std::vector<float> values)
             }
         }
 
-        ranges.set(index, range_array[newIndex]);
+        electrode->displayRanges.set(index, range_array[newIndex]);
         String label = String(range_array[newIndex], 0);
         rangeButtons[index]->setLabel(label);
 
@@ -345,7 +377,7 @@ void SpikePlot::modifyRange(int index, bool up)
     
     for (int k = 0; k < NUM_RANGE; k++)
     {
-        if (std::abs(ranges[index] - range_array[k]) < 0.1)
+        if (std::abs(electrode->displayRanges[index] - range_array[k]) < 0.1)
         {
             int newIndex;
             if (up)
@@ -356,7 +388,7 @@ void SpikePlot::modifyRange(int index, bool up)
                 if (newIndex < 0)
                     newIndex = NUM_RANGE - 1;
             }
-            ranges.set(index, range_array[newIndex]);
+            electrode->displayRanges.set(index, range_array[newIndex]);
             String label = String(range_array[newIndex], 0);
             rangeButtons[index]->setLabel(label);
             setLimitsOnAxes();
@@ -388,46 +420,27 @@ void SpikePlot::setLimitsOnAxes()
     const ScopedLock myScopedLock(mut);
 
     for (int i = 0; i < nWaveAx; i++)
-        wAxes[i]->setRange(ranges[i]);
+        wAxes[i]->setRange(electrode->displayRanges[i]);
 }
 
-void SpikePlot::initLimits()
+int SpikePlot::getPreferredHeight() const
 {
-    
-    for (int i = 0; i < electrode->numChannels; i++)
-    {
-        limits[i][0] = 1209;
-        limits[i][1] = 11059;
-    }
-
+    // electrodes with many channels grow taller (and scroll) instead of
+    // shrinking each waveform below a readable size
+    return jmax(430, 50 + nWaveRows * minWaveformHeight);
 }
 
 void SpikePlot::getBestDimensions(int* w, int* h)
 {
-    switch (electrode->numChannels)
-    {
-    case 4:
-        *w = 4;
-        *h = 2;
-        break;
-    case 2:
-        *w = 2;
-        *h = 1;
-        break;
-    case 1:
-        *w = 1;
-        *h = 1;
-        break;
-    default:
-        *w = 1;
-        *h = 1;
-        break;
-    }
+    *w = nWaveAx <= 2 ? nWaveAx : 2 * nWaveCols;
+    *h = nWaveRows;
 }
 
 void SpikePlot::clear()
 {
 
+    drainDisplayQueue();
+
     const ScopedLock myScopedLock(mut);
 
     for (int i = 0; i < nWaveAx; i++)
@@ -439,24 +452,24 @@ void SpikePlot::clear()
 
 void SpikePlot::setDisplayThresholdForChannel(int i, float f)
 {
-    thresholds.set(i, f);
+    electrode->displayThresholds.set(i, f);
     wAxes[i]->setDetectorThreshold(f);
     sorter->cache->setThreshold(electrode->getKey(), i, f);
 }
 
 float SpikePlot::getDisplayThresholdForChannel(int i)
 {
-    return thresholds[i];
+    return electrode->displayThresholds[i];
 }
 
 Array<float> SpikePlot::getDisplayThresholds()
 {
-    return thresholds;
+    return electrode->displayThresholds;
 }
 
 float SpikePlot::getDisplayRangeForChannel(int i)
 {
-    return ranges[i];
+    return electrode->displayRanges[i];
 }
 
 void SpikePlot::setDisplayRangeForChannel(int i, float f)
@@ -30,8 +30,10 @@
 #include "Containers.h"
 #include "BoxUnit.h"
 #include "PCAUnit.h"
+#include "MemoryBudget.h"
 
 #include <vector>
+#include <atomic>
 
 class SpikeSorter;
 class SpikeSorterCanvas;
@@ -39,8 +41,6 @@ class Electrode;
 class PCAProjectionAxes;
 class WaveformAxes;
 
-#define MAX_N_CHAN 4
-
 class SpikePlot : public Component, 
                   public Button::Listener
 {
@@ -79,9 +79,32 @@ public:
     /** Sets axes limits*/
     void modifyRange(std::vector<float> values);
     
-    /** Handle an incoming spike object*/
+    /** Queues a spike for display. Wait-free and safe on the audio thread;
+        the spike is dropped (and counted) if the queue is full */
 	void processSpikeObject(SorterSpikePtr s);
 
+    /** Returns the number of spikes dropped because the display queue was full */
+    int64 getNumDroppedSpikes() const { return numDroppedSpikes; }
+
+    /** Adds the time an axis spent painting (message thread) */
+    void addPaintTime(double milliseconds) { paintMilliseconds += milliseconds; }
+
+    /** Returns the paint time added since the last call (ms) */
+    double takePaintTime();
+
+    /** Sets the most PC points drawn per frame */
+    void setPointBudget(int numPoints);
+
+    /** Applies a memory budget level (0 = full): each level halves the PC history,
+        and a hidden plot above level 0 stops queueing spikes and frees its images */
+    void setMemoryLevel(int level, bool visible);
+
+    /** Returns true if spikes are currently dropped instead of queued */
+    bool isDisplayPaused() const { return displayPaused; }
+
+    /** Adds the bytes held by the display queue and all axes (message thread) */
+    void addMemoryUsage(MemoryUsage& usage) const;
+
     /** Gets the ID of the currently selected unit and box */
     void getSelectedUnitAndBox(int& unitID, int& boxID);
 
@@ -89,11 +112,14 @@ public:
     void setSelectedUnitAndBox(int unitID, int boxID);
 
     /** Initializes the waveform and PC axes */
-    void initAxes(std::vector<float> scales);
+    void initAxes();
 
     /** Gets the desired aspect ratio for the plot */
     void getBestDimensions(int*, int*);
 
+    /** Returns the height needed to show every waveform axis */
+    int getPreferredHeight() const;
+
     /** Clears the waveform and PCA axes*/
     void clear();
 
@@ -115,12 +141,6 @@ public:
     /** Sets the display range level for the input channel */
     void setDisplayRangeForChannel(int channelNum, float range);
 
-    /** Saves plotting parameters for one electrode */
-    void saveCustomParametersToXml(XmlElement* electrodeNode);
-
-    /** Loads plotting parameters for one electrode*/
-    void loadCustomParametersFromXml(XmlElement* electrodeNode);
-
     SpikeSorter* sorter; 
     Electrode* electrode;
 
@@ -129,15 +149,23 @@ public:
 
 private:
 
-    void initLimits();
     void setLimitsOnAxes();
 
+    /** Moves queued spikes into the axes (message thread) */
+    void drainDisplayQueue();
+
+    /** Releases queued spikes without displaying them (message thread) */
+    void discardDisplayQueue();
+
     int nWaveAx;
     int nProjAx;
 
-    bool limitsChanged;
+    /** Grid of waveform axes */
+    int nWaveCols;
+    int nWaveRows;
 
-    double limits[MAX_N_CHAN][2];
+    /** Smallest height of a row of waveform axes (pixels) */
+    static const int minWaveformHeight = 90;
 
     std::vector<BoxUnit> boxUnits;
     std::vector<PCAUnit> pcaUnits;
@@ -146,8 +174,19 @@ private:
     OwnedArray<WaveformAxes> wAxes;
     OwnedArray<UtilityButton> rangeButtons;
     
-    Array<float> ranges;
-    Array<float> thresholds;
+    /** Single-producer (audio thread), single-consumer (message thread) spike queue */
+    AbstractFifo displayFifo;
+    std::vector<SorterSpikePtr> displayQueue;
+
+    /** Basis whose PC range the axes show; a new basis brings a new range (message thread) */
+    uint32 displayedBasisVersion;
+    std::atomic<int64> numDroppedSpikes;
+
+    /** Set while the plot is hidden and over its memory budget */
+    std::atomic<bool> displayPaused;
+
+    /** Paint time accumulated since the last takePaintTime() */
+    double paintMilliseconds;
 
     String name;
     CriticalSection mut;
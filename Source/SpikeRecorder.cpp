@@ -0,0 +1,324 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SpikeRecorder.h"
+#include "Sorter.h"
+
+/** 8 MB holds several seconds of spikes at high rates */
+static const int fifoSize = 8 * 1024 * 1024;
+
+SpikeRecorder::SpikeRecorder()
+    : Thread("Spike Recorder"),
+      fifo(fifoSize),
+      recording(false),
+      numDropped(0)
+{
+    buffer.malloc(fifoSize);
+}
+
+SpikeRecorder::~SpikeRecorder()
+{
+    stop();
+}
+
+int64 SpikeRecorder::getMemoryUsage() const
+{
+    return fifoSize;
+}
+
+bool SpikeRecorder::start(const File& file_, const Array<SpikeLog::ElectrodeInfo>& electrodes)
+{
+    stop();
+
+    file = file_;
+    file.getParentDirectory().createDirectory();
+
+    output = std::make_unique<FileOutputStream>(file);
+
+    if (output->failedToOpen())
+    {
+        LOGC("Spike Recorder: could not open ", file.getFullPathName());
+        output.reset();
+        return false;
+    }
+
+    // FileOutputStream appends to existing files
+    output->setPosition(0);
+    output->truncate();
+
+    SpikeLog::writeHeader(*output);
+
+    recordedStates.clear();
+
+    for (auto& electrode : electrodes)
+    {
+        SpikeLog::writeElectrode(*output, electrode);
+
+        if (electrode.index >= (int) recordedStates.size())
+            recordedStates.resize(electrode.index + 1);
+
+        // sized here, so recordSpike can compare and copy thresholds without allocating
+        recordedStates[electrode.index].thresholds.resize(electrode.numChannels);
+    }
+
+    fifo.reset();
+    numDropped = 0;
+
+    startThread();
+
+    recording = true;
+
+    LOGC("Spike Recorder: writing ", file.getFullPathName());
+
+    return true;
+}
+
+void SpikeRecorder::stop()
+{
+    if (output == nullptr)
+        return;
+
+    recording = false;
+
+    stopThread(1000);
+
+    drain();
+    output->flush();
+    output.reset();
+
+    if (numDropped > 0)
+        LOGC("Spike Recorder: dropped ", numDropped.load(), " records (disk too slow)");
+}
+
+bool SpikeRecorder::push(const void* first, int firstSize, const void* second, int secondSize)
+{
+    const int total = firstSize + secondSize;
+
+    if (fifo.getFreeSpace() < total)
+    {
+        numDropped++;
+        return false;
+    }
+
+    int start1, size1, start2, size2;
+    fifo.prepareToWrite(total, start1, size1, start2, size2);
+
+    // Copy the two source pieces into the (possibly wrapped) FIFO region
+    const uint8* sources[2] = { (const uint8*) first, (const uint8*) second };
+    const int sizes[2] = { firstSize, secondSize };
+
+    int written = 0;
+
+    for (int s = 0; s < 2; s++)
+    {
+        int done = 0;
+
+        while (done < sizes[s])
+        {
+            const bool inFirst = written < size1;
+            const int dest = inFirst ? start1 + written : start2 + (written - size1);
+            const int space = inFirst ? size1 - written : size2 - (written - size1);
+            const int n = jmin(space, sizes[s] - done);
+
+            memcpy(buffer + dest, sources[s] + done, n);
+
+            done += n;
+            written += n;
+        }
+    }
+
+    fifo.finishedWrite(total);
+
+    return true;
+}
+
+void SpikeRecorder::recordSpike(int electrode,
+                                Sorter* sorter,
+                                const Array<float>& thresholds,
+                                SortingMode sortingMode,
+                                SorterSpikePtr spike,
+                                uint16 incomingSortedId)
+{
+    if (!recording || electrode >= (int) recordedStates.size())
+        return;
+
+    const RecordedState& recorded = recordedStates[electrode];
+
+    // an unsorted spike does not depend on the sorter state
+    uint32 version = spike->stateVersion;
+
+    if (version == 0)
+        version = recorded.written ? recorded.version : sorter->getPublishedVersion();
+
+    // the state the spike was sorted with must be replayed before it
+    recordStateIfChanged(electrode, sorter, version, thresholds, sortingMode, spike->getTimestamp());
+
+    const int numValues = spike->getChannel()->getNumChannels() * spike->getChannel()->getTotalSamples();
+
+    uint8 header[SpikeLog::recordPrefixSize + SpikeLog::spikeHeaderSize];
+
+    const int headerSize = SpikeLog::writeSpikeHeader(header,
+                                                      electrode,
+                                                      spike->getTimestamp(),
+                                                      incomingSortedId,
+                                                      spike->sortedId,
+                                                      numValues);
+
+    push(header, headerSize, spike->getData(), numValues * (int) sizeof(float));
+}
+
+void SpikeRecorder::recordState(int electrode,
+                                Sorter* sorter,
+                                uint32 version,
+                                const Array<float>& thresholds,
+                                SortingMode sortingMode,
+                                int64 sampleNumber)
+{
+    if (!recording || electrode >= (int) recordedStates.size())
+        return;
+
+    recordStateIfChanged(electrode, sorter, version, thresholds, sortingMode, sampleNumber);
+}
+
+void SpikeRecorder::recordStateIfChanged(int electrode,
+                                         Sorter* sorter,
+                                         uint32 version,
+                                         const Array<float>& thresholds,
+                                         SortingMode sortingMode,
+                                         int64 timestamp)
+{
+    RecordedState& recorded = recordedStates[electrode];
+
+    const bool thresholdsChanged = thresholds.size() != (int) recorded.thresholds.size()
+                                   || !std::equal(recorded.thresholds.begin(), recorded.thresholds.end(), thresholds.begin());
+
+    if (recorded.written && version == recorded.version && !thresholdsChanged
+        && sortingMode == recorded.sortingMode)
+        return;
+
+    uint8 marker[SpikeLog::recordPrefixSize + sizeof(StateMarker)];
+
+    StateMarker fixed;
+    fixed.sorter = sorter;
+    fixed.timestamp = timestamp;
+    fixed.version = version;
+    fixed.electrode = electrode;
+    fixed.sortingMode = (int) sortingMode;
+    fixed.numThresholds = thresholds.size();
+
+    const uint32 payloadSize = uint32(sizeof(StateMarker) + thresholds.size() * sizeof(float));
+
+    marker[0] = stateMarkerType;
+    memcpy(marker + 1, &payloadSize, sizeof(payloadSize));
+    memcpy(marker + SpikeLog::recordPrefixSize, &fixed, sizeof(fixed));
+
+    // if the marker was dropped, it is retried with the next record
+    if (push(marker, (int) sizeof(marker), thresholds.begin(), thresholds.size() * (int) sizeof(float)))
+    {
+        recorded.written = true;
+        recorded.version = version;
+        recorded.thresholds.assign(thresholds.begin(), thresholds.end());
+        recorded.sortingMode = sortingMode;
+    }
+}
+
+void SpikeRecorder::peek(void* dest, int numBytes)
+{
+    int start1, size1, start2, size2;
+    fifo.prepareToRead(numBytes, start1, size1, start2, size2);
+
+    memcpy(dest, buffer + start1, size1);
+
+    if (size2 > 0)
+        memcpy((uint8*) dest + size1, buffer + start2, size2);
+}
+
+void SpikeRecorder::drain()
+{
+    // records are pushed whole, so the FIFO only ever holds complete records
+    while (fifo.getNumReady() >= SpikeLog::recordPrefixSize)
+    {
+        uint8 prefix[SpikeLog::recordPrefixSize];
+        peek(prefix, SpikeLog::recordPrefixSize);
+
+        uint32 payloadSize;
+        memcpy(&payloadSize, prefix + 1, sizeof(payloadSize));
+
+        const int recordSize = SpikeLog::recordPrefixSize + (int) payloadSize;
+
+        if (prefix[0] == stateMarkerType)
+        {
+            markerBuffer.ensureSize(recordSize);
+            peek(markerBuffer.getData(), recordSize);
+
+            writeMarkedState((const uint8*) markerBuffer.getData() + SpikeLog::recordPrefixSize);
+        }
+        else
+        {
+            int start1, size1, start2, size2;
+            fifo.prepareToRead(recordSize, start1, size1, start2, size2);
+
+            output->write(buffer + start1, size1);
+
+            if (size2 > 0)
+                output->write(buffer + start2, size2);
+        }
+
+        fifo.finishedRead(recordSize);
+    }
+}
+
+void SpikeRecorder::writeMarkedState(const uint8* payload)
+{
+    StateMarker marker;
+    memcpy(&marker, payload, sizeof(marker));
+
+    const uint8* thresholds = payload + sizeof(marker);
+
+    // serialised when it was published, not now
+    std::unique_ptr<XmlElement> state = marker.sorter->takeSavedState(marker.version);
+    state->setAttribute("sorting_mode", marker.sortingMode);
+
+    for (int i = 0; i < marker.numThresholds; i++)
+    {
+        float threshold;
+        memcpy(&threshold, thresholds + i * sizeof(float), sizeof(float));
+
+        XmlElement* thresholdNode = state->createNewChildElement("THRESHOLD");
+        thresholdNode->setAttribute("channel", i);
+        thresholdNode->setAttribute("value", threshold);
+    }
+
+    SpikeLog::writeState(stateBuffer, marker.electrode, marker.timestamp, state->toString());
+
+    output->write(stateBuffer.getData(), stateBuffer.getSize());
+}
+
+void SpikeRecorder::run()
+{
+    while (!threadShouldExit())
+    {
+        drain();
+        wait(20);
+    }
+}
@@ -0,0 +1,167 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __SPIKERECORDER_H__
+#define __SPIKERECORDER_H__
+
+#include <ProcessorHeaders.h>
+
+#include "SpikeLog.h"
+#include "Containers.h"
+#include "Sorter.h"
+
+#include <atomic>
+
+/**
+    Records everything handleSpike sees (spikes, sorting outcomes and
+    sorter state changes) to a SpikeLog file.
+
+    Records are copied into a lock-free FIFO on the calling thread and
+    written to disk by a background thread, so the cost on the processing
+    thread is a memcpy per spike. When the sorter state changes, only a
+    small marker naming the state version is queued. The state itself is
+    serialised by the sorter when it is published (Sorter::setStateHistory)
+    and taken from there by the writer thread, so an edit made after the
+    marker is never logged early. If the disk falls behind and the FIFO
+    fills, records are dropped and counted rather than blocking.
+
+    recordSpike and recordState must be called from one thread. start() and
+    stop() must not be called while they can be, i.e. only while
+    acquisition is stopped.
+*/
+class SpikeRecorder : public Thread
+{
+public:
+
+    /** Constructor */
+    SpikeRecorder();
+
+    /** Destructor */
+    ~SpikeRecorder();
+
+    /** Opens a new log, writes the electrode table and starts the writer thread */
+    bool start(const File& file, const Array<SpikeLog::ElectrodeInfo>& electrodes);
+
+    /** Stops the writer thread after flushing all pending records */
+    void stop();
+
+    /** Returns true while a log is open */
+    bool isRecording() const { return recording; }
+
+    /** Returns the bytes held by the FIFO (allocated whether or not recording) */
+    int64 getMemoryUsage() const;
+
+    /** Queues a sorted spike. If the state it was sorted with, the thresholds or the sorting
+        mode changed since the last record on this electrode, a STATE record is queued first.
+        Does not lock or allocate; the sorter must outlive the next stop(). */
+    void recordSpike(int electrode,
+                     Sorter* sorter,
+                     const Array<float>& thresholds,
+                     SortingMode sortingMode,
+                     SorterSpikePtr spike,
+                     uint16 incomingSortedId);
+
+    /** Queues a STATE record for a sorter state published at sampleNumber, unless that
+        version was already recorded, so an edit is logged when it takes effect rather
+        than with the next spike. Does not lock or allocate */
+    void recordState(int electrode,
+                     Sorter* sorter,
+                     uint32 version,
+                     const Array<float>& thresholds,
+                     SortingMode sortingMode,
+                     int64 sampleNumber);
+
+    /** Returns the number of records dropped because the FIFO was full */
+    int64 getNumDropped() const { return numDropped; }
+
+    /** Returns the file currently (or last) being written */
+    File getFile() const { return file; }
+
+    /** Writes queued records to disk */
+    void run() override;
+
+private:
+
+    /** Copies one record (in up to two pieces) into the FIFO; returns false if it was dropped */
+    bool push(const void* first, int firstSize, const void* second, int secondSize);
+
+    /** Writes everything currently in the FIFO to the output stream */
+    void drain();
+
+    /** Copies the start of the oldest record in the FIFO without removing it */
+    void peek(void* dest, int numBytes);
+
+    /** Queues a state marker if the version, thresholds or sorting mode differ from
+        the last one queued for the electrode */
+    void recordStateIfChanged(int electrode,
+                              Sorter* sorter,
+                              uint32 version,
+                              const Array<float>& thresholds,
+                              SortingMode sortingMode,
+                              int64 timestamp);
+
+    /** Writes the sorter state a marker names, with its thresholds, as a STATE record */
+    void writeMarkedState(const uint8* payload);
+
+    /** Record type of state markers; they stay in the FIFO and never reach the file */
+    static const uint8 stateMarkerType = 0xff;
+
+    /** Fixed part of a state marker; the thresholds follow */
+    struct StateMarker
+    {
+        Sorter* sorter;
+        int64 timestamp;
+        uint32 version;
+        int electrode;
+        int sortingMode;
+        int numThresholds;
+    };
+
+    /** What was last queued for one electrode (processing thread) */
+    struct RecordedState
+    {
+        bool written = false;
+        uint32 version = 0;
+        std::vector<float> thresholds;
+        SortingMode sortingMode = SORT_AND_DISPLAY;
+    };
+
+    std::vector<RecordedState> recordedStates;
+
+    AbstractFifo fifo;
+    HeapBlock<uint8> buffer;
+
+    std::unique_ptr<FileOutputStream> output;
+    File file;
+
+    /** Writer thread only */
+    MemoryBlock markerBuffer;
+    MemoryBlock stateBuffer;
+
+    std::atomic<bool> recording;
+    std::atomic<int64> numDropped;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SpikeRecorder);
+};
+
+#endif // __SPIKERECORDER_H__
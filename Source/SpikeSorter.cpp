@@ -24,6 +24,7 @@
 #include "SpikeSorter.h"
 #include "SpikeSorterEditor.h"
 #include "Containers.h"
+#include "RealtimeAudit.h"
 
 #include <stdio.h>
 
@@ -31,7 +32,12 @@
 Electrode::Electrode(SpikeSorter* processor_, SpikeChannel* channel, PCAComputingThread* computingThread_)
     : processor(processor_),
       computingThread(computingThread_),
-      isActive(true)
+      isActive(true),
+      index(0),
+      recordedStateVersion(0),
+      createdPlot(nullptr),
+      sortingMode(SORT_AND_DISPLAY),
+      memoryLevel(0)
 {
 
     name = channel->getName();
@@ -46,11 +52,168 @@ Electrode::Electrode(SpikeSorter* processor_, SpikeChannel* channel, PCAComputin
     numChannels = channel->getNumChannels();
     numSamples = channel->getPrePeakSamples() + channel->getPostPeakSamples();
     
-    key = channel->getIdentifier().toStdString();
+    key = DisplayCacheKey(channel->getIdentifier().toStdString());
 
-    sorter = std::make_unique<Sorter>(this, computingThread);
+    sorter = std::make_unique<Sorter>(numChannels, numSamples, computingThread);
+    summary = std::make_unique<ElectrodeSummary>(numChannels, numSamples);
 
-    plot = std::make_unique<SpikePlot>(processor, this);
+    // the plot is only built when the electrode is first viewed
+    for (int i = 0; i < numChannels; i++)
+    {
+        displayThresholds.add(0.0f);
+        displayRanges.add(250.0f);
+
+        processor->cache->setThreshold(key, i, 0.0);
+        processor->cache->setRange(key, i, 250.0);
+    }
+
+}
+
+SpikePlot* Electrode::getPlot()
+{
+    if (plot == nullptr)
+    {
+        plot = std::make_unique<SpikePlot>(processor, this);
+        plot->setName(name);
+
+        // show what the sorter already knows instead of starting from an empty display
+        float p1min, p2min, p1max, p2max;
+        sorter->getPCArange(p1min, p2min, p1max, p2max);
+
+        plot->updateUnits();
+        plot->setPCARange(p1min, p2min, p1max, p2max);
+
+        for (auto spike : sorter->getRecentSpikes())
+            plot->processSpikeObject(spike);
+
+        // a plot is only created to be shown
+        plot->setMemoryLevel(memoryLevel, true);
+
+        createdPlot = plot.get();
+    }
+
+    return plot.get();
+}
+
+void Electrode::setMemoryLevel(int level, bool visible)
+{
+    memoryLevel = jlimit(0, MemoryBudget::maxLevel, level);
+
+    // sorting needs a few dozen spikes to find a basis, whatever the budget
+    sorter->setTrainingBufferSize(jmax(50, Sorter::defaultBufferSize >> memoryLevel));
+    sorter->setCompactStorage(memoryLevel > 0);
+
+    if (plot != nullptr)
+        plot->setMemoryLevel(memoryLevel, visible);
+}
+
+MemoryUsage Electrode::getMemoryUsage()
+{
+    MemoryUsage usage;
+
+    usage.add(MemoryUsage::TRAINING_BUFFER, sorter->getMemoryUsage());
+    usage.add(MemoryUsage::SUMMARY, summary->getMemoryUsage());
+
+    if (plot != nullptr)
+        plot->addMemoryUsage(usage);
+
+    return usage;
+}
+
+void Electrode::setDisplayThresholdForChannel(int channel, float threshold)
+{
+    if (plot != nullptr)
+    {
+        plot->setDisplayThresholdForChannel(channel, threshold);
+    }
+    else
+    {
+        displayThresholds.set(channel, threshold);
+        processor->cache->setThreshold(key, channel, threshold);
+    }
+}
+
+void Electrode::setDisplayRangeForChannel(int channel, float range)
+{
+    if (plot != nullptr)
+    {
+        plot->setDisplayRangeForChannel(channel, range);
+    }
+    else
+    {
+        displayRanges.set(channel, range);
+        processor->cache->setRange(key, channel, range);
+    }
+}
+
+void Electrode::setSortingMode(SortingMode mode)
+{
+    sortingMode = mode;
+    processor->cache->setSortingMode(key, mode);
+}
+
+String Electrode::getSortingModeName(SortingMode mode)
+{
+    switch (mode)
+    {
+    case SORT_AND_DISPLAY:
+        return "Sort + Display";
+    case SORT_ONLY:
+        return "Sort Only";
+    case THRESHOLD_ONLY:
+        return "Threshold Only";
+    case BYPASS:
+        return "Bypass";
+    default:
+        return "Unknown";
+    }
+}
+
+void Electrode::saveDisplaySettings(XmlElement* xml)
+{
+    XmlElement* mainNode = xml->createNewChildElement("PLOT");
+
+    mainNode->setAttribute("stream_source", streamSourceId); // Continuous source node ID
+    mainNode->setAttribute("stream_name", streamName);
+    mainNode->setAttribute("spike_source", sourceNodeId); // Spike node ID
+    mainNode->setAttribute("name", name);
+
+    for (int i = 0; i < numChannels; i++)
+    {
+        XmlElement* rangeNode = mainNode->createNewChildElement("AXIS");
+        rangeNode->setAttribute("thresh", displayThresholds[i]);
+        rangeNode->setAttribute("range", displayRanges[i]);
+    }
+
+}
+
+void Electrode::loadDisplaySettings(XmlElement* xml)
+{
+
+    forEachXmlChildElement(*xml, mainNode)
+    {
+        if (mainNode->hasTagName("PLOT"))
+        {
+
+            std::string stream_source = mainNode->getStringAttribute("stream_source").toStdString();
+            std::string stream_name = mainNode->getStringAttribute("stream_name").toStdString();
+            std::string source = mainNode->getStringAttribute("spike_source").toStdString();
+            std::string electrode_name = mainNode->getStringAttribute("name").toStdString();
+
+            DisplayCacheKey key(stream_source, stream_name, source, electrode_name);
+
+            int i = 0;
+            forEachXmlChildElement(*mainNode, axisNode)
+            {
+                if (axisNode->hasTagName("AXIS"))
+                {
+                    processor->cache->setThreshold(key, i, axisNode->getIntAttribute("thresh"));
+                    processor->cache->setRange(key, i, axisNode->getIntAttribute("range"));
+                    i++;
+                }
+            }
+        }
+    }
 
 }
 
@@ -68,13 +231,15 @@ bool Electrode::matchesChannel(SpikeChannel* channel)
 
 }
 
-void Electrode::applyCachedDisplaySettings(SpikeChannel* channel, std::string key)
+void Electrode::applyCachedDisplaySettings(SpikeChannel* channel, const DisplayCacheKey& key)
 {
     for (int i = 0; i < channel->getNumChannels(); i++)
     {
-        plot->setDisplayThresholdForChannel(i, processor->cache->getThreshold(key, i));
-        plot->setDisplayRangeForChannel(i, processor->cache->getRange(key, i));
+        setDisplayThresholdForChannel(i, processor->cache->getThreshold(key, i));
+        setDisplayRangeForChannel(i, processor->cache->getRange(key, i));
     }
+
+    sortingMode = processor->cache->getSortingMode(key);
 }
 
 void Electrode::updateSettings(SpikeChannel* channel)
@@ -88,7 +253,7 @@ void Electrode::updateSettings(SpikeChannel* channel)
 
     streamSourceId = processor->getDataStream(streamId)->getSourceNodeId();
 
-    std::string cacheKey = channel->getIdentifier().toStdString();
+    DisplayCacheKey cacheKey(channel->getIdentifier().toStdString());
 
     int streamIdx = 0;
     for (auto& stream : processor->getDataStreams())
@@ -102,20 +267,42 @@ void Electrode::updateSettings(SpikeChannel* channel)
     {
         applyCachedDisplaySettings(channel, cacheKey);
     }
-    else if (processor->cache->findSimilarKey(cacheKey, streamIdx).size() > 0)
+    else
     {
-        applyCachedDisplaySettings(channel, processor->cache->findSimilarKey(cacheKey, streamIdx));
+        DisplayCacheKey similarKey = processor->cache->findSimilarKey(cacheKey, streamIdx);
+
+        if (!similarKey.isEmpty())
+            applyCachedDisplaySettings(channel, similarKey);
     }
 
-    plot->setName(name);
-    plot->refresh();
+    if (plot != nullptr)
+    {
+        plot->setName(name);
+        plot->refresh();
+    }
 }
 
-SpikeSorter::SpikeSorter() : GenericProcessor("Spike Sorter")
+/** Memory cap used until one is loaded from the settings (MB) */
+static const int defaultMemoryCapMB = 1024;
+
+/** Length of the TTL pulse raised by a unit trigger (milliseconds) */
+static const float triggerPulseMilliseconds = 1.0f;
+
+SpikeSorter::SpikeSorter() : GenericProcessor("Spike Sorter"),
+    recordInput(false),
+    keepState(false),
+    stateToken(0),
+    stateFingerprint(0),
+    closedLoop(false),
+    closedLoopActive(false),
+    deferredSpikes(this),
+    triggerOutputEnabled(false)
 {
 
     cache = std::make_unique<SpikeDisplayCache>();
 
+    memoryBudget.setCap(int64(defaultMemoryCapMB) << 20);
+
     addIntParameter(Parameter::STREAM_SCOPE, "electrode_index", "The current electrode index being viewed", 0, 0, 1000);
 
 }
@@ -133,6 +320,30 @@ bool SpikeSorter::startAcquisition()
     SpikeSorterEditor* editor = (SpikeSorterEditor*) getEditor();
     
     editor->enable();
+
+    if (recordInput)
+        startInputRecording();
+
+    // units deleted since the last run, or left behind by loaded settings, give up their slots
+    Array<int> unitIds;
+
+    for (auto electrode : electrodes)
+        unitIds.addArray(electrode->sorter->getUnitIds());
+
+    unitTriggers.rebuild(unitIds);
+    unitTriggers.resetHoldoffs();
+
+    for (auto& output : triggerOutputs)
+        std::fill(output.second.offSample, output.second.offSample + UnitTriggerMap::numLines, -1);
+
+    // latched here: handleSpike and the deferred thread must agree for the whole run
+    closedLoopActive = closedLoop;
+
+    if (closedLoopActive)
+    {
+        watchdog.reset();
+        deferredSpikes.startThread();
+    }
     
     return true;
 }
@@ -144,11 +355,289 @@ bool SpikeSorter::stopAcquisition()
     SpikeSorterEditor* editor = (SpikeSorterEditor*) getEditor();
     
     editor->disable();
+
+    if (closedLoopActive)
+    {
+        // bookkeeping still queued is done before recording stops
+        deferredSpikes.stop();
+        closedLoopActive = false;
+
+        LOGC("Spike Sorter closed loop: ", watchdog.toString());
+
+        if (deferredSpikes.getNumDropped() > 0)
+            LOGC("Spike Sorter closed loop: ", deferredSpikes.getNumDropped(), " spikes missed deferred bookkeeping");
+    }
+
+    recorder.stop();
+
+    for (auto electrode : electrodes)
+        electrode->sorter->setStateHistory(false);
+
+    // checkpoint, so a restart picks up what was learned during this run
+    if (keepState && stateToken != 0 && getStateFingerprint() == stateFingerprint)
+        writeStateFile(true);
     
     return true;
 }
 
+void SpikeSorter::setClosedLoop(bool shouldUseClosedLoop)
+{
+    closedLoop = shouldUseClosedLoop;
+
+    if (CoreServices::getAcquisitionStatus())
+        LOGC("Spike Sorter: closed-loop mode changes at the next acquisition start");
+}
+
+void SpikeSorter::setUnitTriggerOutput(bool shouldOutput)
+{
+    if (shouldOutput == triggerOutputEnabled)
+        return;
+
+    if (CoreServices::getAcquisitionStatus())
+    {
+        LOGC("Spike Sorter: the unit trigger output can only be changed while acquisition is stopped");
+        return;
+    }
+
+    triggerOutputEnabled = shouldOutput;
+
+    CoreServices::updateSignalChain(getEditor());
+}
+
+void SpikeSorter::setClosedLoopDeadline(float microseconds)
+{
+    watchdog.setDeadline(microseconds);
+}
+
+void SpikeSorter::setInputRecording(bool shouldRecord)
+{
+    recordInput = shouldRecord;
+
+    // starting or stopping the recorder while handleSpike feeds it would race with it
+    if (CoreServices::getAcquisitionStatus())
+        LOGC("Spike Sorter: input recording changes at the next acquisition start");
+}
+
+void SpikeSorter::startInputRecording()
+{
+    Array<SpikeLog::ElectrodeInfo> info;
+
+    for (auto channel : spikeChannels)
+    {
+        if (!channel->isValid() || electrodeMap.count(channel) == 0)
+            continue;
+
+        Electrode* electrode = electrodeMap[channel];
+
+        SpikeLog::ElectrodeInfo e;
+        e.index = electrode->index;
+        e.name = electrode->name;
+        e.identifier = electrode->uniqueId;
+        e.numChannels = channel->getNumChannels();
+        e.prePeakSamples = channel->getPrePeakSamples();
+        e.postPeakSamples = channel->getPostPeakSamples();
+        e.sampleRate = channel->getSampleRate();
+        info.add(e);
+    }
+
+    File file = CoreServices::getRecordingParentDirectory()
+        .getChildFile("spike_input_" + Time::getCurrentTime().formatted("%Y-%m-%d_%H-%M-%S") + ".spklog");
+
+    // states are serialised as they are published, so the log gets each one as it was
+    for (auto electrode : electrodes)
+    {
+        electrode->sorter->setStateHistory(true);
+        electrode->recordedStateVersion = 0;
+    }
+
+    recorder.start(file, info);
+}
+
+void SpikeSorter::recordSorterEdits()
+{
+    for (auto electrode : electrodes)
+    {
+        if (!electrode->isActive)
+            continue;
+
+        const uint32 version = electrode->sorter->getPublishedVersion();
+
+        if (version == electrode->recordedStateVersion)
+            continue;
+
+        const int64 sampleNumber = getFirstSampleNumberForBlock(electrode->streamId);
+        const SortingMode mode = electrode->getSortingMode();
+
+        // in closed loop the recorder is fed by the deferred thread, in order with the spikes
+        if (closedLoopActive)
+        {
+            if (!deferredSpikes.pushState(electrode->index, version, sampleNumber, mode))
+                continue;
+        }
+        else
+        {
+            recorder.recordState(electrode->index,
+                                 electrode->sorter.get(),
+                                 version,
+                                 electrode->displayThresholds,
+                                 mode,
+                                 sampleNumber);
+        }
+
+        electrode->recordedStateVersion = version;
+    }
+}
+
+void SpikeSorter::setStatePersistence(bool shouldPersist)
+{
+    keepState = shouldPersist;
+}
+
+void SpikeSorter::setMemoryCap(int64 bytes)
+{
+    memoryBudget.setCap(bytes);
+
+    LOGD("Spike Sorter: memory cap ", bytes > 0 ? MemoryBudget::formatBytes(bytes) : String("unlimited"));
+}
+
+void SpikeSorter::updateMemoryBudget(Electrode* visibleElectrode, const MemoryUsage& displayUsage)
+{
+    sharedMemory = displayUsage;
+    sharedMemory.add(MemoryUsage::PCA_JOBS, computingThread.getMemoryUsage());
+    sharedMemory.add(MemoryUsage::RECORDER, recorder.getMemoryUsage());
+
+    Array<Electrode*> active;
+    memoryEntries.clear();
+
+    for (auto electrode : electrodes)
+    {
+        if (!electrode->isActive)
+            continue;
+
+        MemoryBudget::Entry entry;
+        entry.name = electrode->name;
+        entry.usage = electrode->getMemoryUsage();
+        entry.visible = electrode == visibleElectrode;
+        entry.level = electrode->getMemoryLevel();
+
+        memoryEntries.push_back(entry);
+        active.add(electrode);
+    }
+
+    memoryBudget.update(memoryEntries, sharedMemory);
+
+    int numRaised = 0;
+
+    // applied every time, as a plot that became visible has to resume its display
+    for (int i = 0; i < active.size(); i++)
+    {
+        if (memoryEntries[i].level > active[i]->getMemoryLevel())
+            numRaised++;
+
+        active[i]->setMemoryLevel(memoryEntries[i].level, memoryEntries[i].visible);
+
+        // closed-loop runs compact on the deferred thread as spikes are trained on
+        if (!closedLoopActive)
+            active[i]->sorter->compactCollectedSpikes();
+    }
+
+    if (numRaised > 0)
+        LOGC("Spike Sorter: ", MemoryBudget::formatBytes(memoryBudget.getTotal()), " in use, over the ",
+             MemoryBudget::formatBytes(memoryBudget.getCap()), " cap; reducing history on ", numRaised, " electrode(s)");
+}
+
+File SpikeSorter::getStateFile(uint64 token)
+{
+    return File::getSpecialLocation(File::userApplicationDataDirectory)
+        .getChildFile("open-ephys")
+        .getChildFile("spike-sorter-" + String(getNodeId()) + "-"
+                      + String::toHexString((int64) token).paddedLeft('0', 16) + ".state");
+}
 
+uint64 SpikeSorter::getStateFingerprint()
+{
+    uint64 fingerprint = 14695981039346656037ull;
+
+    for (auto electrode : electrodes)
+    {
+        fingerprint = (fingerprint ^ uint64(electrode->index)) * 1099511628211ull;
+        fingerprint = (fingerprint ^ uint64(electrode->sorter->getStateVersion())) * 1099511628211ull;
+    }
+
+    return fingerprint;
+}
+
+std::string SpikeSorter::getMatchKey(const String& name, const String& streamName, int sourceNodeId)
+{
+    return (name + "|" + streamName + "|" + String(sourceNodeId)).toStdString();
+}
+
+/** Identifies an electrode across sessions (same fields as findMatchingElectrode) */
+static String getStateKey(Electrode* electrode)
+{
+    return electrode->name + "|" + electrode->streamName + "|" + String(electrode->sourceNodeId);
+}
+
+void SpikeSorter::writeStateFile(bool append)
+{
+    SorterStateWriter writer(stateFile, stateToken, append);
+
+    if (!writer.openedOk())
+        return;
+
+    for (auto electrode : electrodes)
+        writer.writeElectrode(getStateKey(electrode), electrode->sorter.get());
+}
+
+void SpikeSorter::restoreStateFile(XmlElement* sidecarNode)
+{
+    const uint64 token = (uint64) sidecarNode->getStringAttribute("token").getHexValue64();
+
+    stateFile = File(sidecarNode->getStringAttribute("file", getStateFile(token).getFullPathName()));
+
+    SorterStateReader reader(stateFile);
+
+    // a sidecar written for different settings would restore the wrong units
+    if (!reader.isValid() || reader.getSessionToken() != token)
+    {
+        LOGC("Spike Sorter: state file ", stateFile.getFullPathName(), " does not match these settings; not restoring it");
+
+        // the next save starts a sidecar of its own
+        stateToken = 0;
+        return;
+    }
+
+    for (auto spikeChannel : spikeChannels)
+    {
+        if (!spikeChannel->isValid() || electrodeMap.count(spikeChannel) == 0)
+            continue;
+
+        Electrode* electrode = electrodeMap[spikeChannel];
+
+        if (!reader.hasElectrode(getStateKey(electrode)))
+            continue;
+
+        Array<SorterSpikePtr> spikes = reader.restoreElectrode(getStateKey(electrode),
+                                                               electrode->sorter.get(),
+                                                               spikeChannel);
+
+        // plots created later are filled from the sorter's recent spikes
+        if (SpikePlot* plot = electrode->getPlotIfCreated())
+        {
+            float p1min, p2min, p1max, p2max;
+            electrode->sorter->getPCArange(p1min, p2min, p1max, p2max);
+
+            plot->updateUnits();
+            plot->setPCARange(p1min, p2min, p1max, p2max);
+
+            for (auto spike : spikes)
+                plot->processSpikeObject(spike);
+        }
+    }
+
+    // saving again before anything changes refers to this sidecar
+    stateFingerprint = getStateFingerprint();
+}
 
 void SpikeSorter::updateSettings()
 {
@@ -163,30 +652,68 @@ void SpikeSorter::updateSettings()
         if (spikeChannel->isValid())
         {
 
-            bool foundMatch = false;
+            auto match = electrodesById.find(spikeChannel->getIdentifier().toStdString());
 
-            for (auto electrode : electrodes)
+            if (match != electrodesById.end() && match->second->matchesChannel(spikeChannel))
             {
-                if (electrode->matchesChannel(spikeChannel))
-                {
-                    electrode->updateSettings(spikeChannel);
-                    foundMatch = true;
-                    electrodeMap[spikeChannel] = electrode;
-                    break;
-                }
+                match->second->updateSettings(spikeChannel);
+                electrodeMap[spikeChannel] = match->second;
             }
-
-            if (!foundMatch)
+            else
             {
 
                 Electrode* e = new Electrode(this, spikeChannel, &computingThread);
+                e->index = electrodes.size();
                 electrodes.add(e);
                 electrodeMap[spikeChannel] = e;
+
+                electrodesById.emplace(e->uniqueId.toStdString(), e);
             }
             
         }
     }
 
+    // identifiers and stream names may have changed
+    indexElectrodes();
+
+    triggerOutputs.clear();
+
+    if (triggerOutputEnabled)
+    {
+        for (auto stream : getDataStreams())
+        {
+            EventChannel::Settings settings {
+                EventChannel::Type::TTL,
+                "Spike Sorter unit triggers",
+                "Raised when a spike is sorted into a unit assigned to the line",
+                "spikesorter.unit.ttl",
+                getDataStream(stream->getStreamId())
+            };
+
+            eventChannels.add(new EventChannel(settings));
+            eventChannels.getLast()->addProcessor(processorInfo.get());
+
+            TriggerOutput& output = triggerOutputs[stream->getStreamId()];
+            output.channel = eventChannels.getLast();
+            std::fill(output.offSample, output.offSample + UnitTriggerMap::numLines, -1);
+        }
+    }
+
+}
+
+void SpikeSorter::indexElectrodes()
+{
+    electrodesById.clear();
+    electrodesByName.clear();
+
+    electrodesById.reserve(electrodes.size());
+    electrodesByName.reserve(electrodes.size());
+
+    for (auto electrode : electrodes)
+    {
+        electrodesById.emplace(electrode->uniqueId.toStdString(), electrode);
+        electrodesByName.emplace(getMatchKey(electrode->name, electrode->streamName, electrode->sourceNodeId), electrode);
+    }
 }
 
 Array<Electrode*> SpikeSorter::getElectrodesForStream(uint16 streamId)
@@ -205,10 +732,15 @@ Array<Electrode*> SpikeSorter::getElectrodesForStream(uint16 streamId)
 void SpikeSorter::handleSpike(SpikePtr newSpike)
 {
 
+    REALTIME_AUDIT_SCOPE;
+
+    const int64 startTicks = closedLoopActive ? Time::getHighResolutionTicks() : 0;
+
     const SpikeChannel* channelInfo = newSpike->getChannelInfo();
+    const uint16 incomingSortedId = newSpike->getSortedId();
 
     SorterSpikePtr sorterSpike = new SorterSpikeContainer(channelInfo, 
-                                                          newSpike->getSortedId(),
+                                                          incomingSortedId,
                                                           newSpike->getSampleNumber(),
                                                           newSpike->getDataPointer());
 
@@ -216,52 +748,181 @@ void SpikeSorter::handleSpike(SpikePtr newSpike)
 
     Electrode* electrode = electrodeMap[channelInfo];
 
-    if (sorterSpike->checkThresholds(electrode->plot->getDisplayThresholds()))
-    {
-        electrode->sorter->projectOnPrincipalComponents(sorterSpike);
+    // read once, so a change from the GUI applies from the next spike on
+    const SortingMode mode = electrode->getSortingMode();
 
-        electrode->sorter->sortSpike(sorterSpike, true);
+    if (closedLoopActive)
+    {
+        const bool passed = mode != BYPASS && sorterSpike->checkThresholds(electrode->displayThresholds);
+        bool abandoned = false;
 
-        if (electrode->plot->isVisible())
+        if (passed && mode != THRESHOLD_ONLY)
         {
-            if (electrode->sorter->isPCAfinished())
+            abandoned = !electrode->sorter->classifySpike(sorterSpike, watchdog.getDeadlineTicks(startTicks));
+
+            if (sorterSpike->sortedId > 0)
             {
-                electrode->sorter->resetJobStatus();
-                float p1min, p2min, p1max, p2max;
-                electrode->sorter->getPCArange(p1min, p2min, p1max, p2max);
-                electrode->plot->setPCARange(p1min, p2min, p1max, p2max);
+                newSpike->setSortedId(sorterSpike->sortedId);
+
+                if (unitTriggers.hasTriggers())
+                    emitUnitTrigger(channelInfo, sorterSpike);
             }
+        }
+
+        watchdog.addSpike(startTicks, Time::getHighResolutionTicks(), abandoned);
+
+        if (passed || recorder.isRecording())
+            deferredSpikes.push(electrode->index, sorterSpike, incomingSortedId, mode, passed);
+
+        return;
+    }
+
+    if (mode != BYPASS && sorterSpike->checkThresholds(electrode->displayThresholds))
+    {
+        if (mode != THRESHOLD_ONLY)
+        {
+            electrode->sorter->processSpike(sorterSpike);
 
-            electrode->plot->processSpikeObject(sorterSpike);
+            // before the display, so the pulse goes out as early as possible
+            if (sorterSpike->sortedId > 0 && unitTriggers.hasTriggers())
+                emitUnitTrigger(channelInfo, sorterSpike);
         }
 
+        updateDisplay(electrode, sorterSpike, mode);
+
         if (sorterSpike->sortedId > 0)
             newSpike->setSortedId(sorterSpike->sortedId);
     }
 
-    
+    if (recorder.isRecording())
+        recorder.recordSpike(electrode->index,
+                             electrode->sorter.get(),
+                             electrode->displayThresholds,
+                             mode,
+                             sorterSpike,
+                             incomingSortedId);
+
+}
+
+void SpikeSorter::handleDeferredSpike(const DeferredSpikeQueue::Entry& entry)
+{
+    Electrode* electrode = electrodes[entry.electrode];
+
+    if (electrode == nullptr)
+        return;
+
+    if (entry.spike == nullptr)
+    {
+        recorder.recordState(electrode->index,
+                             electrode->sorter.get(),
+                             entry.stateVersion,
+                             electrode->displayThresholds,
+                             entry.mode,
+                             entry.sampleNumber);
+        return;
+    }
+
+    if (entry.passedThreshold)
+    {
+        if (entry.mode != THRESHOLD_ONLY)
+            electrode->sorter->trainOnSpike(entry.spike);
+
+        updateDisplay(electrode, entry.spike, entry.mode);
+    }
+
+    if (recorder.isRecording())
+        recorder.recordSpike(electrode->index,
+                             electrode->sorter.get(),
+                             electrode->displayThresholds,
+                             entry.mode,
+                             entry.spike,
+                             entry.incomingSortedId);
+}
+
+void SpikeSorter::updateDisplay(Electrode* electrode, const SorterSpikePtr& sorterSpike, SortingMode mode)
+{
+    electrode->summary->addSpike(sorterSpike.get());
+
+    SpikePlot* plot = mode != SORT_ONLY ? electrode->getPlotIfCreated() : nullptr;
+
+    if (plot != nullptr && plot->isVisible())
+        plot->processSpikeObject(sorterSpike);
 }
 
 void SpikeSorter::process(AudioBuffer<float>& buffer)
 {
 
+    if (recorder.isRecording())
+        recordSorterEdits();
+
     checkForEvents(true);
 
+    if (!triggerOutputs.empty())
+        emitPendingTriggerOffsets();
+
 }
 
-Electrode* SpikeSorter::findMatchingElectrode(String name, String stream_name, int stream_source)
+void SpikeSorter::emitUnitTrigger(const SpikeChannel* channel, const SorterSpikePtr& sorterSpike)
 {
-    LOGD("Searching for electrode with ", name, " : ", stream_name, " : ", stream_source);
-    for (auto electrode : electrodes)
+    auto output = triggerOutputs.find(channel->getStreamId());
+
+    if (output == triggerOutputs.end())
+        return;
+
+    const int line = unitTriggers.checkSpike(sorterSpike->sortedId, sorterSpike->getTimestamp(), channel->getSampleRate());
+
+    if (line < 0)
+        return;
+
+    const uint16 streamId = channel->getStreamId();
+    const int64 blockStart = getFirstSampleNumberForBlock(streamId);
+    const int numSamples = getNumSamplesInBlock(streamId);
+
+    // spikes reach the sorter after their waveform ends, so the peak is
+    // usually in an earlier block; the pulse goes out as early as this block allows
+    const int offset = jlimit(0, jmax(0, numSamples - 1), int(sorterSpike->getTimestamp() - blockStart));
+
+    TTLEventPtr event = TTLEvent::createTTLEvent(output->second.channel, blockStart + offset, line, true);
+    addEvent(event, offset);
+
+    output->second.offSample[line] = blockStart + offset
+                                     + jmax(1, roundToInt(triggerPulseMilliseconds * channel->getSampleRate() / 1000.0f));
+}
+
+void SpikeSorter::emitPendingTriggerOffsets()
+{
+    for (auto& entry : triggerOutputs)
     {
-        if (electrode->name == name &&
-            electrode->streamName == stream_name &&
-            electrode->sourceNodeId == stream_source)
+        TriggerOutput& output = entry.second;
+
+        const int64 blockStart = getFirstSampleNumberForBlock(entry.first);
+        const int numSamples = getNumSamplesInBlock(entry.first);
+
+        for (int line = 0; line < UnitTriggerMap::numLines; line++)
         {
-            LOGD("  Found matching electrode!");
-            return electrode;
+            if (output.offSample[line] < 0 || output.offSample[line] >= blockStart + numSamples)
+                continue;
+
+            const int offset = jmax(0, int(output.offSample[line] - blockStart));
+
+            TTLEventPtr event = TTLEvent::createTTLEvent(output.channel, blockStart + offset, line, false);
+            addEvent(event, offset);
+
+            output.offSample[line] = -1;
         }
-            
+    }
+}
+
+Electrode* SpikeSorter::findMatchingElectrode(String name, String stream_name, int stream_source)
+{
+    LOGD("Searching for electrode with ", name, " : ", stream_name, " : ", stream_source);
+
+    auto match = electrodesByName.find(getMatchKey(name, stream_name, stream_source));
+
+    if (match != electrodesByName.end())
+    {
+        LOGD("  Found matching electrode!");
+        return match->second;
     }
 
     LOGD("  No match ");
@@ -277,16 +938,59 @@ void SpikeSorter::saveCustomParametersToXml(XmlElement* parentElement)
         
         XmlElement* electrodeNode = parentElement->createNewChildElement("ELECTRODE");
 
-        electrode->plot->saveCustomParametersToXml(electrodeNode);
+        electrodeNode->setAttribute("name", electrode->name);
+        electrodeNode->setAttribute("stream_name", electrode->streamName);
+        electrodeNode->setAttribute("source_node_id", electrode->sourceNodeId);
+        electrodeNode->setAttribute("sorting_mode", (int) electrode->getSortingMode());
+
+        electrode->saveDisplaySettings(electrodeNode);
         electrode->sorter->saveCustomParametersToXml(electrodeNode);
 
     }
 
+    if (keepState)
+    {
+        const uint64 fingerprint = getStateFingerprint();
+
+        // Each sidecar belongs to one configuration and is never rewritten for
+        // another: settings saved earlier (including the GUI's own recovery
+        // copies) keep restoring from theirs. Saving unchanged units and bases
+        // again refers to the same sidecar.
+        if (stateToken == 0 || fingerprint != stateFingerprint || !stateFile.existsAsFile())
+        {
+            do
+                stateToken = (uint64) Random::getSystemRandom().nextInt64();
+            while (stateToken == 0);
+
+            stateFile = getStateFile(stateToken);
+            stateFingerprint = fingerprint;
+
+            writeStateFile(false);
+        }
+
+        XmlElement* sidecarNode = parentElement->createNewChildElement("STATE_SIDECAR");
+        sidecarNode->setAttribute("file", stateFile.getFullPathName());
+        sidecarNode->setAttribute("token", String::toHexString((int64) stateToken));
+    }
+
+    XmlElement* memoryNode = parentElement->createNewChildElement("MEMORY_BUDGET");
+    memoryNode->setAttribute("cap_mb", int(memoryBudget.getCap() >> 20));
+
+    XmlElement* closedLoopNode = parentElement->createNewChildElement("CLOSED_LOOP");
+    closedLoopNode->setAttribute("enabled", closedLoop);
+    closedLoopNode->setAttribute("deadline_us", (double) watchdog.getDeadline());
+
+    XmlElement* triggersNode = parentElement->createNewChildElement("UNIT_TRIGGERS");
+    triggersNode->setAttribute("enabled", triggerOutputEnabled);
+    unitTriggers.saveToXml(triggersNode);
+
 }
 
 void SpikeSorter::loadCustomParametersFromXml(XmlElement* xml)
 {
 
+    XmlElement* sidecarNode = nullptr;
+
     for (auto* paramsXml : xml->getChildIterator())
     {
 
@@ -301,8 +1005,44 @@ void SpikeSorter::loadCustomParametersFromXml(XmlElement* xml)
             if (electrode != nullptr)
             {
                 electrode->sorter->loadCustomParametersFromXml(paramsXml);
-                electrode->plot->loadCustomParametersFromXml(paramsXml);
+
+                if (SpikePlot* plot = electrode->getPlotIfCreated())
+                    plot->updateUnits();
+
+                electrode->loadDisplaySettings(paramsXml);
+
+                int mode = paramsXml->getIntAttribute("sorting_mode", SORT_AND_DISPLAY);
+
+                if (mode >= 0 && mode < NUM_SORTING_MODES)
+                    electrode->setSortingMode((SortingMode) mode);
             }
         }
+        else if (paramsXml->hasTagName("STATE_SIDECAR"))
+        {
+            sidecarNode = paramsXml;
+        }
+        else if (paramsXml->hasTagName("MEMORY_BUDGET"))
+        {
+            setMemoryCap(int64(jmax(0, paramsXml->getIntAttribute("cap_mb", defaultMemoryCapMB))) << 20);
+        }
+        else if (paramsXml->hasTagName("CLOSED_LOOP"))
+        {
+            setClosedLoop(paramsXml->getBoolAttribute("enabled", false));
+            setClosedLoopDeadline((float) paramsXml->getDoubleAttribute("deadline_us", watchdog.getDeadline()));
+        }
+        else if (paramsXml->hasTagName("UNIT_TRIGGERS"))
+        {
+            // the event channel is created by the signal chain update that follows loading
+            triggerOutputEnabled = paramsXml->getBoolAttribute("enabled", false);
+            unitTriggers.loadFromXml(paramsXml);
+        }
+    }
+
+    keepState = sidecarNode != nullptr;
+
+    if (keepState)
+    {
+        stateToken = (uint64) sidecarNode->getStringAttribute("token").getHexValue64();
+        restoreStateFile(sidecarNode);
     }
 }
@@ -29,104 +29,221 @@
 #include "PCAComputingThread.h"
 #include "Sorter.h"
 #include "SpikePlot.h"
+#include "SpikeRecorder.h"
+#include "SorterStateFile.h"
+#include "ElectrodeSummary.h"
+#include "MemoryBudget.h"
+#include "ClosedLoop.h"
+#include "UnitTriggers.h"
 
 #include <algorithm>    // Needed for std::sort
 #include <queue>
+#include <unordered_map>
+#include <tuple>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 
+/**
+    Identifies an electrode's display settings across signal chain changes
+    (a SpikeChannel identifier: "streamSource|streamName|spikeSource|name")
+*/
+struct DisplayCacheKey
+{
+    /** Empty key */
+    DisplayCacheKey() { }
+
+    /** Key from its parts */
+    DisplayCacheKey(const std::string& streamSource_,
+                    const std::string& streamName_,
+                    const std::string& spikeSource_,
+                    const std::string& electrodeName_)
+        : streamSource(streamSource_), streamName(streamName_),
+          spikeSource(spikeSource_), electrodeName(electrodeName_) { }
+
+    /** Parses a SpikeChannel identifier (stream names may contain '|') */
+    explicit DisplayCacheKey(const std::string& identifier)
+    {
+        size_t first = identifier.find_first_of("|");
+        size_t last = identifier.find_last_of("|");
+
+        if (first == std::string::npos)
+        {
+            electrodeName = identifier;
+            return;
+        }
+
+        streamSource = identifier.substr(0, first);
+        electrodeName = identifier.substr(last + 1);
+
+        if (last > first)
+        {
+            std::string middle = identifier.substr(first + 1, last - first - 1);
+            size_t split = middle.find_last_of("|");
+
+            streamName = split == std::string::npos ? middle : middle.substr(0, split);
+            spikeSource = split == std::string::npos ? "" : middle.substr(split + 1);
+        }
+    }
+
+    bool isEmpty() const
+    {
+        return streamSource.empty() && streamName.empty() && spikeSource.empty() && electrodeName.empty();
+    }
+
+    bool operator==(const DisplayCacheKey& other) const
+    {
+        return streamSource == other.streamSource && streamName == other.streamName
+            && spikeSource == other.spikeSource && electrodeName == other.electrodeName;
+    }
+
+    bool operator<(const DisplayCacheKey& other) const
+    {
+        return std::tie(streamSource, streamName, spikeSource, electrodeName)
+             < std::tie(other.streamSource, other.streamName, other.spikeSource, other.electrodeName);
+    }
+
+    struct Hash
+    {
+        size_t operator()(const DisplayCacheKey& k) const
+        {
+            std::hash<std::string> h;
+            size_t seed = h(k.streamSource);
+
+            for (auto* part : { &k.streamName, &k.spikeSource, &k.electrodeName })
+                seed ^= h(*part) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+
+            return seed;
+        }
+    };
+
+    std::string streamSource;
+    std::string streamName;
+    std::string spikeSource;
+    std::string electrodeName;
+};
+
 class SpikeDisplayCache
 {
 public:
     SpikeDisplayCache () {}
     virtual ~SpikeDisplayCache() {}
 
-    void setMonitor(std::string key, bool isMonitored) {
-        monitors[key] = isMonitored;
+    void setSortingMode(const DisplayCacheKey& key, SortingMode mode) {
+        getOrCreateEntry(key).sortingMode = mode;
     };
 
-    bool isMonitored(std::string key) {
-        return monitors[key];
+    SortingMode getSortingMode(const DisplayCacheKey& key) const {
+        auto it = entries.find(key);
+        return it != entries.end() ? it->second.sortingMode : SORT_AND_DISPLAY;
     };
 
-    void setRange(std::string key, int channelIdx, double range) {
-        ranges[key][channelIdx] = range;
+    void setRange(const DisplayCacheKey& key, int channelIdx, double range) {
+        getOrCreateEntry(key).ranges[channelIdx] = range;
     };
 
-    double getRange(std::string key, int channelIdx) {
-        return ranges[key][channelIdx];
+    double getRange(const DisplayCacheKey& key, int channelIdx) const {
+        return getValue(key, channelIdx, &Entry::ranges);
     };
 
-    void setThreshold(std::string key,int channelIdx, double thresh) {
-        thresholds[key][channelIdx] = thresh;
+    void setThreshold(const DisplayCacheKey& key, int channelIdx, double thresh) {
+        getOrCreateEntry(key).thresholds[channelIdx] = thresh;
     };
 
-    double getThreshold(std::string key, int channelIdx) {
-        return thresholds[key][channelIdx];
+    double getThreshold(const DisplayCacheKey& key, int channelIdx) const {
+        return getValue(key, channelIdx, &Entry::thresholds);
     };
 
-    bool hasCachedDisplaySettings(std::string cacheKey)
+    bool hasCachedDisplaySettings(const DisplayCacheKey& key) const
     {
-        /*
-        LOGD("*********AVAILABLE SETTINGS*********");
-        std::vector<std::string> keys = extract_keys(ranges);
-        std::vector<std::map<int,double>> vals = extract_values(thresholds);
-        for (int i = 0; i < keys.size(); i++)
-        {
-            std::vector<int> channels = extract_keys(vals[i]);
-            std::vector<double> thresholds = extract_values(vals[i]);
-            for (int j = 0; j < channels.size(); j++)
-                LOGC("Key: ", keys[i], " Channel: ", channels[j], " Thresh: ", thresholds[j]);
-        }
-        LOGD("*************************************");
-        */
-        return thresholds.count(cacheKey) > 0;
+        auto it = entries.find(key);
+        return it != entries.end() && !it->second.thresholds.empty();
     };
 
-    std::string findSimilarKey(std::string key, int streamIndex)
+    /** Finds the settings of an electrode whose source node or stream changed;
+        returns an empty key if there is none */
+    DisplayCacheKey findSimilarKey(const DisplayCacheKey& key, int streamIndex) const
     {
-        std::vector<std::string> keys = extract_keys(ranges);
-
-        unsigned sourcePos = 0;
-        unsigned streamPos = key.find_first_of("|");
-        unsigned namePos = key.find_last_of("|");
-
         // First check for a source ID change (match only stream + electrode name)
-        for (int i = 0; i < keys.size(); i++)
-        {
-            std::string partToMatch = key.substr(streamPos, key.length() - streamPos);
-            std::string possibleMatch = keys[i].substr(streamPos, keys[i].length() - streamPos);
-            if (partToMatch.compare(possibleMatch) == 0)
-                return keys[i];
-        }
+        auto sourceMatch = bySourceChange.find(withoutStreamSource(key));
+
+        if (sourceMatch != bySourceChange.end())
+            return sourceMatch->second;
 
         // Next check for a stream name change (match only node + electrode name)
-        std::vector<std::string> matches;
-        for (int i = 0; i < keys.size(); i++)
+        auto streamMatches = byStreamChange.find(withoutStream(key));
+
+        if (streamMatches != byStreamChange.end())
         {
-            int namePos2 = keys[i].find_last_of("|");
-            std::string partToMatch = key.substr(sourcePos, streamPos - sourcePos) + key.substr(namePos, key.length() - namePos);
-            std::string possibleMatch = keys[i].substr(sourcePos, streamPos - sourcePos) + keys[i].substr(namePos2, keys[i].length() - namePos2);
-            if (partToMatch.compare(possibleMatch) == 0)
-                matches.push_back(keys[i]);
-        }
+            const std::vector<DisplayCacheKey>& matches = streamMatches->second;
 
-        // Check if multiple matches, if so, default to stream index
-        if (matches.size() == 1)
-            return matches[0];
-        else if (matches.size() > streamIndex)
-            return matches[streamIndex];
+            // Check if multiple matches, if so, default to stream index
+            if (matches.size() == 1)
+                return matches[0];
+            else if ((int) matches.size() > streamIndex)
+                return matches[streamIndex];
+        }
 
         // No match found
-        return "";
+        return DisplayCacheKey();
     };
 
 private:
 
-    std::map<std::string, std::map<int, double>> ranges;
-    std::map<std::string, std::map<int, double>> thresholds;
-    std::map<std::string, bool> monitors;
+    struct Entry
+    {
+        std::map<int, double> ranges;
+        std::map<int, double> thresholds;
+        SortingMode sortingMode = SORT_AND_DISPLAY;
+    };
+
+    static DisplayCacheKey withoutStreamSource(const DisplayCacheKey& key)
+    {
+        return DisplayCacheKey("", key.streamName, key.spikeSource, key.electrodeName);
+    }
+
+    static DisplayCacheKey withoutStream(const DisplayCacheKey& key)
+    {
+        return DisplayCacheKey(key.streamSource, "", "", key.electrodeName);
+    }
+
+    double getValue(const DisplayCacheKey& key, int channelIdx, std::map<int, double> Entry::* values) const
+    {
+        auto it = entries.find(key);
+
+        if (it == entries.end())
+            return 0.0;
+
+        auto value = (it->second.*values).find(channelIdx);
+        return value != (it->second.*values).end() ? value->second : 0.0;
+    }
+
+    /** Adds new keys to the secondary indices (lowest key first, as a sorted scan would find them) */
+    Entry& getOrCreateEntry(const DisplayCacheKey& key)
+    {
+        auto it = entries.find(key);
+
+        if (it != entries.end())
+            return it->second;
+
+        auto sourceMatch = bySourceChange.emplace(withoutStreamSource(key), key);
+
+        if (!sourceMatch.second && key < sourceMatch.first->second)
+            sourceMatch.first->second = key;
+
+        std::vector<DisplayCacheKey>& matches = byStreamChange[withoutStream(key)];
+        matches.insert(std::lower_bound(matches.begin(), matches.end(), key), key);
+
+        return entries[key];
+    }
+
+    std::unordered_map<DisplayCacheKey, Entry, DisplayCacheKey::Hash> entries;
+
+    /** Keys by (stream name, spike source, electrode name) */
+    std::unordered_map<DisplayCacheKey, DisplayCacheKey, DisplayCacheKey::Hash> bySourceChange;
+
+    /** Keys by (stream source, electrode name), sorted */
+    std::unordered_map<DisplayCacheKey, std::vector<DisplayCacheKey>, DisplayCacheKey::Hash> byStreamChange;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SpikeDisplayCache);
 };
@@ -149,11 +266,49 @@ public:
     void updateSettings(SpikeChannel* channel);
 
     /** Applies cached display settings if inputs change */
-    void applyCachedDisplaySettings(SpikeChannel* channel, std::string cacheKey);
+    void applyCachedDisplaySettings(SpikeChannel* channel, const DisplayCacheKey& cacheKey);
 
     /** Sets 'isActive' to false */
     void reset() { isActive = false; }
 
+    /** Returns the electrode's plot, creating it on first use (message thread only) */
+    SpikePlot* getPlot();
+
+    /** Returns the plot if it has been created, otherwise nullptr (safe on any thread) */
+    SpikePlot* getPlotIfCreated() const { return createdPlot; }
+
+    /** Sets the spike display threshold for one channel, on the plot if it exists */
+    void setDisplayThresholdForChannel(int channel, float threshold);
+
+    /** Sets the waveform display range for one channel, on the plot if it exists */
+    void setDisplayRangeForChannel(int channel, float range);
+
+    /** Changes how much work is done for this electrode's spikes (safe during acquisition) */
+    void setSortingMode(SortingMode mode);
+
+    /** Returns the current sorting mode */
+    SortingMode getSortingMode() const { return sortingMode; }
+
+    /** Returns a short description of a sorting mode */
+    static String getSortingModeName(SortingMode mode);
+
+    /** Saves display settings (PLOT node) for this electrode */
+    void saveDisplaySettings(XmlElement* electrodeNode);
+
+    /** Loads display settings for this electrode into the cache */
+    void loadDisplaySettings(XmlElement* electrodeNode);
+
+    /** Applies a memory budget level (0 = full, up to MemoryBudget::maxLevel):
+        each level halves the training buffer and the PC history, and above
+        level 0 training spikes are stored in 16 bits (message thread) */
+    void setMemoryLevel(int level, bool visible);
+
+    /** Returns the current memory budget level */
+    int getMemoryLevel() const { return memoryLevel; }
+
+    /** Returns the bytes held by the sorter, summary and plot (message thread) */
+    MemoryUsage getMemoryUsage();
+
     String name;
     String streamName;
     int sourceNodeId;
@@ -165,24 +320,46 @@ public:
     uint16 streamId;
 
     bool isActive;
+
+    /** Position in the processor's electrode list (stable, used by the spike recorder) */
+    int index;
+
+    /** Sorter state version last handed to the spike recorder (processing thread) */
+    uint32 recordedStateVersion;
+
+    /** Spike display thresholds, one per channel (also applied before sorting) */
+    Array<float> displayThresholds;
+
+    /** Waveform display ranges, one per channel */
+    Array<float> displayRanges;
   
     std::unique_ptr<SpikePlot> plot;
     std::unique_ptr<Sorter> sorter;
 
+    /** Lightweight running summary shown in the overview grid */
+    std::unique_ptr<ElectrodeSummary> summary;
+
     SpikeSorter* processor;
     PCAComputingThread* computingThread;
 
-    std::string getKey() { return key; }
+    const DisplayCacheKey& getKey() const { return key; }
     
 
 private:
 
-    std::string key; // used for caching
+    DisplayCacheKey key; // used for caching
+
+    std::atomic<SpikePlot*> createdPlot;
+
+    std::atomic<SortingMode> sortingMode;
+
+    int memoryLevel;
 
 };
 
 
-class SpikeSorter : public GenericProcessor
+class SpikeSorter : public GenericProcessor,
+                    public DeferredSpikeQueue::Listener
 {
 public:
 
@@ -222,18 +399,152 @@ public:
     /** Loads all custom parameters*/
     void loadCustomParametersFromXml(XmlElement* xml) override;
 
+    /** Enables or disables recording of the spike input for offline replay (from the next acquisition start) */
+    void setInputRecording(bool shouldRecord);
+
+    /** Returns true if spike input recording is enabled */
+    bool isRecordingInput() const { return recordInput; }
+
+    /** Enables or disables keeping the full sorter state in a sidecar next to the settings */
+    void setStatePersistence(bool shouldPersist);
+
+    /** Returns true if the sorter state is kept in a sidecar */
+    bool isPersistingState() const { return keepState; }
+
+    /** Measures every active electrode and applies new memory levels if the
+        budget requires it; display-wide usage (e.g. overview thumbnails) is
+        passed in by the canvas (message thread) */
+    void updateMemoryBudget(Electrode* visibleElectrode, const MemoryUsage& displayUsage);
+
+    /** Sets the memory cap in bytes (0 = unlimited) */
+    void setMemoryCap(int64 bytes);
+
+    /** Returns the memory cap in bytes (0 = unlimited) */
+    int64 getMemoryCap() const { return memoryBudget.getCap(); }
+
+    /** Returns the total measured by the last budget update */
+    int64 getMemoryTotal() const { return memoryBudget.getTotal(); }
+
+    /** Describes the last budget update */
+    String getMemoryReport() const { return memoryBudget.getReport(memoryEntries, sharedMemory); }
+
+    /** Enables or disables closed-loop sorting; takes effect at the next acquisition start */
+    void setClosedLoop(bool shouldUseClosedLoop);
+
+    /** Returns true if closed-loop sorting is enabled */
+    bool isClosedLoop() const { return closedLoop; }
+
+    /** Returns true if the current acquisition runs in closed-loop mode */
+    bool isClosedLoopActive() const { return closedLoopActive; }
+
+    /** Sets the per-spike deadline for closed-loop sorting (microseconds) */
+    void setClosedLoopDeadline(float microseconds);
+
+    /** Returns the latency counts of closed-loop sorting */
+    const SpikeLatencyWatchdog& getLatencyWatchdog() const { return watchdog; }
+
+    /** Enables or disables the TTL event channel raised by unit triggers (rebuilds the signal chain) */
+    void setUnitTriggerOutput(bool shouldOutput);
+
+    /** Returns true if sorted units can raise TTL lines */
+    bool isUnitTriggerOutputEnabled() const { return triggerOutputEnabled; }
+
+    /** Lines and holdoffs of the units that raise TTL lines */
+    UnitTriggerMap& getUnitTriggers() { return unitTriggers; }
+
+    /** Does the bookkeeping that closed-loop sorting defers (display, statistics, PCA, recording) */
+    void handleDeferredSpike(const DeferredSpikeQueue::Entry& entry) override;
+
     /** Manages connections from SpikeChannels to SpikePlots */
     std::unique_ptr<SpikeDisplayCache> cache;
    
 private:
 
+    /** Opens a new spike log in the recording directory */
+    void startInputRecording();
+
+    /** Logs sorter edits published since the last block, at the block's first
+        sample, so they do not wait for the electrode's next spike */
+    void recordSorterEdits();
+
+    /** Writes the state of every electrode to the sidecar (appending a checkpoint, or replacing the file) */
+    void writeStateFile(bool append);
+
+    /** Restores electrodes from a sidecar referenced by the settings */
+    void restoreStateFile(XmlElement* sidecarNode);
+
+    /** Returns the sidecar location for one configuration of this processor */
+    File getStateFile(uint64 token);
+
+    /** Changes whenever the units, basis or mask of any electrode change */
+    uint64 getStateFingerprint();
+
+    /** Adds a spike that crossed threshold to the electrode's summary and (if shown) its plot */
+    void updateDisplay(Electrode* electrode, const SorterSpikePtr& sorterSpike, SortingMode mode);
+
+    /** Raises the TTL line of the spike's unit, unless it has none or is within its holdoff */
+    void emitUnitTrigger(const SpikeChannel* channel, const SorterSpikePtr& sorterSpike);
+
+    /** Lowers TTL lines whose pulse ends in the current block */
+    void emitPendingTriggerOffsets();
+
+    /** Rebuilds the electrode lookup tables after electrodes were added or renamed */
+    void indexElectrodes();
+
+    /** Key used to match electrodes by name, stream name and source node */
+    static std::string getMatchKey(const String& name, const String& streamName, int sourceNodeId);
+
     CriticalSection mut;
 
     OwnedArray<Electrode> electrodes;
     std::map<const SpikeChannel*, Electrode*> electrodeMap;
+
+    /** Electrodes by SpikeChannel identifier (first match wins, as in a linear scan) */
+    std::unordered_map<std::string, Electrode*> electrodesById;
+
+    /** Electrodes by getMatchKey (first match wins) */
+    std::unordered_map<std::string, Electrode*> electrodesByName;
     
     PCAComputingThread computingThread;
 
+    SpikeRecorder recorder;
+    bool recordInput;
+
+    bool keepState;
+    File stateFile;
+    uint64 stateToken;
+
+    /** getStateFingerprint() when stateFile was written or restored */
+    uint64 stateFingerprint;
+
+    MemoryBudget memoryBudget;
+
+    /** Electrodes and shared buffers as measured by the last budget update */
+    std::vector<MemoryBudget::Entry> memoryEntries;
+    MemoryUsage sharedMemory;
+
+    /** Closed-loop sorting: only thresholds and classification run in handleSpike */
+    bool closedLoop;
+    std::atomic<bool> closedLoopActive;
+
+    SpikeLatencyWatchdog watchdog;
+    DeferredSpikeQueue deferredSpikes;
+
+    /** TTL output of one stream */
+    struct TriggerOutput
+    {
+        EventChannel* channel = nullptr;
+
+        /** Sample at which each line goes low again (-1 if it is low) */
+        int64 offSample[UnitTriggerMap::numLines];
+    };
+
+    bool triggerOutputEnabled;
+    UnitTriggerMap unitTriggers;
+
+    /** Event channel and line states by stream ID (rebuilt in updateSettings) */
+    std::map<uint16, TriggerOutput> triggerOutputs;
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SpikeSorter);
 
 };
@@ -26,11 +26,30 @@
 #include "SpikeSorterEditor.h"
 #include "SpikeSorter.h"
 #include "SpikePlot.h"
+#include "ElectrodeOverview.h"
 #include "PCAUnit.h"
 #include "BoxUnit.h"
 
+/** Limits of the adaptive refresh rate (Hz) and PC point budget */
+static const int minRefreshRate = 4;
+static const int maxRefreshRate = 10;
+static const int minPointBudget = 1000;
+static const int maxPointBudget = 20000;
+
+/** Selectable display CPU budgets */
+static const float cpuBudgets[] = { 0.05f, 0.1f, 0.2f, 0.5f };
+static const int numCpuBudgets = 4;
+
+/** Selectable memory caps (MB, 0 = unlimited) */
+static const int memoryCaps[] = { 64, 128, 256, 512, 1024, 0 };
+static const int numMemoryCaps = 6;
+
+/** Selectable unit trigger holdoffs (ms) */
+static const float triggerHoldoffs[] = { 0.0f, 1.0f, 2.0f, 5.0f, 10.0f, 20.0f, 50.0f };
+static const int numTriggerHoldoffs = 7;
+
 SpikeSorterCanvas::SpikeSorterCanvas(SpikeSorter* n) :
-    processor(n), newSpike(false)
+    processor(n), triggerUnit(-1), newSpike(false)
 {
     electrode = nullptr;
     viewport = new Viewport();
@@ -39,7 +58,23 @@ SpikeSorterCanvas::SpikeSorterCanvas(SpikeSorter* n) :
     viewport->setViewedComponent(spikeDisplay, false);
     viewport->setScrollBarsShown(true, true);
 
+    overview = new ElectrodeOverview();
+    overview->onElectrodeClicked = [this](int index)
+    {
+        setOverviewMode(false);
+
+        SpikeSorterEditor* ed = (SpikeSorterEditor*)processor->getEditor();
+        ed->selectElectrode(index);
+    };
+
     inDrawingPolygonMode = false;
+    inOverviewMode = false;
+
+    cpuBudget = 0.1f;
+    pointBudget = maxPointBudget;
+    frameMilliseconds = 0;
+    numFrames = 0;
+    lastAdaptTime = Time::getMillisecondCounterHiRes();
     scrollBarThickness = viewport->getScrollBarThickness();
 
     addUnitButton = new UtilityButton("New Box Unit", Font("Small Text", 13, Font::plain));
@@ -72,6 +107,27 @@ SpikeSorterCanvas::SpikeSorterCanvas(SpikeSorter* n) :
     newIDbuttons->addListener(this);
     addAndMakeVisible(newIDbuttons);
 
+    triggerLineButton = new UtilityButton("TTL Off", Font("Small Text", 13, Font::plain));
+    triggerLineButton->setRadius(3.0f);
+    triggerLineButton->setTooltip("TTL line raised when a spike is sorted into the selected unit");
+    triggerLineButton->addListener(this);
+    addAndMakeVisible(triggerLineButton);
+
+    triggerHoldoffButton = new UtilityButton("2 ms", Font("Small Text", 13, Font::plain));
+    triggerHoldoffButton->setRadius(3.0f);
+    triggerHoldoffButton->setTooltip("Time after a trigger during which the selected unit cannot trigger again");
+    triggerHoldoffButton->addListener(this);
+    addAndMakeVisible(triggerHoldoffButton);
+
+    triggerOutputButton = new UtilityButton("TTL Output", Font("Small Text", 13, Font::plain));
+    triggerOutputButton->setRadius(3.0f);
+    triggerOutputButton->setClickingTogglesState(true);
+    triggerOutputButton->setToggleState(processor->isUnitTriggerOutputEnabled(), dontSendNotification);
+    triggerOutputButton->setTooltip("Adds a TTL event channel for unit triggers (while acquisition is stopped)");
+    triggerOutputButton->addListener(this);
+    addAndMakeVisible(triggerOutputButton);
+    updateTriggerButtons();
+
     deleteAllUnits = new UtilityButton("Delete All", Font("Small Text", 13, Font::plain));
     deleteAllUnits->setRadius(3.0f);
     deleteAllUnits->addListener(this);
@@ -87,16 +143,67 @@ SpikeSorterCanvas::SpikeSorterCanvas(SpikeSorter* n) :
     prevElectrode->addListener(this);
     addAndMakeVisible(prevElectrode);
 
+    recordInputButton = new UtilityButton("Record Input", Font("Small Text", 13, Font::plain));
+    recordInputButton->setRadius(3.0f);
+    recordInputButton->setClickingTogglesState(true);
+    recordInputButton->setToggleState(processor->isRecordingInput(), dontSendNotification);
+    recordInputButton->addListener(this);
+    addAndMakeVisible(recordInputButton);
+
+    keepStateButton = new UtilityButton("Keep State", Font("Small Text", 13, Font::plain));
+    keepStateButton->setRadius(3.0f);
+    keepStateButton->setClickingTogglesState(true);
+    keepStateButton->setToggleState(processor->isPersistingState(), dontSendNotification);
+    keepStateButton->addListener(this);
+    addAndMakeVisible(keepStateButton);
+
+    closedLoopButton = new UtilityButton("Closed Loop", Font("Small Text", 13, Font::plain));
+    closedLoopButton->setRadius(3.0f);
+    closedLoopButton->setClickingTogglesState(true);
+    closedLoopButton->setToggleState(processor->isClosedLoop(), dontSendNotification);
+    closedLoopButton->setTooltip("Sort with minimal per-spike work and monitor latency against a deadline (not enforced); display, statistics and PCA run on a background thread (from the next acquisition start)");
+    closedLoopButton->addListener(this);
+    addAndMakeVisible(closedLoopButton);
+
+    sortingModeButton = new UtilityButton(Electrode::getSortingModeName(SORT_AND_DISPLAY), Font("Small Text", 13, Font::plain));
+    sortingModeButton->setRadius(3.0f);
+    sortingModeButton->addListener(this);
+    addAndMakeVisible(sortingModeButton);
+
+    overviewButton = new UtilityButton("Overview", Font("Small Text", 13, Font::plain));
+    overviewButton->setRadius(3.0f);
+    overviewButton->setClickingTogglesState(true);
+    overviewButton->addListener(this);
+    addAndMakeVisible(overviewButton);
+
+    cpuBudgetButton = new UtilityButton("CPU Budget 10%", Font("Small Text", 13, Font::plain));
+    cpuBudgetButton->setRadius(3.0f);
+    cpuBudgetButton->addListener(this);
+    addAndMakeVisible(cpuBudgetButton);
+
+    memoryBudgetButton = new UtilityButton("Memory 1024 MB", Font("Small Text", 13, Font::plain));
+    memoryBudgetButton->setRadius(3.0f);
+    memoryBudgetButton->setTooltip("Cap on the memory held by all electrodes; histories shrink to stay under it");
+    memoryBudgetButton->addListener(this);
+    addAndMakeVisible(memoryBudgetButton);
+    updateMemoryBudgetLabel();
+
+    timingLabel = new Label("Timing", "");
+    timingLabel->setFont(Font("Small Text", 12, Font::plain));
+    timingLabel->setColour(Label::textColourId, Colours::white);
+    addAndMakeVisible(timingLabel);
+
     addAndMakeVisible(viewport);
     
     addKeyListener(this);
 
-    refreshRate = 10; // Hz
+    refreshRate = maxRefreshRate; // Hz, lowered if frames exceed the CPU budget
 
 }
 
 void SpikeSorterCanvas::refreshState()
 {
+    updateMemoryBudgetLabel();
     resized();
 }
 
@@ -106,6 +213,10 @@ void SpikeSorterCanvas::resized()
 
     spikeDisplay->setBounds(0, 0, getWidth() - 140, spikeDisplay->getTotalHeight());
 
+    // the width sets the number of columns, which sets the height
+    overview->setSize(getWidth() - 140 - scrollBarThickness, overview->getHeight());
+    overview->setSize(overview->getWidth(), overview->getTotalHeight());
+
     nextElectrode->setBounds(90, 10, 40, 20);
     prevElectrode->setBounds(45, 10, 40, 20);
 
@@ -119,7 +230,20 @@ void SpikeSorterCanvas::resized()
     rePCAButton->setBounds(5, 270, 115, 20);
 
     newIDbuttons->setBounds(5, 300, 115, 20);
+    triggerLineButton->setBounds(5, 325, 55, 20);
+    triggerHoldoffButton->setBounds(65, 325, 55, 20);
     deleteAllUnits->setBounds(5, 350, 115, 20);
+    triggerOutputButton->setBounds(5, 375, 115, 20);
+
+    recordInputButton->setBounds(5, 400, 115, 20);
+    keepStateButton->setBounds(5, 425, 115, 20);
+    closedLoopButton->setBounds(5, 450, 115, 20);
+    sortingModeButton->setBounds(5, 480, 115, 20);
+    overviewButton->setBounds(5, 510, 115, 20);
+
+    cpuBudgetButton->setBounds(5, 550, 115, 20);
+    memoryBudgetButton->setBounds(5, 575, 115, 20);
+    timingLabel->setBounds(0, 600, 125, 70);
 
 }
 
@@ -131,7 +255,172 @@ void SpikeSorterCanvas::paint(Graphics& g)
 
 void SpikeSorterCanvas::refresh()
 {
-    spikeDisplay->refresh();
+    const double start = Time::getMillisecondCounterHiRes();
+
+    if (inOverviewMode)
+        overview->refresh();
+    else
+        spikeDisplay->refresh();
+
+    // painting happens after this returns, so the paint time collected here
+    // belongs to earlier frames; over a second it averages out
+    frameMilliseconds += Time::getMillisecondCounterHiRes() - start;
+
+    if (SpikePlot* plot = spikeDisplay->getSpikePlot())
+        frameMilliseconds += plot->takePaintTime();
+
+    frameMilliseconds += overview->takePaintTime();
+    numFrames++;
+
+    if (Time::getMillisecondCounterHiRes() - lastAdaptTime >= 1000.0)
+        adaptToFrameCost();
+
+    // the selection also changes through clicks on the plot
+    if (electrode != nullptr && electrode->plot != nullptr)
+    {
+        int unitID, boxID;
+        electrode->plot->getSelectedUnitAndBox(unitID, boxID);
+
+        if (unitID != triggerUnit)
+            updateTriggerButtons();
+    }
+}
+
+void SpikeSorterCanvas::adaptToFrameCost()
+{
+    const double meanMilliseconds = frameMilliseconds / jmax(1, numFrames);
+    const double load = meanMilliseconds * refreshRate / 1000.0;
+
+    const int previousRate = refreshRate;
+
+    // fewer frames are less visible than fewer points, so the rate goes first
+    if (load > cpuBudget)
+    {
+        if (refreshRate > minRefreshRate)
+            refreshRate = jmax(minRefreshRate, jmin(refreshRate - 1, int(refreshRate * cpuBudget / load)));
+        else
+            pointBudget = jmax(minPointBudget, pointBudget / 2);
+    }
+    else if (load < cpuBudget / 2)
+    {
+        if (pointBudget < maxPointBudget)
+            pointBudget = jmin(maxPointBudget, pointBudget * 2);
+        else if (refreshRate < maxRefreshRate)
+            refreshRate++;
+    }
+
+    if (refreshRate != previousRate && isTimerRunning())
+        startCallbacks();
+
+    if (SpikePlot* plot = spikeDisplay->getSpikePlot())
+        plot->setPointBudget(pointBudget);
+
+    timingText = String(refreshRate) + " Hz, " + String(meanMilliseconds, 1) + " ms/frame\n"
+                 + String(roundToInt(load * 100.0)) + "% CPU, " + String(pointBudget) + " pts";
+
+    updateMemoryBudget();
+
+    frameMilliseconds = 0;
+    numFrames = 0;
+    lastAdaptTime = Time::getMillisecondCounterHiRes();
+}
+
+void SpikeSorterCanvas::updateMemoryBudget()
+{
+    MemoryUsage displayUsage;
+    displayUsage.add(MemoryUsage::SUMMARY, overview->getMemoryUsage());
+
+    processor->updateMemoryBudget(inOverviewMode ? nullptr : electrode, displayUsage);
+
+    const int64 cap = processor->getMemoryCap();
+
+    String text = timingText + "\n" + MemoryBudget::formatBytes(processor->getMemoryTotal())
+                  + (cap > 0 ? " of " + MemoryBudget::formatBytes(cap) : String());
+
+    if (processor->isClosedLoopActive())
+    {
+        const SpikeLatencyWatchdog& watchdog = processor->getLatencyWatchdog();
+
+        text += "\nLoop worst " + String(watchdog.getWorstMicroseconds(), 0) + " us, "
+                + String(watchdog.getNumLate()) + " late";
+    }
+
+    timingLabel->setText(text, dontSendNotification);
+    timingLabel->setTooltip(processor->getMemoryReport());
+}
+
+void SpikeSorterCanvas::updateTriggerButtons()
+{
+    int unitID = -1, boxID;
+
+    if (electrode != nullptr && electrode->plot != nullptr)
+        electrode->plot->getSelectedUnitAndBox(unitID, boxID);
+
+    triggerUnit = unitID;
+
+    const UnitTriggerMap& triggers = processor->getUnitTriggers();
+    const int line = triggers.getLine(unitID);
+
+    triggerLineButton->setLabel(line >= 0 ? "TTL " + String(line + 1) : String("TTL Off"));
+    triggerHoldoffButton->setLabel(String(roundToInt(triggers.getHoldoff(unitID))) + " ms");
+
+    triggerLineButton->setEnabled(unitID > 0);
+    triggerHoldoffButton->setEnabled(unitID > 0);
+}
+
+void SpikeSorterCanvas::updateMemoryBudgetLabel()
+{
+    const int64 cap = processor->getMemoryCap();
+
+    memoryBudgetButton->setLabel(cap > 0 ? "Memory " + String(int(cap >> 20)) + " MB" : String("Memory Unlimited"));
+}
+
+void SpikeSorterCanvas::setCpuBudget(float budget)
+{
+    cpuBudget = jlimit(0.01f, 1.0f, budget);
+    cpuBudgetButton->setLabel("CPU Budget " + String(roundToInt(cpuBudget * 100.0f)) + "%");
+}
+
+void SpikeSorterCanvas::saveCustomParametersToXml(XmlElement* xml)
+{
+    XmlElement* budgetNode = xml->createNewChildElement("DISPLAY_BUDGET");
+    budgetNode->setAttribute("cpu", cpuBudget);
+}
+
+void SpikeSorterCanvas::loadCustomParametersFromXml(XmlElement* xml)
+{
+    forEachXmlChildElement(*xml, budgetNode)
+    {
+        if (budgetNode->hasTagName("DISPLAY_BUDGET"))
+            setCpuBudget((float) budgetNode->getDoubleAttribute("cpu", 0.1));
+    }
+}
+
+void SpikeSorterCanvas::setOverviewElectrodes(const Array<Electrode*>& electrodes)
+{
+    overview->setElectrodes(electrodes);
+
+    resized();
+}
+
+void SpikeSorterCanvas::setOverviewMode(bool on)
+{
+    inOverviewMode = on;
+    overviewButton->setToggleState(on, dontSendNotification);
+
+    // the hidden plot stops receiving spikes while the overview is shown
+    if (on)
+    {
+        spikeDisplay->setSpikePlot(nullptr);
+        viewport->setViewedComponent(overview, false);
+    }
+    else
+    {
+        viewport->setViewedComponent(spikeDisplay, false);
+        setActiveElectrode(electrode);
+    }
+
+    resized();
 }
 
 void SpikeSorterCanvas::setActiveElectrode(Electrode* electrode_)
@@ -140,13 +429,19 @@ void SpikeSorterCanvas::setActiveElectrode(Electrode* electrode_)
 
     if (electrode != nullptr)
     {
-        spikeDisplay->setSpikePlot(electrode->plot.get());
+        spikeDisplay->setSpikePlot(electrode->getPlot());
+        electrode->getPlot()->setPointBudget(pointBudget);
+        sortingModeButton->setLabel(Electrode::getSortingModeName(electrode->getSortingMode()));
     }
     else {
         spikeDisplay->setSpikePlot(nullptr);
     }
 
-    
+    // the newly shown plot resumes its display at once
+    updateMemoryBudget();
+
+    // the display height depends on the electrode's channel count
+    resized();
 }
 
 void SpikeSorterCanvas::removeUnitOrBox()
@@ -177,6 +472,7 @@ void SpikeSorterCanvas::removeUnitOrBox()
             {
                 // delete unit
                 electrode->sorter->removeUnit(unitID);
+                processor->getUnitTriggers().removeTrigger(unitID);
                 electrode->plot->updateUnits();
 
                 std::vector<BoxUnit> boxunits = electrode->sorter->getBoxUnits();
@@ -199,6 +495,7 @@ void SpikeSorterCanvas::removeUnitOrBox()
         {
             // pca unit
             electrode->sorter->removeUnit(unitID);
+            processor->getUnitTriggers().removeTrigger(unitID);
             electrode->plot->updateUnits();
 
             std::vector<BoxUnit> boxunits = electrode->sorter->getBoxUnits();
@@ -329,16 +626,108 @@ void SpikeSorterCanvas::buttonClicked(Button* button)
     }
     else if (button == newIDbuttons)
     {
-        electrode->sorter->generateNewIds();
+        // triggers follow their units to the new IDs
+        for (auto& ids : electrode->sorter->generateNewIds())
+            processor->getUnitTriggers().moveTrigger(ids.first, ids.second);
+
         electrode->plot->updateUnits();
+        updateTriggerButtons();
     }
     else if (button == deleteAllUnits)
     {
         // delete all units
+        for (int unitId : electrode->sorter->getUnitIds())
+            processor->getUnitTriggers().removeTrigger(unitId);
+
         electrode->sorter->removeAllUnits();
         electrode->plot->updateUnits();
         electrode->plot->setSelectedUnitAndBox(-1, -1);
     }
+    else if (button == recordInputButton)
+    {
+        processor->setInputRecording(recordInputButton->getToggleState());
+    }
+    else if (button == keepStateButton)
+    {
+        processor->setStatePersistence(keepStateButton->getToggleState());
+    }
+    else if (button == closedLoopButton)
+    {
+        processor->setClosedLoop(closedLoopButton->getToggleState());
+    }
+    else if (button == triggerLineButton || button == triggerHoldoffButton)
+    {
+        electrode->plot->getSelectedUnitAndBox(unitID, boxID);
+
+        if (unitID > 0)
+        {
+            UnitTriggerMap& triggers = processor->getUnitTriggers();
+
+            int line = triggers.getLine(unitID);
+            float holdoff = triggers.getHoldoff(unitID);
+
+            if (button == triggerLineButton)
+            {
+                // Off, 1 .. numLines, Off
+                line = line + 1 < UnitTriggerMap::numLines ? line + 1 : -1;
+            }
+            else
+            {
+                int next = 0;
+
+                while (next < numTriggerHoldoffs && triggerHoldoffs[next] <= holdoff)
+                    next++;
+
+                holdoff = triggerHoldoffs[next % numTriggerHoldoffs];
+            }
+
+            if (!triggers.setTrigger(unitID, line, holdoff))
+                LOGC("Spike Sorter: no room for more unit triggers");
+
+            updateTriggerButtons();
+        }
+    }
+    else if (button == triggerOutputButton)
+    {
+        processor->setUnitTriggerOutput(triggerOutputButton->getToggleState());
+        triggerOutputButton->setToggleState(processor->isUnitTriggerOutputEnabled(), dontSendNotification);
+    }
+    else if (button == cpuBudgetButton)
+    {
+        int next = 0;
+
+        while (next < numCpuBudgets && cpuBudgets[next] <= cpuBudget)
+            next++;
+
+        setCpuBudget(cpuBudgets[next % numCpuBudgets]);
+    }
+    else if (button == memoryBudgetButton)
+    {
+        const int currentMB = int(processor->getMemoryCap() >> 20);
+
+        // unlimited is last, so it wraps around to the smallest cap
+        int next = 0;
+
+        while (next < numMemoryCaps && memoryCaps[next] != currentMB)
+            next++;
+
+        next = (next + 1) % numMemoryCaps;
+
+        processor->setMemoryCap(int64(memoryCaps[next]) << 20);
+        updateMemoryBudgetLabel();
+        updateMemoryBudget();
+    }
+    else if (button == overviewButton)
+    {
+        setOverviewMode(overviewButton->getToggleState());
+    }
+    else if (button == sortingModeButton)
+    {
+        // cycle through the modes; takes effect from the next spike
+        SortingMode mode = SortingMode((electrode->getSortingMode() + 1) % NUM_SORTING_MODES);
+        electrode->setSortingMode(mode);
+        sortingModeButton->setLabel(Electrode::getSortingModeName(mode));
+    }
 
     refresh();
 }
@@ -374,6 +763,7 @@ void SpikeDisplay::setSpikePlot(SpikePlot* plot)
     if (activePlot != nullptr)
     {
         addAndMakeVisible(activePlot);
+        totalHeight = activePlot->getPreferredHeight();
     }
     
     resized();
@@ -401,7 +791,7 @@ void SpikeDisplay::resized()
 
 
 GenericDrawAxes::GenericDrawAxes(GenericDrawAxes::AxesType t)
-    : gotFirstSpike(false), type(t)
+    : gotFirstSpike(false), needsRepaint(true), type(t)
 {
     ylims[0] = 0;
     ylims[1] = 1;
@@ -32,6 +32,7 @@
 
 class SpikePlot;
 class SpikeDisplay;
+class ElectrodeOverview;
 class GenericAxes;
 class ProjectionAxes;
 class WaveAxes;
@@ -80,6 +81,21 @@ public:
 
     /** Updates the current electrode */
     void setActiveElectrode(Electrode* electrode);
+
+    /** Sets the electrodes tiled in the overview */
+    void setOverviewElectrodes(const Array<Electrode*>& electrodes);
+
+    /** Switches between the overview grid and the active electrode's plot */
+    void setOverviewMode(bool on);
+
+    /** Sets the share of message-thread time (0-1) the display may use */
+    void setCpuBudget(float budget);
+
+    /** Saves the display CPU budget */
+    void saveCustomParametersToXml(XmlElement* xml) override;
+
+    /** Loads the display CPU budget */
+    void loadCustomParametersFromXml(XmlElement* xml) override;
     
     /** Responds to keypress*/
     bool keyPressed(const KeyPress& key, Component*);
@@ -97,17 +113,62 @@ public:
         nextElectrode,
         prevElectrode,
         newIDbuttons,
-        deleteAllUnits;
+        triggerLineButton,
+        triggerHoldoffButton,
+        triggerOutputButton,
+        deleteAllUnits,
+        recordInputButton,
+        keepStateButton,
+        closedLoopButton,
+        sortingModeButton,
+        overviewButton,
+        cpuBudgetButton,
+        memoryBudgetButton;
 
 private:
     
     /** Deletes currently selected unit or box */
     void removeUnitOrBox();
 
+    /** Adjusts the refresh rate and point budget to the measured frame cost
+        and updates the timing label (about once per second) */
+    void adaptToFrameCost();
+
+    /** Measures memory use through the processor's budget (which may shrink
+        histories) and shows the total on the timing label */
+    void updateMemoryBudget();
+
+    /** Shows the processor's memory cap on its button */
+    void updateMemoryBudgetLabel();
+
+    /** Shows the TTL line and holdoff of the selected unit on the trigger buttons */
+    void updateTriggerButtons();
+
     ScopedPointer<SpikeDisplay> spikeDisplay;
+    ScopedPointer<ElectrodeOverview> overview;
     ScopedPointer<Viewport> viewport;
 
     bool inDrawingPolygonMode;
+    bool inOverviewMode;
+
+    /** Share of message-thread time the display may use */
+    float cpuBudget;
+
+    /** Most PC points drawn per frame */
+    int pointBudget;
+
+    /** Message-thread time spent on frames since the last adaptation */
+    double frameMilliseconds;
+    int numFrames;
+    double lastAdaptTime;
+
+    ScopedPointer<Label> timingLabel;
+
+    /** Frame timing lines of the label, above the memory line */
+    String timingText;
+
+    /** Unit whose trigger settings the trigger buttons show */
+    int triggerUnit;
     bool newSpike;
 
     Electrode* electrode;
@@ -146,6 +207,9 @@ public:
     /** Sets polygon drawing mode in the active plot*/
     void setPolygonMode(bool on);
 
+    /** Returns the plot being displayed, or nullptr */
+    SpikePlot* getSpikePlot() const { return activePlot; }
+
     /** Returns the total height of the display */
     int getTotalHeight()
     {
@@ -186,6 +250,9 @@ public:
     /** Add new spike to the plot */
     virtual bool updateSpikeData(SorterSpikePtr s);
 
+    /** Marks the axes as needing a repaint on the next refresh */
+    void invalidate() { needsRepaint = true; }
+
     void setXLims(double xmin, double xmax);
     void getXLims(double* xmin, double* xmax);
     void setYLims(double ymin, double ymax);
@@ -207,6 +274,9 @@ protected:
 
     bool gotFirstSpike;
 
+    /** Set when something shown has changed; refreshes skip clean axes */
+    bool needsRepaint;
+
     AxesType type;
 
     Font font;
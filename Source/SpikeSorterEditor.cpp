@@ -70,6 +70,9 @@ void SpikeSorterEditor::selectedStreamHasChanged()
 
     currentElectrodes = processor->getElectrodesForStream(selectedStream);
 
+    if (spikeSorterCanvas != nullptr)
+        spikeSorterCanvas->setOverviewElectrodes(currentElectrodes);
+
     int id = 0;
     int viewedPlot = 1;
 
@@ -78,7 +81,7 @@ void SpikeSorterEditor::selectedStreamHasChanged()
 
         electrodeList->addItem(electrode->name, ++id);
             
-        if (electrode->plot->isVisible())
+        if (electrode->getPlotIfCreated() != nullptr && electrode->getPlotIfCreated()->isVisible())
             viewedPlot = id;
             
     }
@@ -135,6 +138,11 @@ void SpikeSorterEditor::nextElectrode()
     electrodeList->setSelectedId(nextID, sendNotification);
 }
 
+void SpikeSorterEditor::selectElectrode(int index)
+{
+    electrodeList->setSelectedId(index + 1, sendNotification);
+}
+
 void SpikeSorterEditor::previousElectrode()
 {
     int numAvailable = electrodeList->getNumItems();
@@ -64,6 +64,9 @@ public:
     /** Selects the previous electrode */
     void previousElectrode();
 
+    /** Selects an electrode by its index in the current stream */
+    void selectElectrode(int index);
+
     /** Called when selected stream is updated*/
     void selectedStreamHasChanged() override;
 
@@ -0,0 +1,257 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "UnitTriggers.h"
+
+#include <vector>
+
+UnitTriggerMap::UnitTriggerMap()
+    : numActive(0)
+{
+    for (auto& slot : slots)
+    {
+        slot.unitId = 0;
+        slot.line = -1;
+        slot.holdoff = defaultHoldoff;
+        slot.lastTrigger = 0;
+        slot.hasTriggered = false;
+    }
+}
+
+const UnitTriggerMap::Slot* UnitTriggerMap::find(int unitId) const
+{
+    if (unitId <= 0)
+        return nullptr;
+
+    for (int probe = 0; probe < maxTriggers; probe++)
+    {
+        const Slot& slot = slots[(unitId + probe) % maxTriggers];
+        const int id = slot.unitId.load(std::memory_order_acquire);
+
+        if (id == unitId)
+            return &slot;
+
+        // freed slots are skipped, so units inserted after them are still found
+        if (id == 0)
+            return nullptr;
+    }
+
+    return nullptr;
+}
+
+bool UnitTriggerMap::setTrigger(int unitId, int line, float holdoffMilliseconds)
+{
+    if (unitId <= 0)
+        return false;
+
+    line = line >= 0 && line < numLines ? line : -1;
+    holdoffMilliseconds = jmax(0.0f, holdoffMilliseconds);
+
+    const bool isDefault = line < 0 && holdoffMilliseconds == defaultHoldoff;
+
+    Slot* slot = const_cast<Slot*>(find(unitId));
+
+    if (slot == nullptr)
+    {
+        if (isDefault)
+            return true;
+
+        // the first free slot in the unit's probe sequence, never used or freed
+        for (int probe = 0; probe < maxTriggers && slot == nullptr; probe++)
+        {
+            Slot& candidate = slots[(unitId + probe) % maxTriggers];
+
+            if (candidate.unitId.load(std::memory_order_relaxed) <= 0)
+                slot = &candidate;
+        }
+
+        if (slot == nullptr)
+            return false;
+
+        slot->line = -1;
+        slot->holdoff = holdoffMilliseconds;
+        slot->hasTriggered = false;
+
+        // published last, so the audio thread never sees a half-written slot
+        slot->unitId.store(unitId, std::memory_order_release);
+    }
+
+    const int previous = slot->line.exchange(line);
+
+    if (previous < 0 && line >= 0)
+        numActive++;
+    else if (previous >= 0 && line < 0)
+        numActive--;
+
+    slot->holdoff = holdoffMilliseconds;
+
+    if (isDefault)
+        freeSlot(slot);
+
+    return true;
+}
+
+void UnitTriggerMap::freeSlot(Slot* slot)
+{
+    if (slot->line.exchange(-1) >= 0)
+        numActive--;
+
+    slot->unitId.store(freedSlot, std::memory_order_release);
+}
+
+void UnitTriggerMap::removeTrigger(int unitId)
+{
+    if (Slot* slot = const_cast<Slot*>(find(unitId)))
+        freeSlot(slot);
+}
+
+void UnitTriggerMap::moveTrigger(int oldUnitId, int newUnitId)
+{
+    const Slot* slot = find(oldUnitId);
+
+    if (slot == nullptr || oldUnitId == newUnitId)
+        return;
+
+    const int line = slot->line.load();
+    const float holdoff = slot->holdoff.load();
+
+    removeTrigger(oldUnitId);
+
+    if (!setTrigger(newUnitId, line, holdoff))
+        LOGC("Spike Sorter: no room for more unit triggers");
+}
+
+int UnitTriggerMap::getLine(int unitId) const
+{
+    const Slot* slot = find(unitId);
+
+    return slot != nullptr ? slot->line.load() : -1;
+}
+
+float UnitTriggerMap::getHoldoff(int unitId) const
+{
+    const Slot* slot = find(unitId);
+
+    return slot != nullptr ? slot->holdoff.load() : defaultHoldoff;
+}
+
+void UnitTriggerMap::clear()
+{
+    for (auto& slot : slots)
+    {
+        if (slot.unitId.load() != 0)
+            freeSlot(&slot);
+    }
+
+    numActive = 0;
+}
+
+void UnitTriggerMap::rebuild(const Array<int>& unitIds)
+{
+    struct Trigger
+    {
+        int unitId;
+        int line;
+        float holdoff;
+    };
+
+    std::vector<Trigger> triggers;
+
+    for (auto& slot : slots)
+    {
+        const int unitId = slot.unitId.load();
+
+        if (unitId > 0 && unitIds.contains(unitId))
+            triggers.push_back({ unitId, slot.line.load(), slot.holdoff.load() });
+
+        slot.unitId = 0;
+        slot.line = -1;
+        slot.holdoff = defaultHoldoff;
+        slot.hasTriggered = false;
+    }
+
+    numActive = 0;
+
+    for (auto& trigger : triggers)
+        setTrigger(trigger.unitId, trigger.line, trigger.holdoff);
+}
+
+void UnitTriggerMap::resetHoldoffs()
+{
+    for (auto& slot : slots)
+        slot.hasTriggered = false;
+}
+
+int UnitTriggerMap::checkSpike(int unitId, int64 sampleNumber, float sampleRate)
+{
+    Slot* slot = const_cast<Slot*>(find(unitId));
+
+    if (slot == nullptr)
+        return -1;
+
+    const int line = slot->line.load(std::memory_order_acquire);
+
+    // the slot may have been freed and given to another unit since it was found
+    if (line < 0 || slot->unitId.load(std::memory_order_acquire) != unitId)
+        return -1;
+
+    const int64 holdoffSamples = int64(slot->holdoff.load(std::memory_order_relaxed) * sampleRate / 1000.0f);
+
+    if (slot->hasTriggered.load(std::memory_order_relaxed)
+        && sampleNumber - slot->lastTrigger.load(std::memory_order_relaxed) < holdoffSamples)
+        return -1;
+
+    slot->lastTrigger.store(sampleNumber, std::memory_order_relaxed);
+    slot->hasTriggered.store(true, std::memory_order_relaxed);
+
+    return line;
+}
+
+void UnitTriggerMap::saveToXml(XmlElement* xml) const
+{
+    for (auto& slot : slots)
+    {
+        const int unitId = slot.unitId.load();
+
+        if (unitId <= 0 || slot.line.load() < 0)
+            continue;
+
+        XmlElement* triggerNode = xml->createNewChildElement("TRIGGER");
+        triggerNode->setAttribute("unit", unitId);
+        triggerNode->setAttribute("line", slot.line.load());
+        triggerNode->setAttribute("holdoff_ms", (double) slot.holdoff.load());
+    }
+}
+
+void UnitTriggerMap::loadFromXml(XmlElement* xml)
+{
+    clear();
+
+    for (auto* triggerNode : xml->getChildIterator())
+    {
+        if (triggerNode->hasTagName("TRIGGER"))
+            setTrigger(triggerNode->getIntAttribute("unit", 0),
+                       triggerNode->getIntAttribute("line", -1),
+                       (float) triggerNode->getDoubleAttribute("holdoff_ms", defaultHoldoff));
+    }
+}
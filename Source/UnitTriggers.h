@@ -0,0 +1,130 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __UNITTRIGGERS_H__
+#define __UNITTRIGGERS_H__
+
+#include <ProcessorHeaders.h>
+
+#include <atomic>
+
+/**
+    Maps sorted units to the TTL lines they trigger.
+
+    Each selected unit has an output line and a refractory holdoff: once a
+    unit has triggered, its spikes are ignored until the holdoff has
+    passed. Triggers are set on the message thread and looked up on the
+    audio thread for every sorted spike, so the table is a fixed array of
+    atomics, probed by unit ID, with no locks or allocation. A unit that
+    goes back to no line and the default holdoff frees its slot. Freed
+    slots stay marked, so the probe sequence of the others stays intact,
+    and can be reused; rebuild() clears them while acquisition is stopped.
+*/
+class UnitTriggerMap
+{
+public:
+
+    /** Number of TTL lines units can be assigned to */
+    static const int numLines = 8;
+
+    /** Number of units that can ever be given a trigger (per processor) */
+    static const int maxTriggers = 256;
+
+    /** Holdoff for units that have not been given one (milliseconds) */
+    static constexpr float defaultHoldoff = 2.0f;
+
+    /** Constructor */
+    UnitTriggerMap();
+
+    /** Sets the line (0-based, -1 for none) and holdoff of a unit; returns
+        false if the table is full (message thread) */
+    bool setTrigger(int unitId, int line, float holdoffMilliseconds);
+
+    /** Frees the slot of a unit, e.g. when the unit is deleted (message thread) */
+    void removeTrigger(int unitId);
+
+    /** Moves the line and holdoff of a unit to a new ID, e.g. after Sorter::generateNewIds */
+    void moveTrigger(int oldUnitId, int newUnitId);
+
+    /** Returns the line a unit triggers, or -1 */
+    int getLine(int unitId) const;
+
+    /** Returns the holdoff of a unit (milliseconds) */
+    float getHoldoff(int unitId) const;
+
+    /** Returns true if any unit triggers a line */
+    bool hasTriggers() const { return numActive.load(std::memory_order_relaxed) > 0; }
+
+    /** Stops every unit from triggering and frees every slot */
+    void clear();
+
+    /** Drops freed slots and the triggers of units that are not in unitIds, then
+        re-inserts the rest, so lookups probe as few slots as possible. Only while
+        checkSpike cannot be called, i.e. while acquisition is stopped */
+    void rebuild(const Array<int>& unitIds);
+
+    /** Forgets when each unit last triggered, so the first spike after this always fires */
+    void resetHoldoffs();
+
+    /** Returns the line to raise for a spike of this unit at sampleNumber,
+        or -1 if the unit has no line or is within its holdoff (audio thread) */
+    int checkSpike(int unitId, int64 sampleNumber, float sampleRate);
+
+    /** Saves every unit that triggers a line */
+    void saveToXml(XmlElement* xml) const;
+
+    /** Replaces the table with the triggers in xml */
+    void loadFromXml(XmlElement* xml);
+
+private:
+
+    /** unitId of a slot that was used and freed again */
+    static const int freedSlot = -1;
+
+    struct Slot
+    {
+        /** 0 while the slot has never been used, freedSlot once freed */
+        std::atomic<int> unitId;
+
+        std::atomic<int> line;
+        std::atomic<float> holdoff;
+
+        /** Written by checkSpike, reset from the message thread */
+        std::atomic<int64> lastTrigger;
+        std::atomic<bool> hasTriggered;
+    };
+
+    /** Returns the slot of a unit, or nullptr if it has none */
+    const Slot* find(int unitId) const;
+
+    /** Marks a slot as free (message thread) */
+    void freeSlot(Slot* slot);
+
+    Slot slots[maxTriggers];
+
+    std::atomic<int> numActive;
+
+    JUCE_DECLARE_NON_COPYABLE(UnitTriggerMap);
+};
+
+#endif // __UNITTRIGGERS_H__
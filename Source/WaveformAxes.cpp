@@ -27,9 +27,20 @@
 #include "SpikePlot.h"
 #include "BoxUnit.h"
 
+/** Raster columns per waveform sample and rows over the vertical range */
+static const int rasterColumnsPerSample = 4;
+static const int rasterHeight = 128;
+
+/** Time constant of the waveform raster's decay */
+static const double rasterDecaySeconds = 2.0;
+
+/** Axes without new spikes are still repainted this often (ms) while their raster fades */
+static const double fadeRepaintInterval = 1000.0;
+
 WaveformAxes::WaveformAxes(SpikePlot* plot_, Electrode* electrode_, int channelIndex) : 
     GenericDrawAxes(GenericDrawAxes::AxesType(channelIndex)),
     channel(channelIndex),
+    raster(rasterColumnsPerSample, rasterHeight),
     plot(plot_),
     electrode(electrode_)
 
@@ -39,10 +50,7 @@ WaveformAxes::WaveformAxes(SpikePlot* plot_, Electrode* electrode_, int channelI
     annotationComponent = std::make_unique<AnnotationComponent>(electrode, &units);
     addAndMakeVisible(annotationComponent.get());
 
-    for (int n = 0; n < bufferSize; n++)
-    {
-        spikeBuffer.add(nullptr);
-    }
+    lastDecayTime = Time::getMillisecondCounterHiRes();
 }
 
 void WaveformAxes::resized()
@@ -56,45 +64,56 @@ void WaveformAxes::setRange(float r)
     
     annotationComponent->range = range;
 
+    invalidate();
     repaint();
 }
 
 void WaveformAxes::plotSpike(SorterSpikePtr s, Graphics& g)
 {
     if (s.get() == nullptr) return;
-    float h = getHeight();
 
-    g.setColour(Colour(s->color[0], s->color[1], s->color[2]));
+    spikePath.clear();
+    addSpikeToPath(s.get(), spikePath);
 
-    //compute the spatial width for each waveform sample
-    float dx = getWidth() / float(s->getChannel()->getTotalSamples());
+    g.setColour(Colour(s->color[0], s->color[1], s->color[2]));
+    g.strokePath(spikePath, PathStrokeType(1.0f));
 
-    int spikeSamples = s->getChannel()->getTotalSamples();
+}
 
-    // type corresponds to channel so we need to calculate the starting
-    // sample based upon which channel is getting plotted
-    int offset = channel * spikeSamples;
+void WaveformAxes::addSpikeToPath(const SorterSpikeContainer* s, Path& path)
+{
+    const int spikeSamples = s->getChannel()->getTotalSamples();
 
-    float x = 0.0f;
+    if (spikeSamples < 2)
+        return;
 
-    for (int i = 0; i < spikeSamples - 1; i++)
+    // the x coordinates only change with the width or the waveform length
+    if (xCoordinatesWidth != getWidth() || (int) xCoordinates.size() != spikeSamples)
     {
-        float s1 = h - (h / 2 + s->getData()[offset + i] / (range)*h);
-        float s2 = h - (h / 2 + s->getData()[offset + i + 1] / (range)*h);
+        const float dx = getWidth() / float(spikeSamples);
 
-        if (signalFlipped)
-        {
-            s1 = h - s1;
-            s2 = h - s2;
-        }
-        g.drawLine(x,
-            s1,
-            x + dx,
-            s2);
+        xCoordinates.resize(spikeSamples);
 
-        x += dx;
+        for (int i = 0; i < spikeSamples; i++)
+            xCoordinates[i] = i * dx;
+
+        xCoordinatesWidth = getWidth();
     }
 
+    // type corresponds to channel so we need to calculate the starting
+    // sample based upon which channel is getting plotted
+    const float* data = s->getData() + channel * spikeSamples;
+
+    const float h = getHeight();
+    const float yScale = signalFlipped ? h / range : -h / range;
+    const float yOffset = h / 2;
+
+    path.preallocateSpace(3 * spikeSamples);
+
+    path.startNewSubPath(xCoordinates[0], yOffset + data[0] * yScale);
+
+    for (int i = 1; i < spikeSamples; i++)
+        path.lineTo(xCoordinates[i], yOffset + data[i] * yScale);
 }
 
 WaveformAxes::AnnotationComponent::AnnotationComponent(Electrode* electrode_,
@@ -149,25 +168,104 @@ void WaveformAxes::drawWaveformGrid(Graphics& g)
 }
 
 
-bool WaveformAxes::updateSpikeData(SorterSpikePtr s)
+void WaveformAxes::drawProjectionMask(Graphics& g)
 {
-    if (!gotFirstSpike)
+    const int numSamples = electrode->sorter->getWaveformLength();
+
+    if (projectionMask.isFull() || projectionMask.getTotalValues() == 0 || numSamples == 0)
+        return;
+
+    const float w = (float) getWidth();
+    const float h = (float) getHeight();
+
+    g.setColour(Colours::black.withAlpha(0.5f));
+
+    if (!projectionMask.isChannelEnabled(channel))
     {
-        gotFirstSpike = true;
+        g.fillRect(0.0f, 0.0f, w, h);
+        return;
     }
 
-    if (spikesReceivedSinceLastRedraw < bufferSize)
+    const float start = w * projectionMask.getWindowStart() / numSamples;
+    const float end = w * projectionMask.getWindowEnd() / numSamples;
+
+    g.fillRect(0.0f, 0.0f, start, h);
+    g.fillRect(end, 0.0f, w - end, h);
+}
+
+void WaveformAxes::showProjectionMaskMenu(float x)
+{
+    Sorter* sorter = electrode->sorter.get();
+
+    const int numSamples = sorter->getWaveformLength();
+    const int sample = jlimit(0, jmax(0, numSamples - 1), int(x / getWidth() * numSamples));
+
+    const ProjectionMask mask = sorter->getProjectionMask();
+    const ProjectionMaskMode mode = sorter->getProjectionMaskMode();
+
+    // the last channel cannot be removed
+    const bool onlyChannel = mask.isChannelEnabled(channel)
+        && mask.getNumValues() == mask.getWindowEnd() - mask.getWindowStart();
+
+    PopupMenu menu;
+    menu.addSectionHeader("PCA mask: " + Sorter::getProjectionMaskModeName(mode));
+    menu.addItem(1, "Use channel " + String(channel + 1), !onlyChannel, mask.isChannelEnabled(channel));
+    menu.addItem(2, "Start window here");
+    menu.addItem(3, "End window here");
+    menu.addSeparator();
+    menu.addItem(4, "Choose automatically", true, mode == MASK_AUTO);
+    menu.addItem(5, "Use whole waveform", true, mode == MASK_NONE);
+
+    Component::SafePointer<WaveformAxes> safeThis(this);
+
+    menu.showMenuAsync(PopupMenu::Options().withTargetComponent(this), [safeThis, sorter, mask, sample](int result)
     {
+        if (safeThis == nullptr || result == 0)
+            return;
 
-        spikeIndex++;
-        spikeIndex %= bufferSize;
+        ProjectionMask edited = mask;
 
-        spikeBuffer.set(spikeIndex, s);
+        switch (result)
+        {
+        case 1:
+            edited.setChannelEnabled(safeThis->channel, !mask.isChannelEnabled(safeThis->channel));
+            break;
+        case 2:
+            edited.setWindow(sample, jmax(sample + 1, mask.getWindowEnd()));
+            break;
+        case 3:
+            edited.setWindow(jmin(sample, mask.getWindowStart()), sample + 1);
+            break;
+        case 4:
+            sorter->setProjectionMaskMode(MASK_AUTO);
+            return;
+        default:
+            sorter->setProjectionMaskMode(MASK_NONE);
+            return;
+        }
 
-        spikesReceivedSinceLastRedraw++;
+        // a manual mask takes effect with the next basis
+        sorter->setProjectionMask(edited, MASK_MANUAL);
+        sorter->RePCA();
+    });
+}
 
+bool WaveformAxes::updateSpikeData(SorterSpikePtr s)
+{
+    if (!gotFirstSpike)
+    {
+        gotFirstSpike = true;
     }
 
+    const int spikeSamples = s->getChannel()->getTotalSamples();
+
+    // a new range clears the raster, since its rows no longer match
+    raster.setLayout(spikeSamples, range);
+    raster.add(s->getData() + channel * spikeSamples, s->color[0], s->color[1], s->color[2]);
+
+    latestSpike = s;
+    needsRepaint = true;
+
     return true;
 
 }
@@ -175,17 +273,32 @@ bool WaveformAxes::updateSpikeData(SorterSpikePtr s)
 
 void WaveformAxes::clear()
 {
-    spikeBuffer.clear();
-    spikeIndex = 0;
-
-    for (int n = 0; n < bufferSize; n++)
-    {
-        spikeBuffer.add(nullptr);
-    }
+    raster.clear();
+    latestSpike = nullptr;
+    rasterMaxCount = 0;
 
     repaint();
 }
 
+void WaveformAxes::releaseMemory()
+{
+    raster.release();
+    rasterImage = Image();
+    latestSpike = nullptr;
+    rasterMaxCount = 0;
+}
+
+void WaveformAxes::addMemoryUsage(MemoryUsage& usage) const
+{
+    int64 bytes = raster.getMemoryUsage() + int64(xCoordinates.capacity()) * (int64) sizeof(float);
+
+    // ARGB images are stored 4 bytes per pixel
+    if (rasterImage.isValid())
+        bytes += int64(rasterImage.getWidth()) * rasterImage.getHeight() * 4;
+
+    usage.add(MemoryUsage::WAVEFORM_RASTERS, bytes);
+}
+
 void WaveformAxes::mouseMove(const MouseEvent& event)
 {
 
@@ -234,6 +347,11 @@ int WaveformAxes::findUnitIndexById(int id)
 
 void WaveformAxes::mouseDown(const juce::MouseEvent& event)
 {
+    if (event.mods.isRightButtonDown())
+    {
+        showProjectionMaskMenu((float) event.x);
+        return;
+    }
 
     float h = getHeight();
     float w = getWidth();
@@ -600,11 +718,37 @@ void WaveformAxes::AnnotationComponent::drawBoxes(Graphics& g)
 
 void WaveformAxes::refresh()
 {
-    spikesReceivedSinceLastRedraw = 0;
-    
+    const double now = Time::getMillisecondCounterHiRes();
+
+    const bool fading = rasterMaxCount >= 0.01f && now - lastDecayTime >= fadeRepaintInterval;
+
+    // the mask shading follows changes made elsewhere (menu, automatic choice, loading)
+    const uint32 stateVersion = electrode->sorter->getStateVersion();
+
+    if (stateVersion != maskStateVersion)
+    {
+        maskStateVersion = stateVersion;
+
+        ProjectionMask mask = electrode->sorter->getProjectionMask();
+
+        if (mask != projectionMask)
+        {
+            projectionMask = mask;
+            needsRepaint = true;
+        }
+    }
+
+    if (!needsRepaint && !fading)
+        return;
+
+    // decay covers the whole time since the last repaint, however long
+    raster.decay(float(std::exp(-(now - lastDecayTime) / (rasterDecaySeconds * 1000.0))));
+    lastDecayTime = now;
+
+    // also repaints the annotations on top
     repaint();
 
-    annotationComponent->repaint();
+    needsRepaint = false;
 }
 
 
@@ -613,10 +757,13 @@ void WaveformAxes::updateUnits(std::vector<BoxUnit> _units)
     units = _units;
 
     annotationComponent->units = &units;
+
+    invalidate();
 }
 
 void WaveformAxes::paint(Graphics& g)
 {
+    const double start = Time::getMillisecondCounterHiRes();
     
     drawWaveformGrid(g);
 
@@ -626,21 +773,66 @@ void WaveformAxes::paint(Graphics& g)
         return;
     }
 
-    for (int spikeNum = 0; spikeNum < bufferSize; spikeNum++)
+    updateRasterImage();
+
+    if (rasterImage.isValid())
     {
+        g.setImageResamplingQuality(Graphics::mediumResamplingQuality);
+        g.drawImage(rasterImage,
+                    0, 0, getWidth(), getHeight(),
+                    0, 0, rasterImage.getWidth(), rasterImage.getHeight());
+    }
+
+    if (latestSpike != nullptr)
+        plotSpike(latestSpike, g);
+
+    drawProjectionMask(g);
+
+    plot->addPaintTime(Time::getMillisecondCounterHiRes() - start);
+
+}
+
+void WaveformAxes::updateRasterImage()
+{
+    const int width = raster.getWidth();
+    const int height = raster.getHeight();
+
+    if (width == 0)
+        return;
+
+    if (rasterImage.getWidth() != width || rasterImage.getHeight() != height)
+        rasterImage = Image(Image::ARGB, width, height, true);
 
-        if (spikeNum != spikeIndex && spikeBuffer[spikeNum] != nullptr)
+    Image::BitmapData data(rasterImage, Image::BitmapData::writeOnly);
+
+    // log scaling keeps rare waveforms visible next to the bulk of a cluster
+    const float maxCount = raster.getMaxCount();
+    rasterMaxCount = maxCount;
+
+    const float scale = maxCount > 0 ? 1.0f / std::log1p(maxCount) : 0.0f;
+
+    for (int y = 0; y < height; y++)
+    {
+        PixelARGB* pixel = (PixelARGB*) data.getLinePointer(signalFlipped ? height - 1 - y : y);
+
+        for (int x = 0; x < width; x++, pixel++)
         {
-            g.setColour(Colours::grey);
-            plotSpike(spikeBuffer[spikeNum], g);
-        }
+            const WaveformRaster::Cell& cell = raster.getCell(x, y);
 
-    }
+            if (cell.count < 0.01f)
+            {
+                pixel->setARGB(0, 0, 0, 0);
+                continue;
+            }
 
-    g.setColour(Colours::white);
-    
-    if (spikeBuffer[spikeIndex] != nullptr)
-        plotSpike(spikeBuffer[spikeIndex], g); 
+            // average unit colour, premultiplied by a brightness that follows the count
+            const float alpha = jmin(1.0f, 0.15f + 0.85f * std::log1p(cell.count) * scale);
+            const float colourScale = alpha / cell.count;
 
-    
+            pixel->setARGB(uint8(alpha * 255.0f),
+                           uint8(jmin(255.0f, cell.red * colourScale)),
+                           uint8(jmin(255.0f, cell.green * colourScale)),
+                           uint8(jmin(255.0f, cell.blue * colourScale)));
+        }
+    }
 }
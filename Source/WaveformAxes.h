@@ -28,6 +28,9 @@
 
 #include "Containers.h"
 #include "SpikeSorterCanvas.h"
+#include "ProjectionMask.h"
+#include "WaveformRaster.h"
+#include "MemoryBudget.h"
 
 #include <vector>
 
@@ -51,20 +54,29 @@ public:
     /** Renders the incoming waveforms */
     void paint(Graphics& g) override;
     
-    /** Sets whether spikes should be redrawn*/
+    /** Decays the waveform raster and repaints, if anything has changed */
     void refresh();
 
     /** Plots an individual spike*/
     void plotSpike(SorterSpikePtr s, Graphics& g);
 
+    /** Appends a spike's trace on this channel to a path as one sub-path */
+    void addSpikeToPath(const SorterSpikeContainer* s, Path& path);
+
     /** Called when axes are resized */
     void resized() override;
 
     void isOverUnitBox(float x, float y, int& UnitID, int& BoxID, String& where) ;
 
-    /** Clears internal spike buffer */
+    /** Clears the waveform raster */
     void clear();
 
+    /** Frees the raster and its image; both are rebuilt from the next spike */
+    void releaseMemory();
+
+    /** Adds the bytes held by the raster, its image and the cached x coordinates */
+    void addMemoryUsage(MemoryUsage& usage) const;
+
     int findUnitIndexById(int id);
 
     /** Mouse callbacks*/
@@ -128,6 +140,15 @@ private:
     /** Draws tick marks behind waveforms */
     void drawWaveformGrid(Graphics& g);
 
+    /** Shades the parts of the waveform left out of PCA */
+    void drawProjectionMask(Graphics& g);
+
+    /** Shows the PCA mask menu for the sample under x (right click) */
+    void showProjectionMaskMenu(float x);
+
+    /** Renders the waveform raster into rasterImage */
+    void updateRasterImage();
+
     bool editAll = false;
     bool signalFlipped = false;
     bool bDragging = false;
@@ -138,15 +159,32 @@ private:
     float displayThresholdLevel = 0.0f;
     float detectorThresholdLevel;
 
-    int spikesReceivedSinceLastRedraw = 0;
-
     float mouseDownX, mouseDownY;
     float mouseOffsetX, mouseOffsetY;
 
-    SorterSpikeArray spikeBuffer;
+    /** Accumulated waveforms of this channel */
+    WaveformRaster raster;
+    Image rasterImage;
+
+    /** Time of the last decay step (ms) */
+    double lastDecayTime = 0;
+
+    /** Highest raster count at the last repaint; clean axes keep fading while it is visible */
+    float rasterMaxCount = 0;
+
+    /** Most recent spike, drawn as a line over the raster */
+    SorterSpikePtr latestSpike;
+
+    /** Screen x of each waveform sample, for the current width and waveform length */
+    std::vector<float> xCoordinates;
+    int xCoordinatesWidth = -1;
+
+    /** Reused by plotSpike, so its storage is only allocated once */
+    Path spikePath;
 
-    int spikeIndex = 0;
-    int bufferSize = 5;
+    /** Copy of the sorter's PCA mask, refreshed when the sorter state changes */
+    ProjectionMask projectionMask;
+    uint32 maskStateVersion = 0;
 
     float range = 250.0f;
 
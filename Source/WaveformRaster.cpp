@@ -0,0 +1,127 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "WaveformRaster.h"
+
+WaveformRaster::WaveformRaster(int columnsPerSample_, int height_)
+    : columnsPerSample(jmax(1, columnsPerSample_)),
+      numSamples(0),
+      width(0),
+      height(jmax(2, height_)),
+      range(250.0f)
+{
+}
+
+void WaveformRaster::setLayout(int numSamples_, float range_)
+{
+    if (numSamples_ == numSamples && range_ == range)
+        return;
+
+    numSamples = jmax(0, numSamples_);
+    range = range_;
+
+    width = jmax(0, (numSamples - 1) * columnsPerSample + 1);
+    cells.assign(size_t(width) * size_t(height), Cell());
+}
+
+void WaveformRaster::add(const float* samples, uint8 red, uint8 green, uint8 blue)
+{
+    if (width == 0 || range <= 0)
+        return;
+
+    const float rowsPerVolt = float(height) / range;
+    const float centre = float(height) * 0.5f;
+
+    int previousRow = -1;
+
+    for (int x = 0; x < width; x++)
+    {
+        // linear interpolation between samples
+        const int i = x / columnsPerSample;
+        const float fraction = float(x % columnsPerSample) / float(columnsPerSample);
+        const float v = i + 1 < numSamples ? samples[i] + (samples[i + 1] - samples[i]) * fraction : samples[i];
+
+        // rows outside the raster are clipped, not piled up on its edges
+        const int row = int(std::floor(jlimit(-1.0f, float(height), centre - v * rowsPerVolt)));
+
+        // fill the rows between this column and the last, so steep edges stay continuous
+        int first = row, last = row;
+
+        if (x > 0)
+        {
+            if (previousRow < row)
+                first = jmin(row, previousRow + 1);
+            else if (previousRow > row)
+                last = jmax(row, previousRow - 1);
+        }
+
+        previousRow = row;
+
+        first = jmax(0, first);
+        last = jmin(height - 1, last);
+
+        for (int y = first; y <= last; y++)
+        {
+            Cell& cell = cells[y * width + x];
+
+            cell.count += 1.0f;
+            cell.red += red;
+            cell.green += green;
+            cell.blue += blue;
+        }
+    }
+}
+
+void WaveformRaster::decay(float factor)
+{
+    for (auto& cell : cells)
+    {
+        cell.count *= factor;
+        cell.red *= factor;
+        cell.green *= factor;
+        cell.blue *= factor;
+    }
+}
+
+void WaveformRaster::clear()
+{
+    std::fill(cells.begin(), cells.end(), Cell());
+}
+
+void WaveformRaster::release()
+{
+    std::vector<Cell>().swap(cells);
+
+    numSamples = 0;
+    width = 0;
+}
+
+float WaveformRaster::getMaxCount() const
+{
+    float maxCount = 0;
+
+    for (auto& cell : cells)
+        maxCount = jmax(maxCount, cell.count);
+
+    return maxCount;
+}
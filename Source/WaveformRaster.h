@@ -0,0 +1,102 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __WAVEFORMRASTER_H__
+#define __WAVEFORMRASTER_H__
+
+#include <ProcessorHeaders.h>
+
+#include <vector>
+
+/**
+    Fixed-size persistence raster of one channel's waveforms.
+
+    Each spike's trace is added to the cells it passes through, together
+    with its unit colour, so every cell knows both how many spikes went
+    through it and the average colour of their units. Counts fade through
+    decay(), which the display applies once per frame.
+
+    Adding a spike costs one cell per column crossed and rendering costs
+    one pass over the raster, however many spikes it holds.
+*/
+class WaveformRaster
+{
+public:
+
+    /** One raster cell */
+    struct Cell
+    {
+        float count = 0;
+        float red = 0;
+        float green = 0;
+        float blue = 0;
+    };
+
+    /** Constructor */
+    WaveformRaster(int columnsPerSample, int height);
+
+    /** Sets the number of samples per waveform and the voltage span
+        (centred on zero) shown; clears the raster if either changes */
+    void setLayout(int numSamples, float range);
+
+    /** Adds one waveform with the colour of its unit */
+    void add(const float* samples, uint8 red, uint8 green, uint8 blue);
+
+    /** Multiplies all cells by factor (0..1) */
+    void decay(float factor);
+
+    /** Empties the raster */
+    void clear();
+
+    /** Frees the cells; the next setLayout() allocates them again */
+    void release();
+
+    /** Returns the bytes held by the cells */
+    int64 getMemoryUsage() const { return int64(cells.capacity()) * (int64) sizeof(Cell); }
+
+    /** Returns a cell; row 0 is the most positive voltage */
+    const Cell& getCell(int x, int y) const { return cells[y * width + x]; }
+
+    /** Returns the highest count in the raster */
+    float getMaxCount() const;
+
+    /** Returns the raster width (columns) */
+    int getWidth() const { return width; }
+
+    /** Returns the raster height (rows) */
+    int getHeight() const { return height; }
+
+private:
+
+    int columnsPerSample;
+    int numSamples;
+    int width;
+    int height;
+    float range;
+
+    std::vector<Cell> cells;
+
+    JUCE_DECLARE_NON_COPYABLE(WaveformRaster);
+};
+
+#endif // __WAVEFORMRASTER_H__
@@ -0,0 +1,123 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SpikeSynthesizer.h"
+
+#include <cmath>
+
+SyntheticElectrode::SyntheticElectrode(const String& name, const SyntheticElectrodeSettings& settings, float sampleRate, int64 seed)
+    : numChannels(settings.numChannels),
+      totalSamples(settings.prePeakSamples + settings.postPeakSamples),
+      noise(settings.noise),
+      random(seed)
+{
+    channel = std::make_unique<SpikeChannel>(name,
+                                             settings.numChannels,
+                                             settings.prePeakSamples,
+                                             settings.postPeakSamples,
+                                             sampleRate);
+
+    // trough width ~0.1 ms, repolarization peak ~0.5 ms after the trough
+    const float troughWidth = 0.0001f * sampleRate;
+    const float reboundDelay = 0.0005f * sampleRate;
+    const float reboundWidth = 0.0002f * sampleRate;
+
+    for (int unit = 0; unit < settings.numUnits; unit++)
+    {
+        std::vector<float> waveform(numChannels * totalSamples);
+
+        float amplitude = settings.minAmplitude + random.nextFloat() * (settings.maxAmplitude - settings.minAmplitude);
+        int mainChannel = random.nextInt(numChannels);
+
+        for (int ch = 0; ch < numChannels; ch++)
+        {
+            float scale = (ch == mainChannel) ? 1.0f : 0.15f + 0.6f * random.nextFloat();
+
+            if (settings.footprint >= 0 && std::abs(ch - mainChannel) > settings.footprint)
+                scale = 0;
+
+            for (int i = 0; i < totalSamples; i++)
+            {
+                float t = float(i - settings.prePeakSamples);
+
+                float trough = -std::exp(-t * t / (2.0f * troughWidth * troughWidth));
+                float rebound = 0.35f * std::exp(-(t - reboundDelay) * (t - reboundDelay) / (2.0f * reboundWidth * reboundWidth));
+
+                waveform[ch * totalSamples + i] = amplitude * scale * (trough + rebound);
+            }
+        }
+
+        templates.push_back(waveform);
+        mainChannels.push_back(mainChannel);
+        troughAmplitudes.push_back(waveform[mainChannel * totalSamples + settings.prePeakSamples]);
+    }
+}
+
+float SyntheticElectrode::nextGaussian()
+{
+    // Box-Muller transform
+    float u1 = jmax(random.nextFloat(), 1.0e-7f);
+    float u2 = random.nextFloat();
+
+    return std::sqrt(-2.0f * std::log(u1)) * std::cos(2.0f * float(M_PI) * u2);
+}
+
+void SyntheticElectrode::synthesize(int unit, float* dest)
+{
+    const float* source = templates[unit].data();
+
+    for (int k = 0; k < numChannels * totalSamples; k++)
+        dest[k] = source[k] + noise * nextGaussian();
+}
+
+SpikeSynthesizer::SpikeSynthesizer(int numElectrodes, const SyntheticElectrodeSettings& settings, float sampleRate_, int64 seed)
+    : sampleRate(sampleRate_),
+      firingRate(settings.firingRate),
+      random(seed)
+{
+    for (int e = 0; e < numElectrodes; e++)
+    {
+        electrodes.add(new SyntheticElectrode("Electrode " + String(e + 1), settings, sampleRate, seed + e + 1));
+
+        for (int unit = 0; unit < settings.numUnits; unit++)
+            pending.push({ nextInterval(), e, unit });
+    }
+}
+
+int64 SpikeSynthesizer::nextInterval()
+{
+    // exponential inter-spike interval, at least one sample
+    float u = jmax(random.nextFloat(), 1.0e-7f);
+
+    return jmax((int64) 1, (int64) (-std::log(u) / firingRate * sampleRate));
+}
+
+SyntheticSpike SpikeSynthesizer::next()
+{
+    SyntheticSpike spike = pending.top();
+    pending.pop();
+
+    pending.push({ spike.sampleNumber + nextInterval(), spike.electrode, spike.unit });
+
+    return spike;
+}
@@ -0,0 +1,165 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __SPIKESYNTHESIZER_H
+#define __SPIKESYNTHESIZER_H
+
+#include <ProcessorHeaders.h>
+
+#include <queue>
+#include <vector>
+
+/**
+    Parameters shared by every synthetic electrode
+*/
+struct SyntheticElectrodeSettings
+{
+    int numChannels = 4;
+    int prePeakSamples = 8;
+    int postPeakSamples = 32;
+    int numUnits = 3;
+
+    /** Mean firing rate of each unit (Hz) */
+    float firingRate = 20.0f;
+
+    /** Standard deviation of the additive noise (uV) */
+    float noise = 10.0f;
+
+    /** Channels on either side of a unit's main channel that see it (-1 = all),
+        as on a dense probe where a unit only reaches nearby sites */
+    int footprint = -1;
+
+        /** Range of trough amplitudes on the main channel (uV) */
+    float minAmplitude = 80.0f;
+    float maxAmplitude = 250.0f;
+};
+
+/**
+    One synthetic electrode: a fixed set of unit templates plus Gaussian noise
+*/
+class SyntheticElectrode
+{
+public:
+
+    /** Constructor */
+    SyntheticElectrode(const String& name, const SyntheticElectrodeSettings& settings, float sampleRate, int64 seed);
+
+    /** Returns the channel description used to build spikes */
+    const SpikeChannel* getChannel() const { return channel.get(); }
+
+    /** Returns the number of units on this electrode */
+    int getNumUnits() const { return (int) templates.size(); }
+
+    /** Returns the noise-free waveform of a unit (numChannels * totalSamples values) */
+    const float* getTemplate(int unit) const { return templates[unit].data(); }
+
+    /** Returns the channel with the largest trough for a unit */
+    int getMainChannel(int unit) const { return mainChannels[unit]; }
+
+    /** Returns the trough amplitude of a unit on its main channel */
+    float getTroughAmplitude(int unit) const { return troughAmplitudes[unit]; }
+
+    /** Writes one noisy instance of a unit's waveform to dest */
+    void synthesize(int unit, float* dest);
+
+    /** Number of values in one waveform */
+    int getWaveformSize() const { return numChannels * totalSamples; }
+
+    /** Noise standard deviation (uV) */
+    float getNoise() const { return noise; }
+
+private:
+
+    float nextGaussian();
+
+    std::unique_ptr<SpikeChannel> channel;
+
+    std::vector<std::vector<float>> templates;
+    std::vector<int> mainChannels;
+    std::vector<float> troughAmplitudes;
+
+    int numChannels;
+    int totalSamples;
+    float noise;
+
+    Random random;
+};
+
+/**
+    A spike emitted by the synthesizer
+*/
+struct SyntheticSpike
+{
+    int64 sampleNumber;
+    int electrode;
+    int unit;
+};
+
+/**
+    Generates a time-ordered stream of spikes from many electrodes,
+    each unit firing as an independent Poisson process.
+
+    Spikes are produced one at a time, so arbitrarily long runs
+    need no storage beyond one pending spike per unit.
+*/
+class SpikeSynthesizer
+{
+public:
+
+    /** Constructor */
+    SpikeSynthesizer(int numElectrodes, const SyntheticElectrodeSettings& settings, float sampleRate, int64 seed);
+
+    /** Returns the number of electrodes */
+    int getNumElectrodes() const { return electrodes.size(); }
+
+    /** Returns an electrode by index */
+    SyntheticElectrode* getElectrode(int index) const { return electrodes[index]; }
+
+    /** Returns the sample rate of the simulated recording */
+    float getSampleRate() const { return sampleRate; }
+
+    /** Returns the next spike in time order */
+    SyntheticSpike next();
+
+private:
+
+    struct Later
+    {
+        bool operator()(const SyntheticSpike& a, const SyntheticSpike& b) const
+        {
+            return a.sampleNumber > b.sampleNumber;
+        }
+    };
+
+    int64 nextInterval();
+
+    OwnedArray<SyntheticElectrode> electrodes;
+    std::priority_queue<SyntheticSpike, std::vector<SyntheticSpike>, Later> pending;
+
+    float sampleRate;
+    float firingRate;
+
+    Random random;
+};
+
+#endif // __SPIKESYNTHESIZER_H
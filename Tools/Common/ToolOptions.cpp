@@ -0,0 +1,122 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ToolOptions.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+ToolOptions::ToolOptions(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        String arg(argv[i]);
+
+        if (arg.startsWith("--"))
+        {
+            String name = arg.substring(2);
+
+            if (i + 1 < argc && !String(argv[i + 1]).startsWith("--"))
+                values[name.toStdString()] = String(argv[++i]);
+            else
+                values[name.toStdString()] = String();
+        }
+        else
+        {
+            positional.add(arg);
+        }
+    }
+}
+
+bool ToolOptions::has(const String& name) const
+{
+    return values.count(name.toStdString()) > 0;
+}
+
+String ToolOptions::getString(const String& name, const String& defaultValue) const
+{
+    auto it = values.find(name.toStdString());
+
+    if (it == values.end() || it->second.isEmpty())
+        return defaultValue;
+
+    return it->second;
+}
+
+int ToolOptions::getInt(const String& name, int defaultValue) const
+{
+    return has(name) ? getString(name, String(defaultValue)).getIntValue() : defaultValue;
+}
+
+double ToolOptions::getDouble(const String& name, double defaultValue) const
+{
+    return has(name) ? getString(name, String(defaultValue)).getDoubleValue() : defaultValue;
+}
+
+float LatencyStats::percentile(double p)
+{
+    if (samples.size() == 0)
+        return 0.0f;
+
+    if (!sorted)
+    {
+        std::sort(samples.begin(), samples.end());
+        sorted = true;
+    }
+
+    size_t index = jmin(samples.size() - 1, (size_t) (p / 100.0 * double(samples.size())));
+
+    return samples[index];
+}
+
+float LatencyStats::maximum()
+{
+    return percentile(100.0);
+}
+
+double LatencyStats::mean() const
+{
+    if (samples.size() == 0)
+        return 0.0;
+
+    double sum = 0;
+
+    for (auto s : samples)
+        sum += s;
+
+    return sum / double(samples.size());
+}
+
+void LatencyStats::print(const char* label, const char* units)
+{
+    printf("%-24s n=%-9zu mean=%8.2f  p50=%8.2f  p90=%8.2f  p99=%8.2f  p99.9=%8.2f  max=%8.2f %s\n",
+           label,
+           samples.size(),
+           mean(),
+           percentile(50),
+           percentile(90),
+           percentile(99),
+           percentile(99.9),
+           maximum(),
+           units);
+}
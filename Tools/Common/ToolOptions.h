@@ -0,0 +1,89 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __TOOLOPTIONS_H
+#define __TOOLOPTIONS_H
+
+#include <ProcessorHeaders.h>
+
+#include <vector>
+
+/**
+    Minimal "--name value" / "--flag" command-line parser for the tools
+*/
+class ToolOptions
+{
+public:
+
+    /** Constructor */
+    ToolOptions(int argc, char* argv[]);
+
+    /** Returns true if --name was given */
+    bool has(const String& name) const;
+
+    /** Returns the value following --name, or a default */
+    String getString(const String& name, const String& defaultValue) const;
+    int getInt(const String& name, int defaultValue) const;
+    double getDouble(const String& name, double defaultValue) const;
+
+    /** Returns arguments that are not options or option values */
+    const StringArray& getPositional() const { return positional; }
+
+private:
+
+    std::map<std::string, String> values;
+    StringArray positional;
+};
+
+/**
+    Collects latency samples and reports percentiles
+*/
+class LatencyStats
+{
+public:
+
+    /** Adds one sample (microseconds) */
+    void add(float microseconds) { samples.push_back(microseconds); }
+
+    /** Number of samples */
+    size_t size() const { return samples.size(); }
+
+    /** Returns the p-th percentile (0-100); sorts on first use */
+    float percentile(double p);
+
+    /** Returns the largest sample */
+    float maximum();
+
+    /** Returns the mean */
+    double mean() const;
+
+    /** Prints count, mean, p50/p90/p99/p99.9 and max on one line */
+    void print(const char* label, const char* units = "us");
+
+private:
+
+    std::vector<float> samples;
+    bool sorted = false;
+};
+
+#endif // __TOOLOPTIONS_H
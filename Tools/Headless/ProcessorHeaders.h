@@ -0,0 +1,104 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2013 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __HEADLESS_PROCESSORHEADERS_H__
+#define __HEADLESS_PROCESSORHEADERS_H__
+
+/**
+    Stand-in for the GUI's ProcessorHeaders.h, used when the sorting
+    classes (Sorter, BoxUnit, PCAUnit, PCAjob, WaveformStats) are built
+    into the command-line tools without the Open Ephys GUI.
+
+    Only juce_core is required. SpikeChannel provides the subset of the
+    GUI's SpikeChannel interface that the sorting classes rely on.
+*/
+
+#include <juce_core/juce_core.h>
+
+using namespace juce;
+
+#include <vector>
+#include <map>
+
+#ifndef LOGD
+#define LOGD(...)
+#endif
+
+#ifndef LOGC
+#define LOGC(...)
+#endif
+
+/**
+    Describes a spike source (one electrode) for headless sorting
+*/
+class SpikeChannel
+{
+public:
+
+    /** Constructor */
+    SpikeChannel(const String& name_,
+                 int numChannels_,
+                 int prePeakSamples_,
+                 int postPeakSamples_,
+                 float sampleRate_)
+        : name(name_),
+          numChannels(numChannels_),
+          prePeakSamples(prePeakSamples_),
+          postPeakSamples(postPeakSamples_),
+          sampleRate(sampleRate_)
+    {
+    }
+
+    /** Returns the electrode name */
+    String getName() const { return name; }
+
+    /** Returns a string that uniquely identifies this electrode */
+    String getIdentifier() const { return name; }
+
+    /** Returns the number of channels in each waveform */
+    int getNumChannels() const { return numChannels; }
+
+    /** Returns the number of samples before the peak */
+    unsigned int getPrePeakSamples() const { return prePeakSamples; }
+
+    /** Returns the number of samples after the peak */
+    unsigned int getPostPeakSamples() const { return postPeakSamples; }
+
+    /** Returns the number of samples per channel */
+    unsigned int getTotalSamples() const { return prePeakSamples + postPeakSamples; }
+
+    /** Returns the sample rate of the continuous data the spikes came from */
+    float getSampleRate() const { return sampleRate; }
+
+private:
+
+    String name;
+    int numChannels;
+    int prePeakSamples;
+    int postPeakSamples;
+    float sampleRate;
+
+    JUCE_DECLARE_NON_COPYABLE(SpikeChannel);
+};
+
+#endif // __HEADLESS_PROCESSORHEADERS_H__
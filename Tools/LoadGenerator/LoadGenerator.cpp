@@ -0,0 +1,368 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Synthetic load generator for the Spike Sorter.
+
+    Synthesizes spikes for N electrodes and pushes them through the same
+    per-spike path as SpikeSorter::handleSpike (container construction,
+    threshold check, PC projection and unit classification), with box or
+    polygon units configured around every template. Reports sustained
+    throughput, per-spike latency and per-block load, so the number of
+    spikes/s one core can sort before the audio callback overruns can be
+    read off directly.
+*/
+
+#include <ProcessorHeaders.h>
+
+#include "Sorter.h"
+#include "BoxUnit.h"
+#include "PCAUnit.h"
+#include "PCAComputingThread.h"
+#include "SpikeRecorder.h"
+#include "RealtimeAudit.h"
+
+#include "SpikeSynthesizer.h"
+#include "ToolOptions.h"
+
+#include <stdio.h>
+
+static void printUsage()
+{
+    printf("Usage: spike-sorter-loadgen [options]\n\n"
+           "  --electrodes N      number of electrodes (16)\n"
+           "  --channels N        channels per electrode (4)\n"
+           "  --pre N             samples before the peak (8)\n"
+           "  --post N            samples after the peak (32)\n"
+           "  --units N           units per electrode (3)\n"
+           "  --rate HZ           firing rate of each unit (20)\n"
+           "  --noise UV          noise standard deviation (10)\n"
+           "  --threshold UV      display threshold on every channel (0)\n"
+           "  --unit-type TYPE    box, pca or mixed (mixed)\n"
+           "  --seconds S         simulated recording length (30)\n"
+           "  --sample-rate HZ    sample rate (30000)\n"
+           "  --block-size N      audio block size used for the overrun model (1024)\n"
+           "  --seed N            random seed (1)\n"
+           "  --record FILE       also write the measured spikes to a spike log for spike-sorter-replay\n"
+#if SPIKE_SORTER_REALTIME_AUDIT
+           "  --audit-trap        stop at the first allocation or lock on the per-spike path\n"
+#endif
+           "\nExits with status 1 if any simulated audio block overran.\n");
+}
+
+/** Converts a waveform sample index to the microsecond axis used by Box */
+static double binToMicroseconds(const SpikeChannel* channel, int bin)
+{
+    double spikeTimeSpan = 1.0 / channel->getSampleRate() * channel->getTotalSamples() * 1e6;
+    return double(bin) / (channel->getTotalSamples() - 1) * spikeTimeSpan;
+}
+
+struct SortedElectrode
+{
+    SyntheticElectrode* source;
+    std::unique_ptr<Sorter> sorter;
+    Array<float> thresholds;
+    std::vector<int> unitIds; // ground-truth unit -> sorter unit ID
+};
+
+/** Adds a box unit around the trough of a template */
+static int addBoxUnitForTemplate(SortedElectrode& e, int unit)
+{
+    const SpikeChannel* channel = e.source->getChannel();
+
+    float trough = e.source->getTroughAmplitude(unit);
+    int peakBin = channel->getPrePeakSamples();
+
+    double x = binToMicroseconds(channel, peakBin - 1);
+    double w = binToMicroseconds(channel, 2);
+    double halfHeight = std::abs(trough) * 0.3;
+
+    Box box(x, trough + halfHeight, w, 2 * halfHeight, e.source->getMainChannel(unit));
+
+    return e.sorter->addBoxUnit(box.channel, box);
+}
+
+/** Adds a square polygon unit around the projection of a template */
+static int addPCAUnitForTemplate(SortedElectrode& e, int unit)
+{
+    SorterSpikePtr spike = new SorterSpikeContainer(e.source->getChannel(), 0, 0, e.source->getTemplate(unit));
+    e.sorter->projectOnPrincipalComponents(spike);
+
+    float halfWidth = 3.0f * e.source->getNoise();
+
+    cPolygon poly;
+    poly.pts.push_back(PointD(spike->pcProj[0] - halfWidth, spike->pcProj[1] - halfWidth));
+    poly.pts.push_back(PointD(spike->pcProj[0] + halfWidth, spike->pcProj[1] - halfWidth));
+    poly.pts.push_back(PointD(spike->pcProj[0] + halfWidth, spike->pcProj[1] + halfWidth));
+    poly.pts.push_back(PointD(spike->pcProj[0] - halfWidth, spike->pcProj[1] + halfWidth));
+
+    PCAUnit pcaUnit(poly, Sorter::generateUnitId());
+    pcaUnit.updateColor();
+    e.sorter->addPCAunit(pcaUnit);
+
+    return pcaUnit.getUnitId();
+}
+
+int main(int argc, char* argv[])
+{
+    ToolOptions options(argc, argv);
+
+    if (options.has("help"))
+    {
+        printUsage();
+        return 0;
+    }
+
+#if SPIKE_SORTER_REALTIME_AUDIT
+    RealtimeAudit::setTrap(options.has("audit-trap"));
+#endif
+
+    SyntheticElectrodeSettings settings;
+    settings.numChannels = options.getInt("channels", 4);
+    settings.prePeakSamples = options.getInt("pre", 8);
+    settings.postPeakSamples = options.getInt("post", 32);
+    settings.numUnits = jmax(1, options.getInt("units", 3));
+    settings.firingRate = (float) options.getDouble("rate", 20.0);
+    settings.noise = (float) options.getDouble("noise", 10.0);
+
+    const int numElectrodes = jmax(1, options.getInt("electrodes", 16));
+    const float sampleRate = (float) options.getDouble("sample-rate", 30000.0);
+    const double seconds = options.getDouble("seconds", 30.0);
+    const int blockSize = jmax(1, options.getInt("block-size", 1024));
+    const float threshold = (float) options.getDouble("threshold", 0.0);
+    const String unitType = options.getString("unit-type", "mixed");
+
+    SpikeSynthesizer synthesizer(numElectrodes, settings, sampleRate, options.getInt("seed", 1));
+    PCAComputingThread computingThread;
+
+    std::vector<SortedElectrode> electrodes(numElectrodes);
+
+    for (int e = 0; e < numElectrodes; e++)
+    {
+        electrodes[e].source = synthesizer.getElectrode(e);
+        electrodes[e].sorter = std::make_unique<Sorter>(settings.numChannels,
+                                                        settings.prePeakSamples + settings.postPeakSamples,
+                                                        &computingThread);
+
+        for (int ch = 0; ch < settings.numChannels; ch++)
+            electrodes[e].thresholds.add(threshold);
+
+        electrodes[e].unitIds.resize(settings.numUnits, 0);
+    }
+
+    HeapBlock<float> waveform(settings.numChannels * (settings.prePeakSamples + settings.postPeakSamples));
+
+    // 1. Warm up until every electrode has a PC basis
+
+    printf("Warming up (collecting spikes for PCA)...\n");
+
+    int64 lastSampleNumber = 0;
+    int numWithBasis = 0;
+    std::vector<bool> hasBasis(numElectrodes, false);
+
+    while (numWithBasis < numElectrodes)
+    {
+        SyntheticSpike s = synthesizer.next();
+        SortedElectrode& e = electrodes[s.electrode];
+
+        e.source->synthesize(s.unit, waveform);
+
+        SorterSpikePtr spike = new SorterSpikeContainer(e.source->getChannel(), 0, s.sampleNumber, waveform);
+
+        if (spike->checkThresholds(e.thresholds))
+            e.sorter->processSpike(spike);
+
+        if (!hasBasis[s.electrode] && e.sorter->firstJobFinished())
+        {
+            hasBasis[s.electrode] = true;
+            numWithBasis++;
+        }
+
+        lastSampleNumber = s.sampleNumber;
+    }
+
+    // 2. Configure one unit per template
+
+    for (int e = 0; e < numElectrodes; e++)
+    {
+        for (int unit = 0; unit < settings.numUnits; unit++)
+        {
+            bool useBox = unitType == "box" || (unitType == "mixed" && unit % 2 == 0);
+
+            electrodes[e].unitIds[unit] = useBox ? addBoxUnitForTemplate(electrodes[e], unit)
+                                                 : addPCAUnitForTemplate(electrodes[e], unit);
+        }
+    }
+
+    // 3. Measure
+
+    printf("Running %d electrodes x %d units x %.1f Hz for %.1f s of simulated data...\n",
+           numElectrodes, settings.numUnits, settings.firingRate, seconds);
+
+    const int64 startSample = lastSampleNumber + 1;
+    const int64 endSample = startSample + int64(seconds * sampleRate);
+    const double ticksToMicroseconds = 1.0e6 / double(Time::getHighResolutionTicksPerSecond());
+
+    LatencyStats spikeLatency;
+    LatencyStats blockLoad;
+
+    int64 currentBlock = startSample / blockSize;
+    double blockMicroseconds = 0;
+    const double blockDuration = double(blockSize) / sampleRate * 1.0e6;
+    int64 overruns = 0;
+    int64 numBlocks = 0;
+
+    int64 numSpikes = 0, numPassed = 0, numSorted = 0, numCorrect = 0;
+    double totalMicroseconds = 0;
+
+    SpikeRecorder recorder;
+
+    if (options.has("record"))
+    {
+        Array<SpikeLog::ElectrodeInfo> info;
+
+        for (int e = 0; e < numElectrodes; e++)
+        {
+            const SpikeChannel* channel = electrodes[e].source->getChannel();
+
+            SpikeLog::ElectrodeInfo electrodeInfo;
+            electrodeInfo.index = e;
+            electrodeInfo.name = channel->getName();
+            electrodeInfo.identifier = channel->getIdentifier();
+            electrodeInfo.numChannels = channel->getNumChannels();
+            electrodeInfo.prePeakSamples = channel->getPrePeakSamples();
+            electrodeInfo.postPeakSamples = channel->getPostPeakSamples();
+            electrodeInfo.sampleRate = channel->getSampleRate();
+            info.add(electrodeInfo);
+
+            electrodes[e].sorter->setStateHistory(true);
+        }
+
+        File logFile = File::getCurrentWorkingDirectory().getChildFile(options.getString("record", "loadgen.spklog"));
+
+        if (!recorder.start(logFile, info))
+        {
+            printf("Could not open %s\n", logFile.getFullPathName().toRawUTF8());
+            return 1;
+        }
+    }
+
+    while (true)
+    {
+        SyntheticSpike s = synthesizer.next();
+
+        if (s.sampleNumber < startSample)
+            continue;
+
+        if (s.sampleNumber >= endSample)
+            break;
+
+        SortedElectrode& e = electrodes[s.electrode];
+        e.source->synthesize(s.unit, waveform);
+
+        // --- equivalent of SpikeSorter::handleSpike ---
+        int64 start, end;
+        bool passed;
+        uint16 sortedId;
+
+        {
+            REALTIME_AUDIT_SCOPE;
+
+            start = Time::getHighResolutionTicks();
+
+            SorterSpikePtr spike = new SorterSpikeContainer(e.source->getChannel(), 0, s.sampleNumber, waveform);
+
+            passed = spike->checkThresholds(e.thresholds);
+
+            if (passed)
+                e.sorter->processSpike(spike);
+
+            if (recorder.isRecording())
+                recorder.recordSpike(s.electrode, e.sorter.get(), e.thresholds, SORT_AND_DISPLAY, spike, 0);
+
+            sortedId = spike->sortedId;
+            spike = nullptr;
+
+            end = Time::getHighResolutionTicks();
+        }
+        // ----------------------------------------------
+
+        float elapsed = float(double(end - start) * ticksToMicroseconds);
+
+        spikeLatency.add(elapsed);
+        totalMicroseconds += elapsed;
+
+        int64 block = s.sampleNumber / blockSize;
+
+        while (currentBlock < block)
+        {
+            blockLoad.add(float(blockMicroseconds / blockDuration * 100.0));
+
+            if (blockMicroseconds > blockDuration)
+                overruns++;
+
+            numBlocks++;
+            blockMicroseconds = 0;
+            currentBlock++;
+        }
+
+        blockMicroseconds += elapsed;
+
+        numSpikes++;
+        numPassed += passed ? 1 : 0;
+        numSorted += sortedId > 0 ? 1 : 0;
+        numCorrect += sortedId == e.unitIds[s.unit] ? 1 : 0;
+    }
+
+    computingThread.stopThread(1000);
+
+    if (recorder.isRecording())
+    {
+        recorder.stop();
+        printf("Recorded to %s (%lld records dropped)\n",
+               recorder.getFile().getFullPathName().toRawUTF8(), (long long) recorder.getNumDropped());
+    }
+
+    // 4. Report
+
+    double offeredRate = double(numSpikes) / seconds;
+    double capacity = totalMicroseconds > 0 ? double(numSpikes) / (totalMicroseconds * 1.0e-6) : 0;
+
+    printf("\n");
+    printf("Spikes processed          %lld (%lld above threshold, %lld sorted, %.1f%% matched ground truth)\n",
+           (long long) numSpikes, (long long) numPassed, (long long) numSorted,
+           numSpikes > 0 ? 100.0 * double(numCorrect) / double(numSpikes) : 0.0);
+    printf("Offered load              %.0f spikes/s\n", offeredRate);
+    printf("Sustained throughput      %.0f spikes/s on one core (%.1fx the offered load)\n",
+           capacity, offeredRate > 0 ? capacity / offeredRate : 0.0);
+    spikeLatency.print("Per-spike latency");
+    blockLoad.print("Block load", "% of block");
+    printf("Block overruns            %lld of %lld blocks of %d samples\n",
+           (long long) overruns, (long long) numBlocks, blockSize);
+
+#if SPIKE_SORTER_REALTIME_AUDIT
+    printf("Real-time audit           %s\n", RealtimeAudit::getReport().toRawUTF8());
+#endif
+
+    return overruns > 0 ? 1 : 0;
+}
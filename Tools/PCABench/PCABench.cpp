@@ -0,0 +1,316 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Benchmarks the PCA job and the per-spike projection for electrodes
+    with many channels.
+
+    For each channel count, a training buffer of synthetic spikes is run
+    through PCAjob (as the computing thread does) and the resulting basis
+    is used to project fresh spikes (as Sorter does on the audio thread).
+    The same is then repeated with the channel and window mask chosen
+    from the first basis. Reports the job time, the projection cost per
+    spike and how well the synthetic units separate in the two-component
+    projection, so changes to the PCA code can be checked for both speed
+    and quality. Finally the whole-waveform basis is trained again from
+    16-bit copies of the training spikes (Sorter::setCompactStorage), and
+    the share of fresh spikes assigned to their own unit is compared
+    with the float basis.
+*/
+
+#include <ProcessorHeaders.h>
+
+#include "Sorter.h"
+#include "PCAJob.h"
+#include "PCAComputingThread.h"
+
+#include "SpikeSynthesizer.h"
+#include "ToolOptions.h"
+
+#include <stdio.h>
+
+static void printUsage()
+{
+    printf("Usage: spike-sorter-pcabench [options]\n\n"
+           "  --channels LIST     comma-separated channel counts (4,8,16,32)\n"
+           "  --pre N             samples before the peak (8)\n"
+           "  --post N            samples after the peak (32)\n"
+           "  --units N           units per electrode (3)\n"
+           "  --noise UV          noise standard deviation (10)\n"
+           "  --footprint N       channels either side of a unit's main channel that see it (2, -1 = all)\n"
+           "  --energy F          share of the PC loadings kept by the automatic mask (0.9)\n"
+           "  --spikes N          spikes in the training buffer (200)\n"
+           "  --repeats N         PCA jobs per channel count; the fastest is reported (5)\n"
+           "  --projections N     spikes projected to time the projection (20000)\n"
+           "  --seed N            random seed (1)\n");
+}
+
+/** Smallest distance between two unit centroids in PC space, in units of the
+    pooled within-unit standard deviation */
+static double unitSeparation(const std::vector<float>& x, const std::vector<float>& y,
+                             const std::vector<int>& units, int numUnits)
+{
+    std::vector<double> meanX(numUnits, 0), meanY(numUnits, 0);
+    std::vector<int> counts(numUnits, 0);
+
+    for (size_t i = 0; i < units.size(); i++)
+    {
+        meanX[units[i]] += x[i];
+        meanY[units[i]] += y[i];
+        counts[units[i]]++;
+    }
+
+    for (int u = 0; u < numUnits; u++)
+    {
+        meanX[u] /= jmax(1, counts[u]);
+        meanY[u] /= jmax(1, counts[u]);
+    }
+
+    double variance = 0;
+
+    for (size_t i = 0; i < units.size(); i++)
+    {
+        const double dx = x[i] - meanX[units[i]];
+        const double dy = y[i] - meanY[units[i]];
+        variance += dx * dx + dy * dy;
+    }
+
+    const double sd = std::sqrt(variance / jmax(size_t(1), units.size()) / 2.0);
+
+    double minDistance = 1e30;
+
+    for (int a = 0; a < numUnits; a++)
+        for (int b = a + 1; b < numUnits; b++)
+            minDistance = jmin(minDistance, std::hypot(meanX[a] - meanX[b], meanY[a] - meanY[b]));
+
+    return sd > 0 ? minDistance / sd : 0;
+}
+
+/** Share of spikes whose nearest unit centroid in PC space is their own unit */
+static double nearestCentroidAccuracy(const std::vector<float>& x, const std::vector<float>& y,
+                                      const std::vector<int>& units, int numUnits)
+{
+    std::vector<double> meanX(numUnits, 0), meanY(numUnits, 0);
+    std::vector<int> counts(numUnits, 0);
+
+    for (size_t i = 0; i < units.size(); i++)
+    {
+        meanX[units[i]] += x[i];
+        meanY[units[i]] += y[i];
+        counts[units[i]]++;
+    }
+
+    for (int u = 0; u < numUnits; u++)
+    {
+        meanX[u] /= jmax(1, counts[u]);
+        meanY[u] /= jmax(1, counts[u]);
+    }
+
+    int numCorrect = 0;
+
+    for (size_t i = 0; i < units.size(); i++)
+    {
+        int nearest = 0;
+        double nearestDistance = 1e30;
+
+        for (int u = 0; u < numUnits; u++)
+        {
+            const double distance = std::hypot(x[i] - meanX[u], y[i] - meanY[u]);
+
+            if (distance < nearestDistance)
+            {
+                nearest = u;
+                nearestDistance = distance;
+            }
+        }
+
+        if (nearest == units[i])
+            numCorrect++;
+    }
+
+    return double(numCorrect) / double(jmax(size_t(1), units.size()));
+}
+
+/** Runs PCA jobs over a mask and returns the fastest time (ms) */
+static double timePCAJob(SorterSpikeArray& spikes, const ProjectionMask& mask, float* pc1, float* pc2, int repeats)
+{
+    std::atomic<float> pc1min(0), pc2min(0), pc1max(0), pc2max(0);
+    std::atomic<bool> done(false);
+
+    const double ticksToMilliseconds = 1.0e3 / double(Time::getHighResolutionTicksPerSecond());
+    double bestMilliseconds = 1e30;
+
+    for (int r = 0; r < repeats; r++)
+    {
+        PCAJobPtr job = new PCAjob(spikes, pc1, pc2, mask, pc1min, pc2min, pc1max, pc2max, done);
+
+        const int64 start = Time::getHighResolutionTicks();
+        job->computeCov();
+        job->computeSVD();
+        const int64 end = Time::getHighResolutionTicks();
+
+        bestMilliseconds = jmin(bestMilliseconds, double(end - start) * ticksToMilliseconds);
+    }
+
+    return bestMilliseconds;
+}
+
+/** Projects spikes through a Sorter, as on the audio thread; returns the time per spike (us) */
+static double timeProjection(Sorter& sorter, const std::vector<SorterSpikePtr>& spikes, int numProjections,
+                             std::vector<float>& x, std::vector<float>& y)
+{
+    const int64 start = Time::getHighResolutionTicks();
+
+    for (int i = 0; i < numProjections; i++)
+        sorter.projectOnPrincipalComponents(spikes[i % spikes.size()]);
+
+    const int64 end = Time::getHighResolutionTicks();
+
+    x.clear();
+    y.clear();
+
+    for (auto& spike : spikes)
+    {
+        sorter.projectOnPrincipalComponents(spike);
+        x.push_back(spike->pcProj[0]);
+        y.push_back(spike->pcProj[1]);
+    }
+
+    return double(end - start) * 1.0e6 / double(Time::getHighResolutionTicksPerSecond()) / numProjections;
+}
+
+int main(int argc, char* argv[])
+{
+    ToolOptions options(argc, argv);
+
+    if (options.has("help"))
+    {
+        printUsage();
+        return 0;
+    }
+
+    StringArray channelCounts = StringArray::fromTokens(options.getString("channels", "4,8,16,32"), ",", "");
+
+    SyntheticElectrodeSettings settings;
+    settings.prePeakSamples = options.getInt("pre", 8);
+    settings.postPeakSamples = options.getInt("post", 32);
+    settings.numUnits = jmax(2, options.getInt("units", 3));
+    settings.noise = (float) options.getDouble("noise", 10.0);
+    settings.footprint = options.getInt("footprint", 2);
+
+    const float energy = (float) jlimit(0.1, 1.0, options.getDouble("energy", 0.9));
+    const int numTrainingSpikes = jmax(3, options.getInt("spikes", 200));
+    const int repeats = jmax(1, options.getInt("repeats", 5));
+    const int numProjections = jmax(1, options.getInt("projections", 20000));
+    const int seed = options.getInt("seed", 1);
+
+    printf("Each pair of columns is whole waveform -> automatic mask,\n"
+           "except accuracy: float -> 16-bit training spikes (whole waveform)\n\n");
+    printf("%8s %15s %19s %17s %15s %17s\n", "channels", "values/spike", "PCA job ms", "projection us",
+           "separation", "accuracy %");
+
+    for (auto& count : channelCounts)
+    {
+        settings.numChannels = jmax(1, count.trim().getIntValue());
+
+        SyntheticElectrode electrode("Bench", settings, 30000.0f, seed);
+        const int dim = electrode.getWaveformSize();
+        const int totalSamples = electrode.getChannel()->getTotalSamples();
+
+        // training buffer, units in turn
+        SorterSpikeArray spikes;
+        HeapBlock<float> waveform(dim);
+
+        for (int i = 0; i < numTrainingSpikes; i++)
+        {
+            electrode.synthesize(i % settings.numUnits, waveform.getData());
+            spikes.add(new SorterSpikeContainer(electrode.getChannel(), 0, i, waveform));
+        }
+
+        std::vector<SorterSpikePtr> testSpikes;
+        std::vector<int> testUnits;
+
+        for (int i = 0; i < jmin(numProjections, 2000); i++)
+        {
+            const int unit = i % settings.numUnits;
+            electrode.synthesize(unit, waveform.getData());
+            testSpikes.push_back(new SorterSpikeContainer(electrode.getChannel(), 0, i, waveform));
+            testUnits.push_back(unit);
+        }
+
+        // whole waveform
+        ProjectionMask fullMask(settings.numChannels, totalSamples);
+        HeapBlock<float> pc1(dim), pc2(dim);
+
+        const double fullJob = timePCAJob(spikes, fullMask, pc1, pc2, repeats);
+
+        // mask chosen from that basis, as the Sorter does in automatic mode
+        ProjectionMask mask(settings.numChannels, totalSamples);
+        mask.chooseFromLoadings(pc1, pc2, energy);
+
+        HeapBlock<float> maskedPc1(dim), maskedPc2(dim);
+
+        const double maskedJob = timePCAJob(spikes, mask, maskedPc1, maskedPc2, repeats);
+
+        Sorter sorter(settings.numChannels, totalSamples, nullptr);
+        sorter.setAutomaticPCA(false);
+
+        std::vector<float> x, y;
+
+        sorter.setProjectionMask(fullMask, MASK_NONE);
+        sorter.setBasis(pc1, pc2);
+        const double fullProjection = timeProjection(sorter, testSpikes, numProjections, x, y);
+        const double fullSeparation = unitSeparation(x, y, testUnits, settings.numUnits);
+
+        sorter.setProjectionMask(mask, MASK_MANUAL);
+        sorter.setBasis(maskedPc1, maskedPc2);
+        const double maskedProjection = timeProjection(sorter, testSpikes, numProjections, x, y);
+        const double maskedSeparation = unitSeparation(x, y, testUnits, settings.numUnits);
+
+        // whole-waveform basis trained from 16-bit copies of the same spikes
+        SorterSpikeArray compactSpikes;
+
+        for (int i = 0; i < spikes.size(); i++)
+            compactSpikes.add(spikes[i]->createCompactCopy());
+
+        HeapBlock<float> compactPc1(dim), compactPc2(dim);
+        timePCAJob(compactSpikes, fullMask, compactPc1, compactPc2, 1);
+
+        sorter.setProjectionMask(fullMask, MASK_NONE);
+        sorter.setBasis(pc1, pc2);
+        timeProjection(sorter, testSpikes, 1, x, y);
+        const double floatAccuracy = nearestCentroidAccuracy(x, y, testUnits, settings.numUnits);
+
+        sorter.setBasis(compactPc1, compactPc2);
+        timeProjection(sorter, testSpikes, 1, x, y);
+        const double compactAccuracy = nearestCentroidAccuracy(x, y, testUnits, settings.numUnits);
+
+        printf("%8d %6d -> %5d %8.2f -> %6.2f %7.3f -> %5.3f %6.1f -> %5.1f %7.2f -> %6.2f\n",
+               settings.numChannels, dim, mask.getNumValues(),
+               fullJob, maskedJob, fullProjection, maskedProjection,
+               fullSeparation, maskedSeparation,
+               floatAccuracy * 100.0, compactAccuracy * 100.0);
+    }
+
+    return 0;
+}
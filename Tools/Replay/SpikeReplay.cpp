@@ -0,0 +1,358 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Replays a spike log recorded by the Spike Sorter ("Record Input")
+    through Sorter, BoxUnit and PCAUnit classification.
+
+    Sorter state (units, PC basis, thresholds) is restored from the
+    STATE records at exactly the point in the stream where it was
+    recorded, and automatic PCA is disabled, so a correct build assigns
+    every spike the same sorted ID as the live session did. Any
+    difference is reported and makes the tool exit with status 2, which
+    turns a recorded session into a deterministic regression test; the
+    throughput and latency figures make it a benchmark at the same time.
+
+    With --closed-loop, each spike is only projected and classified
+    inline (Sorter::classifySpike) and the rest of the sorter's work is
+    done on a DeferredSpikeQueue thread, as in the processor's closed-loop
+    mode; the latency watchdog then reports how often the deadline was
+    missed. Combined with --realtime --speed 10 this checks the per-spike
+    bound at ten times the recorded spike rate.
+*/
+
+#include <ProcessorHeaders.h>
+
+#include "Sorter.h"
+#include "PCAComputingThread.h"
+#include "SpikeLog.h"
+#include "ClosedLoop.h"
+#include "RealtimeAudit.h"
+
+#include "ToolOptions.h"
+
+#include <stdio.h>
+
+static void printUsage()
+{
+    printf("Usage: spike-sorter-replay <log.spklog> [options]\n\n"
+           "  --realtime          pace spikes at their recorded sample times\n"
+           "  --speed X           playback speed for --realtime (1.0)\n"
+           "  --show-mismatches N print the first N mismatching spikes (10)\n"
+           "  --closed-loop       classify inline and defer PCA training and statistics to a thread\n"
+           "  --deadline US       closed-loop per-spike deadline (50)\n"
+#if SPIKE_SORTER_REALTIME_AUDIT
+           "  --audit-trap        stop at the first allocation or lock on the per-spike path\n"
+#endif
+           "\nExits with status 2 if any spike is sorted differently from the recording.\n");
+}
+
+struct ReplayElectrode
+{
+    std::unique_ptr<SpikeChannel> channel;
+    std::unique_ptr<Sorter> sorter;
+    Array<float> thresholds;
+    SortingMode sortingMode = SORT_AND_DISPLAY;
+    int64 numSpikes = 0;
+    int64 numMismatches = 0;
+};
+
+/** Does the deferred half of closed-loop sorting */
+struct ReplayBookkeeper : public DeferredSpikeQueue::Listener
+{
+    std::map<int, ReplayElectrode>* electrodes = nullptr;
+
+    void handleDeferredSpike(const DeferredSpikeQueue::Entry& entry) override
+    {
+        auto it = electrodes->find(entry.electrode);
+
+        if (it != electrodes->end() && entry.passedThreshold && entry.mode <= SORT_ONLY)
+            it->second.sorter->trainOnSpike(entry.spike);
+    }
+};
+
+/** Restores thresholds and sorter state from a STATE record */
+static bool applyState(ReplayElectrode& e, const String& state)
+{
+    std::unique_ptr<XmlElement> xml = parseXML(state);
+
+    if (xml == nullptr)
+        return false;
+
+    e.thresholds.clear();
+    e.sortingMode = (SortingMode) jlimit(0, NUM_SORTING_MODES - 1,
+                                         xml->getIntAttribute("sorting_mode", SORT_AND_DISPLAY));
+
+    forEachXmlChildElement(*xml, thresholdNode)
+    {
+        if (thresholdNode->hasTagName("THRESHOLD"))
+            e.thresholds.set(thresholdNode->getIntAttribute("channel"),
+                             (float) thresholdNode->getDoubleAttribute("value"));
+    }
+
+    e.sorter->loadCustomParametersFromXml(xml.get());
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    ToolOptions options(argc, argv);
+
+    if (options.has("help") || options.getPositional().size() != 1)
+    {
+        printUsage();
+        return options.has("help") ? 0 : 1;
+    }
+
+    File logFile(File::getCurrentWorkingDirectory().getChildFile(options.getPositional()[0]));
+
+    auto fileStream = std::make_unique<FileInputStream>(logFile);
+
+    if (fileStream->failedToOpen())
+    {
+        printf("Could not open %s\n", logFile.getFullPathName().toRawUTF8());
+        return 1;
+    }
+
+    SpikeLogReader reader(new BufferedInputStream(fileStream.release(), 1 << 16, true));
+
+    if (!reader.isValid())
+    {
+        printf("%s: %s\n", logFile.getFullPathName().toRawUTF8(), reader.getLastError().toRawUTF8());
+        return 1;
+    }
+
+    const bool realtime = options.has("realtime");
+    const double speed = jmax(0.01, options.getDouble("speed", 1.0));
+    const int showMismatches = options.getInt("show-mismatches", 10);
+    const bool closedLoop = options.has("closed-loop");
+
+#if SPIKE_SORTER_REALTIME_AUDIT
+    RealtimeAudit::setTrap(options.has("audit-trap"));
+#endif
+
+    PCAComputingThread computingThread;
+
+    std::map<int, ReplayElectrode> electrodes;
+
+    SpikeLatencyWatchdog watchdog;
+    watchdog.setDeadline((float) options.getDouble("deadline", 50.0));
+
+    ReplayBookkeeper bookkeeper;
+    bookkeeper.electrodes = &electrodes;
+
+    DeferredSpikeQueue deferredSpikes(&bookkeeper);
+
+    const double ticksPerSecond = double(Time::getHighResolutionTicksPerSecond());
+    const double ticksToMicroseconds = 1.0e6 / ticksPerSecond;
+
+    LatencyStats spikeLatency;
+    double totalMicroseconds = 0;
+
+    int64 numSpikes = 0, numStates = 0, numMismatches = 0, numBadStates = 0;
+
+    // realtime pacing reference (first spike)
+    int64 firstSample = -1;
+    int64 firstTicks = 0;
+    float pacingRate = 0;
+
+    const int64 wallStart = Time::getHighResolutionTicks();
+
+    for (SpikeLog::RecordType type = reader.readNext(); type != SpikeLog::END_OF_LOG; type = reader.readNext())
+    {
+        if (type == SpikeLog::ELECTRODE)
+        {
+            const SpikeLog::ElectrodeInfo& info = reader.getElectrodeInfo();
+            ReplayElectrode& e = electrodes[info.index];
+
+            e.channel = std::make_unique<SpikeChannel>(info.name,
+                                                       info.numChannels,
+                                                       info.prePeakSamples,
+                                                       info.postPeakSamples,
+                                                       info.sampleRate);
+
+            e.sorter = std::make_unique<Sorter>(info.numChannels,
+                                                info.prePeakSamples + info.postPeakSamples,
+                                                &computingThread);
+
+            // the recorded STATE records are the only source of PC bases
+            e.sorter->setAutomaticPCA(false);
+
+            if (pacingRate == 0)
+                pacingRate = info.sampleRate;
+
+            printf("Electrode %d: %s (%d channels, %d+%d samples)\n",
+                   info.index, info.name.toRawUTF8(), info.numChannels,
+                   info.prePeakSamples, info.postPeakSamples);
+        }
+        else if (type == SpikeLog::STATE)
+        {
+            auto it = electrodes.find(reader.getElectrodeIndex());
+
+            if (it == electrodes.end() || !applyState(it->second, reader.getState()))
+                numBadStates++;
+
+            numStates++;
+        }
+        else if (type == SpikeLog::SPIKE)
+        {
+            auto it = electrodes.find(reader.getElectrodeIndex());
+
+            if (it == electrodes.end())
+                continue;
+
+            ReplayElectrode& e = it->second;
+
+            if (e.channel->getNumChannels() * (int) e.channel->getTotalSamples() != reader.getNumValues())
+                continue;
+
+            // electrodes are all listed before the first spike, so the map no longer changes
+            if (closedLoop && !deferredSpikes.isThreadRunning())
+                deferredSpikes.startThread();
+
+            if (realtime && pacingRate > 0)
+            {
+                if (firstSample < 0)
+                {
+                    firstSample = reader.getSampleNumber();
+                    firstTicks = Time::getHighResolutionTicks();
+                }
+
+                const double due = double(reader.getSampleNumber() - firstSample) / pacingRate / speed;
+                const int64 dueTicks = firstTicks + int64(due * ticksPerSecond);
+
+                while (Time::getHighResolutionTicks() < dueTicks)
+                {
+                    const int64 remainingMs = (dueTicks - Time::getHighResolutionTicks()) * 1000 / int64(ticksPerSecond);
+
+                    if (remainingMs > 1)
+                        Thread::sleep(int(remainingMs - 1));
+                }
+            }
+
+            // --- equivalent of SpikeSorter::handleSpike ---
+            int64 start, end;
+            uint16 sortedId;
+
+            {
+                REALTIME_AUDIT_SCOPE;
+
+                start = Time::getHighResolutionTicks();
+
+                SorterSpikePtr spike = new SorterSpikeContainer(e.channel.get(),
+                                                                reader.getSortedIdIn(),
+                                                                reader.getSampleNumber(),
+                                                                reader.getWaveform());
+
+                if (closedLoop)
+                {
+                    const bool passed = e.sortingMode <= SORT_ONLY && spike->checkThresholds(e.thresholds);
+                    bool abandoned = false;
+
+                    if (passed)
+                        abandoned = !e.sorter->classifySpike(spike, watchdog.getDeadlineTicks(start));
+
+                    watchdog.addSpike(start, Time::getHighResolutionTicks(), abandoned);
+
+                    deferredSpikes.push(it->first, spike, reader.getSortedIdIn(), e.sortingMode, passed);
+                }
+                else if (e.sortingMode <= SORT_ONLY && spike->checkThresholds(e.thresholds))
+                {
+                    e.sorter->processSpike(spike);
+                }
+
+                sortedId = spike->sortedId;
+                spike = nullptr;
+
+                end = Time::getHighResolutionTicks();
+            }
+            // ----------------------------------------------
+
+            float elapsed = float(double(end - start) * ticksToMicroseconds);
+            spikeLatency.add(elapsed);
+            totalMicroseconds += elapsed;
+
+            numSpikes++;
+            e.numSpikes++;
+
+            if (sortedId != reader.getSortedIdOut())
+            {
+                if (numMismatches < showMismatches)
+                    printf("  mismatch: electrode %d, sample %lld: recorded unit %d, replayed unit %d\n",
+                           reader.getElectrodeIndex(), (long long) reader.getSampleNumber(),
+                           (int) reader.getSortedIdOut(), (int) sortedId);
+
+                numMismatches++;
+                e.numMismatches++;
+            }
+        }
+    }
+
+    const double wallSeconds = double(Time::getHighResolutionTicks() - wallStart) / ticksPerSecond;
+
+    deferredSpikes.stop();
+    computingThread.stopThread(1000);
+
+    if (reader.getLastError().isNotEmpty())
+        printf("Warning: %s (log may be incomplete)\n", reader.getLastError().toRawUTF8());
+
+    // Report
+
+    const double capacity = totalMicroseconds > 0 ? double(numSpikes) / (totalMicroseconds * 1.0e-6) : 0;
+
+    printf("\n");
+    printf("Spikes replayed           %lld on %d electrodes (%lld state changes",
+           (long long) numSpikes, (int) electrodes.size(), (long long) numStates);
+
+    if (numBadStates > 0)
+        printf(", %lld unreadable", (long long) numBadStates);
+
+    printf(")\n");
+    printf("Mismatched sorted IDs     %lld\n", (long long) numMismatches);
+
+    for (auto& entry : electrodes)
+    {
+        if (entry.second.numMismatches > 0)
+            printf("  electrode %d: %lld of %lld spikes\n", entry.first,
+                   (long long) entry.second.numMismatches, (long long) entry.second.numSpikes);
+    }
+
+    printf("Wall time                 %.2f s (%s)\n", wallSeconds, realtime ? "paced" : "as fast as possible");
+    printf("Sustained throughput      %.0f spikes/s on one core\n", capacity);
+    spikeLatency.print("Per-spike latency");
+
+    if (closedLoop)
+    {
+        printf("Closed loop               %s\n", watchdog.toString().toRawUTF8());
+
+        if (deferredSpikes.getNumDropped() > 0)
+            printf("  %lld spikes missed deferred bookkeeping (queue full)\n", (long long) deferredSpikes.getNumDropped());
+    }
+
+#if SPIKE_SORTER_REALTIME_AUDIT
+    printf("Real-time audit           %s\n", RealtimeAudit::getReport().toRawUTF8());
+#endif
+
+    return numMismatches > 0 ? 2 : 0;
+}
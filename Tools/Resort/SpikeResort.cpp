@@ -0,0 +1,463 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2013 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+    Offline re-sort of a recorded spike log with a saved set of units.
+
+    Loads the ELECTRODE nodes (PLOT thresholds, PCA basis and units,
+    BOXES) from a saved Spike Sorter settings file, then streams the
+    spikes of a log written by "Record Input" through the same Sorter /
+    BoxUnit / PCAUnit classification the plugin uses, and writes the
+    new unit ID of every spike in log order.
+
+    The log is read in fixed-size chunks, so memory use does not grow
+    with the length of the recording. Electrodes are split into shards,
+    each sorted by its own worker; chunk N+1 is read while the workers
+    sort chunk N. Spikes of one electrode always stay on one worker and
+    in order, so the output is identical to a single-threaded run.
+*/
+
+#include <ProcessorHeaders.h>
+
+#include "Sorter.h"
+#include "PCAComputingThread.h"
+#include "SpikeLog.h"
+
+#include "ToolOptions.h"
+
+#include <stdio.h>
+
+static void printUsage()
+{
+    printf("Usage: spike-sorter-resort <settings.xml> <log.spklog> [options]\n\n"
+           "  --output FILE       where to write the new unit IDs (<log>.sorted_ids)\n"
+           "  --csv               write electrode,sample_number,recorded_id,new_id text instead\n"
+           "                      of one little-endian uint16 per spike\n"
+           "  --threads N         worker threads (one per electrode, up to the number of cores)\n"
+           "  --chunk-size N      spikes read per chunk (65536)\n"
+           "  --ignore-thresholds sort every spike, not only those that cross the saved thresholds\n");
+}
+
+struct ResortElectrode
+{
+    std::unique_ptr<SpikeChannel> channel;
+    std::unique_ptr<Sorter> sorter;
+    Array<float> thresholds;
+    SortingMode sortingMode = SORT_AND_DISPLAY;
+    bool hasSettings = false;
+    int shard = 0;
+    int64 numSpikes = 0;
+    int64 numChanged = 0;
+};
+
+/** One spike in a chunk; its waveform lives in SpikeChunk::waveforms */
+struct ChunkEntry
+{
+    int electrode;
+    int64 sampleNumber;
+    uint16 incomingId;
+    uint16 recordedId;
+    uint16 newId;
+    int64 offset;
+};
+
+/** A block of consecutive spikes from the log */
+struct SpikeChunk
+{
+    std::vector<ChunkEntry> entries;
+    std::vector<float> waveforms;
+    std::vector<std::vector<int>> shardEntries;
+
+    void clear()
+    {
+        entries.clear();
+        waveforms.clear();
+
+        for (auto& s : shardEntries)
+            s.clear();
+    }
+};
+
+/** Sorts the spikes of one shard of electrodes within a chunk */
+class ShardJob : public ThreadPoolJob
+{
+public:
+
+    ShardJob(int shard_, std::map<int, ResortElectrode>& electrodes_, bool applyThresholds_)
+        : ThreadPoolJob("Resort shard " + String(shard_)),
+          shard(shard_),
+          electrodes(electrodes_),
+          applyThresholds(applyThresholds_),
+          chunk(nullptr)
+    {
+    }
+
+    void setChunk(SpikeChunk* c) { chunk = c; }
+
+    JobStatus runJob() override
+    {
+        for (int index : chunk->shardEntries[shard])
+        {
+            ChunkEntry& entry = chunk->entries[index];
+            ResortElectrode& e = electrodes.at(entry.electrode);
+
+            SorterSpikePtr spike = new SorterSpikeContainer(e.channel.get(),
+                                                            entry.incomingId,
+                                                            entry.sampleNumber,
+                                                            chunk->waveforms.data() + entry.offset);
+
+            // electrodes that were not being sorted keep the ID they arrived with
+            if (e.sortingMode <= SORT_ONLY && (!applyThresholds || spike->checkThresholds(e.thresholds)))
+                e.sorter->processSpike(spike);
+
+            entry.newId = spike->sortedId;
+        }
+
+        return jobHasFinished;
+    }
+
+private:
+
+    int shard;
+    std::map<int, ResortElectrode>& electrodes;
+    bool applyThresholds;
+    SpikeChunk* chunk;
+};
+
+/** Finds every ELECTRODE node in a settings file, wherever the processor sits in the signal chain */
+static void findElectrodeNodes(XmlElement* xml, Array<XmlElement*>& nodes)
+{
+    forEachXmlChildElement(*xml, child)
+    {
+        if (child->hasTagName("ELECTRODE"))
+            nodes.add(child);
+        else
+            findElectrodeNodes(child, nodes);
+    }
+}
+
+/** Matches a logged electrode to a saved ELECTRODE node by name (and stream, if ambiguous) */
+static XmlElement* findSettingsFor(const SpikeLog::ElectrodeInfo& info, const Array<XmlElement*>& nodes)
+{
+    XmlElement* match = nullptr;
+
+    for (auto node : nodes)
+    {
+        if (node->getStringAttribute("name") != info.name)
+            continue;
+
+        if (match == nullptr)
+            match = node;
+        else if (info.identifier.contains(node->getStringAttribute("stream_name")))
+            match = node;
+    }
+
+    return match;
+}
+
+/** Loads thresholds and units for one electrode */
+static void applySettings(ResortElectrode& e, XmlElement* node)
+{
+    forEachXmlChildElement(*node, child)
+    {
+        if (child->hasTagName("PLOT"))
+        {
+            forEachXmlChildElement(*child, axisNode)
+            {
+                if (axisNode->hasTagName("AXIS"))
+                    e.thresholds.add((float) axisNode->getDoubleAttribute("thresh"));
+            }
+        }
+    }
+
+    e.sortingMode = (SortingMode) jlimit(0, NUM_SORTING_MODES - 1,
+                                         node->getIntAttribute("sorting_mode", SORT_AND_DISPLAY));
+
+    e.sorter->loadCustomParametersFromXml(node);
+    e.hasSettings = true;
+}
+
+/** Reads up to chunkSize spikes, starting with an already-read record if one is
+    pending; returns false once the end of the log has been reached */
+static bool readChunk(SpikeLogReader& reader,
+                      std::map<int, ResortElectrode>& electrodes,
+                      SpikeChunk& chunk,
+                      int chunkSize,
+                      SpikeLog::RecordType& pending,
+                      int64& numStates)
+{
+    chunk.clear();
+
+    while ((int) chunk.entries.size() < chunkSize)
+    {
+        SpikeLog::RecordType type = pending != SpikeLog::END_OF_LOG ? pending : reader.readNext();
+        pending = SpikeLog::END_OF_LOG;
+
+        if (type == SpikeLog::END_OF_LOG)
+            return false;
+
+        if (type == SpikeLog::STATE)
+        {
+            numStates++;
+            continue;
+        }
+
+        if (type != SpikeLog::SPIKE)
+            continue;
+
+        auto it = electrodes.find(reader.getElectrodeIndex());
+
+        if (it == electrodes.end())
+            continue;
+
+        ChunkEntry entry;
+        entry.electrode = reader.getElectrodeIndex();
+        entry.sampleNumber = reader.getSampleNumber();
+        entry.incomingId = reader.getSortedIdIn();
+        entry.recordedId = reader.getSortedIdOut();
+        entry.newId = 0;
+        entry.offset = (int64) chunk.waveforms.size();
+
+        chunk.waveforms.insert(chunk.waveforms.end(),
+                               reader.getWaveform(),
+                               reader.getWaveform() + reader.getNumValues());
+
+        if (it->second.hasSettings)
+            chunk.shardEntries[it->second.shard].push_back((int) chunk.entries.size());
+
+        chunk.entries.push_back(entry);
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    ToolOptions options(argc, argv);
+
+    if (options.has("help") || options.getPositional().size() != 2)
+    {
+        printUsage();
+        return options.has("help") ? 0 : 1;
+    }
+
+    File settingsFile(File::getCurrentWorkingDirectory().getChildFile(options.getPositional()[0]));
+    File logFile(File::getCurrentWorkingDirectory().getChildFile(options.getPositional()[1]));
+
+    std::unique_ptr<XmlElement> settings = parseXML(settingsFile);
+
+    if (settings == nullptr)
+    {
+        printf("Could not parse %s\n", settingsFile.getFullPathName().toRawUTF8());
+        return 1;
+    }
+
+    Array<XmlElement*> electrodeNodes;
+    findElectrodeNodes(settings.get(), electrodeNodes);
+
+    auto fileStream = std::make_unique<FileInputStream>(logFile);
+
+    if (fileStream->failedToOpen())
+    {
+        printf("Could not open %s\n", logFile.getFullPathName().toRawUTF8());
+        return 1;
+    }
+
+    SpikeLogReader reader(new BufferedInputStream(fileStream.release(), 1 << 16, true));
+
+    if (!reader.isValid())
+    {
+        printf("%s: %s\n", logFile.getFullPathName().toRawUTF8(), reader.getLastError().toRawUTF8());
+        return 1;
+    }
+
+    const bool csv = options.has("csv");
+    const bool applyThresholds = !options.has("ignore-thresholds");
+    const int chunkSize = jmax(1, options.getInt("chunk-size", 65536));
+
+    File outputFile = File::getCurrentWorkingDirectory().getChildFile(
+        options.getString("output", logFile.getFullPathName() + (csv ? ".sorted_ids.csv" : ".sorted_ids")));
+
+    PCAComputingThread computingThread;
+    std::map<int, ResortElectrode> electrodes;
+
+    // 1. Electrode table (written before any spike) and settings
+
+    SpikeChunk chunks[2];
+    int64 numStates = 0;
+
+    SpikeLog::RecordType type = reader.readNext();
+
+    while (type == SpikeLog::ELECTRODE)
+    {
+        const SpikeLog::ElectrodeInfo& info = reader.getElectrodeInfo();
+        ResortElectrode& e = electrodes[info.index];
+
+        e.channel = std::make_unique<SpikeChannel>(info.name,
+                                                   info.numChannels,
+                                                   info.prePeakSamples,
+                                                   info.postPeakSamples,
+                                                   info.sampleRate);
+
+        e.sorter = std::make_unique<Sorter>(info.numChannels,
+                                            info.prePeakSamples + info.postPeakSamples,
+                                            &computingThread);
+        e.sorter->setAutomaticPCA(false);
+
+        if (XmlElement* node = findSettingsFor(info, electrodeNodes))
+            applySettings(e, node);
+        else
+            printf("Warning: no settings for electrode \"%s\"; its spikes get unit 0\n", info.name.toRawUTF8());
+
+        type = reader.readNext();
+    }
+
+    if (type != SpikeLog::SPIKE && type != SpikeLog::STATE)
+    {
+        printf("No spikes in %s\n", logFile.getFullPathName().toRawUTF8());
+        return 1;
+    }
+
+    // the record that ended the electrode table is the first one to sort
+    SpikeLog::RecordType pending = type;
+
+    const int numThreads = jlimit(1, jmax(1, (int) electrodes.size()),
+                                  options.getInt("threads", SystemStats::getNumCpus()));
+
+    int position = 0;
+
+    for (auto& entry : electrodes)
+        entry.second.shard = position++ % numThreads;
+
+    for (auto& chunk : chunks)
+        chunk.shardEntries.resize(numThreads);
+
+    ThreadPool pool(numThreads);
+    OwnedArray<ShardJob> jobs;
+
+    for (int s = 0; s < numThreads; s++)
+        jobs.add(new ShardJob(s, electrodes, applyThresholds));
+
+    std::unique_ptr<FileOutputStream> output = std::make_unique<FileOutputStream>(outputFile);
+
+    if (output->failedToOpen())
+    {
+        printf("Could not write %s\n", outputFile.getFullPathName().toRawUTF8());
+        return 1;
+    }
+
+    output->setPosition(0);
+    output->truncate();
+
+    if (csv)
+        *output << "electrode,sample_number,recorded_id,new_id\n";
+
+    printf("Re-sorting %s with %d worker%s...\n",
+           logFile.getFileName().toRawUTF8(), numThreads, numThreads == 1 ? "" : "s");
+
+    // 2. Stream: sort chunk N while reading chunk N+1
+
+    const int64 startTicks = Time::getHighResolutionTicks();
+
+    int64 numSpikes = 0, numChanged = 0;
+
+    SpikeChunk* current = &chunks[0];
+    bool more = readChunk(reader, electrodes, *current, chunkSize, pending, numStates);
+
+    while (!current->entries.empty())
+    {
+        for (auto job : jobs)
+        {
+            job->setChunk(current);
+            pool.addJob(job, false);
+        }
+
+        SpikeChunk* next = (current == &chunks[0]) ? &chunks[1] : &chunks[0];
+
+        if (more)
+            more = readChunk(reader, electrodes, *next, chunkSize, pending, numStates);
+        else
+            next->clear();
+
+        for (auto job : jobs)
+            pool.waitForJobToFinish(job, -1);
+
+        // write in log order
+        if (csv)
+        {
+            for (auto& entry : current->entries)
+                *output << String(entry.electrode) << "," << String(entry.sampleNumber) << ","
+                        << String(entry.recordedId) << "," << String(entry.newId) << "\n";
+        }
+
+        for (auto& entry : current->entries)
+        {
+            if (!csv)
+                output->write(&entry.newId, sizeof(uint16));
+
+            ResortElectrode& e = electrodes[entry.electrode];
+            e.numSpikes++;
+
+            if (entry.newId != entry.recordedId)
+            {
+                e.numChanged++;
+                numChanged++;
+            }
+        }
+
+        numSpikes += (int64) current->entries.size();
+        current = next;
+    }
+
+    output->flush();
+
+    const double seconds = double(Time::getHighResolutionTicks() - startTicks) / double(Time::getHighResolutionTicksPerSecond());
+
+    computingThread.stopThread(1000);
+
+    if (reader.getLastError().isNotEmpty())
+        printf("Warning: %s (log may be incomplete)\n", reader.getLastError().toRawUTF8());
+
+    // 3. Report
+
+    printf("\n");
+    printf("Spikes re-sorted          %lld on %d electrodes in %.2f s (%.0f spikes/s)\n",
+           (long long) numSpikes, (int) electrodes.size(), seconds, seconds > 0 ? double(numSpikes) / seconds : 0.0);
+    printf("Unit changed              %lld spikes (%.1f%%)\n",
+           (long long) numChanged, numSpikes > 0 ? 100.0 * double(numChanged) / double(numSpikes) : 0.0);
+
+    for (auto& entry : electrodes)
+    {
+        const ResortElectrode& e = entry.second;
+        printf("  %-20s %lld spikes, %lld changed%s\n", e.channel->getName().toRawUTF8(),
+               (long long) e.numSpikes, (long long) e.numChanged, e.hasSettings ? "" : " (no settings)");
+    }
+
+    if (numStates > 0)
+        printf("Ignored %lld recorded state changes (settings come from %s)\n",
+               (long long) numStates, settingsFile.getFileName().toRawUTF8());
+
+    printf("New unit IDs written to   %s\n", outputFile.getFullPathName().toRawUTF8());
+
+    return 0;
+}